@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <ela_carrier.h>
+#include <ela_session.h>
+
+#include "session.h"
+#include "ice.h"
+
+#define DEFAULT_ROUNDS              20
+#define WAIT_TIMEOUT                30000  // ms
+
+typedef struct Peer {
+    const char      *name;
+    ElaSession      *session;
+    int             stream;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    ElaStreamState  state;
+} Peer;
+
+typedef struct Round {
+    uint64_t        prepare;
+    uint64_t        checks;
+} Round;
+
+static Peer offerer = { "offerer" };
+static Peer answerer = { "answerer" };
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void stream_state_changed(ElaSession *ws, int stream,
+                                 ElaStreamState state, void *context)
+{
+    Peer *peer = (Peer *)context;
+
+    pthread_mutex_lock(&peer->lock);
+    peer->state = state;
+    pthread_cond_broadcast(&peer->cond);
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static void stream_on_data(ElaSession *ws, int stream,
+                           const void *data, size_t len, void *context)
+{
+}
+
+static bool wait_for_state(Peer *peer, ElaStreamState state)
+{
+    struct timespec ts;
+    uint64_t deadline = now_us() + WAIT_TIMEOUT * 1000;
+    bool ok;
+
+    ts.tv_sec = (time_t)(deadline / 1000000);
+    ts.tv_nsec = (long)(deadline % 1000000) * 1000;
+
+    pthread_mutex_lock(&peer->lock);
+    while (peer->state != state && peer->state < ElaStreamState_deactivated) {
+        if (pthread_cond_timedwait(&peer->cond, &peer->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    ok = (peer->state == state);
+    pthread_mutex_unlock(&peer->lock);
+
+    if (!ok)
+        fprintf(stderr, "%s: wait for state %d failed, current state %d.\n",
+                peer->name, state, peer->state);
+
+    return ok;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int peer_setup(SessionExtension *ext, Peer *peer, int round,
+                      const ElaSessionIceProfile *profile)
+{
+    ElaStreamCallbacks callbacks;
+    IceTransportOptions opts;
+    char to[ELA_MAX_ID_LEN + 1];
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.state_changed = stream_state_changed;
+    callbacks.stream_data = stream_on_data;
+
+    peer->state = 0;
+
+    // A new peer name each round, no resumption ticket to the last one.
+    snprintf(to, sizeof(to), "%s-%d", peer->name, round);
+
+    peer->session = session_create(ext, to, &opts);
+    if (!peer->session) {
+        fprintf(stderr, "%s: create session failed (0x%x).\n",
+                peer->name, ela_get_error());
+        return -1;
+    }
+
+    if (ela_session_set_ice_profile(peer->session, profile) < 0) {
+        fprintf(stderr, "%s: set ICE profile failed (0x%x).\n",
+                peer->name, ela_get_error());
+        return -1;
+    }
+
+    peer->stream = ela_session_add_stream(peer->session,
+                        ElaStreamType_application, ELA_STREAM_RELIABLE,
+                        &callbacks, peer);
+    if (peer->stream < 0) {
+        fprintf(stderr, "%s: add stream failed (0x%x).\n",
+                peer->name, ela_get_error());
+        return -1;
+    }
+
+    return 0;
+}
+
+static void peer_close(Peer *peer)
+{
+    if (peer->session) {
+        ela_session_close(peer->session);
+        peer->session = NULL;
+    }
+}
+
+static int peer_prepare(Peer *peer, bool offer, char *sdp, size_t len)
+{
+    int rc;
+
+    if (!wait_for_state(peer, ElaStreamState_initialized))
+        return -1;
+
+    rc = session_prepare_local_sdp(peer->session, offer, sdp, len - 1);
+    if (rc < 0) {
+        fprintf(stderr, "%s: prepare local SDP failed (0x%x).\n",
+                peer->name, rc);
+        return -1;
+    }
+    sdp[rc] = 0;
+
+    if (!wait_for_state(peer, ElaStreamState_transport_ready))
+        return -1;
+
+    return rc + 1;
+}
+
+static int bench_round(SessionExtension *ext, int round,
+                       const ElaSessionIceProfile *profile, Round *result)
+{
+    char offer_sdp[2048];
+    char answer_sdp[2048];
+    int offer_len;
+    int answer_len;
+    uint64_t start;
+    uint64_t checks;
+    int rc = -1;
+
+    if (peer_setup(ext, &offerer, round, profile) < 0 ||
+        peer_setup(ext, &answerer, round, profile) < 0)
+        goto cleanup;
+
+    start = now_us();
+
+    offer_len = peer_prepare(&offerer, true, offer_sdp, sizeof(offer_sdp));
+    if (offer_len < 0)
+        goto cleanup;
+
+    answer_len = peer_prepare(&answerer, false, answer_sdp, sizeof(answer_sdp));
+    if (answer_len < 0)
+        goto cleanup;
+
+    checks = now_us();
+
+    if (ela_session_start(answerer.session, offer_sdp, offer_len) < 0 ||
+        ela_session_start(offerer.session, answer_sdp, answer_len) < 0) {
+        fprintf(stderr, "Start session failed (0x%x).\n", ela_get_error());
+        goto cleanup;
+    }
+
+    if (!wait_for_state(&offerer, ElaStreamState_connected) ||
+        !wait_for_state(&answerer, ElaStreamState_connected))
+        goto cleanup;
+
+    result->prepare = checks - start;
+    result->checks = now_us() - checks;
+    rc = 0;
+
+cleanup:
+    peer_close(&offerer);
+    peer_close(&answerer);
+
+    return rc;
+}
+
+static int bench_rounds(SessionExtension *ext, int rounds,
+                        const ElaSessionIceProfile *profile)
+{
+    uint64_t *prepares;
+    uint64_t *checks;
+    uint64_t prepare_sum = 0;
+    uint64_t checks_sum = 0;
+    int failed = 0;
+    int done = 0;
+    int i;
+
+    prepares = (uint64_t *)calloc(rounds, sizeof(uint64_t));
+    checks = (uint64_t *)calloc(rounds, sizeof(uint64_t));
+    if (!prepares || !checks) {
+        free(prepares);
+        free(checks);
+        return -1;
+    }
+
+    for (i = 0; i < rounds; i++) {
+        Round result;
+
+        if (bench_round(ext, i, profile, &result) < 0) {
+            failed++;
+            continue;
+        }
+
+        prepares[done] = result.prepare;
+        checks[done] = result.checks;
+        prepare_sum += result.prepare;
+        checks_sum += result.checks;
+        done++;
+    }
+
+    qsort(prepares, done, sizeof(uint64_t), compare_u64);
+    qsort(checks, done, sizeof(uint64_t), compare_u64);
+
+    if (profile)
+        printf("ICE profile: %s nomination, delay %d ms, timeout %d ms, "
+               "%d remote candidates\n",
+               profile->aggressive_nomination ? "aggressive" : "regular",
+               profile->nomination_delay, profile->nomination_timeout,
+               profile->max_remote_candidates);
+    else
+        printf("ICE profile: default\n");
+
+    printf("  rounds:    %d, failed %d\n", done + failed, failed);
+    if (done > 0) {
+        printf("  prepare:   avg %.3f ms, p50 %.3f ms\n",
+               prepare_sum / done / 1000.0, prepares[done / 2] / 1000.0);
+        printf("  connect:   min %.3f ms, avg %.3f ms, p50 %.3f ms, "
+               "p99 %.3f ms, max %.3f ms\n",
+               checks[0] / 1000.0, checks_sum / done / 1000.0,
+               checks[done / 2] / 1000.0, checks[(done * 99) / 100] / 1000.0,
+               checks[done - 1] / 1000.0);
+    }
+
+    free(prepares);
+    free(checks);
+
+    return failed ? -1 : 0;
+}
+
+static void usage(void)
+{
+    printf("ICE negotiation benchmark.\n");
+    printf("Usage: elaicebench [OPTION]...\n");
+    printf("\n");
+    printf("ICE profile options:\n");
+    printf("  -a, --aggressive        Use aggressive nomination.\n");
+    printf("  -d, --delay=MS          Nomination delay in milliseconds.\n");
+    printf("  -t, --timeout=MS        Nomination timeout in milliseconds.\n");
+    printf("  -c, --candidates=COUNT  Remote candidates of each component.\n");
+    printf("\n");
+    printf("Benchmark options:\n");
+    printf("  -n, --rounds=COUNT      Sessions to negotiate.\n");
+    printf("  -C, --compare           Run the default profile first.\n");
+    printf("  -v, --verbose           Enable debug logs.\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ElaCarrier *w;
+    SessionExtension *ext;
+    ElaSessionIceProfile profile;
+    int rounds = DEFAULT_ROUNDS;
+    int loglevel = ElaLogLevel_Warning;
+    bool compare = false;
+    int rc;
+
+    int opt;
+    int idx;
+    struct option opts[] = {
+        { "aggressive",     no_argument,        NULL, 'a' },
+        { "delay",          required_argument,  NULL, 'd' },
+        { "timeout",        required_argument,  NULL, 't' },
+        { "candidates",     required_argument,  NULL, 'c' },
+        { "rounds",         required_argument,  NULL, 'n' },
+        { "compare",        no_argument,        NULL, 'C' },
+        { "verbose",        no_argument,        NULL, 'v' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL, 0 }
+    };
+
+    memset(&profile, 0, sizeof(profile));
+
+    while ((opt = getopt_long(argc, argv, "ad:t:c:n:Cvh?",
+            opts, &idx)) != -1) {
+        switch (opt) {
+        case 'a':
+            profile.aggressive_nomination = true;
+            break;
+        case 'd':
+            profile.nomination_delay = atoi(optarg);
+            break;
+        case 't':
+            profile.nomination_timeout = atoi(optarg);
+            break;
+        case 'c':
+            profile.max_remote_candidates = atoi(optarg);
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'C':
+            compare = true;
+            break;
+        case 'v':
+            loglevel = ElaLogLevel_Debug;
+            break;
+        case 'h':
+        case '?':
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (rounds <= 0) {
+        fprintf(stderr, "Invalid rounds.\n");
+        return -1;
+    }
+
+    ela_log_init(loglevel, NULL, NULL);
+
+    // The session extension only needs the extension slot of the carrier.
+    w = (ElaCarrier *)calloc(1, sizeof(ElaCarrier));
+    if (!w)
+        return -1;
+    pthread_mutex_init(&w->ext_mutex, NULL);
+
+    pthread_mutex_init(&offerer.lock, NULL);
+    pthread_cond_init(&offerer.cond, NULL);
+    pthread_mutex_init(&answerer.lock, NULL);
+    pthread_cond_init(&answerer.cond, NULL);
+
+    rc = session_extension_init(w, ice_transport_create);
+    if (rc < 0) {
+        fprintf(stderr, "Initialize session extension failed (0x%x).\n", rc);
+        free(w);
+        return -1;
+    }
+
+    ext = (SessionExtension *)w->extension;
+
+    rc = 0;
+    if (compare && bench_rounds(ext, rounds, NULL) < 0)
+        rc = -1;
+
+    if (bench_rounds(ext, rounds, &profile) < 0)
+        rc = -1;
+
+    ela_session_cleanup(w);
+
+    pthread_mutex_destroy(&w->ext_mutex);
+    free(w);
+
+    return rc;
+}
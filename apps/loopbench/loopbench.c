@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <ela_carrier.h>
+#include <ela_session.h>
+
+#include "session.h"
+#include "loopback.h"
+
+#define DEFAULT_TRANSFER_SIZE       (64 * 1024 * 1024)
+#define DEFAULT_PACKET_SIZE         1024
+#define DEFAULT_PINGS               1000
+#define WAIT_TIMEOUT                10000  // ms
+
+typedef struct Peer {
+    const char      *name;
+    ElaSession      *session;
+    int             stream;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    ElaStreamState  state;
+    int             echo;
+
+    uint64_t        bytes;
+    uint64_t        packets;
+    uint64_t        last_seq;
+    uint64_t        last_received;
+} Peer;
+
+static Peer offerer = { "offerer" };
+static Peer answerer = { "answerer" };
+
+/*
+ * The carrier node only hosts the session extension, it is never run.
+ * Its persistent data goes to a scratch directory removed on exit.
+ */
+static ElaCarrier *carrier_create(char *datadir)
+{
+    ElaOptions opts;
+    ElaCarrier *w;
+
+    if (!mkdtemp(datadir)) {
+        fprintf(stderr, "Create data directory failed (%d).\n", errno);
+        return NULL;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.udp_enabled = false;
+    opts.persistent_location = datadir;
+
+    w = ela_new(&opts, NULL, NULL);
+    if (!w) {
+        fprintf(stderr, "Create carrier failed (0x%x).\n", ela_get_error());
+        rmdir(datadir);
+        return NULL;
+    }
+
+    return w;
+}
+
+static void remove_datadir(const char *datadir)
+{
+    struct dirent *entry;
+    char path[1024];
+    DIR *dir;
+
+    dir = opendir(datadir);
+    if (dir) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", datadir, entry->d_name);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+
+    rmdir(datadir);
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
+
+static void stream_state_changed(ElaSession *ws, int stream,
+                                 ElaStreamState state, void *context)
+{
+    Peer *peer = (Peer *)context;
+
+    pthread_mutex_lock(&peer->lock);
+    peer->state = state;
+    pthread_cond_broadcast(&peer->cond);
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static void stream_on_data(ElaSession *ws, int stream,
+                           const void *data, size_t len, void *context)
+{
+    Peer *peer = (Peer *)context;
+
+    if (peer->echo) {
+        ela_stream_write(ws, stream, data, len);
+        return;
+    }
+
+    pthread_mutex_lock(&peer->lock);
+    peer->bytes += len;
+    peer->packets++;
+    if (len >= sizeof(uint64_t))
+        memcpy(&peer->last_seq, data, sizeof(uint64_t));
+    peer->last_received = now_us();
+    pthread_cond_broadcast(&peer->cond);
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static bool wait_for_state(Peer *peer, ElaStreamState state)
+{
+    struct timespec ts;
+    uint64_t deadline = now_us() + WAIT_TIMEOUT * 1000;
+    bool ok;
+
+    ts.tv_sec = (time_t)(deadline / 1000000);
+    ts.tv_nsec = (long)(deadline % 1000000) * 1000;
+
+    pthread_mutex_lock(&peer->lock);
+    while (peer->state != state && peer->state < ElaStreamState_deactivated) {
+        if (pthread_cond_timedwait(&peer->cond, &peer->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    ok = (peer->state == state);
+    pthread_mutex_unlock(&peer->lock);
+
+    if (!ok)
+        fprintf(stderr, "%s: wait for state %d failed, current state %d.\n",
+                peer->name, state, peer->state);
+
+    return ok;
+}
+
+static ssize_t write_retry(Peer *peer, const void *data, size_t len)
+{
+    ssize_t rc;
+
+    while (1) {
+        rc = ela_stream_write(peer->session, peer->stream, data, len);
+        if (rc >= 0 || ela_get_error() != ELA_GENERAL_ERROR(ELAERR_BUSY))
+            return rc;
+
+        sleep_ms(1);
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int bench_throughput(size_t total, size_t packet_size, bool reliable)
+{
+    char *buf;
+    uint64_t seq;
+    uint64_t start;
+    uint64_t elapsed;
+    size_t sent = 0;
+    struct timespec ts;
+    uint64_t deadline;
+
+    buf = (char *)calloc(1, packet_size);
+    if (!buf)
+        return -1;
+
+    pthread_mutex_lock(&answerer.lock);
+    answerer.bytes = 0;
+    answerer.packets = 0;
+    answerer.last_received = 0;
+    pthread_mutex_unlock(&answerer.lock);
+
+    start = now_us();
+
+    for (seq = 1; sent < total; seq++) {
+        size_t len = total - sent < packet_size ? total - sent : packet_size;
+        ssize_t rc;
+
+        memcpy(buf, &seq, len < sizeof(seq) ? len : sizeof(seq));
+        rc = write_retry(&offerer, buf, len);
+        if (rc < 0) {
+            fprintf(stderr, "Write data failed (0x%x).\n", ela_get_error());
+            free(buf);
+            return -1;
+        }
+
+        sent += (size_t)rc;
+    }
+
+    free(buf);
+
+    // Reliable streams deliver everything; unreliable ones are done when
+    // the link stays quiet for a while.
+    pthread_mutex_lock(&answerer.lock);
+    while (answerer.bytes < total) {
+        deadline = reliable ? now_us() + WAIT_TIMEOUT * 1000 :
+                              answerer.last_received + 500 * 1000;
+        if (!reliable && answerer.last_received == 0)
+            deadline = now_us() + 2000 * 1000;
+
+        ts.tv_sec = (time_t)(deadline / 1000000);
+        ts.tv_nsec = (long)(deadline % 1000000) * 1000;
+
+        if (pthread_cond_timedwait(&answerer.cond, &answerer.lock,
+                                   &ts) == ETIMEDOUT)
+            break;
+    }
+
+    elapsed = (reliable || !answerer.last_received ? now_us() :
+                                                     answerer.last_received) - start;
+
+    printf("Throughput:\n");
+    printf("  sent:      %zu bytes in %" PRIu64 " packets\n", sent, seq - 1);
+    printf("  received:  %" PRIu64 " bytes in %" PRIu64 " packets\n",
+           answerer.bytes, answerer.packets);
+    printf("  elapsed:   %.3f s\n", elapsed / 1000000.0);
+    printf("  goodput:   %.2f MB/s\n",
+           elapsed ? (double)answerer.bytes / elapsed : 0.0);
+
+    // A reliable stream losing data is a failure, not a measurement.
+    if (reliable && answerer.bytes != total) {
+        fprintf(stderr, "Reliable transfer incomplete, %" PRIu64 " of %zu "
+                "bytes received.\n", answerer.bytes, total);
+        pthread_mutex_unlock(&answerer.lock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&answerer.lock);
+
+    return 0;
+}
+
+static int bench_latency(int count, size_t packet_size)
+{
+    char *buf;
+    uint64_t *rtts;
+    uint64_t sum = 0;
+    int lost = 0;
+    int done = 0;
+    int i;
+
+    if (packet_size < sizeof(uint64_t))
+        packet_size = sizeof(uint64_t);
+
+    buf = (char *)calloc(1, packet_size);
+    rtts = (uint64_t *)calloc(count, sizeof(uint64_t));
+    if (!buf || !rtts) {
+        free(buf);
+        free(rtts);
+        return -1;
+    }
+
+    answerer.echo = 1;
+
+    for (i = 1; i <= count; i++) {
+        uint64_t seq = (uint64_t)i;
+        uint64_t start;
+        uint64_t deadline;
+        struct timespec ts;
+        bool got;
+
+        memcpy(buf, &seq, sizeof(seq));
+        start = now_us();
+
+        if (write_retry(&offerer, buf, packet_size) < 0) {
+            fprintf(stderr, "Write data failed (0x%x).\n", ela_get_error());
+            break;
+        }
+
+        deadline = start + 1000 * 1000;
+        ts.tv_sec = (time_t)(deadline / 1000000);
+        ts.tv_nsec = (long)(deadline % 1000000) * 1000;
+
+        pthread_mutex_lock(&offerer.lock);
+        while (offerer.last_seq != seq) {
+            if (pthread_cond_timedwait(&offerer.cond, &offerer.lock,
+                                       &ts) == ETIMEDOUT)
+                break;
+        }
+        got = (offerer.last_seq == seq);
+        pthread_mutex_unlock(&offerer.lock);
+
+        if (got) {
+            rtts[done] = now_us() - start;
+            sum += rtts[done];
+            done++;
+        } else {
+            lost++;
+        }
+    }
+
+    answerer.echo = 0;
+
+    qsort(rtts, done, sizeof(uint64_t), compare_u64);
+
+    printf("Latency (%zu bytes ping-pong):\n", packet_size);
+    printf("  pings:     %d, lost %d\n", done + lost, lost);
+    if (done > 0) {
+        printf("  rtt min:   %" PRIu64 " us\n", rtts[0]);
+        printf("  rtt avg:   %" PRIu64 " us\n", sum / done);
+        printf("  rtt p50:   %" PRIu64 " us\n", rtts[done / 2]);
+        printf("  rtt p99:   %" PRIu64 " us\n", rtts[(done * 99) / 100]);
+        printf("  rtt max:   %" PRIu64 " us\n", rtts[done - 1]);
+    }
+
+    free(buf);
+    free(rtts);
+
+    return 0;
+}
+
+static void print_layer(const char *name, ElaLayerStats *stats)
+{
+    printf("  %-12s sent %" PRIu64 "/%" PRIu64 ", received %" PRIu64 "/%"
+           PRIu64 ", dropped %" PRIu64 "\n", name,
+           stats->bytes_sent, stats->packets_sent,
+           stats->bytes_received, stats->packets_received,
+           stats->packets_dropped);
+}
+
+static void print_stats(Peer *peer)
+{
+    ElaStreamStats stats;
+
+    if (ela_stream_get_stats(peer->session, peer->stream, &stats) < 0)
+        return;
+
+    printf("Stream stats (%s):\n", peer->name);
+    print_layer("application", &stats.application);
+    print_layer("multiplex", &stats.multiplex);
+    print_layer("reliable", &stats.reliable);
+    print_layer("crypto", &stats.crypto);
+    print_layer("transport", &stats.transport);
+    printf("  retransmits %" PRIu64 ", rtt %u ms, cwnd %u\n",
+           stats.retransmits, stats.rtt, stats.cwnd);
+}
+
+static int peer_setup(SessionExtension *ext, Peer *peer, int options)
+{
+    ElaStreamCallbacks callbacks;
+    IceTransportOptions opts;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.state_changed = stream_state_changed;
+    callbacks.stream_data = stream_on_data;
+
+    pthread_mutex_init(&peer->lock, NULL);
+    pthread_cond_init(&peer->cond, NULL);
+
+    peer->session = session_create(ext, peer->name, &opts);
+    if (!peer->session) {
+        fprintf(stderr, "%s: create session failed (0x%x).\n",
+                peer->name, ela_get_error());
+        return -1;
+    }
+
+    peer->stream = ela_session_add_stream(peer->session,
+                        ElaStreamType_application, options, &callbacks, peer);
+    if (peer->stream < 0) {
+        fprintf(stderr, "%s: add stream failed (0x%x).\n",
+                peer->name, ela_get_error());
+        return -1;
+    }
+
+    return 0;
+}
+
+static int peer_prepare(Peer *peer, bool offer, char *sdp, size_t len)
+{
+    int rc;
+
+    if (!wait_for_state(peer, ElaStreamState_initialized))
+        return -1;
+
+    rc = session_prepare_local_sdp(peer->session, offer, sdp, len - 1);
+    if (rc < 0) {
+        fprintf(stderr, "%s: prepare local SDP failed (0x%x).\n",
+                peer->name, rc);
+        return -1;
+    }
+    sdp[rc] = 0;
+
+    if (!wait_for_state(peer, ElaStreamState_transport_ready))
+        return -1;
+
+    return rc + 1;
+}
+
+static void usage(void)
+{
+    printf("Loopback session benchmark.\n");
+    printf("Usage: elaloopbench [OPTION]...\n");
+    printf("\n");
+    printf("Link options:\n");
+    printf("  -d, --delay=MS          One way delay in milliseconds.\n");
+    printf("  -j, --jitter=MS         Random extra delay up to MS milliseconds.\n");
+    printf("  -l, --loss=PERMILLE     Packet loss rate in per mille.\n");
+    printf("  -b, --bandwidth=KBPS    Link bandwidth in KB/s, 0 for unlimited.\n");
+    printf("  -S, --seed=SEED         Seed of the jitter and loss, random by default.\n");
+    printf("\n");
+    printf("Stream options:\n");
+    printf("  -u, --unreliable        Use an unreliable stream.\n");
+    printf("  -P, --plain             Disable the stream encryption.\n");
+    printf("  -m, --multiplexing      Use a multiplexing stream.\n");
+    printf("\n");
+    printf("Benchmark options:\n");
+    printf("  -s, --size=BYTES        Bytes to transfer for throughput.\n");
+    printf("  -p, --packet=BYTES      Bytes of each write.\n");
+    printf("  -n, --pings=COUNT       Ping-pong rounds for latency.\n");
+    printf("  -v, --verbose           Enable debug logs.\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ElaCarrier *w;
+    SessionExtension *ext;
+    LoopbackLinkOptions link;
+    char datadir[] = "/tmp/elaloopbench.XXXXXX";
+    int options = ELA_STREAM_RELIABLE;
+    size_t total = DEFAULT_TRANSFER_SIZE;
+    size_t packet_size = DEFAULT_PACKET_SIZE;
+    int pings = DEFAULT_PINGS;
+    int loglevel = ElaLogLevel_Warning;
+    char offer_sdp[2048];
+    char answer_sdp[2048];
+    int offer_len;
+    int answer_len;
+    uint64_t start;
+    int rc = -1;
+
+    int opt;
+    int idx;
+    struct option opts[] = {
+        { "delay",          required_argument,  NULL, 'd' },
+        { "jitter",         required_argument,  NULL, 'j' },
+        { "loss",           required_argument,  NULL, 'l' },
+        { "bandwidth",      required_argument,  NULL, 'b' },
+        { "seed",           required_argument,  NULL, 'S' },
+        { "unreliable",     no_argument,        NULL, 'u' },
+        { "plain",          no_argument,        NULL, 'P' },
+        { "multiplexing",   no_argument,        NULL, 'm' },
+        { "size",           required_argument,  NULL, 's' },
+        { "packet",         required_argument,  NULL, 'p' },
+        { "pings",          required_argument,  NULL, 'n' },
+        { "verbose",        no_argument,        NULL, 'v' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL, 0 }
+    };
+
+    memset(&link, 0, sizeof(link));
+    link.seed = (uint32_t)now_us();
+
+    while ((opt = getopt_long(argc, argv, "d:j:l:b:S:uPms:p:n:vh?",
+            opts, &idx)) != -1) {
+        switch (opt) {
+        case 'd':
+            link.delay = (unsigned)atoi(optarg);
+            break;
+        case 'j':
+            link.jitter = (unsigned)atoi(optarg);
+            break;
+        case 'l':
+            link.loss = (unsigned)atoi(optarg);
+            break;
+        case 'b':
+            link.bandwidth = (uint64_t)strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'S':
+            link.seed = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            options &= ~ELA_STREAM_RELIABLE;
+            break;
+        case 'P':
+            options |= ELA_STREAM_PLAIN;
+            break;
+        case 'm':
+            options |= ELA_STREAM_MULTIPLEXING;
+            break;
+        case 's':
+            total = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            packet_size = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            pings = atoi(optarg);
+            break;
+        case 'v':
+            loglevel = ElaLogLevel_Debug;
+            break;
+        case 'h':
+        case '?':
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (!packet_size || packet_size > ELA_MAX_USER_DATA_LEN) {
+        fprintf(stderr, "Invalid packet size.\n");
+        return -1;
+    }
+
+    ela_log_init(loglevel, NULL, NULL);
+
+    w = carrier_create(datadir);
+    if (!w)
+        return -1;
+
+    rc = session_extension_init(w, loopback_transport_create);
+    if (rc < 0) {
+        fprintf(stderr, "Initialize session extension failed (0x%x).\n", rc);
+        ela_kill(w);
+        remove_datadir(datadir);
+        return -1;
+    }
+
+    ext = (SessionExtension *)w->extension;
+    loopback_transport_set_link(ext->transport, &link);
+
+    rc = -1;
+
+    if (peer_setup(ext, &offerer, options) < 0 ||
+        peer_setup(ext, &answerer, options) < 0)
+        goto cleanup;
+
+    start = now_us();
+
+    offer_len = peer_prepare(&offerer, true, offer_sdp, sizeof(offer_sdp));
+    if (offer_len < 0)
+        goto cleanup;
+
+    answer_len = peer_prepare(&answerer, false, answer_sdp, sizeof(answer_sdp));
+    if (answer_len < 0)
+        goto cleanup;
+
+    if (ela_session_start(answerer.session, offer_sdp, offer_len) < 0 ||
+        ela_session_start(offerer.session, answer_sdp, answer_len) < 0) {
+        fprintf(stderr, "Start session failed (0x%x).\n", ela_get_error());
+        goto cleanup;
+    }
+
+    if (!wait_for_state(&offerer, ElaStreamState_connected) ||
+        !wait_for_state(&answerer, ElaStreamState_connected))
+        goto cleanup;
+
+    printf("Link: delay %u ms, jitter %u ms, loss %u%%o, bandwidth %" PRIu64
+           " B/s, seed %u\n", link.delay, link.jitter, link.loss, link.bandwidth,
+           link.seed);
+    printf("Stream: %s%s%s\n",
+           options & ELA_STREAM_RELIABLE ? "reliable" : "unreliable",
+           options & ELA_STREAM_PLAIN ? ", plain" : ", encrypted",
+           options & ELA_STREAM_MULTIPLEXING ? ", multiplexing" : "");
+    printf("Setup:       %.3f ms\n", (now_us() - start) / 1000.0);
+
+    if (options & ELA_STREAM_MULTIPLEXING) {
+        printf("Multiplexing streams carry data on channels, skip benchmarks.\n");
+        rc = 0;
+        goto cleanup;
+    }
+
+    if (total > 0 &&
+        bench_throughput(total, packet_size, options & ELA_STREAM_RELIABLE) < 0)
+        goto cleanup;
+
+    if (pings > 0 && bench_latency(pings, packet_size) < 0)
+        goto cleanup;
+
+    print_stats(&offerer);
+    print_stats(&answerer);
+
+    rc = 0;
+
+cleanup:
+    if (offerer.session)
+        ela_session_close(offerer.session);
+    if (answerer.session)
+        ela_session_close(answerer.session);
+
+    ela_session_cleanup(w);
+
+    ela_kill(w);
+    remove_datadir(datadir);
+
+    return rc;
+}
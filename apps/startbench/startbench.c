@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <rc_mem.h>
+#include <crypto.h>
+#include <base58.h>
+#include <ela_carrier.h>
+
+#include "ela_carrier_impl.h"
+#include "config.h"
+
+#define DEFAULT_RUNS                5
+#define READY_TIMEOUT               60000  // ms
+#define VERIFY_TIMEOUT              10000  // ms
+#define FRIENDS_PAGE_SIZE           256
+
+typedef struct BenchContext {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            ready;
+} BenchContext;
+
+typedef struct PhaseTimes {
+    double total;
+    double load;
+    double dht;
+    double friends;
+    double init;
+    double bootstrap;
+    double verify;
+} PhaseTimes;
+
+static void sleep_ms(int ms)
+{
+    usleep(ms * 1000);
+}
+
+static void ready_callback(ElaCarrier *w, void *context)
+{
+    BenchContext *ctx = (BenchContext *)context;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->ready = true;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static bool wait_for_ready(BenchContext *ctx, int timeout)
+{
+    struct timeval now;
+    struct timespec deadline;
+    bool ready;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout / 1000;
+    deadline.tv_nsec = (now.tv_usec + (timeout % 1000) * 1000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->ready) {
+        if (pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    ready = ctx->ready;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ready;
+}
+
+static void *carrier_routine(void *arg)
+{
+    ela_run((ElaCarrier *)arg, 10);
+    return NULL;
+}
+
+static int count_friends(ElaCarrier *w)
+{
+    ElaFriendInfo *friends;
+    uint32_t cursor = 0;
+    int total = 0;
+    int rc;
+
+    friends = (ElaFriendInfo *)calloc(FRIENDS_PAGE_SIZE, sizeof(ElaFriendInfo));
+    if (!friends)
+        return -1;
+
+    do {
+        rc = ela_get_friends_page(w, &cursor, friends, FRIENDS_PAGE_SIZE);
+        if (rc > 0)
+            total += rc;
+    } while (rc == FRIENDS_PAGE_SIZE);
+
+    free(friends);
+
+    return rc < 0 ? -1 : total;
+}
+
+static int populate_friends(ElaCarrier *w, int count)
+{
+    int existing;
+    int i;
+
+    existing = count_friends(w);
+    if (existing < 0) {
+        fprintf(stderr, "Get friends failed (0x%x).\n", ela_get_error());
+        return -1;
+    }
+
+    if (existing < count)
+        printf("Adding %d friends...\n", count - existing);
+
+    for (i = existing; i < count; i++) {
+        uint8_t public_key[PUBLIC_KEY_BYTES];
+        uint8_t secret_key[SECRET_KEY_BYTES];
+        char userid[ELA_MAX_ID_LEN + 1];
+        size_t len = sizeof(userid);
+
+        crypto_create_keypair(public_key, secret_key);
+        base58_encode(public_key, sizeof(public_key), userid, &len);
+
+        if (ela_accept_friend(w, userid) < 0) {
+            fprintf(stderr, "Add friend failed (0x%x).\n", ela_get_error());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static double phase_ms(int64_t from, int64_t to)
+{
+    return (to - from) / 1000.0;
+}
+
+static int run_once(ElaOptions *opts, int friends, PhaseTimes *pt)
+{
+    ElaCallbacks callbacks;
+    BenchContext ctx;
+    StartupStats ss;
+    ElaCarrier *w;
+    pthread_t thread;
+    int rc = 0;
+    int i;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.ready = ready_callback;
+
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    w = ela_new(opts, &callbacks, &ctx);
+    if (!w) {
+        fprintf(stderr, "Create carrier instance failed (0x%x).\n",
+                ela_get_error());
+        rc = -1;
+        goto cleanup;
+    }
+
+    if (pthread_create(&thread, NULL, carrier_routine, w) != 0) {
+        fprintf(stderr, "Create carrier thread failed.\n");
+        ela_kill(w);
+        rc = -1;
+        goto cleanup;
+    }
+
+    if (!wait_for_ready(&ctx, READY_TIMEOUT)) {
+        fprintf(stderr, "Carrier not ready in %d ms.\n", READY_TIMEOUT);
+        rc = -1;
+        goto kill;
+    }
+
+    if (opts->deferred_verification) {
+        for (i = 0; i < VERIFY_TIMEOUT / 10 && w->verifier; i++)
+            sleep_ms(10);
+    }
+
+    ss = w->startup;
+
+    pt->total = phase_ms(ss.begin, ss.ready);
+    pt->load = phase_ms(ss.begin, ss.loaded);
+    pt->dht = phase_ms(ss.loaded, ss.dht_created);
+    pt->friends = phase_ms(ss.dht_created, ss.friends_loaded);
+    pt->init = phase_ms(ss.friends_loaded, ss.created);
+    pt->bootstrap = phase_ms(ss.created, ss.ready);
+    pt->verify = ss.verified ? phase_ms(ss.begin, ss.verified) : 0;
+
+    if (friends > 0)
+        rc = populate_friends(w, friends);
+
+kill:
+    ela_kill(w);
+    pthread_join(thread, NULL);
+
+cleanup:
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+
+    return rc;
+}
+
+static void print_times(const char *name, PhaseTimes *pt)
+{
+    printf("%-8s %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f ", name, pt->total,
+           pt->load, pt->dht, pt->friends, pt->init, pt->bootstrap);
+
+    if (pt->verify > 0)
+        printf("%9.2f\n", pt->verify);
+    else
+        printf("%9s\n", "-");
+}
+
+static void usage(void)
+{
+    printf("Carrier startup benchmark.\n");
+    printf("Usage: elastartbench [OPTION]...\n");
+    printf("\n");
+    printf("  -c, --config=CONFIG_FILE  Set config file path.\n");
+    printf("  -n, --runs=COUNT          Measured restarts after the warm-up run.\n");
+    printf("  -f, --friends=COUNT       Make sure the node has COUNT friends.\n");
+    printf("  -D, --deferred            Verify persistent data in background.\n");
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    SpeedtestConfig *cfg;
+    char buffer[2048] = {0};
+    ElaOptions opts;
+    PhaseTimes pt;
+    PhaseTimes sum;
+    int runs = DEFAULT_RUNS;
+    int friends = 0;
+    int done = 0;
+    int rc;
+    int i;
+
+    int opt;
+    int idx;
+    struct option options[] = {
+        { "config",         required_argument,  NULL, 'c' },
+        { "runs",           required_argument,  NULL, 'n' },
+        { "friends",        required_argument,  NULL, 'f' },
+        { "deferred",       no_argument,        NULL, 'D' },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL,             0,                  NULL, 0 }
+    };
+
+    memset(&opts, 0, sizeof(opts));
+
+    while ((opt = getopt_long(argc, argv, "c:n:f:Dh?",
+            options, &idx)) != -1) {
+        switch (opt) {
+        case 'c':
+            strncpy(buffer, optarg, sizeof(buffer) - 1);
+            break;
+
+        case 'n':
+            runs = atoi(optarg);
+            break;
+
+        case 'f':
+            friends = atoi(optarg);
+            break;
+
+        case 'D':
+            opts.deferred_verification = true;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            usage();
+            exit(-1);
+        }
+    }
+
+    if (!*buffer || runs <= 0 || friends < 0) {
+        usage();
+        return -1;
+    }
+
+    cfg = load_config(buffer);
+    if (!cfg) {
+        fprintf(stderr, "loading configure failed !\n");
+        return -1;
+    }
+
+    ela_log_init(cfg->loglevel, cfg->logfile, NULL);
+
+    opts.udp_enabled = cfg->udp_enabled;
+    opts.persistent_location = cfg->datadir;
+    opts.bootstraps_size = cfg->bootstraps_size;
+    opts.bootstraps = (BootstrapNode *)calloc(1, sizeof(BootstrapNode) * opts.bootstraps_size);
+    if (!opts.bootstraps) {
+        fprintf(stderr, "out of memory.");
+        deref(cfg);
+        return -1;
+    }
+
+    for (i = 0 ; i < cfg->bootstraps_size; i++) {
+        BootstrapNode *b = &opts.bootstraps[i];
+        BootstrapNode *node = cfg->bootstraps[i];
+
+        b->ipv4 = node->ipv4;
+        b->ipv6 = node->ipv6;
+        b->port = node->port;
+        b->public_key = node->public_key;
+    }
+
+    printf("Phase times in ms, verify is the time to deferred verification.\n");
+    printf("%-8s %9s %9s %9s %9s %9s %9s %9s\n", "run", "ready", "load",
+           "dht", "friends", "init", "bootstrap", "verify");
+
+    // The warm-up run creates the node and its friends if needed.
+    rc = run_once(&opts, friends, &pt);
+    if (rc < 0)
+        goto quit;
+    print_times("warm-up", &pt);
+
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < runs; i++) {
+        char name[16];
+
+        rc = run_once(&opts, 0, &pt);
+        if (rc < 0)
+            break;
+
+        sprintf(name, "%d", i + 1);
+        print_times(name, &pt);
+
+        sum.total += pt.total;
+        sum.load += pt.load;
+        sum.dht += pt.dht;
+        sum.friends += pt.friends;
+        sum.init += pt.init;
+        sum.bootstrap += pt.bootstrap;
+        sum.verify += pt.verify;
+        done++;
+    }
+
+    if (done > 0) {
+        sum.total /= done;
+        sum.load /= done;
+        sum.dht /= done;
+        sum.friends /= done;
+        sum.init /= done;
+        sum.bootstrap /= done;
+        sum.verify /= done;
+        print_times("average", &sum);
+    }
+
+quit:
+    free(opts.bootstraps);
+    deref(cfg);
+
+    return rc < 0 ? -1 : 0;
+}
@@ -0,0 +1,799 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ALLOCA_H
+#include <alloca.h>
+#endif
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_IO_H
+#include <io.h>
+#endif
+#ifdef HAVE_WINSOCK2_H
+#include <winsock2.h>
+#endif
+#ifdef HAVE_WS2TCPIP_H
+#include <ws2tcpip.h>
+#endif
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include <rc_mem.h>
+#include <vlog.h>
+#include <crypto.h>
+#include <socket.h>
+#include <time_util.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <posix_helper.h>
+#endif
+
+#include "ela_carrier.h"
+#include "bootstrap_cache.h"
+
+/*
+ * The bootstrap cache keeps the bootstrap nodes that answered recent
+ * probes, together with their measured connect rtt, so the next start
+ * can bootstrap to the fastest nodes first instead of all configured
+ * nodes in configuration order. It also keeps the DHT nodes and the TCP
+ * relays the carrier got connected to, so the next start has more to try
+ * than the configured nodes.
+ *
+ * File layout, all integers in network byte order:
+ *   magic(4) | revision(4) | count(4) | checksum(4) | entries
+ * Each entry:
+ *   ipv4(16) | ipv6(48) | port(2) | flags(2) | public key(32) |
+ *   rtt(4) | failures(4) | last ok(8)
+ * The checksum is the first 4 bytes of sha256 over all entries.
+ */
+static const char *cache_filename = "carrier.bootstraps";
+
+static const uint32_t BOOTSTRAP_CACHE_MAGIC = 0x0E0C0B0C;
+static const uint32_t BOOTSTRAP_CACHE_REVISION = 2;
+
+#define BOOTSTRAP_CACHE_HEADER_SIZE     (sizeof(uint32_t) * 4)
+#define BOOTSTRAP_CACHE_ENTRY_SIZE      (16 + 48 + 2 + 2 + 32 + 4 + 4 + 8)
+
+// Cached nodes not from the configuration are dropped after so many
+// consecutive failed probes.
+#define MAX_BOOTSTRAP_FAILURES          3
+
+// The DHT only nodes, which are not probed, are dropped once not seen
+// connected for so long, in seconds.
+#define MAX_BOOTSTRAP_NODE_AGE          (7 * 24 * 60 * 60)
+
+// Learned nodes are taken up to so many candidates in total, the best
+// ranked of them are stored.
+#define MAX_BOOTSTRAP_CANDIDATES        (2 * MAX_BOOTSTRAP_CACHE_SIZE)
+
+static uint8_t *put_uint32(uint8_t *pos, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(pos, &val, sizeof(uint32_t));
+    return pos + sizeof(uint32_t);
+}
+
+static const uint8_t *get_uint32(const uint8_t *pos, uint32_t *val)
+{
+    memcpy(val, pos, sizeof(uint32_t));
+    *val = ntohl(*val);
+    return pos + sizeof(uint32_t);
+}
+
+static void encode_entry(uint8_t *pos, const BootstrapCandidate *bc)
+{
+    uint16_t port;
+    uint16_t flags;
+
+    memset(pos, 0, BOOTSTRAP_CACHE_ENTRY_SIZE);
+
+    strncpy((char *)pos, bc->node.ipv4, 15);
+    pos += 16;
+    strncpy((char *)pos, bc->node.ipv6, 47);
+    pos += 48;
+
+    port = htons(bc->node.port);
+    memcpy(pos, &port, sizeof(port));
+    pos += sizeof(port);
+    flags = htons((uint16_t)bc->flags);
+    memcpy(pos, &flags, sizeof(flags));
+    pos += sizeof(flags);
+
+    memcpy(pos, bc->node.public_key, DHT_PUBLIC_KEY_SIZE);
+    pos += DHT_PUBLIC_KEY_SIZE;
+
+    pos = put_uint32(pos, (uint32_t)bc->rtt);
+    pos = put_uint32(pos, (uint32_t)bc->failures);
+    pos = put_uint32(pos, (uint32_t)((uint64_t)bc->last_ok >> 32));
+    put_uint32(pos, (uint32_t)((uint64_t)bc->last_ok & 0xFFFFFFFF));
+}
+
+static void decode_entry(const uint8_t *pos, BootstrapCandidate *bc)
+{
+    uint16_t port;
+    uint16_t flags;
+    uint32_t hi, lo, val;
+
+    memset(bc, 0, sizeof(*bc));
+
+    memcpy(bc->node.ipv4, pos, 15);
+    pos += 16;
+    memcpy(bc->node.ipv6, pos, 47);
+    pos += 48;
+
+    memcpy(&port, pos, sizeof(port));
+    bc->node.port = ntohs(port);
+    pos += sizeof(port);
+    memcpy(&flags, pos, sizeof(flags));
+    bc->flags = ntohs(flags);
+    pos += sizeof(flags);
+
+    memcpy(bc->node.public_key, pos, DHT_PUBLIC_KEY_SIZE);
+    pos += DHT_PUBLIC_KEY_SIZE;
+
+    pos = get_uint32(pos, &val);
+    bc->rtt = (int)val;
+    pos = get_uint32(pos, &val);
+    bc->failures = (int)val;
+    pos = get_uint32(pos, &hi);
+    get_uint32(pos, &lo);
+    bc->last_ok = (int64_t)(((uint64_t)hi << 32) | lo);
+}
+
+static bool same_node(const BootstrapNodeBuf *a, const BootstrapNodeBuf *b)
+{
+    return a->port == b->port &&
+           memcmp(a->public_key, b->public_key, DHT_PUBLIC_KEY_SIZE) == 0 &&
+           strcmp(a->ipv4, b->ipv4) == 0 &&
+           strcmp(a->ipv6, b->ipv6) == 0;
+}
+
+static int find_node(const BootstrapCandidate *candidates, int size,
+                     const BootstrapNodeBuf *node)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (same_node(&candidates[i].node, node))
+            return i;
+    }
+
+    return -1;
+}
+
+static int read_cache_file(const char *data_location,
+                           BootstrapCandidate *candidates, int max)
+{
+    uint8_t sum[SHA256_BYTES];
+    uint8_t header[BOOTSTRAP_CACHE_HEADER_SIZE];
+    const uint8_t *pos;
+    uint8_t *buf;
+    char *filename;
+    uint32_t magic, revision, count;
+    size_t len;
+    int fd;
+    int i;
+
+    filename = (char *)alloca(strlen(data_location) + strlen(cache_filename) + 4);
+    sprintf(filename, "%s/%s", data_location, cache_filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (read(fd, header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return 0;
+    }
+
+    pos = get_uint32(header, &magic);
+    pos = get_uint32(pos, &revision);
+    pos = get_uint32(pos, &count);
+
+    if (magic != BOOTSTRAP_CACHE_MAGIC ||
+            revision != BOOTSTRAP_CACHE_REVISION || count > max) {
+        vlogW("Carrier: Bootstrap cache %s is invalid, ignored.", filename);
+        close(fd);
+        return 0;
+    }
+
+    if (count == 0) {
+        close(fd);
+        return 0;
+    }
+
+    len = count * BOOTSTRAP_CACHE_ENTRY_SIZE;
+    buf = (uint8_t *)alloca(len);
+    if (read(fd, buf, len) != len) {
+        vlogW("Carrier: Bootstrap cache %s is truncated, ignored.", filename);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+
+    sha256(buf, len, sum, sizeof(sum));
+    if (memcmp(pos, sum, sizeof(uint32_t)) != 0) {
+        vlogW("Carrier: Bootstrap cache %s checksum error, ignored.", filename);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+        decode_entry(buf + i * BOOTSTRAP_CACHE_ENTRY_SIZE, &candidates[i]);
+
+    return (int)count;
+}
+
+int bootstrap_cache_load(const char *data_location,
+                         const BootstrapNodeBuf *nodes, int count,
+                         BootstrapCandidate **candidates, int *size)
+{
+    BootstrapCandidate *cands;
+    int cached;
+    int total;
+    int i;
+
+    assert(data_location);
+    assert(candidates && size);
+
+    cands = (BootstrapCandidate *)calloc(MAX_BOOTSTRAP_CACHE_SIZE + count,
+                                         sizeof(BootstrapCandidate));
+    if (!cands)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    cached = read_cache_file(data_location, cands, MAX_BOOTSTRAP_CACHE_SIZE);
+    total = cached;
+
+    for (i = 0; i < count; i++) {
+        int idx = find_node(cands, total, &nodes[i]);
+
+        if (idx < 0) {
+            idx = total++;
+            cands[idx].node = nodes[i];
+            cands[idx].rtt = -1;
+            cands[idx].failures = 0;
+            cands[idx].last_ok = 0;
+        }
+
+        // Bootstrapping adds the node both as DHT node and TCP relay.
+        cands[idx].configured = true;
+        cands[idx].flags |= BOOTSTRAP_NODE_TCP | BOOTSTRAP_NODE_UDP;
+    }
+
+    bootstrap_cache_rank(cands, total);
+
+    vlogD("Carrier: Loaded %d cached bootstrap nodes, %d candidates in total.",
+          cached, total);
+
+    *candidates = cands;
+    *size = total;
+    return 0;
+}
+
+static bool should_store(const BootstrapCandidate *bc, time_t now)
+{
+    if (bc->configured)
+        return true;
+
+    if (bc->failures >= MAX_BOOTSTRAP_FAILURES)
+        return false;
+
+    if (!(bc->flags & BOOTSTRAP_NODE_TCP) &&
+            now - bc->last_ok > MAX_BOOTSTRAP_NODE_AGE)
+        return false;
+
+    return true;
+}
+
+int bootstrap_cache_store(const char *data_location,
+                          const BootstrapCandidate *candidates, int size)
+{
+    uint8_t *buf;
+    uint8_t *pos;
+    char *journal_filename;
+    char *filename;
+    uint8_t sum[SHA256_BYTES];
+    size_t total_len;
+    uint32_t count = 0;
+    time_t now = time(NULL);
+    int fd;
+    int i;
+
+    assert(data_location);
+    assert(candidates || size == 0);
+
+    total_len = BOOTSTRAP_CACHE_HEADER_SIZE +
+                MAX_BOOTSTRAP_CACHE_SIZE * BOOTSTRAP_CACHE_ENTRY_SIZE;
+    buf = (uint8_t *)alloca(total_len);
+
+    pos = buf + BOOTSTRAP_CACHE_HEADER_SIZE;
+    for (i = 0; i < size && count < MAX_BOOTSTRAP_CACHE_SIZE; i++) {
+        if (!should_store(&candidates[i], now))
+            continue;
+
+        encode_entry(pos, &candidates[i]);
+        pos += BOOTSTRAP_CACHE_ENTRY_SIZE;
+        count++;
+    }
+
+    total_len = pos - buf;
+    sha256(buf + BOOTSTRAP_CACHE_HEADER_SIZE,
+           total_len - BOOTSTRAP_CACHE_HEADER_SIZE, sum, sizeof(sum));
+
+    pos = put_uint32(buf, BOOTSTRAP_CACHE_MAGIC);
+    pos = put_uint32(pos, BOOTSTRAP_CACHE_REVISION);
+    pos = put_uint32(pos, count);
+    memcpy(pos, sum, sizeof(uint32_t));
+
+    filename = (char *)alloca(strlen(data_location) + strlen(cache_filename) + 4);
+    sprintf(filename, "%s/%s", data_location, cache_filename);
+    journal_filename = (char *)alloca(strlen(data_location) + strlen(cache_filename) + 16);
+    sprintf(journal_filename, "%s/%s.journal", data_location, cache_filename);
+
+    fd = open(journal_filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return ELA_SYS_ERROR(errno);
+
+    if (write(fd, buf, total_len) != total_len) {
+        close(fd);
+        remove(journal_filename);
+        return ELA_SYS_ERROR(errno);
+    }
+
+    close(fd);
+
+    remove(filename);
+    rename(journal_filename, filename);
+
+    return 0;
+}
+
+/*
+ * Nodes that answered the last probe come first, ordered by rtt. Nodes
+ * never measured keep their relative order, with configured nodes ahead
+ * of the merely cached ones, and failing nodes go last.
+ */
+static int candidate_compare(const void *a, const void *b)
+{
+    const BootstrapCandidate *ca = (const BootstrapCandidate *)a;
+    const BootstrapCandidate *cb = (const BootstrapCandidate *)b;
+
+    if (ca->failures != cb->failures)
+        return ca->failures < cb->failures ? -1 : 1;
+
+    if ((ca->rtt >= 0) != (cb->rtt >= 0))
+        return ca->rtt >= 0 ? -1 : 1;
+
+    if (ca->rtt != cb->rtt)
+        return ca->rtt < cb->rtt ? -1 : 1;
+
+    if (ca->configured != cb->configured)
+        return ca->configured ? -1 : 1;
+
+    return 0;
+}
+
+void bootstrap_cache_rank(BootstrapCandidate *candidates, int size)
+{
+    BootstrapCandidate *tmp;
+    int i, j;
+
+    assert(candidates || size == 0);
+
+    // Insertion sort: stable, and the candidate list is short.
+    tmp = (BootstrapCandidate *)alloca(sizeof(BootstrapCandidate));
+    for (i = 1; i < size; i++) {
+        *tmp = candidates[i];
+        for (j = i; j > 0 && candidate_compare(&candidates[j - 1], tmp) > 0; j--)
+            candidates[j] = candidates[j - 1];
+        candidates[j] = *tmp;
+    }
+}
+
+int bootstrap_cache_learn(BootstrapCandidate **candidates, int *size,
+                          const BootstrapNodeBuf *node, int flags)
+{
+    BootstrapCandidate *cands = *candidates;
+    BootstrapCandidate *bc = NULL;
+    int added = 0;
+    int i;
+
+    assert(candidates && size && node);
+
+    // The same node may be known by another of its addresses.
+    for (i = 0; i < *size; i++) {
+        if (cands[i].node.port == node->port &&
+                memcmp(cands[i].node.public_key, node->public_key,
+                       DHT_PUBLIC_KEY_SIZE) == 0) {
+            bc = &cands[i];
+            break;
+        }
+    }
+
+    if (!bc) {
+        if (*size >= MAX_BOOTSTRAP_CANDIDATES)
+            return 0;
+
+        cands = (BootstrapCandidate *)realloc(cands,
+                            sizeof(BootstrapCandidate) * (*size + 1));
+        if (!cands)
+            return 0;
+
+        *candidates = cands;
+        bc = &cands[(*size)++];
+
+        memset(bc, 0, sizeof(*bc));
+        bc->node = *node;
+        bc->rtt = -1;
+        added = 1;
+    }
+
+    // Connected to, the node works whatever the last probe said.
+    bc->flags |= flags;
+    bc->failures = 0;
+    bc->last_ok = time(NULL);
+
+    return added;
+}
+
+struct BootstrapProbe {
+    BootstrapCandidate *candidates;
+    int size;
+    int timeout;
+    int done;
+};
+
+#if defined(_WIN32) || defined(_WIN64)
+#define CONNECT_IN_PROGRESS     WSAEWOULDBLOCK
+#else
+#define CONNECT_IN_PROGRESS     EINPROGRESS
+#endif
+
+static int set_nonblocking(SOCKET s)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    u_long mode = 1;
+
+    return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags;
+
+    flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0 ? 0 : -1;
+#endif
+}
+
+/*
+ * Start a non-blocking TCP connect to the node. Return 1 if connected
+ * already, 0 if in progress, or -1 on failure.
+ */
+static int probe_connect(const BootstrapNodeBuf *node, SOCKET *sock)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai = NULL;
+    const char *host;
+    char port[16];
+    SOCKET s;
+    int rc;
+
+    host = *node->ipv4 ? node->ipv4 : node->ipv6;
+    if (!*host)
+        return -1;
+
+    sprintf(port, "%u", node->port);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0 || !ai)
+        return -1;
+
+    s = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    // Out of the range select() can watch.
+    if (s >= FD_SETSIZE) {
+        socket_close(s);
+        freeaddrinfo(ai);
+        return -1;
+    }
+#endif
+
+    if (set_nonblocking(s) < 0) {
+        socket_close(s);
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    rc = connect(s, ai->ai_addr, (int)ai->ai_addrlen);
+    freeaddrinfo(ai);
+
+    if (rc < 0 && socket_errno() != CONNECT_IN_PROGRESS) {
+        socket_close(s);
+        return -1;
+    }
+
+    *sock = s;
+    return rc == 0 ? 1 : 0;
+}
+
+static void probe_result(BootstrapCandidate *bc, int rtt)
+{
+    if (rtt >= 0) {
+        bc->rtt = rtt;
+        bc->failures = 0;
+        bc->last_ok = time(NULL);
+    } else {
+        bc->rtt = -1;
+        bc->failures++;
+    }
+}
+
+static void probe_candidates(BootstrapCandidate *candidates, int size,
+                             int timeout)
+{
+    SOCKET *socks;
+    int64_t start;
+    int pending = 0;
+    int i;
+
+    socks = (SOCKET *)alloca(sizeof(SOCKET) * size);
+
+    start = get_monotonic_time();
+
+    for (i = 0; i < size; i++) {
+        int rc;
+
+        socks[i] = INVALID_SOCKET;
+
+        if (!(candidates[i].flags & BOOTSTRAP_NODE_TCP))
+            continue;
+
+        // The fd_set of Windows holds up to FD_SETSIZE sockets.
+        if (pending >= FD_SETSIZE) {
+            probe_result(&candidates[i], -1);
+            continue;
+        }
+
+        rc = probe_connect(&candidates[i].node, &socks[i]);
+        if (rc < 0) {
+            probe_result(&candidates[i], -1);
+        } else if (rc > 0) {
+            socket_close(socks[i]);
+            socks[i] = INVALID_SOCKET;
+            probe_result(&candidates[i],
+                         (int)((get_monotonic_time() - start) / 1000));
+        } else {
+            pending++;
+        }
+    }
+
+    while (pending > 0) {
+        struct timeval tv;
+        fd_set wfds;
+        fd_set efds;
+        int64_t elapsed;
+        int64_t now;
+        SOCKET max_fd = 0;
+        int rc;
+
+        elapsed = (get_monotonic_time() - start) / 1000;
+        if (elapsed >= timeout)
+            break;
+
+        tv.tv_sec = (long)((timeout - elapsed) / 1000);
+        tv.tv_usec = (long)(((timeout - elapsed) % 1000) * 1000);
+
+        // Windows reports a failed connect in the exception set.
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+        for (i = 0; i < size; i++) {
+            if (socks[i] != INVALID_SOCKET) {
+                FD_SET(socks[i], &wfds);
+                FD_SET(socks[i], &efds);
+                if (socks[i] > max_fd)
+                    max_fd = socks[i];
+            }
+        }
+
+        rc = select((int)max_fd + 1, NULL, &wfds, &efds, &tv);
+        if (rc < 0) {
+            if (socket_errno() == EINTR)
+                continue;
+            break;
+        }
+
+        now = get_monotonic_time();
+
+        for (i = 0; i < size; i++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (socks[i] == INVALID_SOCKET ||
+                    (!FD_ISSET(socks[i], &wfds) && !FD_ISSET(socks[i], &efds)))
+                continue;
+
+            if (FD_ISSET(socks[i], &efds) ||
+                    getsockopt(socks[i], SOL_SOCKET, SO_ERROR,
+                               (char *)&err, &len) < 0)
+                err = -1;
+
+            probe_result(&candidates[i],
+                         err == 0 ? (int)((now - start) / 1000) : -1);
+
+            socket_close(socks[i]);
+            socks[i] = INVALID_SOCKET;
+            pending--;
+        }
+    }
+
+    // Timeout for the rest.
+    for (i = 0; i < size; i++) {
+        if (socks[i] != INVALID_SOCKET) {
+            socket_close(socks[i]);
+            probe_result(&candidates[i], -1);
+        }
+    }
+}
+
+static void *probe_routine(void *arg)
+{
+    BootstrapProbe *probe = (BootstrapProbe *)arg;
+    int probed = 0;
+    int ok = 0;
+    int i;
+
+    probe_candidates(probe->candidates, probe->size, probe->timeout);
+
+    for (i = 0; i < probe->size; i++) {
+        if (!(probe->candidates[i].flags & BOOTSTRAP_NODE_TCP))
+            continue;
+
+        probed++;
+        if (probe->candidates[i].rtt >= 0)
+            ok++;
+    }
+
+    vlogD("Carrier: Bootstrap probe finished, %d of %d nodes responsive.",
+          ok, probed);
+
+    __atomic_store_n(&probe->done, 1, __ATOMIC_RELEASE);
+    deref(probe);
+    return NULL;
+}
+
+static void probe_destroy(void *p)
+{
+    BootstrapProbe *probe = (BootstrapProbe *)p;
+
+    if (probe->candidates)
+        free(probe->candidates);
+}
+
+BootstrapProbe *bootstrap_probe_start(const BootstrapCandidate *candidates,
+                                      int size, int timeout)
+{
+    BootstrapProbe *probe;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rc;
+
+    assert(candidates && size > 0 && timeout > 0);
+
+    probe = (BootstrapProbe *)rc_zalloc(sizeof(BootstrapProbe), probe_destroy);
+    if (!probe)
+        return NULL;
+
+    probe->candidates = (BootstrapCandidate *)malloc(sizeof(BootstrapCandidate) * size);
+    if (!probe->candidates) {
+        deref(probe);
+        return NULL;
+    }
+
+    memcpy(probe->candidates, candidates, sizeof(BootstrapCandidate) * size);
+    probe->size = size;
+    probe->timeout = timeout;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    rc = pthread_create(&thread, &attr, probe_routine, ref(probe));
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        vlogW("Carrier: Create bootstrap probe thread error(%d).", rc);
+        deref(probe);
+        deref(probe);
+        return NULL;
+    }
+
+    return probe;
+}
+
+bool bootstrap_probe_done(BootstrapProbe *probe)
+{
+    assert(probe);
+
+    return __atomic_load_n(&probe->done, __ATOMIC_ACQUIRE) != 0;
+}
+
+void bootstrap_probe_apply(BootstrapProbe *probe,
+                           BootstrapCandidate *candidates, int size)
+{
+    int i;
+
+    assert(probe && bootstrap_probe_done(probe));
+    assert(candidates || size == 0);
+
+    for (i = 0; i < probe->size; i++) {
+        int idx;
+
+        // Not probed, the results may have been updated meanwhile.
+        if (!(probe->candidates[i].flags & BOOTSTRAP_NODE_TCP))
+            continue;
+
+        idx = find_node(candidates, size, &probe->candidates[i].node);
+        if (idx < 0)
+            continue;
+
+        candidates[idx].rtt = probe->candidates[i].rtt;
+        candidates[idx].failures = probe->candidates[i].failures;
+        candidates[idx].last_ok = probe->candidates[i].last_ok;
+    }
+
+    bootstrap_cache_rank(candidates, size);
+}
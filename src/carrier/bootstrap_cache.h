@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __BOOTSTRAP_CACHE_H__
+#define __BOOTSTRAP_CACHE_H__
+
+#include <stdbool.h>
+
+#include "ela_carrier_impl.h"
+
+#define MAX_BOOTSTRAP_CACHE_SIZE        32
+
+// The node runs a TCP relay on the port.
+#define BOOTSTRAP_NODE_TCP              0x01
+// The node is a DHT node on the port, over UDP.
+#define BOOTSTRAP_NODE_UDP              0x02
+
+/*
+ * Load the bootstrap cache from the data location and merge the
+ * configured bootstrap nodes into it. The result is ranked best first.
+ */
+int bootstrap_cache_load(const char *data_location,
+                         const BootstrapNodeBuf *nodes, int count,
+                         BootstrapCandidate **candidates, int *size);
+
+int bootstrap_cache_store(const char *data_location,
+                          const BootstrapCandidate *candidates, int size);
+
+void bootstrap_cache_rank(BootstrapCandidate *candidates, int size);
+
+/*
+ * Merge a node toxcore is connected to, a DHT node or a TCP relay, into
+ * the candidates. The array is grown as needed. Return 1 if the node is
+ * new, 0 if already known or there is no room for it.
+ */
+int bootstrap_cache_learn(BootstrapCandidate **candidates, int *size,
+                          const BootstrapNodeBuf *node, int flags);
+
+/*
+ * Measure the TCP connect rtt of the candidates with a TCP relay, in
+ * parallel on a background thread. It is a heuristic of how fast the node
+ * answers, not a DHT or relay handshake: a node accepting the connection
+ * counts as responsive. Candidates known as DHT nodes only can not be
+ * probed so, and keep their results. The returned probe is ref counted.
+ */
+BootstrapProbe *bootstrap_probe_start(const BootstrapCandidate *candidates,
+                                      int size, int timeout);
+
+bool bootstrap_probe_done(BootstrapProbe *probe);
+
+void bootstrap_probe_apply(BootstrapProbe *probe,
+                           BootstrapCandidate *candidates, int size);
+
+#endif /* __BOOTSTRAP_CACHE_H__ */
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __BULKMSGS_H__
+#define __BULKMSGS_H__
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <linkedhashtable.h>
+
+#include "ela_carrier_impl.h"
+
+static
+uint32_t bulkmsg_hash_code(const void *key, size_t keylen)
+{
+    const BulkMsgKey *k = (const BulkMsgKey *)key;
+
+    assert(key && keylen == sizeof(BulkMsgKey));
+
+    return (uint32_t)(k->tid & 0x00000000ffffffff) +
+           (uint32_t)((k->tid & 0xffffffff00000000) >> 32) +
+           k->friend_number * 31;
+}
+
+static
+int bulkmsg_compare(const void *key1, size_t len1, const void *key2, size_t len2)
+{
+    const BulkMsgKey *k1 = (const BulkMsgKey *)key1;
+    const BulkMsgKey *k2 = (const BulkMsgKey *)key2;
+
+    assert(key1 && len1 == sizeof(BulkMsgKey));
+    assert(key2 && len2 == sizeof(BulkMsgKey));
+
+    if (k1->friend_number != k2->friend_number)
+        return k1->friend_number > k2->friend_number ? 1 : -1;
+
+    if (k1->tid != k2->tid)
+        return k1->tid > k2->tid ? 1 : -1;
+
+    return 0;
+}
+
+static inline
+hashtable_t *bulkmsgs_create(int capacity)
+{
+    return hashtable_create(capacity, 1, bulkmsg_hash_code, bulkmsg_compare);
+}
+
+static inline
+void bulkmsgs_put(hashtable_t *bulkmsgs, BulkMsg *msg)
+{
+    assert(bulkmsgs && msg);
+    msg->he.data = msg;
+    msg->he.key = &msg->key;
+    msg->he.keylen = sizeof(msg->key);
+    hashtable_put(bulkmsgs, &msg->he);
+}
+
+static inline
+BulkMsg *bulkmsgs_get(hashtable_t *bulkmsgs, uint32_t friend_number,
+                      int64_t tid)
+{
+    BulkMsgKey key;
+
+    assert(bulkmsgs);
+
+    key.tid = tid;
+    key.friend_number = friend_number;
+    return (BulkMsg *)hashtable_get(bulkmsgs, &key, sizeof(key));
+}
+
+static inline
+void bulkmsgs_remove(hashtable_t *bulkmsgs, uint32_t friend_number,
+                     int64_t tid)
+{
+    BulkMsgKey key;
+
+    assert(bulkmsgs);
+
+    key.tid = tid;
+    key.friend_number = friend_number;
+    deref(hashtable_remove(bulkmsgs, &key, sizeof(key)));
+}
+
+static inline
+int bulkmsgs_is_empty(hashtable_t *bulkmsgs)
+{
+    assert(bulkmsgs);
+    return hashtable_is_empty(bulkmsgs);
+}
+
+static inline
+hashtable_iterator_t *bulkmsgs_iterate(hashtable_t *bulkmsgs,
+                                       hashtable_iterator_t *iterator)
+{
+    assert(bulkmsgs && iterator);
+    return hashtable_iterate(bulkmsgs, iterator);
+}
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+static inline
+int bulkmsgs_iterator_next(hashtable_iterator_t *iterator, BulkMsg **msg)
+{
+    return hashtable_iterator_next(iterator, NULL, NULL, (void **)msg);
+}
+
+static inline
+int bulkmsgs_iterator_has_next(hashtable_iterator_t *iterator)
+{
+    return hashtable_iterator_has_next(iterator);
+}
+
+// return 1 on success, 0 nothing removed, -1 on modified conflict or error.
+static inline
+int bulkmsgs_iterator_remove(hashtable_iterator_t *iterator)
+{
+    return hashtable_iterator_remove(iterator);
+}
+
+#endif /* __BULKMSGS_H__ */
@@ -419,6 +419,16 @@ void notify_friend_message_cb(Tox *tox, uint32_t friend_number,
     cbs->notify_friend_message(friend_number, message, length, cbs->context);
 }
 
+static
+void notify_friend_read_receipt_cb(Tox *tox, uint32_t friend_number,
+                                   uint32_t message_id, void *context)
+{
+    DHTCallbacks *cbs = (DHTCallbacks *)context;
+
+    if (cbs->notify_friend_receipt)
+        cbs->notify_friend_receipt(friend_number, message_id, cbs->context);
+}
+
 static
 void log_cb(Tox *tox, TOX_LOG_LEVEL level, const char *file, uint32_t line,
             const char *func, const char *message, void *user_data)
@@ -489,6 +499,7 @@ int dht_new(const uint8_t *savedata, size_t datalen, bool udp_enabled, DHT *dht)
     tox_callback_friend_status(tox, notify_friend_status_cb);
     tox_callback_friend_request(tox, notify_friend_request_cb);
     tox_callback_friend_message(tox, notify_friend_message_cb);
+    tox_callback_friend_read_receipt(tox, notify_friend_read_receipt_cb);
 
     dht->tox = tox;
 
@@ -633,6 +644,7 @@ int dht_get_friends(DHT *dht, FriendsIterateCallback cb, void *context)
     size_t list_sz;
     uint32_t *friend_list;
     int i;
+    int rc = 0;
     uint8_t desc[TOX_MAX_STATUS_MESSAGE_LENGTH];
     uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
 
@@ -642,7 +654,11 @@ int dht_get_friends(DHT *dht, FriendsIterateCallback cb, void *context)
     if (!list_sz)
         return 0;
 
-    friend_list = (uint32_t *)alloca(list_sz * sizeof(uint32_t));
+    // Too large for stack with tens of thousands of friends.
+    friend_list = (uint32_t *)malloc(list_sz * sizeof(uint32_t));
+    if (!friend_list)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
     tox_self_get_friend_list(tox, friend_list);
 
     for (i = 0; i < list_sz; i++) {
@@ -656,35 +672,50 @@ int dht_get_friends(DHT *dht, FriendsIterateCallback cb, void *context)
                                                       &error);
         if (error != TOX_ERR_FRIEND_QUERY_OK) {
             vlogE("DHT: get friend status message size error (%d).", error);
-            return __dht_friend_query_error(error);
+            rc = __dht_friend_query_error(error);
+            break;
         }
 
         success = tox_friend_get_status_message(tox, friend_list[i], desc,
                                                 &error);
         if (!success) {
             vlogE("DHT: get friend status message error (%d).", error);
-            return __dht_friend_query_error(error);
+            rc = __dht_friend_query_error(error);
+            break;
         }
 
         user_status = tox_friend_get_status(tox, friend_list[i], &error);
         if (error != TOX_ERR_FRIEND_QUERY_OK) {
             vlogE("DHT: get friend user status error (%d).", error);
-            return __dht_friend_query_error(error);
+            rc = __dht_friend_query_error(error);
+            break;
         }
 
         success = tox_friend_get_public_key(tox, friend_list[i], public_key, &_error);
         if (!success) {
             vlogE("DHT: get friend public key error (%d).", _error);
-            return __dht_friend_get_pk_error(_error);
+            rc = __dht_friend_get_pk_error(_error);
+            break;
         }
 
         success = cb(friend_list[i], public_key, (int)user_status, desc, desc_len,
                      context);
         if (!success)
-            return 0;
+            break;
     }
 
-    return 0;
+    free(friend_list);
+
+    return rc;
+}
+
+size_t dht_get_friend_count(DHT *dht)
+{
+    Tox *tox = dht->tox;
+
+    assert(tox);
+
+    return tox_self_get_friend_list_size(tox);
 }
 
 size_t dht_get_savedata_size(DHT *dht)
@@ -723,6 +754,15 @@ void dht_iterate(DHT *dht, void *context)
     tox_iterate(tox, context);
 }
 
+int dht_get_fds(DHT *dht, int *fds, int count)
+{
+    Tox *tox = dht->tox;
+
+    assert(tox);
+
+    return tox_self_get_fds(tox, fds, count);
+}
+
 int dht_self_set_name(DHT *dht, uint8_t *name, size_t length)
 {
     Tox *tox = dht->tox;
@@ -822,23 +862,27 @@ int dht_friend_add_norequest(DHT *dht, const uint8_t *public_key,
 }
 
 int dht_friend_message(DHT *dht, uint32_t friend_number, const uint8_t *data,
-                       size_t length)
+                       size_t length, uint32_t *message_id)
 {
     Tox *tox = dht->tox;
     TOX_ERR_FRIEND_SEND_MESSAGE error;
+    uint32_t id;
 
     assert(tox);
     assert(friend_number != UINT32_MAX);
     assert(data && length > 0);
 
-    tox_friend_send_message(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL,
-                            data, length, &error);
+    id = tox_friend_send_message(tox, friend_number, TOX_MESSAGE_TYPE_NORMAL,
+                                 data, length, &error);
     if (error != TOX_ERR_FRIEND_SEND_MESSAGE_OK) {
         vlogW("DHT: send friend message to %u error (%d).", friend_number,
               error);
         return __dht_friend_send_msg_error(error);
     }
 
+    if (message_id)
+        *message_id = id;
+
     return 0;
 }
 
@@ -884,3 +928,37 @@ int dht_get_random_tcp_relay(DHT *dht, char *tcp_relay, size_t buflen,
 
     return 0;
 }
+
+typedef struct ConnectedNodesContext {
+    ConnectedNodesIterateCallback cb;
+    void *context;
+} ConnectedNodesContext;
+
+static void connected_node_cb(const uint8_t *public_key, const uint8_t *ip,
+                              size_t ip_len, uint16_t port, bool tcp,
+                              void *user_data)
+{
+    ConnectedNodesContext *ctx = (ConnectedNodesContext *)user_data;
+    char addr[INET6_ADDRSTRLEN];
+
+    if (!inet_ntop(ip_len == 4 ? AF_INET : AF_INET6, ip, addr, sizeof(addr)))
+        return;
+
+    ctx->cb(public_key, ip_len == 4 ? addr : "", ip_len == 4 ? "" : addr,
+            (int)port, tcp, ctx->context);
+}
+
+int dht_get_connected_nodes(DHT *dht, ConnectedNodesIterateCallback cb,
+                            void *context)
+{
+    Tox *tox = dht->tox;
+    ConnectedNodesContext ctx;
+
+    assert(tox);
+    assert(cb);
+
+    ctx.cb = cb;
+    ctx.context = context;
+
+    return tox_self_iterate_connected_nodes(tox, connected_node_cb, &ctx);
+}
@@ -25,6 +25,7 @@
 
 #define DHT_PUBLIC_KEY_SIZE     32U
 #define DHT_ADDRESS_SIZE        (32U + sizeof(uint32_t) + sizeof(uint16_t))
+#define DHT_MAX_MESSAGE_LEN     1372U
 
 typedef struct DHT DHT;
 
@@ -40,6 +41,12 @@ typedef void (*SelfInfoCallback)(const uint8_t *address,
                                  const uint8_t *desc, size_t desc_length,
                                  void *context);
 
+typedef void (*ConnectedNodesIterateCallback)(const uint8_t *public_key,
+                                              const char *ipv4,
+                                              const char *ipv6,
+                                              int port, bool tcp,
+                                              void *context);
+
 int dht_new(const uint8_t *savedata, size_t datalen, bool udp_enabled, DHT *dht);
 
 void dht_kill(DHT *dht);
@@ -61,6 +68,8 @@ int dht_get_self_info(DHT *dht, SelfInfoCallback cb, void *context);
 
 int dht_get_friends(DHT *dht, FriendsIterateCallback cb, void *context);
 
+size_t dht_get_friend_count(DHT *dht);
+
 size_t dht_get_savedata_size(DHT *dht);
 
 void dht_get_savedata(DHT *dht, uint8_t *data);
@@ -69,6 +78,8 @@ int dht_iteration_idle(DHT *dht);
 
 void dht_iterate(DHT *dht, void *context);
 
+int dht_get_fds(DHT *dht, int *fds, int count);
+
 int dht_self_set_name(DHT *dht, uint8_t *name, size_t length);
 
 int dht_self_set_desc(DHT *dht, uint8_t *status_msg, size_t length);
@@ -86,11 +97,15 @@ int dht_friend_add_norequest(DHT *dht, const uint8_t *public_key,
 
 
 int dht_friend_message(DHT *dht, uint32_t friend_number,
-                       const uint8_t *data, size_t length);
+                       const uint8_t *data, size_t length,
+                       uint32_t *message_id);
 
 int dht_friend_delete(DHT *dht, uint32_t friend_number);
 
 int dht_get_random_tcp_relay(DHT *dht, char *tcp_relay, size_t buflen,
                              uint8_t *public_key);
 
+int dht_get_connected_nodes(DHT *dht, ConnectedNodesIterateCallback cb,
+                            void *context);
+
 #endif // __DHT_WRAPPER_H__
@@ -48,6 +48,9 @@ struct DHTCallbacks {
 
     void (*notify_friend_message)(uint32_t friend_number, const uint8_t *message,
                                   size_t length, void *context);
+
+    void (*notify_friend_receipt)(uint32_t friend_number, uint32_t message_id,
+                                  void *context);
 };
 
 typedef struct DHTCallbacks DHTCallbacks;
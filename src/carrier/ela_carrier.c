@@ -46,6 +46,15 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
@@ -61,6 +70,7 @@
 #include <vlog.h>
 #include <crypto.h>
 #include <linkedlist.h>
+#include <time_util.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <posix_helper.h>
@@ -74,6 +84,9 @@
 #include "friends.h"
 #include "tcallbacks.h"
 #include "thistory.h"
+#include "receipts.h"
+#include "bulkmsgs.h"
+#include "bootstrap_cache.h"
 #include "elacp.h"
 #include "dht.h"
 
@@ -184,30 +197,62 @@ static
 int get_friend_number(ElaCarrier *w, const char *friendid, uint32_t *friend_number)
 {
     uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
+    FriendInfo *fi;
     ssize_t len;
-    int rc;
 
     assert(w);
     assert(friendid);
     assert(friend_number);
 
+    fi = friend_ids_get(w->friend_ids, friendid);
+    if (fi) {
+        *friend_number = fi->friend_number;
+        deref(fi);
+        return 0;
+    }
+
     len = base58_decode(friendid, strlen(friendid), public_key, sizeof(public_key));
     if (len != DHT_PUBLIC_KEY_SIZE) {
         vlogE("Carrier: friendid %s not base58 encoded.", friendid);
         return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
     }
 
-    rc = dht_get_friend_number(&w->dht, public_key, friend_number);
-    if (rc < 0) {
-        //vlogE("Carrier: friendid %s is not friend yet.", friendid);
-        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
-    }
+    //vlogE("Carrier: friendid %s is not friend yet.", friendid);
+    return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+}
 
-    return rc;
+static void friends_add(ElaCarrier *w, FriendInfo *fi)
+{
+    assert(w);
+    assert(fi);
+
+    friends_put(w->friends, fi);
+    friend_ids_put(w->friend_ids, fi);
+    friend_keys_put(w->friend_keys, fi);
+
+    if (fi->friend_number >= w->friend_number_end)
+        w->friend_number_end = fi->friend_number + 1;
+}
+
+static FriendInfo *friends_delete(ElaCarrier *w, uint32_t friend_number)
+{
+    FriendInfo *fi;
+
+    assert(w);
+
+    fi = friends_remove(w->friends, friend_number);
+    if (!fi)
+        return NULL;
+
+    deref(friend_ids_remove(w->friend_ids, fi->info.user_info.userid));
+    deref(friend_keys_remove(w->friend_keys, fi->public_key));
+
+    return fi;
 }
 
-static void fill_empty_user_desc(ElaCarrier *w)
+static void update_self_desc(ElaCarrier *w)
 {
+    ElaUserInfo *ui = &w->me;
     ElaCP *cp;
     uint8_t *data;
     size_t data_len;
@@ -220,13 +265,14 @@ static void fill_empty_user_desc(ElaCarrier *w)
         return;
     }
 
-    elacp_set_has_avatar(cp, false);
-    elacp_set_name(cp, "");
-    elacp_set_descr(cp, "");
-    elacp_set_gender(cp, "");
-    elacp_set_phone(cp, "");
-    elacp_set_email(cp, "");
-    elacp_set_region(cp, "");
+    elacp_set_has_avatar(cp, !!ui->has_avatar);
+    elacp_set_name(cp, ui->name);
+    elacp_set_descr(cp, ui->description);
+    elacp_set_gender(cp, ui->gender);
+    elacp_set_phone(cp, ui->phone);
+    elacp_set_email(cp, ui->email);
+    elacp_set_region(cp, ui->region);
+    elacp_set_caps(cp, ELACP_CAPS);
 
     data = elacp_encode(cp, &data_len);
     elacp_free(cp);
@@ -242,7 +288,7 @@ static void fill_empty_user_desc(ElaCarrier *w)
 
 static
 int unpack_user_desc(const uint8_t *desc, size_t desc_len, ElaUserInfo *info,
-                     bool *changed)
+                     uint32_t *caps, bool *changed)
 {
     ElaCP *cp;
     const char *name;
@@ -277,6 +323,9 @@ int unpack_user_desc(const uint8_t *desc, size_t desc_len, ElaUserInfo *info,
     email  = elacp_get_email(cp)  ? elacp_get_email(cp) : "";
     region = elacp_get_region(cp) ? elacp_get_region(cp) : "";
 
+    if (caps)
+        *caps = elacp_get_caps(cp);
+
     if (strcmp(info->name, name)) {
         strcpy(info->name, name);
         did_changed = true;
@@ -341,6 +390,7 @@ static void get_self_info_cb(const uint8_t *address, const uint8_t *public_key,
 {
     ElaCarrier *w = (ElaCarrier *)context;
     ElaUserInfo *ui = &w->me;
+    uint32_t caps = 0;
     size_t text_len;
 
     memcpy(w->address, address, DHT_ADDRESS_SIZE);
@@ -354,9 +404,11 @@ static void get_self_info_cb(const uint8_t *address, const uint8_t *public_key,
     w->presence_status = get_presence_status(user_status);
 
     if (desc_len > 0)
-        unpack_user_desc(desc, desc_len, ui, NULL);
-    else
-        fill_empty_user_desc(w);
+        unpack_user_desc(desc, desc_len, ui, &caps, NULL);
+
+    // Desc saved by older versions carries no capabilities, refresh it.
+    if (caps != ELACP_CAPS)
+        update_self_desc(w);
 }
 
 static bool friends_iterate_cb(uint32_t friend_number,
@@ -379,9 +431,10 @@ static bool friends_iterate_cb(uint32_t friend_number,
 
     ui = &fi->info.user_info;
     base58_encode(public_key, DHT_PUBLIC_KEY_SIZE, ui->userid, &_len);
+    memcpy(fi->public_key, public_key, DHT_PUBLIC_KEY_SIZE);
 
     if (desc_len > 0) {
-        rc = unpack_user_desc(desc, desc_len, ui, NULL);
+        rc = unpack_user_desc(desc, desc_len, ui, &fi->caps, NULL);
         if (rc < 0) {
             deref(fi);
             return false;
@@ -394,7 +447,7 @@ static bool friends_iterate_cb(uint32_t friend_number,
 
     // Label will be synched later from data file.
 
-    friends_put(w->friends, fi);
+    friends_add(w, fi);
 
     deref(fi);
 
@@ -417,8 +470,42 @@ typedef struct persistence_data {
     const uint8_t *dht_savedata;
     size_t extra_savedata_len;
     const uint8_t *extra_savedata;
+    size_t changes_len;
+    const uint8_t *changes;
+
+    uint8_t *file;              // whole data file, mapped or allocated.
+    size_t file_len;
+    bool mapped;
+    bool verified;
+    bool journal;               // unverified journal, not renamed yet.
+    uint8_t sum[SHA256_BYTES];  // checksum stored in data file.
 } persistence_data;
 
+struct PersistenceVerifier {
+    uint8_t *file;
+    size_t file_len;
+    bool mapped;
+    bool journal;
+    uint8_t sum[SHA256_BYTES];
+    int result;         // 0 pending, 1 passed, -1 failed.
+    int64_t done_time;
+};
+
+static void release_data_file(uint8_t *file, size_t file_len, bool mapped)
+{
+    if (!file)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (mapped) {
+        munmap(file, file_len);
+        return;
+    }
+#endif
+
+    free(file);
+}
+
 static int convert_old_dhtdata(const char *data_location)
 {
     uint8_t *buf;
@@ -585,16 +672,16 @@ write_data:
     return 0;
 }
 
-static int _load_persistence_data_i(int fd, persistence_data *data)
+static int _load_persistence_data_i(int fd, persistence_data *data,
+                                    bool verify)
 {
     struct stat st;
     uint32_t val;
     size_t dht_data_len;
     size_t extra_data_len;
-    unsigned char p_sum[SHA256_BYTES];
     unsigned char c_sum[SHA256_BYTES];
-
-    uint8_t *buf;
+    uint8_t *file = NULL;
+    bool mapped = false;
 
     if (fstat(fd, &st) < 0) {
         vlogW("Load persistence data failed, stat files error(%d).", errno);
@@ -606,80 +693,89 @@ static int _load_persistence_data_i(int fd, persistence_data *data)
         return -1;
     }
 
-    if (read(fd, (void *)&val, sizeof(val)) != sizeof(val)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
-        return -1;
-    }
-    val = ntohl(val);
-    if (val != PERSISTENCE_MAGIC) {
+    if (st.st_size > 256 + MAX_PERSISTENCE_SECTION_SIZE * 2 + 512) {
         vlogW("Load persistence data failed, corrupt file.");
         return -1;
     }
 
-    if (read(fd, (void *)&val, sizeof(val)) != sizeof(val)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
-        return -1;
+#ifdef HAVE_SYS_MMAN_H
+    file = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == (uint8_t *)MAP_FAILED)
+        file = NULL;
+    else
+        mapped = true;
+#endif
+
+    if (!file) {
+        file = (uint8_t *)malloc(st.st_size);
+        if (!file) {
+            vlogW("Load persistence data failed, out of memory.");
+            return -1;
+        }
+
+        if (read(fd, file, st.st_size) != st.st_size) {
+            vlogW("Load persistence data failed, read error(%d).", errno);
+            free(file);
+            return -1;
+        }
     }
-    val = ntohl(val);
-    if (val != PERSISTENCE_REVISION) {
-        vlogW("Load persistence data failed, unsupported date file version.");
+
+    memcpy(&val, file, sizeof(val));
+    if (ntohl(val) != PERSISTENCE_MAGIC) {
+        vlogW("Load persistence data failed, corrupt file.");
+        release_data_file(file, st.st_size, mapped);
         return -1;
     }
 
-    if (read(fd, (void *)&val, sizeof(val)) != sizeof(val)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
+    memcpy(&val, file + sizeof(uint32_t), sizeof(val));
+    if (ntohl(val) != PERSISTENCE_REVISION) {
+        vlogW("Load persistence data failed, unsupported date file version.");
+        release_data_file(file, st.st_size, mapped);
         return -1;
     }
+
+    memcpy(&val, file + sizeof(uint32_t) * 2, sizeof(val));
     dht_data_len = ntohl(val);
     if (dht_data_len > MAX_PERSISTENCE_SECTION_SIZE) {
         vlogW("Load persistence data failed, corrupt file.");
+        release_data_file(file, st.st_size, mapped);
         return -1;
     }
 
-    if (read(fd, (void *)&val, sizeof(val)) != sizeof(val)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
-        return -1;
-    }
+    memcpy(&val, file + sizeof(uint32_t) * 3, sizeof(val));
     extra_data_len = ntohl(val);
     if (extra_data_len > MAX_PERSISTENCE_SECTION_SIZE) {
         vlogW("Load persistence data failed, corrupt file.");
+        release_data_file(file, st.st_size, mapped);
         return -1;
     }
 
     if (st.st_size != 256 + ROUND256(dht_data_len) + ROUND256(extra_data_len)) {
         vlogW("Load persistence data failed, corrupt file.");
+        release_data_file(file, st.st_size, mapped);
         return -1;
     }
 
-    if (read(fd, p_sum, sizeof(p_sum)) != sizeof(p_sum)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
-        return -1;
-    }
-
-    buf = (uint8_t *)malloc(st.st_size - 256);
-    if (!buf) {
-        vlogW("Load persistence data failed, out of memory.");
-        return -1;
-    }
+    memcpy(data->sum, file + sizeof(uint32_t) * 4, SHA256_BYTES);
 
-    lseek(fd, 256, SEEK_SET);
-    if (read(fd, buf, st.st_size - 256) != (st.st_size - 256)) {
-        vlogW("Load persistence data failed, read error(%d).", errno);
-        free(buf);
-        return -1;
+    if (verify) {
+        sha256(file + 256, st.st_size - 256, c_sum, sizeof(c_sum));
+        if (memcmp(data->sum, c_sum, SHA256_BYTES) != 0) {
+            vlogW("Load persistence data failed, corrupt file.");
+            release_data_file(file, st.st_size, mapped);
+            return -1;
+        }
     }
 
-    sha256(buf, st.st_size - 256, c_sum, sizeof(c_sum));
-    if (memcmp(p_sum, c_sum, SHA256_BYTES) != 0) {
-        vlogW("Load persistence data failed, corrupt file.");
-        free(buf);
-        return -1;
-    }
+    data->file = file;
+    data->file_len = st.st_size;
+    data->mapped = mapped;
+    data->verified = verify;
 
     data->dht_savedata_len = dht_data_len;
-    data->dht_savedata = (const uint8_t *)buf;
+    data->dht_savedata = (const uint8_t *)file + 256;
     data->extra_savedata_len = extra_data_len;
-    data->extra_savedata = (const uint8_t *)buf + ROUND256(dht_data_len);
+    data->extra_savedata = (const uint8_t *)file + 256 + ROUND256(dht_data_len);
 
     return 0;
 }
@@ -692,7 +788,8 @@ static int _load_persistence_data_i(int fd, persistence_data *data)
         return rc;                      \
     }
 
-static int load_persistence_data(const char *data_location, persistence_data *data)
+static int load_persistence_data(const char *data_location,
+                                 persistence_data *data, bool verify)
 {
     char *filename;
     int journal = 1;
@@ -740,14 +837,18 @@ failback:
         FAILBACK_OR_RETURN(-1);
     }
 
-    rc = _load_persistence_data_i(fd, data);
+    rc = _load_persistence_data_i(fd, data, verify);
     close(fd);
 
     if (rc < 0) {
         FAILBACK_OR_RETURN(rc);
     }
 
-    if (rc == 0 && journal) {
+    // An unverified journal stays until verified, the data file is the
+    // fallback if it turns out to be corrupt.
+    if (rc == 0 && journal && !verify) {
+        data->journal = true;
+    } else if (rc == 0 && journal) {
         char *journal_filename = filename;
         char *filename = (char *)alloca(strlen(data_location) + strlen(data_filename) + 16);
         sprintf(filename, "%s/%s", data_location, data_filename);
@@ -762,17 +863,33 @@ failback:
 static void apply_extra_data(ElaCarrier *w, const uint8_t *extra_savedata, size_t extra_savedata_len)
 {
     const uint8_t *pos = extra_savedata;
+    const uint8_t *end = extra_savedata + extra_savedata_len;
 
-    while (extra_savedata_len > 0) {
+    while (end - pos > sizeof(uint32_t)) {
         uint32_t friend_number;
-        char *label;
+        const char *label;
         size_t label_len;
+        size_t max_len;
         FriendInfo *fi;
 
-        friend_number = ntohl(*(uint32_t *)pos);
+        memcpy(&friend_number, pos, sizeof(friend_number));
+        friend_number = ntohl(friend_number);
         pos += sizeof(uint32_t);
-        label = (char *)pos;
-        label_len = strlen(label);
+
+        // The data may be unverified yet, the label with its terminator
+        // must be within the section and fit in the friend info.
+        label = (const char *)pos;
+        max_len = end - pos;
+        if (max_len > ELA_MAX_USER_NAME_LEN + 1)
+            max_len = ELA_MAX_USER_NAME_LEN + 1;
+
+        label_len = strnlen(label, max_len);
+        if (label_len == max_len) {
+            vlogW("Carrier: Invalid friend label in persistence data, "
+                  "ignore the rest.");
+            break;
+        }
+
         pos += label_len + 1;
 
         if (label_len == 0)
@@ -780,18 +897,85 @@ static void apply_extra_data(ElaCarrier *w, const uint8_t *extra_savedata, size_
 
         fi = friends_get(w->friends, friend_number);
         if (fi) {
-            strcpy(fi->info.label, label);
+            memcpy(fi->info.label, label, label_len + 1);
             deref(fi);
         }
-
-        extra_savedata_len -= (sizeof(uint32_t) + label_len + 1);
     }
 }
 
 static void free_persistence_data(persistence_data *data)
 {
-    if (data && data->dht_savedata)
-        free((void *)data->dht_savedata);
+    if (data && data->file)
+        release_data_file(data->file, data->file_len, data->mapped);
+
+    if (data && data->changes)
+        free((void *)data->changes);
+}
+
+static void persistence_verifier_destroy(void *p)
+{
+    PersistenceVerifier *pv = (PersistenceVerifier *)p;
+
+    release_data_file(pv->file, pv->file_len, pv->mapped);
+}
+
+static void *persistence_verifier_routine(void *arg)
+{
+    PersistenceVerifier *pv = (PersistenceVerifier *)arg;
+    uint8_t sum[SHA256_BYTES];
+    int result;
+
+    sha256(pv->file + 256, pv->file_len - 256, sum, sizeof(sum));
+    result = memcmp(sum, pv->sum, SHA256_BYTES) == 0 ? 1 : -1;
+
+    pv->done_time = (int64_t)get_monotonic_time();
+    __atomic_store_n(&pv->result, result, __ATOMIC_RELEASE);
+
+    deref(pv);
+    return NULL;
+}
+
+/*
+ * Take over the data file of unverified persistence data and verify its
+ * checksum on a background thread. The result is checked on the carrier
+ * loop by check_persistence_verifier().
+ */
+static int start_persistence_verifier(ElaCarrier *w, persistence_data *data)
+{
+    PersistenceVerifier *pv;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rc;
+
+    pv = (PersistenceVerifier *)rc_zalloc(sizeof(PersistenceVerifier),
+                                          persistence_verifier_destroy);
+    if (!pv)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    pv->file = data->file;
+    pv->file_len = data->file_len;
+    pv->mapped = data->mapped;
+    pv->journal = data->journal;
+    memcpy(pv->sum, data->sum, SHA256_BYTES);
+
+    data->file = NULL;
+    data->dht_savedata = NULL;
+    data->extra_savedata = NULL;
+
+    w->verifier = pv;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    rc = pthread_create(&thread, &attr, persistence_verifier_routine, ref(pv));
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0) {
+        vlogW("Carrier: Create verifier thread error(%d), verify in place.", rc);
+        persistence_verifier_routine(pv);
+    }
+
+    return 0;
 }
 
 static int mkdir_internal(const char *path, mode_t mode)
@@ -990,160 +1174,1233 @@ static int store_persistence_data(ElaCarrier *w)
     return 0;
 }
 
-#ifdef _MSC_VER
-#pragma warning(pop)
-#endif
-
-static void ela_destroy(void *argv)
+/*
+ * Friend and self info changes are appended to a change log next to the
+ * persistence data file instead of rewriting the whole file. On startup
+ * the change records are replayed on top of the loaded persistence data,
+ * and the carrier loop folds them back into the persistence data from
+ * time to time. Replaying a record twice is harmless, so a crash between
+ * storing the persistence data and removing the change log loses nothing.
+ *
+ * The change log starts with magic and revision, followed by records:
+ *   length(4) | checksum(4) | type(1) | reserved(3) | payload(length)
+ * The checksum covers type, reserved and payload.
+ */
+static const uint32_t CHANGE_LOG_MAGIC = 0x0E0C0D0C;
+static const uint32_t CHANGE_LOG_REVISION = 1;
+
+static const char *changes_filename = "carrier.data.log";
+
+#define CHANGE_LOG_HEADER_SIZE          (sizeof(uint32_t) * 2)
+#define CHANGE_RECORD_HEADER_SIZE       (sizeof(uint32_t) * 3)
+#define MAX_CHANGE_RECORD_SIZE          4096
+
+#define CHANGE_LOG_COMPACT_SIZE         (256 * 1024)
+#define CHANGE_LOG_COMPACT_INTERVAL     (30 * 60)
+/* The data file also keeps the DHT nodes and friend status, which are not
+ * logged as changes, store it now and then to keep them fresh. */
+#define DHT_STATE_STORE_INTERVAL        (2 * 60 * 60)
+
+enum {
+    ChangeType_FriendAdd = 1,   // address, friend request data
+    ChangeType_FriendAccept,    // public key
+    ChangeType_FriendRemove,    // public key
+    ChangeType_FriendLabel,     // public key, label with null terminator
+    ChangeType_SelfDesc,        // packed user info
+    ChangeType_SelfNospam       // nospam in network order
+};
+
+static uint32_t change_record_checksum(const uint8_t *data, size_t len)
 {
-    ElaCarrier *w = (ElaCarrier *)argv;
-
-    if (w->pref.data_location)
-        free(w->pref.data_location);
-
-    if (w->pref.bootstraps)
-        free(w->pref.bootstraps);
+    uint8_t sum[SHA256_BYTES];
+    uint32_t val;
 
-    if (w->tcallbacks)
-        deref(w->tcallbacks);
+    sha256(data, len, sum, sizeof(sum));
+    memcpy(&val, sum, sizeof(val));
 
-    if (w->thistory)
-        deref(w->thistory);
+    return val;
+}
 
-    if (w->friends)
-        deref(w->friends);
+static size_t load_change_log(const char *data_location,
+                              persistence_data *data)
+{
+    char *filename;
+    struct stat st;
+    uint8_t *buf;
+    uint32_t val;
+    int fd;
 
-    if (w->friend_events)
-        deref(w->friend_events);
+    assert(data_location);
+    assert(data);
 
-    pthread_mutex_destroy(&w->ext_mutex);
+    filename = (char *)alloca(strlen(data_location) + strlen(changes_filename) + 4);
+    sprintf(filename, "%s/%s", data_location, changes_filename);
 
-    dht_kill(&w->dht);
-}
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
 
-ElaCarrier *ela_new(const ElaOptions *opts,
-                 ElaCallbacks *callbacks, void *context)
-{
-    ElaCarrier *w;
-    persistence_data data;
-    int rc;
-    int i;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
 
-    if (!opts) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-        return NULL;
+    if (st.st_size < CHANGE_LOG_HEADER_SIZE ||
+            st.st_size > MAX_PERSISTENCE_SECTION_SIZE) {
+        vlogW("Load change log failed, corrupt file.");
+        close(fd);
+        return (size_t)st.st_size;
     }
 
-    if (!opts->persistent_location || !*opts->persistent_location) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-        return NULL;
+    buf = (uint8_t *)malloc(st.st_size);
+    if (!buf) {
+        vlogW("Load change log failed, out of memory.");
+        close(fd);
+        return (size_t)st.st_size;
     }
 
-    w = (ElaCarrier *)rc_zalloc(sizeof(ElaCarrier), ela_destroy);
-    if (!w) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return NULL;
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        vlogW("Load change log failed, read error(%d).", errno);
+        free(buf);
+        close(fd);
+        return (size_t)st.st_size;
     }
 
-    w->pref.udp_enabled = opts->udp_enabled;
-    w->pref.data_location = strdup(opts->persistent_location);
-    w->pref.bootstraps_size = opts->bootstraps_size;
+    close(fd);
 
-    w->pref.bootstraps = (BootstrapNodeBuf *)calloc(1, sizeof(BootstrapNodeBuf)
-                         * opts->bootstraps_size);
-    if (!w->pref.bootstraps) {
-        deref(w);
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return NULL;
+    memcpy(&val, buf, sizeof(val));
+    if (ntohl(val) != CHANGE_LOG_MAGIC) {
+        vlogW("Load change log failed, corrupt file.");
+        free(buf);
+        return (size_t)st.st_size;
     }
 
-    for (i = 0; i < opts->bootstraps_size; i++) {
-        BootstrapNode *b = &opts->bootstraps[i];
-        BootstrapNodeBuf *bi = &w->pref.bootstraps[i];
-        char *endptr = NULL;
-        ssize_t len;
+    memcpy(&val, buf + sizeof(uint32_t), sizeof(val));
+    if (ntohl(val) != CHANGE_LOG_REVISION) {
+        vlogW("Load change log failed, unsupported change log version.");
+        free(buf);
+        return (size_t)st.st_size;
+    }
 
-        if (b->ipv4 && strlen(b->ipv4) > MAX_IPV4_ADDRESS_LEN) {
-            vlogE("Carrier: Bootstrap ipv4 address (%s) too long", b->ipv4);
-            deref(w);
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-            return NULL;
-        }
+    data->changes = buf;
+    data->changes_len = st.st_size;
 
-        if (b->ipv6 && strlen(b->ipv6) > MAX_IPV6_ADDRESS_LEN) {
-            vlogE("Carrier: Bootstrap ipv4 address (%s) too long", b->ipv6);
-            deref(w);
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-            return NULL;
-        }
+    return (size_t)st.st_size;
+}
 
-        if (!b->ipv4 && !b->ipv6) {
-            vlogE("Carrier: Bootstrap ipv4 and ipv6 address both empty");
-            deref(w);
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-            return NULL;
-        }
+static void apply_dht_change(ElaCarrier *w, uint8_t type,
+                             const uint8_t *payload, size_t len)
+{
+    uint32_t friend_number;
+    uint32_t val;
 
-        if (b->ipv4)
-            strcpy(bi->ipv4, b->ipv4);
-        if (b->ipv6)
-            strcpy(bi->ipv6, b->ipv6);
+    switch(type) {
+    case ChangeType_FriendAdd:
+        if (len <= DHT_ADDRESS_SIZE)
+            break;
 
-        bi->port = (int)strtol(b->port, &endptr, 10);
-        if (*endptr) {
-            vlogE("Carrier: Invalid bootstrap port value (%s)", b->port);
-            deref(w);
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-            return NULL;
-        }
+        if (dht_get_friend_number(&w->dht, payload, &friend_number) == 0)
+            break;
 
-        len = base58_decode(b->public_key, strlen(b->public_key), bi->public_key,
-                            sizeof(bi->public_key));
-        if (len != DHT_PUBLIC_KEY_SIZE) {
-            vlogE("Carrier: Invalid bootstrap public key (%s)", b->public_key);
-            deref(w);
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-            return NULL;
-        }
-    }
+        dht_friend_add(&w->dht, payload, payload + DHT_ADDRESS_SIZE,
+                       len - DHT_ADDRESS_SIZE, &friend_number);
+        break;
 
-    memset(&data, 0, sizeof(data));
-    load_persistence_data(opts->persistent_location, &data);
+    case ChangeType_FriendAccept:
+        if (len != DHT_PUBLIC_KEY_SIZE)
+            break;
 
-    rc = dht_new(data.dht_savedata, data.dht_savedata_len, w->pref.udp_enabled, &w->dht);
-    if (rc < 0) {
-        free_persistence_data(&data);
-        deref(w);
-        ela_set_error(rc);
-        return NULL;
-    }
+        if (dht_get_friend_number(&w->dht, payload, &friend_number) == 0)
+            break;
 
-    w->friends = friends_create();
-    if (!w->friends) {
-        free_persistence_data(&data);
-        deref(w);
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return NULL;
-    }
+        dht_friend_add_norequest(&w->dht, payload, &friend_number);
+        break;
 
-    w->friend_events = list_create(1, NULL);
-    if (!w->friend_events) {
-        free_persistence_data(&data);
+    case ChangeType_FriendRemove:
+        if (len != DHT_PUBLIC_KEY_SIZE)
+            break;
+
+        if (dht_get_friend_number(&w->dht, payload, &friend_number) < 0)
+            break;
+
+        dht_friend_delete(&w->dht, friend_number);
+        break;
+
+    case ChangeType_SelfDesc:
+        dht_self_set_desc(&w->dht, (uint8_t *)payload, len);
+        break;
+
+    case ChangeType_SelfNospam:
+        if (len != sizeof(val))
+            break;
+
+        memcpy(&val, payload, sizeof(val));
+        dht_self_set_nospam(&w->dht, ntohl(val));
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void apply_friend_change(ElaCarrier *w, uint8_t type,
+                                const uint8_t *payload, size_t len)
+{
+    FriendInfo *fi;
+    const char *label;
+
+    if (type != ChangeType_FriendLabel || len <= DHT_PUBLIC_KEY_SIZE)
+        return;
+
+    label = (const char *)payload + DHT_PUBLIC_KEY_SIZE;
+    if (label[len - DHT_PUBLIC_KEY_SIZE - 1] != 0 ||
+            strlen(label) > ELA_MAX_USER_NAME_LEN)
+        return;
+
+    fi = friend_keys_get(w->friend_keys, payload);
+    if (fi) {
+        strcpy(fi->info.label, label);
+        deref(fi);
+    }
+}
+
+/*
+ * Replay the change records in two passes: the DHT pass runs right after
+ * the DHT instance is created, before the friend list is loaded from it;
+ * the friend pass runs after the friend list is loaded.
+ */
+static void replay_change_log(ElaCarrier *w, const persistence_data *data,
+                              bool dht_pass)
+{
+    const uint8_t *pos;
+    size_t left;
+    int count = 0;
+
+    if (!data->changes)
+        return;
+
+    pos = data->changes + CHANGE_LOG_HEADER_SIZE;
+    left = data->changes_len - CHANGE_LOG_HEADER_SIZE;
+
+    while (left >= CHANGE_RECORD_HEADER_SIZE) {
+        uint32_t len;
+        uint32_t sum;
+
+        memcpy(&len, pos, sizeof(len));
+        len = ntohl(len);
+        if (len > MAX_CHANGE_RECORD_SIZE ||
+                len > left - CHANGE_RECORD_HEADER_SIZE)
+            break;
+
+        memcpy(&sum, pos + sizeof(uint32_t), sizeof(sum));
+        if (sum != change_record_checksum(pos + sizeof(uint32_t) * 2,
+                                          len + sizeof(uint32_t)))
+            break;
+
+        if (dht_pass)
+            apply_dht_change(w, pos[sizeof(uint32_t) * 2],
+                             pos + CHANGE_RECORD_HEADER_SIZE, len);
+        else
+            apply_friend_change(w, pos[sizeof(uint32_t) * 2],
+                                pos + CHANGE_RECORD_HEADER_SIZE, len);
+
+        pos += CHANGE_RECORD_HEADER_SIZE + len;
+        left -= CHANGE_RECORD_HEADER_SIZE + len;
+        count++;
+    }
+
+    if (dht_pass) {
+        vlogD("Carrier: Replayed %d change records.", count);
+        if (left)
+            vlogW("Carrier: Change log has %zu bytes incomplete data dropped.",
+                  left);
+    }
+}
+
+// Should be called with changes lock held.
+static int open_change_log(ElaCarrier *w)
+{
+    char *filename;
+    uint32_t header[2];
+    int fd;
+
+    if (w->changes.fd >= 0)
+        return 0;
+
+    if (mkdirs(w->pref.data_location, S_IRWXU) < 0)
+        return ELA_SYS_ERROR(errno);
+
+    filename = (char *)alloca(strlen(w->pref.data_location) + strlen(changes_filename) + 4);
+    sprintf(filename, "%s/%s", w->pref.data_location, changes_filename);
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return ELA_SYS_ERROR(errno);
+
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        header[0] = htonl(CHANGE_LOG_MAGIC);
+        header[1] = htonl(CHANGE_LOG_REVISION);
+
+        if (write(fd, header, sizeof(header)) != sizeof(header)) {
+            int err = errno;
+            close(fd);
+            remove(filename);
+            return ELA_SYS_ERROR(err);
+        }
+    }
+
+    w->changes.fd = fd;
+    return 0;
+}
+
+static int compact_changes(ElaCarrier *w)
+{
+    char *filename;
+    int rc;
+
+    pthread_mutex_lock(&w->changes.lock);
+
+    // Never store the state loaded from unverified or corrupt data, the
+    // change log keeps the changes meanwhile.
+    if (w->changes.frozen) {
+        pthread_mutex_unlock(&w->changes.lock);
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    }
+
+    rc = store_persistence_data(w);
+    if (rc == 0) {
+        if (w->changes.fd >= 0) {
+            close(w->changes.fd);
+            w->changes.fd = -1;
+        }
+
+        filename = (char *)alloca(strlen(w->pref.data_location) + strlen(changes_filename) + 4);
+        sprintf(filename, "%s/%s", w->pref.data_location, changes_filename);
+        remove(filename);
+
+        w->changes.size = 0;
+
+        // Stored with the whole data.
+        if (w->changes.pending) {
+            free(w->changes.pending);
+            w->changes.pending = NULL;
+            w->changes.pending_len = 0;
+        }
+    }
+
+    w->changes.last_compact = time(NULL);
+
+    pthread_mutex_unlock(&w->changes.lock);
+
+    return rc;
+}
+
+// Should be called with changes lock held.
+static int write_change_log(ElaCarrier *w, const uint8_t *buf, size_t len)
+{
+    int rc;
+
+    rc = open_change_log(w);
+    if (rc < 0)
+        return rc;
+
+    if (write(w->changes.fd, buf, len) != len || fsync(w->changes.fd) < 0)
+        return ELA_SYS_ERROR(errno);
+
+    w->changes.size += len;
+    return 0;
+}
+
+// Should be called with changes lock held.
+static int flush_pending_changes(ElaCarrier *w)
+{
+    int rc;
+
+    if (!w->changes.pending_len)
+        return 0;
+
+    rc = write_change_log(w, w->changes.pending, w->changes.pending_len);
+    if (rc == 0) {
+        free(w->changes.pending);
+        w->changes.pending = NULL;
+        w->changes.pending_len = 0;
+    }
+
+    return rc;
+}
+
+// Should be called with changes lock held.
+static int queue_pending_change(ElaCarrier *w, const uint8_t *buf, size_t len)
+{
+    uint8_t *pending;
+
+    pending = (uint8_t *)realloc(w->changes.pending,
+                                 w->changes.pending_len + len);
+    if (!pending)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    memcpy(pending + w->changes.pending_len, buf, len);
+    w->changes.pending = pending;
+    w->changes.pending_len += len;
+
+    return 0;
+}
+
+static int append_change(ElaCarrier *w, uint8_t type,
+                         const void *data1, size_t len1,
+                         const void *data2, size_t len2)
+{
+    uint8_t buf[CHANGE_RECORD_HEADER_SIZE + MAX_CHANGE_RECORD_SIZE];
+    size_t len = len1 + len2;
+    uint32_t val;
+    int rc;
+
+    if (len > MAX_CHANGE_RECORD_SIZE)
+        return ELA_GENERAL_ERROR(ELAERR_TOO_LONG);
+
+    val = htonl((uint32_t)len);
+    memcpy(buf, &val, sizeof(val));
+
+    buf[sizeof(uint32_t) * 2] = type;
+    memset(buf + sizeof(uint32_t) * 2 + 1, 0, 3);
+
+    if (len1)
+        memcpy(buf + CHANGE_RECORD_HEADER_SIZE, data1, len1);
+    if (len2)
+        memcpy(buf + CHANGE_RECORD_HEADER_SIZE + len1, data2, len2);
+
+    val = change_record_checksum(buf + sizeof(uint32_t) * 2,
+                                 len + sizeof(uint32_t));
+    memcpy(buf + sizeof(uint32_t), &val, sizeof(val));
+
+    len += CHANGE_RECORD_HEADER_SIZE;
+
+    pthread_mutex_lock(&w->changes.lock);
+
+    // The records queued before go first, to keep the order.
+    rc = flush_pending_changes(w);
+    if (rc == 0)
+        rc = write_change_log(w, buf, len);
+
+    // Storing the whole data can not save the record while the data is
+    // frozen, keep it until the log is writable or the data is stored.
+    if (rc < 0 && w->changes.frozen) {
+        int err = rc;
+
+        rc = queue_pending_change(w, buf, len);
+        if (rc == 0)
+            vlogW("Carrier: Append change log error (0x%x), change queued.",
+                  err);
+    }
+
+    pthread_mutex_unlock(&w->changes.lock);
+
+    return rc;
+}
+
+static void record_change(ElaCarrier *w, uint8_t type,
+                          const void *data1, size_t len1,
+                          const void *data2, size_t len2)
+{
+    int rc;
+
+    rc = append_change(w, type, data1, len1, data2, len2);
+    if (rc < 0) {
+        // A partial record would hide all records after it, so store the
+        // whole persistence data and start over with an empty change log.
+        vlogW("Carrier: Append change log error (0x%x), store all data.", rc);
+        rc = compact_changes(w);
+        if (rc < 0)
+            vlogE("Carrier: Store persistence data error (0x%x), "
+                  "change type %d lost.", rc, type);
+    }
+}
+
+static void check_persistence_verifier(ElaCarrier *w)
+{
+    PersistenceVerifier *pv = w->verifier;
+    char *journal_filename = NULL;
+    char *filename;
+    int result;
+
+    if (!pv)
+        return;
+
+    result = __atomic_load_n(&pv->result, __ATOMIC_ACQUIRE);
+    if (result == 0)
+        return;
+
+    w->startup.verified = pv->done_time;
+
+    filename = (char *)alloca(strlen(w->pref.data_location) + strlen(data_filename) + 16);
+    sprintf(filename, "%s/%s", w->pref.data_location, data_filename);
+
+    if (pv->journal) {
+        journal_filename = (char *)alloca(strlen(w->pref.data_location) + strlen(data_filename) + 16);
+        sprintf(journal_filename, "%s/%s.journal", w->pref.data_location, data_filename);
+    }
+
+    if (result < 0) {
+        // The loaded state may be broken up to the identity, storing it
+        // would make that permanent. Fail the node instead.
+        if (journal_filename) {
+            vlogE("Carrier: Persistence data journal checksum mismatch, "
+                  "removed, the next start loads the data file.");
+            remove(journal_filename);
+        } else {
+            // Loading the same file again would fail the same way. Keep it
+            // for recovery under another name, with the change log on top
+            // of it, and let the next start create a new node.
+            char *corrupt_filename;
+            char *log_filename;
+
+            corrupt_filename = (char *)alloca(strlen(filename) + 16);
+            log_filename = (char *)alloca(strlen(w->pref.data_location) + strlen(changes_filename) + 16);
+            sprintf(log_filename, "%s/%s", w->pref.data_location, changes_filename);
+
+            pthread_mutex_lock(&w->changes.lock);
+            if (w->changes.fd >= 0) {
+                close(w->changes.fd);
+                w->changes.fd = -1;
+            }
+            pthread_mutex_unlock(&w->changes.lock);
+
+            sprintf(corrupt_filename, "%s.corrupt", filename);
+            remove(corrupt_filename);
+            rename(filename, corrupt_filename);
+
+            sprintf(corrupt_filename, "%s.corrupt", log_filename);
+            remove(corrupt_filename);
+            rename(log_filename, corrupt_filename);
+
+            vlogE("Carrier: Persistence data checksum mismatch, moved to "
+                  "%s.corrupt, the next start creates a new node.", data_filename);
+        }
+
+        w->persistence_failed = 1;
+        w->quit = 1;
+    } else {
+        vlogD("Carrier: Persistence data verified in background.");
+
+        if (journal_filename) {
+            remove(filename);
+            rename(journal_filename, filename);
+        }
+
+        pthread_mutex_lock(&w->changes.lock);
+        w->changes.frozen = 0;
+        pthread_mutex_unlock(&w->changes.lock);
+
+        // Fold the changes replayed on load.
+        if (w->changes.size > 0)
+            compact_changes(w);
+    }
+
+    w->verifier = NULL;
+    deref(pv);
+}
+
+static void do_compact_changes(ElaCarrier *w)
+{
+    time_t elapsed;
+
+    // Retry logging the queued records, the data is not stored meanwhile.
+    if (w->changes.frozen) {
+        if (w->changes.pending_len) {
+            pthread_mutex_lock(&w->changes.lock);
+            flush_pending_changes(w);
+            pthread_mutex_unlock(&w->changes.lock);
+        }
+        return;
+    }
+
+    elapsed = time(NULL) - w->changes.last_compact;
+
+    if (w->changes.size >= CHANGE_LOG_COMPACT_SIZE ||
+            (w->changes.size > 0 && elapsed >= CHANGE_LOG_COMPACT_INTERVAL) ||
+            elapsed >= DHT_STATE_STORE_INTERVAL)
+        compact_changes(w);
+}
+
+/*
+ * On clean shutdown only make sure the change log is durable, the next
+ * start replays it. The data file is left to the periodic compaction.
+ */
+static void sync_changes(ElaCarrier *w)
+{
+    int rc;
+
+    pthread_mutex_lock(&w->changes.lock);
+
+    rc = flush_pending_changes(w);
+    if (rc < 0)
+        vlogE("Carrier: Append change log error (0x%x), %zu bytes of "
+              "changes lost.", rc, w->changes.pending_len);
+    else if (w->changes.fd >= 0 && fsync(w->changes.fd) < 0)
+        vlogW("Carrier: Sync change log error (%d).", errno);
+
+    pthread_mutex_unlock(&w->changes.lock);
+}
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+static void wakeup_init(ElaCarrier *w)
+{
+    w->wakeup_fd[0] = -1;
+    w->wakeup_fd[1] = -1;
+
+#if defined(HAVE_SYS_EVENTFD_H)
+    w->wakeup_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    w->wakeup_fd[1] = w->wakeup_fd[0];
+#elif !defined(_WIN32) && !defined(_WIN64)
+    if (pipe(w->wakeup_fd) == 0) {
+        fcntl(w->wakeup_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(w->wakeup_fd[1], F_SETFL, O_NONBLOCK);
+    } else {
+        w->wakeup_fd[0] = -1;
+        w->wakeup_fd[1] = -1;
+    }
+#endif
+
+    if (w->wakeup_fd[0] < 0)
+        vlogW("Carrier: No wakeup fd available, queued messages will be "
+              "sent on next loop iteration.");
+}
+
+static void wakeup_close(ElaCarrier *w)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (w->wakeup_fd[1] >= 0 && w->wakeup_fd[1] != w->wakeup_fd[0])
+        close(w->wakeup_fd[1]);
+
+    if (w->wakeup_fd[0] >= 0)
+        close(w->wakeup_fd[0]);
+#endif
+
+    w->wakeup_fd[0] = -1;
+    w->wakeup_fd[1] = -1;
+}
+
+static void wakeup_signal(ElaCarrier *w)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+#if defined(HAVE_SYS_EVENTFD_H)
+    uint64_t v = 1;
+#else
+    uint8_t v = 1;
+#endif
+
+    // Full pipe or saturated counter means the loop is already signaled.
+    if (w->wakeup_fd[1] >= 0)
+        (void)!write(w->wakeup_fd[1], &v, sizeof(v));
+#endif
+}
+
+static void wakeup_drain(ElaCarrier *w)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    uint8_t buf[64];
+
+    if (w->wakeup_fd[0] < 0)
+        return;
+
+    while (read(w->wakeup_fd[0], buf, sizeof(buf)) > 0);
+#endif
+}
+
+static int64_t generate_msgid(ElaCarrier *w)
+{
+#if defined(_MSC_VER)
+    return InterlockedIncrement64(&w->last_msgid);
+#else
+    return __atomic_add_fetch(&w->last_msgid, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static OutgoingMessage *outgoing_message_new(uint32_t friend_number,
+                                             const uint8_t *data, size_t len,
+                                             int64_t tid, int64_t msgid,
+                                             void *callback, void *context)
+{
+    OutgoingMessage *om;
+
+    om = (OutgoingMessage *)rc_alloc(sizeof(OutgoingMessage) + len, NULL);
+    if (!om)
+        return NULL;
+
+    om->friend_number = friend_number;
+    om->msgid = msgid;
+    om->tid = tid;
+    om->callback = callback;
+    om->context = context;
+    om->len = len;
+    memcpy(om->data, data, len);
+
+    om->le.data = om;
+
+    return om;
+}
+
+/*
+ * Can be called from any thread. The encoded packet is owned by the
+ * queue afterwards, and will be sent out by the carrier loop. Fails with
+ * ELAERR_NOT_READY once the carrier node is killed.
+ */
+static int enqueue_message(ElaCarrier *w, uint32_t friend_number,
+                           const uint8_t *data, size_t len, int64_t tid,
+                           int64_t msgid, void *callback, void *context)
+{
+    OutgoingMessage *om;
+
+    om = outgoing_message_new(friend_number, data, len, tid, msgid,
+                              callback, context);
+    if (!om)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    // Nothing would drain the queue after the carrier node is killed.
+    pthread_mutex_lock(&w->send_lock);
+    if (!w->is_ready) {
+        pthread_mutex_unlock(&w->send_lock);
+        deref(om);
+        return ELA_GENERAL_ERROR(ELAERR_NOT_READY);
+    }
+
+    list_push_tail(w->send_queue, &om->le);
+    pthread_mutex_unlock(&w->send_lock);
+    deref(om);
+
+    wakeup_signal(w);
+
+    return 0;
+}
+
+static void notify_message_failed(ElaCarrier *w, OutgoingMessage *om, int err)
+{
+    if (om->tid) {
+        TransactedCallback *tcb;
+        ElaFriendInviteResponseCallback *callback_func;
+
+        tcb = transacted_callbacks_get(w->tcallbacks, om->tid);
+        if (!tcb)
+            return;
+
+        transacted_callbacks_remove(w->tcallbacks, om->tid);
+
+        callback_func = (ElaFriendInviteResponseCallback *)tcb->callback_func;
+        callback_func(w, tcb->userid, err, "Friend invite can not be delivered",
+                      NULL, 0, tcb->callback_context);
+
+        deref(tcb);
+    } else if (om->msgid && om->callback) {
+        ElaFriendMessageReceiptCallback *callback_func;
+
+        ElaReceiptState state;
+
+        if (err == ELA_DHT_ERROR(ELAERR_FRIEND_OFFLINE))
+            state = ElaReceipt_Offline;
+        else if (err == ELA_GENERAL_ERROR(ELAERR_CANCELLED))
+            state = ElaReceipt_Cancelled;
+        else
+            state = ElaReceipt_Error;
+
+        callback_func = (ElaFriendMessageReceiptCallback *)om->callback;
+        callback_func(w, om->msgid, state, om->context);
+    }
+}
+
+static void track_receipt(ElaCarrier *w, OutgoingMessage *om,
+                          uint32_t message_id)
+{
+    PendingReceipt *pr;
+
+    pr = (PendingReceipt *)rc_zalloc(sizeof(PendingReceipt), NULL);
+    if (!pr) {
+        vlogW("Carrier: Out of memory, receipt for message %lld dropped.",
+              (long long)om->msgid);
+        return;
+    }
+
+    pr->key = receipt_key(om->friend_number, message_id);
+    pr->msgid = om->msgid;
+    pr->friend_number = om->friend_number;
+    pr->callback = om->callback;
+    pr->context = om->context;
+
+    receipts_put(w->receipts, pr);
+    deref(pr);
+}
+
+#define MAX_BLOCKED_FRIENDS         32
+
+static bool friend_blocked(uint32_t *blocked, int count, uint32_t friend_number)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (blocked[i] == friend_number)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Drain the send queue on the carrier loop. Messages to the same friend
+ * go out back to back, and once the DHT send queue of a friend is full
+ * the remaining messages to that friend stay queued in order for the
+ * next iteration, without holding back other friends.
+ */
+static void do_send_queue(ElaCarrier *w)
+{
+    list_iterator_t it;
+    uint32_t blocked[MAX_BLOCKED_FRIENDS];
+    int nblocked = 0;
+
+redo_queue:
+    list_iterate(w->send_queue, &it);
+    while (list_iterator_has_next(&it)) {
+        OutgoingMessage *om;
+        uint32_t message_id;
+        int rc;
+
+        rc = list_iterator_next(&it, (void **)&om);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto redo_queue;
+
+        if (friend_blocked(blocked, nblocked, om->friend_number)) {
+            deref(om);
+            continue;
+        }
+
+        rc = dht_friend_message(&w->dht, om->friend_number, om->data, om->len,
+                                &message_id);
+        if (rc == ELA_DHT_ERROR(ELAERR_OUT_OF_MEMORY)) {
+            uint32_t friend_number = om->friend_number;
+
+            deref(om);
+            if (nblocked == MAX_BLOCKED_FRIENDS)
+                break;
+
+            blocked[nblocked++] = friend_number;
+            continue;
+        }
+
+        list_iterator_remove(&it);
+
+        if (rc < 0)
+            notify_message_failed(w, om, rc);
+        else if (om->msgid && om->callback)
+            track_receipt(w, om, message_id);
+
+        deref(om);
+    }
+}
+
+/*
+ * Fail the receipts still waiting for the friend's confirmation,
+ * UINT32_MAX for the receipts of all friends.
+ */
+static void fail_pending_receipts(ElaCarrier *w, uint32_t friend_number,
+                                  ElaReceiptState state)
+{
+    hashtable_iterator_t it;
+
+redo_receipts:
+    receipts_iterate(w->receipts, &it);
+    while (receipts_iterator_has_next(&it)) {
+        PendingReceipt *pr;
+        ElaFriendMessageReceiptCallback *callback_func;
+        int rc;
+
+        rc = receipts_iterator_next(&it, &pr);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto redo_receipts;
+
+        if (friend_number == UINT32_MAX || pr->friend_number == friend_number) {
+            receipts_iterator_remove(&it);
+
+            callback_func = (ElaFriendMessageReceiptCallback *)pr->callback;
+            callback_func(w, pr->msgid, state, pr->context);
+        }
+
+        deref(pr);
+    }
+}
+
+static
+void notify_friend_receipt_cb(uint32_t friend_number, uint32_t message_id,
+                              void *context)
+{
+    ElaCarrier *w = (ElaCarrier *)context;
+    PendingReceipt *pr;
+    ElaFriendMessageReceiptCallback *callback_func;
+
+    pr = receipts_remove(w->receipts, receipt_key(friend_number, message_id));
+    if (!pr)
+        return;
+
+    callback_func = (ElaFriendMessageReceiptCallback *)pr->callback;
+    callback_func(w, pr->msgid, ElaReceipt_ByFriend, pr->context);
+
+    deref(pr);
+}
+
+static void fail_transactions(ElaCarrier *w, int64_t now, int status,
+                              const char *reason)
+{
+    int64_t tid;
+
+    while (transaction_deadlines_pop_expired(&w->tdeadlines, now, &tid)) {
+        TransactedCallback *tcb;
+        ElaFriendInviteResponseCallback *callback_func;
+
+        tcb = transacted_callbacks_get(w->tcallbacks, tid);
+        if (!tcb)
+            continue;
+
+        transacted_callbacks_remove(w->tcallbacks, tid);
+
+        vlogD("Carrier: Invite transaction %lld to %s failed: %s.",
+              (long long)tid, tcb->userid, reason);
+
+        callback_func = (ElaFriendInviteResponseCallback *)tcb->callback_func;
+        callback_func(w, tcb->userid, status, reason, NULL, 0,
+                      tcb->callback_context);
+
+        deref(tcb);
+    }
+}
+
+static void do_transaction_expiry(ElaCarrier *w)
+{
+    fail_transactions(w, (int64_t)(get_monotonic_time() / 1000),
+                      ELA_GENERAL_ERROR(ELAERR_TIMEOUT),
+                      "Friend invite timeout");
+}
+
+/*
+ * The carrier loop is gone for good. Fail everything still in flight with
+ * ELAERR_CANCELLED, so each receipt and invite response callback still
+ * fires exactly once, and refuse new messages from now on.
+ */
+static void cancel_pending_messages(ElaCarrier *w)
+{
+    list_iterator_t it;
+
+    /*
+     * Senders check is_ready and enqueue under the same lock, so once it
+     * is cleared nothing more gets queued, and the drain below is final.
+     * The lock is not held while draining, the failure callbacks may call
+     * back into the carrier.
+     */
+    pthread_mutex_lock(&w->send_lock);
+    w->is_ready = false;
+    pthread_mutex_unlock(&w->send_lock);
+
+redo_queue:
+    list_iterate(w->send_queue, &it);
+    while (list_iterator_has_next(&it)) {
+        OutgoingMessage *om;
+        int rc;
+
+        rc = list_iterator_next(&it, (void **)&om);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto redo_queue;
+
+        list_iterator_remove(&it);
+        notify_message_failed(w, om, ELA_GENERAL_ERROR(ELAERR_CANCELLED));
+        deref(om);
+    }
+
+    fail_pending_receipts(w, UINT32_MAX, ElaReceipt_Cancelled);
+    fail_transactions(w, INT64_MAX, ELA_GENERAL_ERROR(ELAERR_CANCELLED),
+                      "Friend invite cancelled");
+}
+
+static void ela_destroy(void *argv)
+{
+    ElaCarrier *w = (ElaCarrier *)argv;
+
+    if (w->pref.data_location)
+        free(w->pref.data_location);
+
+    if (w->pref.bootstraps)
+        free(w->pref.bootstraps);
+
+    if (w->bootstrap.candidates)
+        free(w->bootstrap.candidates);
+
+    if (w->bootstrap.probe)
+        deref(w->bootstrap.probe);
+
+    if (w->tcallbacks)
+        deref(w->tcallbacks);
+
+    transaction_deadlines_destroy(&w->tdeadlines);
+
+    if (w->thistory)
+        deref(w->thistory);
+
+    if (w->friend_ids)
+        deref(w->friend_ids);
+
+    if (w->friend_keys)
+        deref(w->friend_keys);
+
+    if (w->friends)
+        deref(w->friends);
+
+    if (w->friend_events)
+        deref(w->friend_events);
+
+    if (w->send_queue)
+        deref(w->send_queue);
+
+    if (w->receipts)
+        deref(w->receipts);
+
+    if (w->bulkmsgs)
+        deref(w->bulkmsgs);
+
+    wakeup_close(w);
+
+    if (w->changes.fd >= 0)
+        close(w->changes.fd);
+
+    if (w->changes.pending)
+        free(w->changes.pending);
+
+    if (w->verifier)
+        deref(w->verifier);
+
+    pthread_mutex_destroy(&w->send_lock);
+    pthread_mutex_destroy(&w->changes.lock);
+    pthread_mutex_destroy(&w->ext_mutex);
+
+    dht_kill(&w->dht);
+}
+
+#define MAX_FRIENDS_CAPACITY        (1 << 20)
+
+ElaCarrier *ela_new(const ElaOptions *opts,
+                 ElaCallbacks *callbacks, void *context)
+{
+    ElaCarrier *w;
+    persistence_data data;
+    size_t changes_len;
+    bool data_loaded;
+    bool verify;
+    size_t count;
+    size_t capacity;
+    int rc;
+    int i;
+
+    if (!opts) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return NULL;
+    }
+
+    if (!opts->persistent_location || !*opts->persistent_location) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return NULL;
+    }
+
+    w = (ElaCarrier *)rc_zalloc(sizeof(ElaCarrier), ela_destroy);
+    if (!w) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->startup.begin = (int64_t)get_monotonic_time();
+
+    wakeup_init(w);
+    w->changes.fd = -1;
+
+    w->pref.udp_enabled = opts->udp_enabled;
+    w->pref.data_location = strdup(opts->persistent_location);
+    w->pref.bootstraps_size = opts->bootstraps_size;
+
+    w->pref.bootstraps = (BootstrapNodeBuf *)calloc(1, sizeof(BootstrapNodeBuf)
+                         * opts->bootstraps_size);
+    if (!w->pref.bootstraps) {
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    for (i = 0; i < opts->bootstraps_size; i++) {
+        BootstrapNode *b = &opts->bootstraps[i];
+        BootstrapNodeBuf *bi = &w->pref.bootstraps[i];
+        char *endptr = NULL;
+        ssize_t len;
+
+        if (b->ipv4 && strlen(b->ipv4) > MAX_IPV4_ADDRESS_LEN) {
+            vlogE("Carrier: Bootstrap ipv4 address (%s) too long", b->ipv4);
+            deref(w);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return NULL;
+        }
+
+        if (b->ipv6 && strlen(b->ipv6) > MAX_IPV6_ADDRESS_LEN) {
+            vlogE("Carrier: Bootstrap ipv4 address (%s) too long", b->ipv6);
+            deref(w);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return NULL;
+        }
+
+        if (!b->ipv4 && !b->ipv6) {
+            vlogE("Carrier: Bootstrap ipv4 and ipv6 address both empty");
+            deref(w);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return NULL;
+        }
+
+        if (b->ipv4)
+            strcpy(bi->ipv4, b->ipv4);
+        if (b->ipv6)
+            strcpy(bi->ipv6, b->ipv6);
+
+        bi->port = (int)strtol(b->port, &endptr, 10);
+        if (*endptr) {
+            vlogE("Carrier: Invalid bootstrap port value (%s)", b->port);
+            deref(w);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return NULL;
+        }
+
+        len = base58_decode(b->public_key, strlen(b->public_key), bi->public_key,
+                            sizeof(bi->public_key));
+        if (len != DHT_PUBLIC_KEY_SIZE) {
+            vlogE("Carrier: Invalid bootstrap public key (%s)", b->public_key);
+            deref(w);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return NULL;
+        }
+    }
+
+    rc = bootstrap_cache_load(w->pref.data_location, w->pref.bootstraps,
+                              w->pref.bootstraps_size,
+                              &w->bootstrap.candidates, &w->bootstrap.size);
+    if (rc < 0) {
+        deref(w);
+        ela_set_error(rc);
+        return NULL;
+    }
+
+    verify = !opts->deferred_verification;
+
+reload:
+    memset(&data, 0, sizeof(data));
+    rc = load_persistence_data(opts->persistent_location, &data, verify);
+    data_loaded = (rc == 0);
+    changes_len = load_change_log(opts->persistent_location, &data);
+
+    w->startup.loaded = (int64_t)get_monotonic_time();
+
+    rc = dht_new(data.dht_savedata, data.dht_savedata_len, w->pref.udp_enabled, &w->dht);
+    if (rc < 0) {
+        free_persistence_data(&data);
+
+        if (data_loaded && !verify) {
+            vlogW("Carrier: Load unverified persistence data failed, "
+                  "reload with verification.");
+            verify = true;
+            goto reload;
+        }
+
+        deref(w);
+        ela_set_error(rc);
+        return NULL;
+    }
+
+    replay_change_log(w, &data, true);
+
+    w->startup.dht_created = (int64_t)get_monotonic_time();
+
+    // Size the friend tables for the persisted friends with headroom.
+    count = dht_get_friend_count(&w->dht);
+    capacity = 32;
+    while (capacity < count * 2 && capacity < MAX_FRIENDS_CAPACITY)
+        capacity <<= 1;
+
+    w->friends = friends_create(capacity);
+    if (!w->friends) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->friend_ids = friend_ids_create(capacity);
+    w->friend_keys = friend_keys_create(capacity);
+    if (!w->friend_ids || !w->friend_keys) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->friend_events = list_create(1, NULL);
+    if (!w->friend_events) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->tcallbacks = transacted_callbacks_create(32);
+    if (!w->tcallbacks) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    rc = transaction_deadlines_init(&w->tdeadlines);
+    if (rc) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_SYS_ERROR(rc));
+        return NULL;
+    }
+
+    w->thistory = transaction_history_create(32);
+    if (!w->thistory) {
+        free_persistence_data(&data);
         deref(w);
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
         return NULL;
     }
 
-    w->tcallbacks = transacted_callbacks_create(32);
-    if (!w->tcallbacks) {
+    w->send_queue = list_create(1, NULL);
+    if (!w->send_queue) {
         free_persistence_data(&data);
         deref(w);
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
         return NULL;
     }
 
-    w->thistory = transaction_history_create(32);
-    if (!w->thistory) {
+    w->receipts = receipts_create(32);
+    if (!w->receipts) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->bulkmsgs = bulkmsgs_create(8);
+    if (!w->bulkmsgs) {
         free_persistence_data(&data);
         deref(w);
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
@@ -1174,10 +2431,47 @@ ElaCarrier *ela_new(const ElaOptions *opts,
         return NULL;
     }
 
+    rc = pthread_mutex_init(&w->changes.lock, NULL);
+    if (rc) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_SYS_ERROR(rc));
+        return NULL;
+    }
+
+    rc = pthread_mutex_init(&w->send_lock, NULL);
+    if (rc) {
+        free_persistence_data(&data);
+        deref(w);
+        ela_set_error(ELA_SYS_ERROR(rc));
+        return NULL;
+    }
+
     apply_extra_data(w, data.extra_savedata, data.extra_savedata_len);
+    replay_change_log(w, &data, false);
+
+    w->startup.friends_loaded = (int64_t)get_monotonic_time();
+
+    if (data_loaded && !data.verified) {
+        rc = start_persistence_verifier(w, &data);
+        if (rc < 0) {
+            free_persistence_data(&data);
+            deref(w);
+            ela_set_error(rc);
+            return NULL;
+        }
+
+        // Stored again once verified.
+        w->changes.frozen = 1;
+        w->changes.size = changes_len;
+    }
+
     free_persistence_data(&data);
 
-    store_persistence_data(w);
+    // Fold the replayed changes into the persistence data, or create it.
+    w->changes.last_compact = time(NULL);
+    if (!w->changes.frozen && (!data_loaded || changes_len > 0))
+        compact_changes(w);
 
     srand((unsigned int)time(NULL));
 
@@ -1186,6 +2480,8 @@ ElaCarrier *ela_new(const ElaOptions *opts,
         w->context = context;
     }
 
+    w->startup.created = (int64_t)get_monotonic_time();
+
     vlogI("Carrier: Carrier node created.");
 
     return w;
@@ -1198,11 +2494,16 @@ void ela_kill(ElaCarrier *w)
         return;
     }
 
-    if (w->running) {
+    if (w->running && !w->embedded) {
+        // The loop fails the pending messages on its own thread on exit.
         w->quit = 1;
 
         if (!pthread_equal(pthread_self(), w->main_thread))
             while(!w->quit) usleep(5000);
+    } else {
+        w->running = 0;
+        cancel_pending_messages(w);
+        sync_changes(w);
     }
 
     deref(w);
@@ -1220,23 +2521,42 @@ static void notify_friends(ElaCarrier *w)
 {
     hashtable_iterator_t it;
 
+    // Application lists friends on demand by ela_get_friends_page().
+    if (!w->callbacks.friend_list)
+        return;
+
     friends_iterate(w->friends, &it);
     while(friends_iterator_has_next(&it)) {
         FriendInfo *fi;
         ElaFriendInfo _fi;
 
         if (friends_iterator_next(&it, &fi) == 1) {
-            if (w->callbacks.friend_list) {
-                memcpy(&_fi, &fi->info, sizeof(ElaFriendInfo));
-                w->callbacks.friend_list(w, &_fi, w->context);
-            }
-
+            memcpy(&_fi, &fi->info, sizeof(ElaFriendInfo));
             deref(fi);
+
+            w->callbacks.friend_list(w, &_fi, w->context);
         }
     }
 
-    if (w->callbacks.friend_list)
-        w->callbacks.friend_list(w, NULL, w->context);
+    w->callbacks.friend_list(w, NULL, w->context);
+}
+
+#define BOOTSTRAP_BEST_K            4
+#define BOOTSTRAP_MIN_INTERVAL      2000    // in milliseconds.
+#define BOOTSTRAP_MAX_INTERVAL      30000   // in milliseconds.
+#define BOOTSTRAP_PROBE_TIMEOUT     3000    // in milliseconds.
+#define BOOTSTRAP_PROBE_INTERVAL    (10 * 60) // in seconds.
+#define BOOTSTRAP_LEARN_INTERVAL    (5 * 60)  // in seconds.
+
+static void start_bootstrap_probe(ElaCarrier *w)
+{
+    if (w->bootstrap.size == 0)
+        return;
+
+    w->bootstrap.probe = bootstrap_probe_start(w->bootstrap.candidates,
+                                               w->bootstrap.size,
+                                               BOOTSTRAP_PROBE_TIMEOUT);
+    w->bootstrap.last_probe = time(NULL);
 }
 
 static void notify_connection_cb(bool connected, void *context)
@@ -1244,6 +2564,18 @@ static void notify_connection_cb(bool connected, void *context)
     ElaCarrier *w = (ElaCarrier *)context;
 
     if (!w->is_ready && connected) {
+        StartupStats *ss = &w->startup;
+
+        ss->ready = (int64_t)get_monotonic_time();
+        vlogI("Carrier: Ready after %lld ms (load %lld, dht %lld, friends %lld, "
+              "init %lld, bootstrap %lld ms).",
+              (long long)(ss->ready - ss->begin) / 1000,
+              (long long)(ss->loaded - ss->begin) / 1000,
+              (long long)(ss->dht_created - ss->loaded) / 1000,
+              (long long)(ss->friends_loaded - ss->dht_created) / 1000,
+              (long long)(ss->created - ss->friends_loaded) / 1000,
+              (long long)(ss->ready - ss->created) / 1000);
+
         w->is_ready = true;
         if (w->callbacks.ready)
             w->callbacks.ready(w, w->context);
@@ -1252,6 +2584,16 @@ static void notify_connection_cb(bool connected, void *context)
     w->connection_status = (connected ? ElaConnectionStatus_Connected :
                                         ElaConnectionStatus_Disconnected);
 
+    if (!connected) {
+        // Start over from the best ranked nodes right away.
+        w->bootstrap.next = 0;
+        w->bootstrap.interval = 0;
+
+        if (!w->bootstrap.probe &&
+                time(NULL) - w->bootstrap.last_probe >= BOOTSTRAP_PROBE_INTERVAL)
+            start_bootstrap_probe(w);
+    }
+
     if (w->callbacks.connection_status)
         w->callbacks.connection_status(w, w->connection_status, w->context);
 }
@@ -1301,7 +2643,7 @@ void notify_friend_description_cb(uint32_t friend_number, const uint8_t *desc,
     }
 
     ui = &fi->info.user_info;
-    unpack_user_desc(desc, length, ui, &changed);
+    unpack_user_desc(desc, length, ui, &fi->caps, &changed);
 
     if (changed) {
         ElaFriendInfo tmpfi;
@@ -1323,6 +2665,146 @@ static void notify_friend_connection(ElaCarrier *w, const char *friendid,
         w->callbacks.friend_connection(w, friendid, status, w->context);
 }
 
+#define BULKMSG_TIMEOUT             30 // in seconds.
+#define MAX_BULKMSGS_PER_FRIEND     4
+
+static int friend_bulkmsgs_count(ElaCarrier *w, uint32_t friend_number)
+{
+    hashtable_iterator_t it;
+    int count = 0;
+
+redo_count:
+    bulkmsgs_iterate(w->bulkmsgs, &it);
+    while (bulkmsgs_iterator_has_next(&it)) {
+        BulkMsg *bm;
+        int rc;
+
+        rc = bulkmsgs_iterator_next(&it, &bm);
+        if (rc == 0)
+            break;
+
+        if (rc == -1) {
+            count = 0;
+            goto redo_count;
+        }
+
+        if (bm->key.friend_number == friend_number)
+            count++;
+
+        deref(bm);
+    }
+
+    return count;
+}
+
+/*
+ * Fragments of a message arrive in order, since DHT messages to a friend
+ * are delivered losslessly and in sequence.
+ */
+static void handle_friend_bulkmsg(ElaCarrier *w, uint32_t friend_number,
+                                  const char *friendid, ElaCP *cp)
+{
+    BulkMsg *bm;
+    int64_t tid;
+    size_t totalsz;
+    const void *data;
+    size_t len;
+
+    tid = elacp_get_tid(cp);
+    totalsz = elacp_get_total_size(cp);
+    data = elacp_get_raw_data(cp);
+    len  = elacp_get_raw_data_length(cp);
+
+    bm = bulkmsgs_get(w->bulkmsgs, friend_number, tid);
+    if (!bm) {
+        if (totalsz <= ELA_MAX_APP_MESSAGE_LEN ||
+                totalsz > ELA_MAX_APP_BULKMSG_LEN) {
+            vlogW("Carrier: Invalid large message size %zu from friend %u, "
+                  "dropped.", totalsz, friend_number);
+            return;
+        }
+
+        if (friend_bulkmsgs_count(w, friend_number) >= MAX_BULKMSGS_PER_FRIEND) {
+            vlogW("Carrier: Too many large messages in progress from "
+                  "friend %u, dropped.", friend_number);
+            return;
+        }
+
+        bm = (BulkMsg *)rc_zalloc(sizeof(BulkMsg) + totalsz, NULL);
+        if (!bm) {
+            vlogE("Carrier: Out of memory, large message from friend %u "
+                  "dropped.", friend_number);
+            return;
+        }
+
+        bm->key.tid = tid;
+        bm->key.friend_number = friend_number;
+        bm->totalsz = totalsz;
+        bulkmsgs_put(w->bulkmsgs, bm);
+    }
+
+    /*
+     * Drop the offending fragment only, the partial message is left to
+     * complete or to expire.
+     */
+    if (bm->totalsz != totalsz || bm->received + len > bm->totalsz) {
+        vlogW("Carrier: Invalid large message fragment from friend %u, "
+              "dropped.", friend_number);
+        deref(bm);
+        return;
+    }
+
+    memcpy(bm->data + bm->received, data, len);
+    bm->received += len;
+    bm->expire_time = time(NULL) + BULKMSG_TIMEOUT;
+
+    if (bm->received == bm->totalsz) {
+        bulkmsgs_remove(w->bulkmsgs, friend_number, tid);
+
+        if (w->callbacks.friend_message)
+            w->callbacks.friend_message(w, friendid, bm->data, bm->totalsz,
+                                        w->context);
+    }
+
+    deref(bm);
+}
+
+/*
+ * Drop the partially received large messages which timed out, or all
+ * of them from the friend if friend_number is not UINT32_MAX.
+ */
+static void expire_bulkmsgs(ElaCarrier *w, uint32_t friend_number)
+{
+    hashtable_iterator_t it;
+    time_t now = time(NULL);
+
+    if (bulkmsgs_is_empty(w->bulkmsgs))
+        return;
+
+redo_expire:
+    bulkmsgs_iterate(w->bulkmsgs, &it);
+    while (bulkmsgs_iterator_has_next(&it)) {
+        BulkMsg *bm;
+        int rc;
+
+        rc = bulkmsgs_iterator_next(&it, &bm);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto redo_expire;
+
+        if (bm->key.friend_number == friend_number || bm->expire_time <= now) {
+            vlogW("Carrier: Large message from friend %u dropped, "
+                  "%zu of %zu bytes received.", bm->key.friend_number,
+                  bm->received, bm->totalsz);
+            bulkmsgs_iterator_remove(&it);
+        }
+
+        deref(bm);
+    }
+}
+
 static
 void notify_friend_connection_cb(uint32_t friend_number, bool connected,
                                  void *context)
@@ -1352,6 +2834,11 @@ void notify_friend_connection_cb(uint32_t friend_number, bool connected,
     }
 
     deref(fi);
+
+    if (!connected) {
+        fail_pending_receipts(w, friend_number, ElaReceipt_Offline);
+        expire_bulkmsgs(w, friend_number);
+    }
 }
 
 static void notify_friend_presence(ElaCarrier *w, const char *friendid,
@@ -1402,20 +2889,20 @@ void notify_friend_request_cb(const uint8_t *public_key, const uint8_t* gretting
                               size_t length, void *context)
 {
     ElaCarrier *w = (ElaCarrier *)context;
-    uint32_t friend_number;
+    FriendInfo *fi;
     ElaCP* cp;
     ElaUserInfo ui;
     size_t _len = sizeof(ui.userid);
     const char *name;
     const char *descr;
     const char *hello;
-    int rc;
 
     assert(public_key);
     assert(gretting && length > 0);
 
-    rc = dht_get_friend_number(&w->dht, public_key, &friend_number);
-    if (rc == 0 && friend_number != UINT32_MAX) {
+    fi = friend_keys_get(w->friend_keys, public_key);
+    if (fi) {
+        deref(fi);
         vlogW("Carrier: friend already exist, dropped friend request.");
         return;
     }
@@ -1457,8 +2944,6 @@ static void notify_friend_added(ElaCarrier *w, ElaFriendInfo *fi)
     assert(w);
     assert(fi);
 
-    store_persistence_data(w);
-
     event = (FriendEvent *)rc_alloc(sizeof(FriendEvent), NULL);
     if (event) {
         event->type = FriendEventType_Added;
@@ -1477,8 +2962,6 @@ static void notify_friend_removed(ElaCarrier *w, ElaFriendInfo *fi)
     assert(w);
     assert(fi);
 
-    store_persistence_data(w);
-
     event = (FriendEvent *)rc_alloc(sizeof(FriendEvent), NULL);
     if (event) {
         event->type = FriendEventType_Removed;
@@ -1570,10 +3053,23 @@ void handle_friend_message(ElaCarrier *w, uint32_t friend_number, ElaCP *cp)
     msg  = elacp_get_raw_data(cp);
     len  = elacp_get_raw_data_length(cp);
 
-    if (!name) {
-        if (w->callbacks.friend_message)
-            w->callbacks.friend_message(w, friendid, msg, len, w->context);
+    if (name) {
+        if (strcmp(name, "session") == 0) {
+            SessionExtension *ext = (SessionExtension *)w->session;
+            if (ext && ext->friend_message_cb)
+                ext->friend_message_cb(w, friendid, (const char *)msg, len,
+                                       ext->friend_message_context);
+        }
+        return;
     }
+
+    if (elacp_get_tid(cp) != 0) {
+        handle_friend_bulkmsg(w, friend_number, friendid, cp);
+        return;
+    }
+
+    if (w->callbacks.friend_message)
+        w->callbacks.friend_message(w, friendid, msg, len, w->context);
 }
 
 static
@@ -1680,14 +3176,20 @@ void handle_invite_response(ElaCarrier *w, uint32_t friend_number, ElaCP *cp)
     callback_func(w, friendid, status, reason, data, data_len, callback_ctxt);
 }
 
+/*
+ * Complete the invite transactions whose deadline has passed with a
+ * timeout status. Deadlines of transactions that already got a response
+ * are left in the heap and skipped here.
+ */
 static
 void notify_friend_message_cb(uint32_t friend_number, const uint8_t *message,
                               size_t length, void *context)
 {
     ElaCarrier *w = (ElaCarrier *)context;
+    ElaCPStorage storage;
     ElaCP *cp;
 
-    cp = elacp_decode(message, length);
+    cp = elacp_decode_view(message, length, &storage);
     if (!cp) {
         vlogE("Carrier: Invalid DHT message, dropped.");
         return;
@@ -1707,34 +3209,286 @@ void notify_friend_message_cb(uint32_t friend_number, const uint8_t *message,
         vlogE("Carrier: Unknown DHT message, dropped.");
         break;
     }
+}
+
+/*
+ * Bootstrap to the next batch of ranked candidates. Without any measured
+ * rtt there is no telling which nodes are good, so all candidates are
+ * tried in one go as before.
+ */
+static void connect_to_bootstraps(ElaCarrier *w)
+{
+    int count;
+    int i;
+
+    if (w->bootstrap.size == 0)
+        return;
+
+    count = w->bootstrap.candidates[0].rtt >= 0 ? BOOTSTRAP_BEST_K :
+                                                  w->bootstrap.size;
+    if (count > w->bootstrap.size)
+        count = w->bootstrap.size;
+
+    for (i = 0; i < count; i++) {
+        BootstrapNodeBuf *bi;
+        char id[ELA_MAX_ID_LEN + 1] = {0};
+        size_t id_len = sizeof(id);
+        int rc;
+
+        if (w->bootstrap.next >= w->bootstrap.size)
+            w->bootstrap.next = 0;
+
+        bi = &w->bootstrap.candidates[w->bootstrap.next++].node;
+
+        base58_encode(bi->public_key, DHT_PUBLIC_KEY_SIZE, id, &id_len);
+        rc = dht_bootstrap(&w->dht, bi->ipv4, bi->ipv6, bi->port, bi->public_key);
+        if (rc < 0) {
+            vlogW("Carrier: Try to connect to bootstrap "
+                  "[ipv4:%s, ipv6:%s, port:%d, public_key:%s] error.",
+                  *bi->ipv4 ? bi->ipv4 : "N/A", *bi->ipv6 ? bi->ipv6 : "N/A",
+                  bi->port, id);
+        } else {
+            vlogT("Carrier: Try to connect to bootstrap "
+                  "[ipv4:%s, ipv6:%s, port:%d, public_key:%s] succeess.",
+                  *bi->ipv4 ? bi->ipv4 : "N/A", *bi->ipv6 ? bi->ipv6 : "N/A",
+                  bi->port, id);
+        }
+    }
+
+    w->bootstrap.last_attempt = (int64_t)get_monotonic_time() / 1000;
+}
+
+static void learn_bootstrap_node_cb(const uint8_t *public_key,
+                                    const char *ipv4, const char *ipv6,
+                                    int port, bool tcp, void *context)
+{
+    ElaCarrier *w = (ElaCarrier *)context;
+    BootstrapNodeBuf node;
+
+    memset(&node, 0, sizeof(node));
+    strncpy(node.ipv4, ipv4, MAX_IPV4_ADDRESS_LEN);
+    strncpy(node.ipv6, ipv6, MAX_IPV6_ADDRESS_LEN);
+    node.port = (uint16_t)port;
+    memcpy(node.public_key, public_key, DHT_PUBLIC_KEY_SIZE);
+
+    bootstrap_cache_learn(&w->bootstrap.candidates, &w->bootstrap.size, &node,
+                          tcp ? BOOTSTRAP_NODE_TCP : BOOTSTRAP_NODE_UDP);
+}
+
+/*
+ * Merge the DHT nodes and TCP relays toxcore is connected to into the
+ * bootstrap cache, so the next start has more than the configured nodes
+ * to choose from.
+ */
+static void learn_bootstrap_nodes(ElaCarrier *w)
+{
+    int rc;
+
+    if (time(NULL) - w->bootstrap.last_learn < BOOTSTRAP_LEARN_INTERVAL)
+        return;
+
+    w->bootstrap.last_learn = time(NULL);
+
+    rc = dht_get_connected_nodes(&w->dht, learn_bootstrap_node_cb, w);
+    if (rc < 0)
+        return;
+
+    bootstrap_cache_rank(w->bootstrap.candidates, w->bootstrap.size);
+
+    rc = bootstrap_cache_store(w->pref.data_location,
+                               w->bootstrap.candidates, w->bootstrap.size);
+    if (rc < 0)
+        vlogW("Carrier: Store bootstrap cache error (0x%x).", rc);
+}
+
+/*
+ * Pick up the probe results into the ranking, and while disconnected
+ * keep bootstrapping further down the ranking with a growing interval.
+ */
+static void do_bootstrap(ElaCarrier *w)
+{
+    BootstrapProbe *probe = w->bootstrap.probe;
+    int64_t now;
+
+    if (probe && bootstrap_probe_done(probe)) {
+        int rc;
+
+        bootstrap_probe_apply(probe, w->bootstrap.candidates, w->bootstrap.size);
+        w->bootstrap.probe = NULL;
+        deref(probe);
+
+        rc = bootstrap_cache_store(w->pref.data_location,
+                                   w->bootstrap.candidates, w->bootstrap.size);
+        if (rc < 0)
+            vlogW("Carrier: Store bootstrap cache error (0x%x).", rc);
+
+        if (w->connection_status != ElaConnectionStatus_Connected)
+            w->bootstrap.next = 0;
+    }
+
+    if (w->connection_status == ElaConnectionStatus_Connected) {
+        learn_bootstrap_nodes(w);
+        return;
+    }
+
+    now = (int64_t)get_monotonic_time() / 1000;
+    if (now - w->bootstrap.last_attempt < w->bootstrap.interval)
+        return;
+
+    connect_to_bootstraps(w);
+
+    if (w->bootstrap.interval < BOOTSTRAP_MIN_INTERVAL)
+        w->bootstrap.interval = BOOTSTRAP_MIN_INTERVAL;
+    else if (w->bootstrap.interval < BOOTSTRAP_MAX_INTERVAL)
+        w->bootstrap.interval *= 2;
+
+    if (w->bootstrap.interval > BOOTSTRAP_MAX_INTERVAL)
+        w->bootstrap.interval = BOOTSTRAP_MAX_INTERVAL;
+}
+
+static void carrier_start(ElaCarrier *w)
+{
+    w->dht_callbacks.notify_connection = notify_connection_cb;
+    w->dht_callbacks.notify_friend_desc = notify_friend_description_cb;
+    w->dht_callbacks.notify_friend_connection = notify_friend_connection_cb;
+    w->dht_callbacks.notify_friend_status = notify_friend_status_cb;
+    w->dht_callbacks.notify_friend_request = notify_friend_request_cb;
+    w->dht_callbacks.notify_friend_message = notify_friend_message_cb;
+    w->dht_callbacks.notify_friend_receipt = notify_friend_receipt_cb;
+    w->dht_callbacks.context = w;
+
+    notify_friends(w);
+
+    w->running = 1;
+
+    w->bootstrap.next = 0;
+    w->bootstrap.interval = BOOTSTRAP_MIN_INTERVAL;
+    connect_to_bootstraps(w);
+
+    start_bootstrap_probe(w);
+}
+
+#define MAX_WAIT_FDS                32
+
+/*
+ * Sleep until the DHT sockets become readable, or messages were queued
+ * by other threads, or the timeout expires.
+ */
+static void wait_for_events(ElaCarrier *w, struct timeval *timeout)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    int fds[MAX_WAIT_FDS];
+    fd_set rfds;
+    int maxfd = -1;
+    int count;
+    int i;
+
+    count = dht_get_fds(&w->dht, fds, MAX_WAIT_FDS - 1);
+    if (count < 0)
+        count = 0;
+    else if (count > MAX_WAIT_FDS - 1)
+        count = MAX_WAIT_FDS - 1;
+
+    if (w->wakeup_fd[0] >= 0)
+        fds[count++] = w->wakeup_fd[0];
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < count; i++) {
+        if (fds[i] < 0 || fds[i] >= FD_SETSIZE)
+            continue;
+
+        FD_SET(fds[i], &rfds);
+        if (fds[i] > maxfd)
+            maxfd = fds[i];
+    }
+
+    if (maxfd >= 0) {
+        select(maxfd + 1, &rfds, NULL, NULL, timeout);
+        return;
+    }
+#endif
+
+    usleep(timeout->tv_usec);
+}
+
+static time_t next_bulkmsg_expiry(ElaCarrier *w)
+{
+    hashtable_iterator_t it;
+    time_t expire_time = 0;
+
+    if (bulkmsgs_is_empty(w->bulkmsgs))
+        return 0;
+
+redo_next:
+    bulkmsgs_iterate(w->bulkmsgs, &it);
+    while (bulkmsgs_iterator_has_next(&it)) {
+        BulkMsg *bm;
+        int rc;
+
+        rc = bulkmsgs_iterator_next(&it, &bm);
+        if (rc == 0)
+            break;
+
+        if (rc == -1) {
+            expire_time = 0;
+            goto redo_next;
+        }
+
+        if (!expire_time || bm->expire_time < expire_time)
+            expire_time = bm->expire_time;
+
+        deref(bm);
+    }
 
-    elacp_free(cp);
+    return expire_time;
 }
 
-static void connect_to_bootstraps(ElaCarrier *w)
+static inline void min_timeout(int *timeout, int64_t interval)
 {
-    int i;
+    if (interval < 0)
+        interval = 0;
 
-    for (i = 0; i < w->pref.bootstraps_size; i++) {
-        BootstrapNodeBuf *bi = &w->pref.bootstraps[i];
-        char id[ELA_MAX_ID_LEN + 1] = {0};
-        size_t id_len = sizeof(id);
-        int rc;
+    if (interval < *timeout)
+        *timeout = (int)interval;
+}
 
-        base58_encode(bi->public_key, DHT_PUBLIC_KEY_SIZE, id, &id_len);
-        rc = dht_bootstrap(&w->dht, bi->ipv4, bi->ipv6, bi->port, bi->public_key);
-        if (rc < 0) {
-            vlogW("Carrier: Try to connect to bootstrap "
-                  "[ipv4:%s, ipv6:%s, port:%d, public_key:%s] error.",
-                  *bi->ipv4 ? bi->ipv4 : "N/A", *bi->ipv6 ? bi->ipv6 : "N/A",
-                  bi->port, id);
-        } else {
-            vlogT("Carrier: Try to connect to bootstrap "
-                  "[ipv4:%s, ipv6:%s, port:%d, public_key:%s] succeess.",
-                  *bi->ipv4 ? bi->ipv4 : "N/A", *bi->ipv6 ? bi->ipv6 : "N/A",
-                  bi->port, id);
-        }
-    }
+/*
+ * Milliseconds until the earliest of the node's internal deadlines: the
+ * DHT iteration, the bootstrap retry, invite timeouts, expiry of partial
+ * large messages and the change log compaction.
+ */
+static int next_timeout(ElaCarrier *w)
+{
+    int64_t now = (int64_t)(get_monotonic_time() / 1000);
+    time_t wall = time(NULL);
+    int64_t expire_time;
+    time_t bulk_expire;
+    int timeout;
+
+    timeout = dht_iteration_idle(&w->dht);
+
+    if (w->connection_status != ElaConnectionStatus_Connected)
+        min_timeout(&timeout,
+                    w->bootstrap.last_attempt + w->bootstrap.interval - now);
+
+    if (transaction_deadlines_next(&w->tdeadlines, &expire_time))
+        min_timeout(&timeout, expire_time - now);
+
+    bulk_expire = next_bulkmsg_expiry(w);
+    if (bulk_expire)
+        min_timeout(&timeout, (int64_t)(bulk_expire - wall) * 1000);
+
+    if (w->changes.frozen)
+        ; // Stored once verified.
+    else if (w->changes.size >= CHANGE_LOG_COMPACT_SIZE)
+        min_timeout(&timeout, 0);
+    else
+        min_timeout(&timeout, (int64_t)(w->changes.last_compact +
+                              (w->changes.size > 0 ?
+                               CHANGE_LOG_COMPACT_INTERVAL :
+                               DHT_STATE_STORE_INTERVAL) - wall) * 1000);
+
+    return timeout;
 }
 
 int ela_run(ElaCarrier *w, int interval)
@@ -1744,24 +3498,17 @@ int ela_run(ElaCarrier *w, int interval)
         return -1;
     }
 
+    if (w->running) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
     if (interval == 0)
         interval = 1000; // in milliseconds.
 
     ref(w);
 
-    w->dht_callbacks.notify_connection = notify_connection_cb;
-    w->dht_callbacks.notify_friend_desc = notify_friend_description_cb;
-    w->dht_callbacks.notify_friend_connection = notify_friend_connection_cb;
-    w->dht_callbacks.notify_friend_status = notify_friend_status_cb;
-    w->dht_callbacks.notify_friend_request = notify_friend_request_cb;
-    w->dht_callbacks.notify_friend_message = notify_friend_message_cb;
-    w->dht_callbacks.context = w;
-
-    notify_friends(w);
-
-    w->running = 1;
-
-    connect_to_bootstraps(w);
+    carrier_start(w);
 
     while(!w->quit) {
         int idle_interval;
@@ -1771,7 +3518,7 @@ int ela_run(ElaCarrier *w, int interval)
 
         gettimeofday(&expire, NULL);
 
-        idle_interval = dht_iteration_idle(&w->dht);
+        idle_interval = next_timeout(w);
         if (idle_interval > interval)
             idle_interval = interval;
 
@@ -1791,21 +3538,121 @@ int ela_run(ElaCarrier *w, int interval)
 
         if (timercmp(&expire, &check, >)) {
             timersub(&expire, &check, &tmp);
-            usleep(tmp.tv_usec);
+            wait_for_events(w, &tmp);
         }
 
+        wakeup_drain(w);
+        do_send_queue(w);
+
         dht_iterate(&w->dht, &w->dht_callbacks);
+        do_bootstrap(w);
+
+        expire_bulkmsgs(w, UINT32_MAX);
+        do_transaction_expiry(w);
+        check_persistence_verifier(w);
+        do_compact_changes(w);
     }
 
     w->running = 0;
+    cancel_pending_messages(w);
+    sync_changes(w);
 
-    store_persistence_data(w);
+    if (w->persistence_failed) {
+        deref(w);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_BAD_PERSISTENT_DATA));
+        return -1;
+    }
 
     deref(w);
 
     return 0;
 }
 
+int ela_process(ElaCarrier *w)
+{
+    if (!w) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (w->running && !w->embedded) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    if (w->persistence_failed) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_BAD_PERSISTENT_DATA));
+        return -1;
+    }
+
+    if (!w->running) {
+        w->embedded = 1;
+        carrier_start(w);
+    }
+
+    do_friend_events(w);
+
+    notify_idle(w);
+
+    wakeup_drain(w);
+    do_send_queue(w);
+
+    dht_iterate(&w->dht, &w->dht_callbacks);
+    do_bootstrap(w);
+
+    expire_bulkmsgs(w, UINT32_MAX);
+    do_transaction_expiry(w);
+    check_persistence_verifier(w);
+    do_compact_changes(w);
+
+    if (w->persistence_failed) {
+        w->running = 0;
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_BAD_PERSISTENT_DATA));
+        return -1;
+    }
+
+    return 0;
+}
+
+int ela_get_fds(ElaCarrier *w, int *fds, int count)
+{
+    int rc;
+
+    if (!w || count < 0 || (count > 0 && !fds)) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    rc = dht_get_fds(&w->dht, fds, count);
+    if (rc < 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    // Signaled when other threads queue messages to send.
+    if (w->wakeup_fd[0] >= 0) {
+        if (rc < count)
+            fds[rc] = w->wakeup_fd[0];
+        rc++;
+    }
+
+    return rc;
+}
+
+int ela_get_next_timeout(ElaCarrier *w)
+{
+    if (!w) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    // Not started yet, or friend events are waiting for dispatching.
+    if (!w->running || list_size(w->friend_events) > 0)
+        return 0;
+
+    return next_timeout(w);
+}
+
 char *ela_get_address(ElaCarrier *w, char *address, size_t length)
 {
     if (!w || !address || !length) {
@@ -1860,7 +3707,8 @@ int ela_set_self_nospam(ElaCarrier *w, uint32_t nospam)
         return -1;
     }
 
-    store_persistence_data(w);
+    nospam = htonl(nospam);
+    record_change(w, ChangeType_SelfNospam, &nospam, sizeof(nospam), NULL, 0);
 
     return 0;
 }
@@ -1920,6 +3768,7 @@ int ela_set_self_info(ElaCarrier *w, const ElaUserInfo *info)
         elacp_set_phone(cp, info->phone);
         elacp_set_email(cp, info->email);
         elacp_set_region(cp, info->region);
+        elacp_set_caps(cp, ELACP_CAPS);
 
         data = elacp_encode(cp, &data_len);
         elacp_free(cp);
@@ -1942,7 +3791,7 @@ int ela_set_self_info(ElaCarrier *w, const ElaUserInfo *info)
         strcpy(w->me.region, info->region);
         dht_self_set_desc(&w->dht, data, data_len);
 
-        store_persistence_data(w);
+        record_change(w, ChangeType_SelfDesc, data, data_len, NULL, 0);
 
         free(data);
     }
@@ -2042,6 +3891,40 @@ int ela_get_friends(ElaCarrier *w,
     return 0;
 }
 
+int ela_get_friends_page(ElaCarrier *w, uint32_t *cursor,
+                         ElaFriendInfo *friends, int count)
+{
+    uint32_t friend_number;
+    uint32_t end;
+    int i = 0;
+
+    if (!w || !cursor || !friends || count <= 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    /*
+     * The cursor is the next friend number to look at. Friend numbers
+     * are small and dense, and stay stable while friends come and go.
+     */
+    end = w->friend_number_end;
+    for (friend_number = *cursor; friend_number < end && i < count;
+         friend_number++) {
+        FriendInfo *fi;
+
+        fi = friends_get(w->friends, friend_number);
+        if (!fi)
+            continue;
+
+        memcpy(&friends[i++], &fi->info, sizeof(ElaFriendInfo));
+        deref(fi);
+    }
+
+    *cursor = friend_number;
+
+    return i;
+}
+
 int ela_get_friend_info(ElaCarrier *w, const char *friendid,
                         ElaFriendInfo *info)
 {
@@ -2106,9 +3989,11 @@ int ela_set_friend_label(ElaCarrier *w,
 
     strcpy(fi->info.label, label ? label : "");
 
-    deref(fi);
+    record_change(w, ChangeType_FriendLabel, fi->public_key,
+                  DHT_PUBLIC_KEY_SIZE, fi->info.label,
+                  strlen(fi->info.label) + 1);
 
-    store_persistence_data(w);
+    deref(fi);
 
     return 0;
 }
@@ -2165,8 +4050,9 @@ int ela_add_friend(ElaCarrier *w, const char *address, const char *hello)
 
     base58_decode(address, strlen(address), addr, sizeof(addr));
 
-    rc = dht_get_friend_number(&w->dht, addr, &friend_number);
-    if (rc == 0 && friend_number != UINT32_MAX) {
+    fi = friend_keys_get(w->friend_keys, addr);
+    if (fi) {
+        deref(fi);
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_ALREADY_EXIST));
         return -1;
     }
@@ -2198,21 +4084,25 @@ int ela_add_friend(ElaCarrier *w, const char *address, const char *hello)
     }
 
     rc = dht_friend_add(&w->dht, addr, data, data_len, &friend_number);
-    free(data);
-
     if (rc < 0) {
+        free(data);
         ela_set_error(rc);
         deref(fi);
         return -1;
     }
 
+    record_change(w, ChangeType_FriendAdd, addr, DHT_ADDRESS_SIZE,
+                  data, data_len);
+    free(data);
+
     _len = sizeof(fi->info.user_info.userid);
     base58_encode(addr, DHT_PUBLIC_KEY_SIZE, fi->info.user_info.userid, &_len);
+    memcpy(fi->public_key, addr, DHT_PUBLIC_KEY_SIZE);
 
     fi->friend_number = friend_number;
     fi->info.presence = ElaPresenceStatus_None;
     fi->info.status   = ElaConnectionStatus_Disconnected;
-    friends_put(w->friends, fi);
+    friends_add(w, fi);
 
     notify_friend_added(w, &fi->info);
 
@@ -2268,13 +4158,17 @@ int ela_accept_friend(ElaCarrier *w, const char *userid)
         return -1;
     }
 
+    record_change(w, ChangeType_FriendAccept, public_key, DHT_PUBLIC_KEY_SIZE,
+                  NULL, 0);
+
     strcpy(fi->info.user_info.userid, userid);
+    memcpy(fi->public_key, public_key, DHT_PUBLIC_KEY_SIZE);
 
     fi->friend_number = friend_number;
     fi->info.presence = ElaPresenceStatus_None;
     fi->info.status   = ElaConnectionStatus_Disconnected;
 
-    friends_put(w->friends, fi);
+    friends_add(w, fi);
 
     notify_friend_added(w, &fi->info);
 
@@ -2317,9 +4211,12 @@ int ela_remove_friend(ElaCarrier *w, const char *friendid)
 
     dht_friend_delete(&w->dht, friend_number);
 
-    fi = friends_remove(w->friends, friend_number);
+    fi = friends_delete(w, friend_number);
     assert(fi);
 
+    record_change(w, ChangeType_FriendRemove, fi->public_key,
+                  DHT_PUBLIC_KEY_SIZE, NULL, 0);
+
     notify_friend_removed(w, &fi->info);
 
     deref(fi);
@@ -2349,17 +4246,72 @@ static void parse_address(const char *addr, char **uid, char **ext)
     }
 }
 
-int ela_send_friend_message(ElaCarrier *w, const char *to, const void *msg,
-                            size_t len)
+static int64_t generate_tid(void)
+{
+    int64_t tid;
+
+    do {
+        tid = time(NULL);
+        tid += rand();
+    } while (tid == 0);
+
+    return tid;
+}
+
+static int check_friend_online(ElaCarrier *w, uint32_t friend_number)
+{
+    FriendInfo *fi;
+    int rc = 0;
+
+    fi = friends_get(w->friends, friend_number);
+    if (!fi)
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    if (fi->info.status != ElaConnectionStatus_Connected)
+        rc = ELA_DHT_ERROR(ELAERR_FRIEND_OFFLINE);
+
+    deref(fi);
+    return rc;
+}
+
+static bool friend_has_caps(ElaCarrier *w, uint32_t friend_number,
+                            uint32_t caps)
+{
+    FriendInfo *fi;
+    bool rc;
+
+    fi = friends_get(w->friends, friend_number);
+    if (!fi)
+        return false;
+
+    rc = (fi->caps & caps) == caps;
+
+    deref(fi);
+    return rc;
+}
+
+static int64_t send_friend_message(ElaCarrier *w, const char *to,
+                                   const void *msg, size_t len,
+                                   ElaFriendMessageReceiptCallback *callback,
+                                   void *context)
 {
     char *addr, *userid, *ext_name;
     uint32_t friend_number;
     int rc;
     ElaCP *cp;
-    uint8_t *data;
+    ElaCPStorage storage;
+    uint8_t data[DHT_MAX_MESSAGE_LEN];
     size_t data_len;
+    size_t offset;
+    size_t frag_len;
+    int64_t tid = 0;
+    int64_t msgid;
+    OutgoingMessage *frags[(ELA_MAX_APP_BULKMSG_LEN + ELA_MAX_APP_MESSAGE_LEN - 1)
+                           / ELA_MAX_APP_MESSAGE_LEN];
+    int nfrags = 0;
+    int i;
 
-    if (!w || !to || !msg || !len || len > ELA_MAX_APP_MESSAGE_LEN) {
+    if (!w || !to || !msg || !len || len > ELA_MAX_APP_BULKMSG_LEN) {
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
         return -1;
     }
@@ -2400,49 +4352,127 @@ int ela_send_friend_message(ElaCarrier *w, const char *to, const void *msg,
         return -1;
     }
 
-    cp = elacp_create(ELACP_TYPE_MESSAGE, ext_name);
-    if (!cp) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+    rc = check_friend_online(w, friend_number);
+    if (rc < 0) {
+        ela_set_error(rc);
         return -1;
     }
 
-    elacp_set_raw_data(cp, msg, len);
+    if (len > ELA_MAX_APP_MESSAGE_LEN && !friend_has_caps(w, friend_number,
+                                                           ELACP_CAP_BULKMSG)) {
+        vlogW("Carrier: Friend %u can not reassemble large messages.",
+              friend_number);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_TOO_LONG));
+        return -1;
+    }
 
-    data = elacp_encode(cp, &data_len);
-    elacp_free(cp);
+    msgid = generate_msgid(w);
 
-    if (!data) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return -1;
+    // Large message goes out as fragments sharing the same tid.
+    if (len > ELA_MAX_APP_MESSAGE_LEN)
+        tid = generate_tid();
+
+    /*
+     * All fragments are built before any of them is queued, a message
+     * is either queued as a whole or not at all.
+     */
+    for (offset = 0; offset < len; offset += frag_len) {
+        bool last;
+
+        frag_len = len - offset;
+        if (frag_len > ELA_MAX_APP_MESSAGE_LEN)
+            frag_len = ELA_MAX_APP_MESSAGE_LEN;
+
+        last = (offset + frag_len == len);
+
+        cp = elacp_init(&storage, ELACP_TYPE_MESSAGE, ext_name);
+        elacp_set_raw_data(cp, (const uint8_t *)msg + offset, frag_len);
+        if (tid) {
+            elacp_set_tid(cp, &tid);
+            elacp_set_total_size(cp, len);
+        }
+
+        data_len = sizeof(data);
+        rc = elacp_encode_to(cp, data, &data_len);
+        if (rc < 0) {
+            rc = data_len ? ELA_GENERAL_ERROR(ELAERR_TOO_LONG) :
+                            ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+            goto errorExit;
+        }
+
+        // Receipt of the last fragment confirms the whole message.
+        frags[nfrags] = outgoing_message_new(friend_number, data, data_len, 0,
+                                             last ? msgid : 0,
+                                             last ? callback : NULL,
+                                             last ? context : NULL);
+        if (!frags[nfrags]) {
+            rc = ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+            goto errorExit;
+        }
+
+        nfrags++;
     }
 
-    rc = dht_friend_message(&w->dht, friend_number, data, data_len);
-    free(data);
+    pthread_mutex_lock(&w->send_lock);
+    if (!w->is_ready) {
+        pthread_mutex_unlock(&w->send_lock);
+        rc = ELA_GENERAL_ERROR(ELAERR_NOT_READY);
+        goto errorExit;
+    }
 
-    if (rc < 0) {
-        ela_set_error(rc);
-        return -1;
+    for (i = 0; i < nfrags; i++) {
+        list_push_tail(w->send_queue, &frags[i]->le);
+        deref(frags[i]);
     }
+    pthread_mutex_unlock(&w->send_lock);
 
-    return 0;
+    wakeup_signal(w);
+
+    return msgid;
+
+errorExit:
+    for (i = 0; i < nfrags; i++)
+        deref(frags[i]);
+
+    ela_set_error(rc);
+    return -1;
 }
 
-static int64_t generate_tid(void)
+int ela_send_friend_message(ElaCarrier *w, const char *to, const void *msg,
+                            size_t len)
 {
-    int64_t tid;
+    return send_friend_message(w, to, msg, len, NULL, NULL) > 0 ? 0 : -1;
+}
 
-    do {
-        tid = time(NULL);
-        tid += rand();
-    } while (tid == 0);
+int64_t ela_send_message_with_receipt(ElaCarrier *w, const char *to,
+                                      const void *msg, size_t len,
+                                      ElaFriendMessageReceiptCallback *callback,
+                                      void *context)
+{
+    if (!callback) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
 
-    return tid;
+    return send_friend_message(w, to, msg, len, callback, context);
 }
 
+#define DEFAULT_INVITE_TIMEOUT      (120 * 1000)
+
 int ela_invite_friend(ElaCarrier *w, const char *to,
                       const void *data, size_t len,
                       ElaFriendInviteResponseCallback *callback,
                       void *context)
+{
+    return ela_invite_friend_with_timeout(w, to, data, len,
+                                          DEFAULT_INVITE_TIMEOUT,
+                                          callback, context);
+}
+
+int ela_invite_friend_with_timeout(ElaCarrier *w, const char *to,
+                                   const void *data, size_t len, int timeout,
+                                   ElaFriendInviteResponseCallback *callback,
+                                   void *context)
 {
     char *addr, *userid, *ext_name;
     uint32_t friend_number;
@@ -2450,10 +4480,11 @@ int ela_invite_friend(ElaCarrier *w, const char *to,
     int rc;
     TransactedCallback *tcb;
     int64_t tid;
-    uint8_t *_data;
+    ElaCPStorage storage;
+    uint8_t _data[DHT_MAX_MESSAGE_LEN];
     size_t _data_len;
 
-    if (!w || !to || !data || !len || !callback) {
+    if (!w || !to || !data || !len || timeout <= 0 || !callback) {
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
         return -1;
     }
@@ -2488,43 +4519,54 @@ int ela_invite_friend(ElaCarrier *w, const char *to,
         return -1;
     }
 
-    cp = elacp_create(ELACP_TYPE_INVITE_REQUEST, ext_name);
-    if (!cp) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+    rc = check_friend_online(w, friend_number);
+    if (rc < 0) {
+        ela_set_error(rc);
         return -1;
     }
 
+    cp = elacp_init(&storage, ELACP_TYPE_INVITE_REQUEST, ext_name);
+
     tid = generate_tid();
 
     elacp_set_tid(cp, &tid);
     elacp_set_raw_data(cp, data, len);
 
-    _data = elacp_encode(cp, &_data_len);
-    elacp_free(cp);
-
-    if (!_data) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+    _data_len = sizeof(_data);
+    rc = elacp_encode_to(cp, _data, &_data_len);
+    if (rc < 0) {
+        ela_set_error(_data_len ? ELA_GENERAL_ERROR(ELAERR_TOO_LONG) :
+                                  ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
         return -1;
     }
 
     tcb = (TransactedCallback*)rc_alloc(sizeof(TransactedCallback), NULL);
     if (!tcb) {
         ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        free(_data);
         return -1;
     }
 
     tcb->tid = tid;
+    strcpy(tcb->userid, userid);
     tcb->callback_func = callback;
     tcb->callback_context = context;
 
     transacted_callbacks_put(w->tcallbacks, tcb);
     deref(tcb);
 
-    rc = dht_friend_message(&w->dht, friend_number, _data, _data_len);
-    free(_data);
+    rc = transaction_deadlines_push(&w->tdeadlines, tid,
+                    (int64_t)(get_monotonic_time() / 1000) + timeout);
+    if (rc < 0) {
+        transacted_callbacks_remove(w->tcallbacks, tid);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+        return -1;
+    }
+
+    rc = enqueue_message(w, friend_number, _data, _data_len, tid, 0,
+                         NULL, NULL);
 
     if (rc < 0) {
+        transacted_callbacks_remove(w->tcallbacks, tid);
         ela_set_error(rc);
         return -1;
     }
@@ -2541,7 +4583,8 @@ int ela_reply_friend_invite(ElaCarrier *w, const char *to,
     int64_t tid;
     ElaCP *cp;
     int rc;
-    uint8_t *_data;
+    ElaCPStorage storage;
+    uint8_t _data[DHT_MAX_MESSAGE_LEN];
     size_t _data_len;
 
     if (!w || !to || !*to || (status != 0 && !reason)
@@ -2586,12 +4629,14 @@ int ela_reply_friend_invite(ElaCarrier *w, const char *to,
         return -1;
     }
 
-    cp = elacp_create(ELACP_TYPE_INVITE_RESPONSE, ext_name);
-    if (!cp) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+    rc = check_friend_online(w, friend_number);
+    if (rc < 0) {
+        ela_set_error(rc);
         return -1;
     }
 
+    cp = elacp_init(&storage, ELACP_TYPE_INVITE_RESPONSE, ext_name);
+
     elacp_set_tid(cp, &tid);
     elacp_set_status(cp, status);
     if (status)
@@ -2599,16 +4644,16 @@ int ela_reply_friend_invite(ElaCarrier *w, const char *to,
     if (data)
         elacp_set_raw_data(cp, data, len);
 
-    _data = elacp_encode(cp, &_data_len);
-    elacp_free(cp);
-
-    if (!_data) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+    _data_len = sizeof(_data);
+    rc = elacp_encode_to(cp, _data, &_data_len);
+    if (rc < 0) {
+        ela_set_error(_data_len ? ELA_GENERAL_ERROR(ELAERR_TOO_LONG) :
+                                  ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
         return -1;
     }
 
-    rc = dht_friend_message(&w->dht, friend_number, _data, _data_len);
-    free(_data);
+    rc = enqueue_message(w, friend_number, _data, _data_len, 0, 0,
+                         NULL, NULL);
 
     if (rc < 0) {
         ela_set_error(rc);
@@ -122,6 +122,14 @@ extern "C" {
  */
 #define ELA_MAX_APP_MESSAGE_LEN         1024
 
+/**
+ * \~English
+ * Carrier App large message max length. Messages longer than
+ * ELA_MAX_APP_MESSAGE_LEN are sent as fragments and reassembled
+ * by the receiving carrier node.
+ */
+#define ELA_MAX_APP_BULKMSG_LEN         (64 * 1024)
+
 typedef struct ElaCarrier ElaCarrier;
 
 /******************************************************************************
@@ -204,6 +212,23 @@ typedef struct ElaOptions {
      * The array of bootstrap nodes.
      */
     BootstrapNode *bootstraps;
+
+    /**
+     * \~English
+     * The option to verify the checksum of the persistent data on a
+     * background thread after the carrier node is created, instead of
+     * before loading it. This shortens the startup with large persistent
+     * data. Nothing is stored over the persistent data until it is
+     * verified. If the checksum turns out to be wrong, the node fails:
+     * ela_run() or ela_process() returns -1 with
+     * ELAERR_BAD_PERSISTENT_DATA, and the application should kill the
+     * node and create it again. A corrupt journal is removed, so the new
+     * node loads the previous data. A corrupt data file is renamed to
+     * carrier.data.corrupt, and its change log to carrier.data.log.corrupt,
+     * so the new node starts with a new identity and the files are kept
+     * for recovery.
+     */
+    bool deferred_verification;
 } ElaOptions;
 
 /**
@@ -452,6 +477,10 @@ typedef struct ElaCallbacks {
      * \~English
      * An application-defined function that iterate the each friends list item.
      *
+     * The whole friends list is replayed through this callback when the
+     * node starts. Leave it NULL to skip the replay, and list friends on
+     * demand with ela_get_friends_page() instead.
+     *
      * @param
      *      carrier     [in] A handle to the Carrier node instance.
      * @param
@@ -698,6 +727,20 @@ ElaCarrier *ela_new(const ElaOptions *options,
  * After calling the function, the Carrier pointer becomes invalid.
  * No other functions can be called.
  *
+ * Messages still queued for sending are dropped. Their receipt callbacks,
+ * and the receipt callbacks of the sent messages not confirmed yet, are
+ * invoked with ElaReceipt_Cancelled. The response callbacks of pending
+ * friend invites are invoked with ELAERR_CANCELLED. In embedded mode the
+ * callbacks are invoked on the calling thread, otherwise on the carrier
+ * event loop thread right before ela_run() returns.
+ *
+ * For a node embedded with ela_process(), this function does not wait
+ * for the application's event loop. It only marks the node stopped, fails
+ * the pending messages on the calling thread and releases the node.
+ * Application should remove the descriptors returned by ela_get_fds()
+ * from its event loop and stop calling ela_process() and
+ * ela_get_next_timeout() before killing it.
+ *
  * @param
  *      carrier     [in] A handle identifying the Carrier node instance
  *                       to kill.
@@ -729,6 +772,78 @@ void ela_kill(ElaCarrier *carrier);
 CARRIER_API
 int ela_run(ElaCarrier *carrier, int interval);
 
+/**
+ * \~English
+ * Run one step of the node's event loop, for applications that embed the
+ * carrier into their own event loop (epoll, libuv, ...) instead of running
+ * ela_run() on a dedicated thread.
+ *
+ * The first call connects the node to Carrier network, the same as
+ * ela_run() does on start. Each call then dispatches the pending friend
+ * events, invokes the idle callback and processes the DHT network I/O
+ * and timers without blocking.
+ *
+ * Application should call this function whenever any descriptor returned
+ * by ela_get_fds() becomes readable, and at the latest when the timeout
+ * returned by ela_get_next_timeout() expires. The node must not be
+ * running ela_run() at the same time.
+ *
+ * @param
+ *      carrier     [in] A handle identifying the Carrier node instance.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred. The specific error code
+ *      can be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_process(ElaCarrier *carrier);
+
+/**
+ * \~English
+ * Get the file descriptors the node reads network data from.
+ *
+ * The returned descriptors should be polled for readability, and
+ * ela_process() called once any of them becomes readable. The set changes
+ * as the node connects to or disconnects from TCP relays, so application
+ * should refresh it after each ela_process() call.
+ *
+ * @param
+ *      carrier     [in] A handle identifying the Carrier node instance.
+ * @param
+ *      fds         [out] The buffer to receive the file descriptors.
+ * @param
+ *      count       [in] The capacity of fds buffer.
+ *
+ * @return
+ *      The total number of the descriptors, which might be greater than
+ *      count, in which case only the first count descriptors are stored.
+ *      Otherwise, return -1, and a specific error code can be retrieved
+ *      by calling ela_get_error().
+ */
+CARRIER_API
+int ela_get_fds(ElaCarrier *carrier, int *fds, int count);
+
+/**
+ * \~English
+ * Get the time until the node's next scheduled work.
+ *
+ * The timeout is the earliest of the node's internal deadlines: the DHT
+ * iteration, the retry of bootstrapping while disconnected, the timeout
+ * of pending friend invites, the expiry of partially received large
+ * messages and the periodic compaction of the persistent change log.
+ *
+ * @param
+ *      carrier     [in] A handle identifying the Carrier node instance.
+ *
+ * @return
+ *      The number of milliseconds application may wait before calling
+ *      ela_process() again, 0 if ela_process() should be called right away.
+ *      Otherwise, return -1, and a specific error code can be retrieved
+ *      by calling ela_get_error().
+ */
+CARRIER_API
+int ela_get_next_timeout(ElaCarrier *carrier);
+
 /******************************************************************************
  * Internal node information
  *****************************************************************************/
@@ -959,6 +1074,33 @@ CARRIER_API
 int ela_get_friends(ElaCarrier *carrier,
                     ElaFriendsIterateCallback *callback, void *context);
 
+/**
+ * \~English
+ * Get a page of the friends list.
+ *
+ * This is the scalable alternative to ela_get_friends() for nodes with
+ * many friends. Application starts with cursor set to 0, and calls the
+ * function repeatedly with the updated cursor until it returns 0.
+ *
+ * @param
+ *      carrier     [in] a handle to the Carrier node instance.
+ * @param
+ *      cursor      [in,out] The position to list from, 0 for the first
+ *                       page. Updated to the position of the next page.
+ * @param
+ *      friends     [out] The buffer to receive the friend information.
+ * @param
+ *      count       [in] The capacity of friends buffer.
+ *
+ * @return
+ *      The number of friends stored in the buffer, 0 if there are no
+ *      more friends. Otherwise, return -1, and a specific error code can
+ *      be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_get_friends_page(ElaCarrier *carrier, uint32_t *cursor,
+                         ElaFriendInfo *friends, int count);
+
 /**
  * \~English
  * Get friend information.
@@ -1094,12 +1236,32 @@ int ela_remove_friend(ElaCarrier *carrier, const char *userid);
  * \~English
  * Send a message to a friend.
  *
- * The message length may not exceed ELA_MAX_APP_MESSAGE_LEN, and message
- * itself should be text-formatted. Larger messages must be split by application
- * and sent as separate messages. Other carrier nodes can reassemble the
- * fragments.
+ * The message length may not exceed ELA_MAX_APP_BULKMSG_LEN, and message
+ * itself should be text-formatted. Messages longer than
+ * ELA_MAX_APP_MESSAGE_LEN are split into fragments which are pipelined
+ * to the friend, and the friend receives the whole message in a single
+ * friend_message callback. Larger messages must be split by application
+ * and sent as separate messages. Friends running an older carrier which
+ * can not reassemble fragments only accept messages up to
+ * ELA_MAX_APP_MESSAGE_LEN, and longer messages to them fail with
+ * ELAERR_TOO_LONG.
  *
  * Message may not be empty or NULL.
+ *
+ * This function is thread-safe. The message is queued and sent out by
+ * the carrier event loop, which is woken up immediately. The function
+ * fails right away with ELAERR_NOT_EXIST if the target is not a friend,
+ * and with ELAERR_FRIEND_OFFLINE if the friend is offline, the message
+ * is not queued in both cases. Once the carrier node is killed, it fails
+ * with ELAERR_NOT_READY.
+ *
+ * Returning 0 means the message is queued, not that it is delivered.
+ * Unlike earlier versions, an error handing the message over to the
+ * friend connection, or the carrier node being killed before the
+ * message goes out, is not returned to the caller. The message is
+ * dropped in that case. Use ela_send_message_with_receipt() to learn
+ * the outcome of each message.
+ *
  * @param
  *      carrier     [in] A handle to the Carrier node instance.
  * @param
@@ -1110,7 +1272,7 @@ int ela_remove_friend(ElaCarrier *carrier, const char *userid);
  *      len         [in] The message length in bytes.
  *
  * @return
- *      0 if the text message successfully sent.
+ *      0 if the text message successfully queued for sending.
  *      Otherwise, return -1, and a specific error code can be
  *      retrieved by calling ela_get_error().
  */
@@ -1118,6 +1280,87 @@ CARRIER_API
 int ela_send_friend_message(ElaCarrier *carrier, const char *to,
                             const void *msg, size_t len);
 
+/**
+ * \~English
+ * Message delivery state reported to ElaFriendMessageReceiptCallback.
+ */
+typedef enum ElaReceiptState {
+    /**
+     * \~English
+     * The message has been received by the friend.
+     */
+    ElaReceipt_ByFriend,
+    /**
+     * \~English
+     * The friend went offline before the message was confirmed.
+     */
+    ElaReceipt_Offline,
+    /**
+     * \~English
+     * The message could not be sent.
+     */
+    ElaReceipt_Error,
+    /**
+     * \~English
+     * The carrier node was killed before the message was confirmed.
+     */
+    ElaReceipt_Cancelled
+} ElaReceiptState;
+
+/**
+ * \~English
+ * An application-defined function that process the message receipt.
+ *
+ * ElaFriendMessageReceiptCallback is the callback function type.
+ *
+ * @param
+ *      carrier     [in] A handle to the Carrier node instance.
+ * @param
+ *      msgid       [in] The message handle returned by
+ *                       ela_send_message_with_receipt().
+ * @param
+ *      state       [in] The delivery state of the message.
+ * @param
+ *      context     [in] The application defined context data.
+ */
+typedef void ElaFriendMessageReceiptCallback(ElaCarrier *carrier,
+                                             int64_t msgid,
+                                             ElaReceiptState state,
+                                             void *context);
+
+/**
+ * \~English
+ * Send a message to a friend, and get notified when the friend received it.
+ *
+ * Same as ela_send_friend_message(), except that a handle is returned
+ * for the message, and the receipt callback is invoked on the carrier
+ * event loop thread exactly once with the delivery state of the message.
+ *
+ * @param
+ *      carrier     [in] A handle to the Carrier node instance.
+ * @param
+ *      to          [in] The target userid.
+ * @param
+ *      msg         [in] The message content defined by application.
+ * @param
+ *      len         [in] The message length in bytes.
+ * @param
+ *      callback    [in] A pointer to ElaFriendMessageReceiptCallback
+ *                       function to receive the message receipt.
+ * @param
+ *      context     [in] The application defined context data.
+ *
+ * @return
+ *      A positive message handle if the message successfully queued for
+ *      sending. Otherwise, return -1, and a specific error code can be
+ *      retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int64_t ela_send_message_with_receipt(ElaCarrier *carrier, const char *to,
+                                      const void *msg, size_t len,
+                                      ElaFriendMessageReceiptCallback *callback,
+                                      void *context);
+
 /**
  * \~English
  * An application-defined function that process the friend invite response.
@@ -1153,6 +1396,11 @@ typedef void ElaFriendInviteResponseCallback(ElaCarrier *carrier,
  * Application can attach the application defined data within the invite
  * request, and the data will send to target friend.
  *
+ * This function is thread-safe. If the request can not be delivered,
+ * the response callback is invoked with the error code as status. If no
+ * response arrives within 120 seconds, the callback is invoked with
+ * ELA_GENERAL_ERROR(ELAERR_TIMEOUT) as status.
+ *
  * @param
  *      carrier     [in] A handle to the Carrier node instance.
  * @param
@@ -1178,6 +1426,42 @@ int ela_invite_friend(ElaCarrier *carrier, const char *to,
                       ElaFriendInviteResponseCallback *callback,
                       void *context);
 
+/**
+ * \~English
+ * Send invite request to a friend with the specified response timeout.
+ *
+ * Same as ela_invite_friend(), except that the response callback is
+ * invoked with ELA_GENERAL_ERROR(ELAERR_TIMEOUT) as status once the
+ * timeout elapsed without any response from the friend. A response
+ * arriving after that is dropped.
+ *
+ * @param
+ *      carrier     [in] A handle to the Carrier node instance.
+ * @param
+ *      to          [in] The target userid.
+ * @param
+ *      data        [in] The application defined data send to target user.
+ * @param
+ *      len         [in] The data length in bytes.
+ * @param
+ *      timeout     [in] The response timeout in milliseconds.
+ * @param
+ *      callback    [in] A pointer to ElaFriendInviteResponseCallback
+ *                       function to receive the invite response.
+ * @param
+ *      context      [in] The application defined context data.
+ *
+ * @return
+ *      0 if the invite request successfully send to the friend.
+ *      Otherwise, return -1, and a specific error code can be
+ *      retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_invite_friend_with_timeout(ElaCarrier *carrier, const char *to,
+                                   const void *data, size_t len, int timeout,
+                                   ElaFriendInviteResponseCallback *callback,
+                                   void *context);
+
 /**
  * \~English
  * Reply the friend invite request.
@@ -1428,6 +1712,18 @@ int ela_reply_friend_invite(ElaCarrier *carrier, const char *to,
  */
 #define ELAERR_FRIEND_OFFLINE                       0x22
 
+/**
+ * \~English
+ * The operation timed out.
+ */
+#define ELAERR_TIMEOUT                              0x23
+
+/**
+ * \~English
+ * The operation was cancelled because the carrier node was killed.
+ */
+#define ELAERR_CANCELLED                            0x24
+
 /**
  * \~English
  * Unknown error.
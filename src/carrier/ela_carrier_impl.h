@@ -24,6 +24,8 @@
 #define __ELA_CARRIER_IMPL_H__
 
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <crypto.h>
 #include <linkedhashtable.h>
@@ -48,6 +50,17 @@ typedef struct BootstrapNodeBuf {
     uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
 } BootstrapNodeBuf;
 
+typedef struct BootstrapCandidate {
+    BootstrapNodeBuf node;
+    int rtt;                // connect rtt in ms, -1 if not measured.
+    int failures;           // consecutive failed probes.
+    int64_t last_ok;        // unix time last probed ok or seen connected.
+    bool configured;        // from ElaOptions, never evicted from cache.
+    int flags;              // BOOTSTRAP_NODE_* the node serves on the port.
+} BootstrapCandidate;
+
+typedef struct BootstrapProbe BootstrapProbe;
+
 typedef struct Preferences {
     char *data_location;
     bool udp_enabled;
@@ -66,6 +79,74 @@ typedef struct FriendEvent {
     ElaFriendInfo fi;
 } FriendEvent;
 
+/*
+ * Encoded packets queued by the application threads, and sent out by
+ * the carrier loop which is the only thread touching the DHT.
+ */
+typedef struct OutgoingMessage {
+    list_entry_t le;
+    uint32_t friend_number;
+    int64_t msgid;          // receipt handle, 0 if no receipt requested.
+    int64_t tid;            // invite transaction, 0 if not an invite.
+    void *callback;
+    void *context;
+    size_t len;
+    uint8_t data[1];
+} OutgoingMessage;
+
+typedef struct PendingReceipt {
+    hash_entry_t he;
+    int64_t key;            // friend number << 32 | DHT message id.
+    int64_t msgid;
+    uint32_t friend_number;
+    void *callback;
+    void *context;
+} PendingReceipt;
+
+/*
+ * Reassembly buffer of a large friend message received in fragments.
+ */
+typedef struct BulkMsgKey {
+    int64_t tid;
+    uint32_t friend_number;
+} BulkMsgKey;
+
+typedef struct BulkMsg {
+    hash_entry_t he;
+    BulkMsgKey key;         // tid is only unique per sending friend.
+    time_t expire_time;
+    size_t totalsz;
+    size_t received;
+    uint8_t data[1];
+} BulkMsg;
+
+typedef struct PersistenceVerifier PersistenceVerifier;
+
+/*
+ * Startup phase timestamps, monotonic time in microseconds.
+ */
+typedef struct StartupStats {
+    int64_t begin;          // ela_new() called.
+    int64_t loaded;         // persistence data and change log loaded.
+    int64_t dht_created;    // DHT instance created, changes replayed.
+    int64_t friends_loaded; // self info and friend list loaded.
+    int64_t created;        // ela_new() returned.
+    int64_t verified;       // deferred verification done, 0 if not deferred.
+    int64_t ready;          // ready callback invoked.
+} StartupStats;
+
+typedef struct TransactionDeadline {
+    int64_t expire_time;    // monotonic time in milliseconds.
+    int64_t tid;
+} TransactionDeadline;
+
+typedef struct TransactionDeadlines {
+    pthread_mutex_t lock;
+    TransactionDeadline *heap;  // min-heap ordered by expire_time.
+    int size;
+    int capacity;
+} TransactionDeadlines;
+
 struct ElaCarrier {
     pthread_mutex_t ext_mutex;
     void *session;  // reserved for session.
@@ -90,24 +171,67 @@ struct ElaCarrier {
 
     list_t *friend_events; // for friend_added/removed.
     hashtable_t *friends;
+    hashtable_t *friend_ids;
+    hashtable_t *friend_keys;
+    uint32_t friend_number_end; // one past the largest friend number.
 
     hashtable_t *tcallbacks;
+    TransactionDeadlines tdeadlines;
     hashtable_t *thistory;
 
+    struct {
+        pthread_mutex_t lock;
+        int fd;                 // append-only change log, -1 if not open.
+        size_t size;            // bytes of change records since last snapshot.
+        time_t last_compact;
+        int frozen;             // data file not to be stored, unverified.
+        uint8_t *pending;       // records failed to log while frozen.
+        size_t pending_len;
+    } changes;
+
+    PersistenceVerifier *verifier;  // pending deferred verification.
+    int persistence_failed;         // deferred verification failed.
+
+    struct {
+        BootstrapCandidate *candidates; // ranked, best first.
+        int size;
+        int next;               // next candidate to hand to DHT.
+        int64_t last_attempt;   // monotonic time in ms.
+        int interval;           // ms before next bootstrap round.
+        BootstrapProbe *probe;  // pending rtt probe.
+        time_t last_probe;
+        time_t last_learn;      // last harvest of connected nodes.
+    } bootstrap;
+    StartupStats startup;
+
+    hashtable_t *bulkmsgs;
+
+    list_t *send_queue;
+    pthread_mutex_t send_lock;  // is_ready check and enqueue vs. cancel.
+    hashtable_t *receipts;
+    int64_t last_msgid;
+    int wakeup_fd[2];   // eventfd or pipe, -1 if not available.
+
     pthread_t main_thread;
 
     int running;
+    int embedded; // driven by ela_process() instead of ela_run().
     int quit;
 };
 
 typedef void (*friend_invite_callback)(ElaCarrier *, const char *,
                                        const char *, size_t, void *);
+typedef void (*friend_message_callback)(ElaCarrier *, const char *,
+                                        const char *, size_t, void *);
 typedef struct SessionExtension {
     ElaCarrier              *carrier;
 
     friend_invite_callback  friend_invite_cb;
     void                    *friend_invite_context;
 
+    friend_message_callback friend_message_cb;
+    void                    *friend_message_context;
+
     uint8_t                 reserved[1];
 } SessionExtension;
 
@@ -119,6 +243,7 @@ typedef struct FriendLabelItem {
 typedef struct TransactedCallback {
     hash_entry_t he;
     int64_t tid;
+    char userid[ELA_MAX_ID_LEN + 1];
     void *callback_func;
     void *callback_context;
 } TransactedCallback;
@@ -128,6 +128,8 @@ const ErrorDesc error_codes[] = {
     { ELAERR_ADD_SELF,                    "Try add myself as friend"},
     { ELAERR_BAD_ADDRESS,                 "Bad carrier node address"},
     { ELAERR_FRIEND_OFFLINE,              "Friend is being offline" },
+    { ELAERR_TIMEOUT,                     "Operation timeout"       },
+    { ELAERR_CANCELLED,                   "Operation cancelled"     },
     { ELAERR_UNKNOWN,                     "Unknown error"           }
 };
 
@@ -22,8 +22,10 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <vlog.h>
 #include <bitset.h>
@@ -49,6 +51,7 @@ struct ElaCPUserInfo {
     const char *gender;
     const char *email;
     const char *region;
+    uint32_t caps;
 };
 
 struct ElaCPFriendReq {
@@ -60,6 +63,8 @@ struct ElaCPFriendReq {
 
 struct ElaCPFriendMsg {
     ElaCP headr;
+    int64_t tid;
+    size_t totalsz;
     size_t len;
     const uint8_t *msg;
 };
@@ -115,9 +120,8 @@ struct elacp_table_t {
     } u;
 };
 
-ElaCP *elacp_create(uint8_t type, const char *ext_name)
+static size_t elacp_packet_size(uint8_t type)
 {
-    ElaCP *cp;
     size_t len;
 
     switch(type) {
@@ -138,9 +142,21 @@ ElaCP *elacp_create(uint8_t type, const char *ext_name)
         break;
     default:
         assert(0);
-        return NULL;
+        return 0;
     }
 
+    return len;
+}
+
+ElaCP *elacp_create(uint8_t type, const char *ext_name)
+{
+    ElaCP *cp;
+    size_t len;
+
+    len = elacp_packet_size(type);
+    if (!len)
+        return NULL;
+
     cp = (ElaCP *)calloc(1, len);
     if (!cp)
         return NULL;
@@ -151,6 +167,28 @@ ElaCP *elacp_create(uint8_t type, const char *ext_name)
     return cp;
 }
 
+ElaCP *elacp_init(ElaCPStorage *storage, uint8_t type, const char *ext_name)
+{
+    ElaCP *cp;
+    size_t len;
+
+    assert(storage);
+
+    len = elacp_packet_size(type);
+    if (!len)
+        return NULL;
+
+    assert(len <= sizeof(ElaCPStorage));
+
+    memset(storage, 0, len);
+
+    cp = (ElaCP *)storage;
+    cp->type = type;
+    cp->ext  = ext_name;
+
+    return cp;
+}
+
 void elacp_free(ElaCP *cp)
 {
     if (cp)
@@ -317,6 +355,26 @@ bool elacp_get_has_avatar(ElaCP *cp)
     return has_avatar;
 }
 
+uint32_t elacp_get_caps(ElaCP *cp)
+{
+    struct elacp_packet_t pkt;
+    uint32_t caps = 0;
+
+    assert(cp);
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case ELACP_TYPE_USERINFO:
+        caps = pktinfo->caps;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    return caps;
+}
+
 const char *elacp_get_hello(ElaCP *cp)
 {
     struct elacp_packet_t pkt;
@@ -346,6 +404,9 @@ int64_t elacp_get_tid(ElaCP *cp)
     pkt.u.cp = cp;
 
     switch(cp->type) {
+    case ELACP_TYPE_MESSAGE:
+        tid = pktfmsg->tid;
+        break;
     case ELACP_TYPE_INVITE_REQUEST:
         tid = pktireq->tid;
         break;
@@ -432,6 +493,26 @@ size_t elacp_get_raw_data_length(ElaCP *cp)
     return len;
 }
 
+size_t elacp_get_total_size(ElaCP *cp)
+{
+    struct elacp_packet_t pkt;
+    size_t totalsz = 0;
+
+    assert(cp);
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case ELACP_TYPE_MESSAGE:
+        totalsz = pktfmsg->totalsz;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    return totalsz;
+}
+
 const char *elacp_get_reason(ElaCP *cp)
 {
     struct elacp_packet_t pkt;
@@ -589,6 +670,23 @@ void elacp_set_has_avatar(ElaCP *cp, int has_avatar)
     }
 }
 
+void elacp_set_caps(ElaCP *cp, uint32_t caps)
+{
+    struct elacp_packet_t pkt;
+
+    assert(cp);
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case ELACP_TYPE_USERINFO:
+        pktinfo->caps = caps;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
 void elacp_set_hello(ElaCP *cp, const char *hello)
 {
     struct elacp_packet_t pkt;
@@ -618,6 +716,9 @@ void elacp_set_tid(ElaCP *cp, int64_t *tid)
     pkt.u.cp = cp;
 
     switch(cp->type) {
+    case ELACP_TYPE_MESSAGE:
+        pktfmsg->tid = *tid;
+        break;
     case ELACP_TYPE_INVITE_REQUEST:
         pktireq->tid = *tid;
         break;
@@ -676,6 +777,24 @@ void elacp_set_raw_data(ElaCP *cp, const void *data, size_t len)
     }
 }
 
+void elacp_set_total_size(ElaCP *cp, size_t totalsz)
+{
+    struct elacp_packet_t pkt;
+
+    assert(cp);
+
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case ELACP_TYPE_MESSAGE:
+        pktfmsg->totalsz = totalsz;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
 void elacp_set_reason(ElaCP *cp, const char *reason)
 {
     struct elacp_packet_t pkt;
@@ -695,97 +814,99 @@ void elacp_set_reason(ElaCP *cp, const char *reason)
     }
 }
 
-uint8_t *elacp_encode(ElaCP *cp, size_t *encoded_len)
+static int elacp_build(flatcc_builder_t *builder, ElaCP *cp)
 {
     struct elacp_packet_t pkt;
-    flatcc_builder_t builder;
     flatcc_builder_ref_t str;
     flatbuffers_uint8_vec_ref_t vec;
     flatbuffers_ref_t ref;
     elacp_anybody_union_ref_t body;
-    uint8_t *encoded_data;
 
+    assert(builder);
     assert(cp);
-    assert(encoded_len);
 
     pkt.u.cp = cp;
 
-    flatcc_builder_init(&builder);
-
     switch(cp->type) {
     case ELACP_TYPE_USERINFO:
-        elacp_userinfo_start(&builder);
+        elacp_userinfo_start(builder);
         if (pktinfo->name) {
-            str = flatcc_builder_create_string_str(&builder, pktinfo->name);
-            elacp_userinfo_name_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, pktinfo->name);
+            elacp_userinfo_name_add(builder, str);
         }
-        str = flatcc_builder_create_string_str(&builder, pktinfo->descr);
-        elacp_userinfo_descr_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->gender);
-        elacp_userinfo_gender_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->phone);
-        elacp_userinfo_phone_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->email);
-        elacp_userinfo_email_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->region);
-        elacp_userinfo_region_add(&builder, str);
-        elacp_userinfo_avatar_add(&builder, pktinfo->has_avatar);
-        ref = elacp_userinfo_end(&builder);
+        str = flatcc_builder_create_string_str(builder, pktinfo->descr);
+        elacp_userinfo_descr_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->gender);
+        elacp_userinfo_gender_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->phone);
+        elacp_userinfo_phone_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->email);
+        elacp_userinfo_email_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->region);
+        elacp_userinfo_region_add(builder, str);
+        elacp_userinfo_avatar_add(builder, pktinfo->has_avatar);
+        if (pktinfo->caps)
+            elacp_userinfo_caps_add(builder, pktinfo->caps);
+        ref = elacp_userinfo_end(builder);
         break;
 
     case ELACP_TYPE_FRIEND_REQUEST:
-        elacp_friendreq_start(&builder);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->name);
-        elacp_friendreq_name_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->descr);
-        elacp_friendreq_descr_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->hello);
-        elacp_friendreq_hello_add(&builder, str);
-        ref = elacp_friendreq_end(&builder);
+        elacp_friendreq_start(builder);
+        str = flatcc_builder_create_string_str(builder, pktfreq->name);
+        elacp_friendreq_name_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktfreq->descr);
+        elacp_friendreq_descr_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktfreq->hello);
+        elacp_friendreq_hello_add(builder, str);
+        ref = elacp_friendreq_end(builder);
         break;
 
     case ELACP_TYPE_MESSAGE:
-        elacp_friendmsg_start(&builder);
+        elacp_friendmsg_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            elacp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            elacp_friendmsg_ext_add(builder, str);
         }
 
-        vec = flatbuffers_uint8_vec_create(&builder, pktfmsg->msg, pktfmsg->len);
-        elacp_friendmsg_msg_add(&builder, vec);
-        ref = elacp_friendmsg_end(&builder);
+        vec = flatbuffers_uint8_vec_create(builder, pktfmsg->msg, pktfmsg->len);
+        elacp_friendmsg_msg_add(builder, vec);
+        if (pktfmsg->tid) {
+            elacp_friendmsg_tid_add(builder, pktfmsg->tid);
+            elacp_friendmsg_totalsz_add(builder, (uint32_t)pktfmsg->totalsz);
+        }
+        ref = elacp_friendmsg_end(builder);
         break;
 
     case ELACP_TYPE_INVITE_REQUEST:
-        elacp_invitereq_start(&builder);
+        elacp_invitereq_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            elacp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            elacp_friendmsg_ext_add(builder, str);
         }
-        elacp_invitereq_tid_add(&builder, pktireq->tid);
-        vec = flatbuffers_uint8_vec_create(&builder, pktireq->data, pktireq->len);
-        elacp_invitereq_data_add(&builder, vec);
-        ref = elacp_invitereq_end(&builder);
+        elacp_invitereq_tid_add(builder, pktireq->tid);
+        vec = flatbuffers_uint8_vec_create(builder, pktireq->data, pktireq->len);
+        elacp_invitereq_data_add(builder, vec);
+        ref = elacp_invitereq_end(builder);
         break;
 
     case ELACP_TYPE_INVITE_RESPONSE:
-        elacp_invitersp_start(&builder);
+        elacp_invitersp_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            elacp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            elacp_friendmsg_ext_add(builder, str);
         }
-        elacp_invitersp_tid_add(&builder, pktirsp->tid);
-        elacp_invitersp_status_add(&builder, pktirsp->status);
+        elacp_invitersp_tid_add(builder, pktirsp->tid);
+        elacp_invitersp_status_add(builder, pktirsp->status);
         if (pktirsp->status) {
-            str = flatcc_builder_create_string_str(&builder, pktirsp->reason);
-            elacp_invitersp_reason_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, pktirsp->reason);
+            elacp_invitersp_reason_add(builder, str);
         }
 
         if (pktirsp->data) {
-            vec = flatbuffers_uint8_vec_create(&builder, pktirsp->data, pktirsp->len);
-            elacp_invitersp_data_add(&builder, vec);
+            vec = flatbuffers_uint8_vec_create(builder, pktirsp->data, pktirsp->len);
+            elacp_invitersp_data_add(builder, vec);
         }
-        ref = elacp_invitersp_end(&builder);
+        ref = elacp_invitersp_end(builder);
         break;
 
     default:
@@ -794,10 +915,8 @@ uint8_t *elacp_encode(ElaCP *cp, size_t *encoded_len)
         break;
     }
 
-    if (!ref) {
-        flatcc_builder_clear(&builder);
-        return NULL;
-    }
+    if (!ref)
+        return -1;
 
     switch(cp->type) {
     case ELACP_TYPE_USERINFO:
@@ -817,13 +936,29 @@ uint8_t *elacp_encode(ElaCP *cp, size_t *encoded_len)
         break;
     default:
         assert(0);
-        return NULL;
+        return -1;
     }
 
-    elacp_packet_start_as_root(&builder);
-    elacp_packet_type_add(&builder, cp->type);
-    elacp_packet_body_add(&builder, body);
-    if (!elacp_packet_end_as_root(&builder)) {
+    elacp_packet_start_as_root(builder);
+    elacp_packet_type_add(builder, cp->type);
+    elacp_packet_body_add(builder, body);
+    if (!elacp_packet_end_as_root(builder))
+        return -1;
+
+    return 0;
+}
+
+uint8_t *elacp_encode(ElaCP *cp, size_t *encoded_len)
+{
+    flatcc_builder_t builder;
+    uint8_t *encoded_data;
+
+    assert(cp);
+    assert(encoded_len);
+
+    flatcc_builder_init(&builder);
+
+    if (elacp_build(&builder, cp) < 0) {
         flatcc_builder_clear(&builder);
         return NULL;
     }
@@ -834,21 +969,96 @@ uint8_t *elacp_encode(ElaCP *cp, size_t *encoded_len)
     return encoded_data;
 }
 
-ElaCP *elacp_decode(const uint8_t *data, size_t len)
+static pthread_key_t builder_key;
+static pthread_once_t builder_key_once = PTHREAD_ONCE_INIT;
+
+static void builder_destroy(void *p)
+{
+    flatcc_builder_t *builder = (flatcc_builder_t *)p;
+
+    flatcc_builder_clear(builder);
+    free(builder);
+}
+
+static void builder_key_create(void)
+{
+    pthread_key_create(&builder_key, builder_destroy);
+}
+
+/*
+ * Each thread keeps its own builder, which is reset rather than cleared
+ * after use, so the internal buffers are reused by the next encoding.
+ */
+static flatcc_builder_t *get_thread_builder(void)
+{
+    flatcc_builder_t *builder;
+
+    pthread_once(&builder_key_once, builder_key_create);
+
+    builder = (flatcc_builder_t *)pthread_getspecific(builder_key);
+    if (builder) {
+        flatcc_builder_reset(builder);
+        return builder;
+    }
+
+    builder = (flatcc_builder_t *)malloc(sizeof(flatcc_builder_t));
+    if (!builder)
+        return NULL;
+
+    flatcc_builder_init(builder);
+
+    if (pthread_setspecific(builder_key, builder) != 0) {
+        builder_destroy(builder);
+        return NULL;
+    }
+
+    return builder;
+}
+
+int elacp_encode_to(ElaCP *cp, uint8_t *buf, size_t *len)
+{
+    flatcc_builder_t *builder;
+    size_t size;
+
+    assert(cp);
+    assert(buf);
+    assert(len);
+
+    builder = get_thread_builder();
+    if (!builder) {
+        *len = 0;
+        return -1;
+    }
+
+    if (elacp_build(builder, cp) < 0) {
+        *len = 0;
+        return -1;
+    }
+
+    size = flatcc_builder_get_buffer_size(builder);
+    if (size > *len) {
+        *len = size;
+        return -1;
+    }
+
+    flatcc_builder_copy_buffer(builder, buf, size);
+    *len = size;
+
+    return 0;
+}
+
+
+static elacp_packet_table_t elacp_decode_header(const uint8_t *data,
+                                                uint8_t *type)
 {
-    ElaCP *cp;
-    struct elacp_packet_t pkt;
-    struct elacp_table_t  tbl;
     elacp_packet_table_t packet;
-    flatbuffers_uint8_vec_t vec;
-    uint8_t type;
 
     packet = elacp_packet_as_root(data);
     if (!packet)
         return NULL;
 
-    type = elacp_packet_type(packet);
-    switch(type) {
+    *type = elacp_packet_type(packet);
+    switch(*type) {
     case ELACP_TYPE_USERINFO:
     case ELACP_TYPE_FRIEND_REQUEST:
     case ELACP_TYPE_MESSAGE:
@@ -860,19 +1070,21 @@ ElaCP *elacp_decode(const uint8_t *data, size_t len)
         return NULL;
     }
 
-    cp = elacp_create(type, NULL);
-    if (!cp) {
-        //TODO: clean resource for 'packet'; (how ?)
+    if (!elacp_packet_body_is_present(packet))
         return NULL;
-    }
-    pkt.u.cp = cp;
 
-    if (!elacp_packet_body_is_present(packet)) {
-        elacp_free(cp);
-        return NULL;
-    }
+    return packet;
+}
 
-    switch(type) {
+static void elacp_decode_body(elacp_packet_table_t packet, ElaCP *cp)
+{
+    struct elacp_packet_t pkt;
+    struct elacp_table_t  tbl;
+    flatbuffers_uint8_vec_t vec;
+
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
     case ELACP_TYPE_USERINFO:
         tblinfo = elacp_packet_body(packet);
         if (elacp_userinfo_name_is_present(tblinfo))
@@ -883,6 +1095,7 @@ ElaCP *elacp_decode(const uint8_t *data, size_t len)
         pktinfo->email  = elacp_userinfo_email(tblinfo);
         pktinfo->region = elacp_userinfo_region(tblinfo);
         pktinfo->has_avatar = elacp_userinfo_avatar(tblinfo);
+        pktinfo->caps = elacp_userinfo_caps(tblinfo);
         break;
 
     case ELACP_TYPE_FRIEND_REQUEST:
@@ -896,6 +1109,8 @@ ElaCP *elacp_decode(const uint8_t *data, size_t len)
         tblfmsg = elacp_packet_body(packet);
         pktfmsg->msg = vec = elacp_friendmsg_msg(tblfmsg);
         pktfmsg->len = flatbuffers_uint8_vec_len(vec);
+        pktfmsg->tid = elacp_friendmsg_tid(tblfmsg);
+        pktfmsg->totalsz = elacp_friendmsg_totalsz(tblfmsg);
         if (elacp_friendmsg_ext_is_present(tblfmsg))
             cp->ext = elacp_friendmsg_ext(tblfmsg);
         break;
@@ -928,6 +1143,47 @@ ElaCP *elacp_decode(const uint8_t *data, size_t len)
         assert(0);
         break;
     }
+}
+
+ElaCP *elacp_decode(const uint8_t *data, size_t len)
+{
+    ElaCP *cp;
+    elacp_packet_table_t packet;
+    uint8_t type;
+
+    packet = elacp_decode_header(data, &type);
+    if (!packet)
+        return NULL;
+
+    cp = elacp_create(type, NULL);
+    if (!cp) {
+        //TODO: clean resource for 'packet'; (how ?)
+        return NULL;
+    }
+
+    elacp_decode_body(packet, cp);
+
+    return cp;
+}
+
+ElaCP *elacp_decode_view(const uint8_t *data, size_t len,
+                         ElaCPStorage *storage)
+{
+    ElaCP *cp;
+    elacp_packet_table_t packet;
+    uint8_t type;
+
+    assert(storage);
+
+    packet = elacp_decode_header(data, &type);
+    if (!packet)
+        return NULL;
+
+    cp = elacp_init(storage, type, NULL);
+    if (!cp)
+        return NULL;
+
+    elacp_decode_body(packet, cp);
 
     return cp;
 }
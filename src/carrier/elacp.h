@@ -29,6 +29,18 @@
 
 typedef struct ElaCP ElaCP;
 
+#define ELACP_STORAGE_SIZE                    96
+
+/*
+ * Caller provided storage for an ElaCP packet, normally on the stack.
+ * Packets living in the storage must not be freed by elacp_free().
+ */
+typedef union ElaCPStorage {
+    int64_t align;
+    void *ptr;
+    uint8_t buf[ELACP_STORAGE_SIZE];
+} ElaCPStorage;
+
 /* WMCP types */
 #define ELACP_TYPE_MIN                        1
 
@@ -43,8 +55,15 @@ typedef struct ElaCP ElaCP;
 
 #define ELACP_TYPE_MAX                        95
 
+/* Capabilities advertised in userinfo */
+#define ELACP_CAP_BULKMSG                     0x01
+
+#define ELACP_CAPS                            (ELACP_CAP_BULKMSG)
+
 ElaCP *elacp_create(uint8_t type, const char *ext_name);
 
+ElaCP *elacp_init(ElaCPStorage *storage, uint8_t type, const char *ext_name);
+
 void elacp_free(ElaCP *cp);
 
 int elacp_get_type(ElaCP *cp);
@@ -57,6 +76,8 @@ const char *elacp_get_descr(ElaCP *cp);
 
 bool elacp_get_has_avatar(ElaCP *cp);
 
+uint32_t elacp_get_caps(ElaCP *cp);
+
 const char *elacp_get_gender(ElaCP *cp);
 
 const char *elacp_get_phone(ElaCP *cp);
@@ -75,6 +96,8 @@ const void *elacp_get_raw_data(ElaCP *cp);
 
 size_t elacp_get_raw_data_length(ElaCP *cp);
 
+size_t elacp_get_total_size(ElaCP *cp);
+
 const char *elacp_get_reason(ElaCP *cp);
 
 void elacp_set_name(ElaCP *cp, const char *name);
@@ -83,6 +106,8 @@ void elacp_set_descr(ElaCP *cp, const char *descr);
 
 void elacp_set_has_avatar(ElaCP *cp, int has_avatar);
 
+void elacp_set_caps(ElaCP *cp, uint32_t caps);
+
 void elacp_set_gender(ElaCP *cp, const char *gender);
 
 void elacp_set_phone(ElaCP *cp, const char *phone);
@@ -99,10 +124,26 @@ void elacp_set_status(ElaCP *cp, int status);
 
 void elacp_set_raw_data(ElaCP *cp, const void *data, size_t len);
 
+void elacp_set_total_size(ElaCP *cp, size_t totalsz);
+
 void elacp_set_reason(ElaCP *cp, const char *reason);
 
 uint8_t *elacp_encode(ElaCP *cp, size_t *len);
 
+/*
+ * Encode into the caller's buffer with a per-thread builder. On input *len
+ * is the buffer size, and on return the encoded length, or the required
+ * length if the buffer is too small (0 if encoding failed).
+ */
+int elacp_encode_to(ElaCP *cp, uint8_t *buf, size_t *len);
+
 ElaCP *elacp_decode(const uint8_t *buf, size_t len);
 
+/*
+ * Decode into the caller's storage. The packet references the input
+ * buffer, which must outlive it.
+ */
+ElaCP *elacp_decode_view(const uint8_t *buf, size_t len,
+                         ElaCPStorage *storage);
+
 #endif /* __ELACP_H__ */
@@ -25,14 +25,20 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 #include <linkedhashtable.h>
 
 #include "ela_carrier.h"
+#include "dht.h"
 
 typedef struct FriendInfo {
     hash_entry_t he;
+    hash_entry_t he_id;     // entry in userid index.
+    hash_entry_t he_key;    // entry in public key index.
 
     uint32_t friend_number;
+    uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
+    uint32_t caps;          // ELACP_CAP_* advertised by the friend.
     ElaFriendInfo info;
 } FriendInfo;
 
@@ -47,9 +53,9 @@ int friend_number_compare(const void *key1, size_t len1,
 }
 
 static inline
-hashtable_t *friends_create(void)
+hashtable_t *friends_create(int capacity)
 {
-    return hashtable_create(32, 1, NULL, friend_number_compare);
+    return hashtable_create(capacity, 1, NULL, friend_number_compare);
 }
 
 static inline
@@ -121,4 +127,93 @@ int friends_iterator_has_next(hashtable_iterator_t *iterator)
     return hashtable_iterator_has_next(iterator);
 }
 
+/*
+ * Secondary indexes of the friends, by userid string and by public key.
+ */
+static
+int friend_index_compare(const void *key1, size_t len1,
+                         const void *key2, size_t len2)
+{
+    assert(key1 && key2);
+
+    if (len1 != len2)
+        return 1;
+
+    return memcmp(key1, key2, len1);
+}
+
+static inline
+hashtable_t *friend_ids_create(int capacity)
+{
+    return hashtable_create(capacity, 1, NULL, friend_index_compare);
+}
+
+static inline
+void friend_ids_put(hashtable_t *ids, FriendInfo *fi)
+{
+    assert(ids);
+    assert(fi);
+
+    fi->he_id.data = fi;
+    fi->he_id.key = fi->info.user_info.userid;
+    fi->he_id.keylen = strlen(fi->info.user_info.userid);
+
+    hashtable_put(ids, &fi->he_id);
+}
+
+static inline
+FriendInfo *friend_ids_get(hashtable_t *ids, const char *userid)
+{
+    assert(ids);
+    assert(userid);
+
+    return (FriendInfo *)hashtable_get(ids, userid, strlen(userid));
+}
+
+static inline
+FriendInfo *friend_ids_remove(hashtable_t *ids, const char *userid)
+{
+    assert(ids);
+    assert(userid);
+
+    return (FriendInfo *)hashtable_remove(ids, userid, strlen(userid));
+}
+
+static inline
+hashtable_t *friend_keys_create(int capacity)
+{
+    return hashtable_create(capacity, 1, NULL, friend_index_compare);
+}
+
+static inline
+void friend_keys_put(hashtable_t *keys, FriendInfo *fi)
+{
+    assert(keys);
+    assert(fi);
+
+    fi->he_key.data = fi;
+    fi->he_key.key = fi->public_key;
+    fi->he_key.keylen = DHT_PUBLIC_KEY_SIZE;
+
+    hashtable_put(keys, &fi->he_key);
+}
+
+static inline
+FriendInfo *friend_keys_get(hashtable_t *keys, const uint8_t *public_key)
+{
+    assert(keys);
+    assert(public_key);
+
+    return (FriendInfo *)hashtable_get(keys, public_key, DHT_PUBLIC_KEY_SIZE);
+}
+
+static inline
+FriendInfo *friend_keys_remove(hashtable_t *keys, const uint8_t *public_key)
+{
+    assert(keys);
+    assert(public_key);
+
+    return (FriendInfo *)hashtable_remove(keys, public_key, DHT_PUBLIC_KEY_SIZE);
+}
+
 #endif /* __FRIENDINFOS_H__ */
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RECEIPTS_H__
+#define __RECEIPTS_H__
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <linkedhashtable.h>
+
+#include "ela_carrier_impl.h"
+#include "tcallbacks.h"
+
+static inline
+int64_t receipt_key(uint32_t friend_number, uint32_t message_id)
+{
+    return (int64_t)(((uint64_t)friend_number << 32) | message_id);
+}
+
+static inline
+hashtable_t *receipts_create(int capacity)
+{
+    return hashtable_create(capacity, 1, cid_hash_code, cid_compare);
+}
+
+static inline
+void receipts_put(hashtable_t *receipts, PendingReceipt *receipt)
+{
+    assert(receipts && receipt);
+    receipt->he.data = receipt;
+    receipt->he.key = &receipt->key;
+    receipt->he.keylen = sizeof(receipt->key);
+    hashtable_put(receipts, &receipt->he);
+}
+
+static inline
+PendingReceipt *receipts_remove(hashtable_t *receipts, int64_t key)
+{
+    assert(receipts);
+    return (PendingReceipt *)hashtable_remove(receipts, &key, sizeof(key));
+}
+
+static inline
+hashtable_iterator_t *receipts_iterate(hashtable_t *receipts,
+                                       hashtable_iterator_t *iterator)
+{
+    assert(receipts && iterator);
+    return hashtable_iterate(receipts, iterator);
+}
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+static inline
+int receipts_iterator_next(hashtable_iterator_t *iterator,
+                           PendingReceipt **receipt)
+{
+    return hashtable_iterator_next(iterator, NULL, NULL, (void **)receipt);
+}
+
+static inline
+int receipts_iterator_has_next(hashtable_iterator_t *iterator)
+{
+    return hashtable_iterator_has_next(iterator);
+}
+
+// return 1 on success, 0 nothing removed, -1 on modified conflict or error.
+static inline
+int receipts_iterator_remove(hashtable_iterator_t *iterator)
+{
+    return hashtable_iterator_remove(iterator);
+}
+
+static inline
+void receipts_clear(hashtable_t *receipts)
+{
+    assert(receipts);
+    hashtable_clear(receipts);
+}
+
+#endif /* __RECEIPTS_H__ */
@@ -24,7 +24,9 @@
 #define __TCALLBACKS_H__
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <linkedhashtable.h>
 
@@ -108,4 +110,146 @@ void transacted_callbacks_clear(hashtable_t *callbacks)
     hashtable_clear(callbacks);
 }
 
+/*
+ * Deadlines of transacted callbacks, kept in a min-heap ordered by expire
+ * time. Entries are not removed when a transaction completes; an expired
+ * entry whose tid is no longer in the callbacks table is simply dropped.
+ */
+static inline
+int transaction_deadlines_init(TransactionDeadlines *tdl)
+{
+    assert(tdl);
+
+    tdl->heap = NULL;
+    tdl->size = 0;
+    tdl->capacity = 0;
+
+    return pthread_mutex_init(&tdl->lock, NULL);
+}
+
+static inline
+void transaction_deadlines_destroy(TransactionDeadlines *tdl)
+{
+    assert(tdl);
+
+    if (tdl->heap)
+        free(tdl->heap);
+
+    tdl->heap = NULL;
+    tdl->size = 0;
+    tdl->capacity = 0;
+
+    pthread_mutex_destroy(&tdl->lock);
+}
+
+// return 0 on success, -1 on out of memory.
+static inline
+int transaction_deadlines_push(TransactionDeadlines *tdl, int64_t tid,
+                               int64_t expire_time)
+{
+    TransactionDeadline *heap;
+    int i;
+
+    assert(tdl);
+
+    pthread_mutex_lock(&tdl->lock);
+
+    heap = tdl->heap;
+
+    if (tdl->size == tdl->capacity) {
+        int capacity = tdl->capacity ? tdl->capacity * 2 : 32;
+
+        heap = (TransactionDeadline *)realloc(tdl->heap,
+                                    sizeof(TransactionDeadline) * capacity);
+        if (!heap) {
+            pthread_mutex_unlock(&tdl->lock);
+            return -1;
+        }
+
+        tdl->heap = heap;
+        tdl->capacity = capacity;
+    }
+
+    i = tdl->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (heap[parent].expire_time <= expire_time)
+            break;
+
+        heap[i] = heap[parent];
+        i = parent;
+    }
+
+    heap[i].expire_time = expire_time;
+    heap[i].tid = tid;
+
+    pthread_mutex_unlock(&tdl->lock);
+    return 0;
+}
+
+// return 1 with the earliest expire time, 0 if there are no deadlines.
+static inline
+int transaction_deadlines_next(TransactionDeadlines *tdl, int64_t *expire_time)
+{
+    int rc = 0;
+
+    assert(tdl && expire_time);
+
+    pthread_mutex_lock(&tdl->lock);
+
+    if (tdl->size > 0) {
+        *expire_time = tdl->heap[0].expire_time;
+        rc = 1;
+    }
+
+    pthread_mutex_unlock(&tdl->lock);
+    return rc;
+}
+
+// return 1 if an expired deadline was popped, 0 if nothing has expired.
+static inline
+int transaction_deadlines_pop_expired(TransactionDeadlines *tdl, int64_t now,
+                                      int64_t *tid)
+{
+    TransactionDeadline *heap;
+    TransactionDeadline last;
+    int i;
+
+    assert(tdl && tid);
+
+    pthread_mutex_lock(&tdl->lock);
+
+    heap = tdl->heap;
+
+    if (tdl->size == 0 || heap[0].expire_time > now) {
+        pthread_mutex_unlock(&tdl->lock);
+        return 0;
+    }
+
+    *tid = heap[0].tid;
+
+    last = heap[--tdl->size];
+    i = 0;
+    while (i * 2 + 1 < tdl->size) {
+        int child = i * 2 + 1;
+
+        if (child + 1 < tdl->size &&
+                heap[child + 1].expire_time < heap[child].expire_time)
+            child++;
+
+        if (last.expire_time <= heap[child].expire_time)
+            break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    if (tdl->size > 0)
+        heap[i] = last;
+
+    pthread_mutex_unlock(&tdl->lock);
+    return 1;
+}
+
 #endif /* __TCALLBACKS_H__ */
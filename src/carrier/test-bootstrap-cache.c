@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_IO_H
+#include <io.h>
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <posix_helper.h>
+#endif
+
+#include "bootstrap_cache.h"
+
+static int failed = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                   \
+                    __FILE__, __LINE__, #cond);                             \
+            failed++;                                                       \
+        }                                                                   \
+    } while (0)
+
+static const char *data_location = ".";
+
+static void make_node(BootstrapNodeBuf *node, int id)
+{
+    memset(node, 0, sizeof(*node));
+    sprintf(node->ipv4, "10.0.0.%d", id);
+    node->port = (uint16_t)(33440 + id);
+    memset(node->public_key, id, sizeof(node->public_key));
+}
+
+static void remove_cache_file(void)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/carrier.bootstraps", data_location);
+    remove(path);
+}
+
+static void test_load_configured(void)
+{
+    BootstrapNodeBuf nodes[3];
+    BootstrapCandidate *cands = NULL;
+    int size = 0;
+    int rc;
+    int i;
+
+    remove_cache_file();
+
+    for (i = 0; i < 3; i++)
+        make_node(&nodes[i], i + 1);
+
+    rc = bootstrap_cache_load(data_location, nodes, 3, &cands, &size);
+    CHECK(rc == 0);
+    CHECK(size == 3);
+
+    // Nothing measured yet, the configuration order is kept.
+    for (i = 0; i < size; i++) {
+        CHECK(memcmp(&cands[i].node, &nodes[i], sizeof(nodes[i])) == 0);
+        CHECK(cands[i].rtt == -1);
+        CHECK(cands[i].configured);
+        CHECK(cands[i].flags == (BOOTSTRAP_NODE_TCP | BOOTSTRAP_NODE_UDP));
+    }
+
+    free(cands);
+}
+
+static void test_rank(void)
+{
+    BootstrapCandidate cands[5];
+    int i;
+
+    memset(cands, 0, sizeof(cands));
+    for (i = 0; i < 5; i++)
+        make_node(&cands[i].node, i + 1);
+
+    cands[0].rtt = -1;                              // cached, not measured.
+    cands[1].rtt = 80;
+    cands[2].rtt = -1;
+    cands[2].configured = true;                     // configured, not measured.
+    cands[3].rtt = 20;
+    cands[4].rtt = 10;
+    cands[4].failures = 1;                          // failing goes last.
+
+    bootstrap_cache_rank(cands, 5);
+
+    CHECK(cands[0].node.port == 33444);
+    CHECK(cands[1].node.port == 33442);
+    CHECK(cands[2].node.port == 33443);
+    CHECK(cands[3].node.port == 33441);
+    CHECK(cands[4].node.port == 33445);
+}
+
+static void test_learn(void)
+{
+    BootstrapNodeBuf nodes[2];
+    BootstrapNodeBuf node;
+    BootstrapCandidate *cands = NULL;
+    int size = 0;
+    int rc;
+
+    remove_cache_file();
+
+    make_node(&nodes[0], 1);
+    make_node(&nodes[1], 2);
+
+    rc = bootstrap_cache_load(data_location, nodes, 2, &cands, &size);
+    CHECK(rc == 0);
+    CHECK(size == 2);
+
+    cands[1].failures = 2;
+
+    // The same node seen connected by its IPv6 address.
+    node = nodes[1];
+    strcpy(node.ipv4, "");
+    strcpy(node.ipv6, "fd00::2");
+    rc = bootstrap_cache_learn(&cands, &size, &node, BOOTSTRAP_NODE_UDP);
+    CHECK(rc == 0);
+    CHECK(size == 2);
+    CHECK(cands[1].failures == 0);
+    CHECK(cands[1].last_ok > 0);
+
+    make_node(&node, 3);
+    rc = bootstrap_cache_learn(&cands, &size, &node, BOOTSTRAP_NODE_TCP);
+    CHECK(rc == 1);
+    CHECK(size == 3);
+    CHECK(memcmp(&cands[2].node, &node, sizeof(node)) == 0);
+    CHECK(cands[2].rtt == -1);
+    CHECK(!cands[2].configured);
+    CHECK(cands[2].flags == BOOTSTRAP_NODE_TCP);
+
+    rc = bootstrap_cache_learn(&cands, &size, &node, BOOTSTRAP_NODE_UDP);
+    CHECK(rc == 0);
+    CHECK(size == 3);
+    CHECK(cands[2].flags == (BOOTSTRAP_NODE_TCP | BOOTSTRAP_NODE_UDP));
+
+    free(cands);
+}
+
+static void test_store_load(void)
+{
+    BootstrapNodeBuf configured;
+    BootstrapCandidate saved[4];
+    BootstrapCandidate *cands = NULL;
+    int size = 0;
+    int rc;
+    int i;
+
+    remove_cache_file();
+
+    memset(saved, 0, sizeof(saved));
+    for (i = 0; i < 4; i++)
+        make_node(&saved[i].node, i + 1);
+
+    saved[0].rtt = 15;
+    saved[0].last_ok = 1500000000;
+    saved[0].configured = true;
+    saved[0].flags = BOOTSTRAP_NODE_TCP | BOOTSTRAP_NODE_UDP;
+
+    saved[1].rtt = 40;
+    saved[1].failures = 1;
+    saved[1].last_ok = time(NULL);
+    saved[1].flags = BOOTSTRAP_NODE_TCP;
+
+    // Learned node failing the probes, dropped.
+    saved[2].rtt = -1;
+    saved[2].failures = 3;
+    saved[2].flags = BOOTSTRAP_NODE_TCP;
+
+    // DHT only node not seen for long, dropped.
+    saved[3].rtt = -1;
+    saved[3].last_ok = time(NULL) - 30 * 24 * 60 * 60;
+    saved[3].flags = BOOTSTRAP_NODE_UDP;
+
+    rc = bootstrap_cache_store(data_location, saved, 4);
+    CHECK(rc == 0);
+
+    configured = saved[0].node;
+    rc = bootstrap_cache_load(data_location, &configured, 1, &cands, &size);
+    CHECK(rc == 0);
+    CHECK(size == 2);
+
+    if (size == 2) {
+        CHECK(memcmp(&cands[0].node, &saved[0].node,
+                     sizeof(BootstrapNodeBuf)) == 0);
+        CHECK(cands[0].rtt == 15);
+        CHECK(cands[0].failures == 0);
+        CHECK(cands[0].last_ok == 1500000000);
+        CHECK(cands[0].configured);
+
+        CHECK(memcmp(&cands[1].node, &saved[1].node,
+                     sizeof(BootstrapNodeBuf)) == 0);
+        CHECK(cands[1].rtt == 40);
+        CHECK(cands[1].failures == 1);
+        CHECK(cands[1].last_ok == saved[1].last_ok);
+        CHECK(!cands[1].configured);
+        CHECK(cands[1].flags == BOOTSTRAP_NODE_TCP);
+    }
+
+    free(cands);
+}
+
+static void test_corrupted(void)
+{
+    BootstrapCandidate saved;
+    BootstrapCandidate *cands = NULL;
+    char path[1024];
+    int size = 0;
+    int fd;
+    int rc;
+
+    remove_cache_file();
+
+    memset(&saved, 0, sizeof(saved));
+    make_node(&saved.node, 1);
+    saved.rtt = 15;
+    saved.flags = BOOTSTRAP_NODE_TCP;
+
+    rc = bootstrap_cache_store(data_location, &saved, 1);
+    CHECK(rc == 0);
+
+    // Flip a byte of the entry, the checksum no longer matches.
+    snprintf(path, sizeof(path), "%s/carrier.bootstraps", data_location);
+    fd = open(path, O_RDWR);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        lseek(fd, 16, SEEK_SET);
+        rc = (int)write(fd, "x", 1);
+        CHECK(rc == 1);
+        close(fd);
+    }
+
+    rc = bootstrap_cache_load(data_location, NULL, 0, &cands, &size);
+    CHECK(rc == 0);
+    CHECK(size == 0);
+
+    free(cands);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        data_location = argv[1];
+
+    test_load_configured();
+    test_rank();
+    test_learn();
+    test_store_load();
+    test_corrupted();
+
+    remove_cache_file();
+
+    if (failed) {
+        fprintf(stderr, "%d checks failed.\n", failed);
+        return 1;
+    }
+
+    printf("All checks passed.\n");
+    return 0;
+}
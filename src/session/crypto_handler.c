@@ -65,6 +65,8 @@ ssize_t crypto_handler_write(StreamHandler *handler, FlexBuffer *buf)
     if (cipher_len <= 0) {
         vlogE("Stream: %d crypto handler encrypt data error.",
               handler->stream->id);
+        stats_add(&handler->stream->stats.crypto_failures, 1);
+        stats_dropped(&handler->stream->stats.crypto);
         return ELA_GENERAL_ERROR(ELAERR_ENCRYPT);
     } else {
         vlogT("Stream: %d crypto handler encrypted %zu bytes data.",
@@ -74,6 +76,8 @@ ssize_t crypto_handler_write(StreamHandler *handler, FlexBuffer *buf)
         flex_buffer_forward_offset(cipher_buf, ZERO_BYTES - MAC_BYTES);
 
         written = handler->next->write(handler->next, cipher_buf);
+        if (written > 0)
+            stats_sent(&handler->stream->stats.crypto, flex_buffer_size(buf));
 
         return written == flex_buffer_size(cipher_buf) ?
                                 flex_buffer_size(buf) : written;
@@ -108,6 +112,8 @@ void crypto_handler_on_rx_data(StreamHandler *handler, FlexBuffer *buf)
     if (plain_len <=0) {
         vlogE("Stream: %d crypto handler decrypt data error.",
               handler->stream->id);
+        stats_add(&handler->stream->stats.crypto_failures, 1);
+        stats_dropped(&handler->stream->stats.crypto);
         // TODO: need to stop stream or fire failed state.
         return;
     } else {
@@ -117,6 +123,8 @@ void crypto_handler_on_rx_data(StreamHandler *handler, FlexBuffer *buf)
         flex_buffer_set_size(plain_buf, plain_len);
         flex_buffer_forward_offset(plain_buf, ZERO_BYTES);
 
+        stats_received(&handler->stream->stats.crypto,
+                       flex_buffer_size(plain_buf));
         handler->prev->on_data(handler->prev, plain_buf);
     }
 }
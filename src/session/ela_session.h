@@ -205,6 +205,206 @@ typedef struct ElaTransportInfo {
     ElaAddressInfo remote;
 } ElaTransportInfo;
 
+/**
+ * \~English
+ * A data segment used by the vectored stream write.
+ */
+typedef struct ElaIOVec {
+    /**
+     * \~English
+     * The start address of the data segment.
+     */
+    const void *data;
+    /**
+     * \~English
+     * The length of the data segment.
+     */
+    size_t len;
+} ElaIOVec;
+
+/**
+ * \~English
+ * Traffic counters of one layer of the stream, or of one channel.
+ */
+typedef struct ElaLayerStats {
+    /**
+     * \~English
+     * Total bytes handed down by this layer for sending.
+     */
+    uint64_t bytes_sent;
+    /**
+     * \~English
+     * Total bytes delivered up by this layer.
+     */
+    uint64_t bytes_received;
+    /**
+     * \~English
+     * Total packets handed down by this layer for sending.
+     */
+    uint64_t packets_sent;
+    /**
+     * \~English
+     * Total packets delivered up by this layer.
+     */
+    uint64_t packets_received;
+    /**
+     * \~English
+     * Total packets discarded by this layer, either invalid incoming
+     * packets or outgoing packets the lower layer could not take.
+     */
+    uint64_t packets_dropped;
+} ElaLayerStats;
+
+/**
+ * \~English
+ * Carrier stream statistics.
+ */
+typedef struct ElaStreamStats {
+    /**
+     * \~English
+     * Traffic counters of the application data, as written by
+     * ela_stream_write() and delivered to stream_data callback.
+     */
+    ElaLayerStats application;
+    /**
+     * \~English
+     * Traffic counters of the multiplexing layer, all channels included.
+     */
+    ElaLayerStats multiplex;
+    /**
+     * \~English
+     * Traffic counters of the reliable layer, in segments.
+     */
+    ElaLayerStats reliable;
+    /**
+     * \~English
+     * Traffic counters of the encryption layer.
+     */
+    ElaLayerStats crypto;
+    /**
+     * \~English
+     * Traffic counters of the underlying transport.
+     */
+    ElaLayerStats transport;
+
+    /**
+     * \~English
+     * Number of packets failed to be encrypted or decrypted.
+     */
+    uint64_t crypto_failures;
+    /**
+     * \~English
+     * Number of retransmitted segments, reliable stream only.
+     */
+    uint64_t retransmits;
+
+    /**
+     * \~English
+     * Smoothed round-trip time in milliseconds, reliable stream only.
+     */
+    uint32_t rtt;
+    /**
+     * \~English
+     * Round-trip time variation in milliseconds, reliable stream only.
+     */
+    uint32_t rtt_var;
+    /**
+     * \~English
+     * Congestion window in bytes, reliable stream only.
+     */
+    uint32_t cwnd;
+    /**
+     * \~English
+     * Slow start threshold in bytes, reliable stream only.
+     */
+    uint32_t ssthresh;
+
+    /**
+     * \~English
+     * Bytes held in the send buffer, reliable stream only.
+     */
+    size_t send_buffered;
+    /**
+     * \~English
+     * Capacity of the send buffer, reliable stream only.
+     */
+    size_t send_buffer_size;
+    /**
+     * \~English
+     * Bytes received but not delivered yet, reliable stream only.
+     */
+    size_t recv_buffered;
+    /**
+     * \~English
+     * Capacity of the receive buffer, reliable stream only.
+     */
+    size_t recv_buffer_size;
+} ElaStreamStats;
+
+/**
+ * \~English
+ * The number of buckets in the handler call time histogram.
+ */
+#define ELA_PROFILE_HISTOGRAM_BUCKETS   16
+
+/**
+ * \~English
+ * Call statistics of one entry point of a stream handler.
+ */
+typedef struct ElaHandlerCallStats {
+    /**
+     * \~English
+     * The number of calls.
+     */
+    uint64_t calls;
+    /**
+     * \~English
+     * Total bytes passed in.
+     */
+    uint64_t bytes;
+    /**
+     * \~English
+     * Total time spent in the handler itself in nanoseconds, excluding
+     * the time spent in the other handlers it called.
+     */
+    uint64_t time;
+    /**
+     * \~English
+     * The longest time of a single call in nanoseconds.
+     */
+    uint64_t max_time;
+    /**
+     * \~English
+     * Histogram of the time of a single call. Bucket 0 counts the calls
+     * took less than 1024 nanoseconds, and bucket i counts the calls took
+     * from 2^(i+9) to 2^(i+10) nanoseconds. The last bucket also counts
+     * all the longer calls.
+     */
+    uint64_t histogram[ELA_PROFILE_HISTOGRAM_BUCKETS];
+} ElaHandlerCallStats;
+
+/**
+ * \~English
+ * Profile of a stream handler.
+ */
+typedef struct ElaHandlerProfile {
+    /**
+     * \~English
+     * The handler name.
+     */
+    const char *name;
+    /**
+     * \~English
+     * Statistics of writing outgoing data.
+     */
+    ElaHandlerCallStats write;
+    /**
+     * \~English
+     * Statistics of handling incoming data.
+     */
+    ElaHandlerCallStats on_data;
+} ElaHandlerProfile;
+
 /* Global session APIs */
 
 /**
@@ -234,6 +434,8 @@ bool ela_session_jni_onload(void *vm, void *reserved);
  * @param
  *      sdp         [in] The remote users SDP. End the null terminal.
  *                       Reference: https://tools.ietf.org/html/rfc4566
+ *                       With the peers supporting it, this is a compact
+ *                       binary offer instead, pass it as is.
  * @param
  *      len         [in] The length of the SDP.
  * @param
@@ -329,6 +531,134 @@ ElaSession *ela_session_new(ElaCarrier *carrier, const char *address);
 CARRIER_API
 void ela_session_close(ElaSession *session);
 
+/**
+ * \~English
+ * Enable or disable trickle mode of the session.
+ *
+ * In trickle mode, the streams get initialized as soon as the host
+ * candidates are ready, and the session request or reply carries the
+ * candidates gathered so far. The server reflexive and relayed candidates
+ * gathered later are delivered to the peer in follow-up messages.
+ * This function must be called before adding any stream to the session.
+ *
+ * @param
+ *      session     [in] A handle to the carrier session.
+ * @param
+ *      enable      [in] True to enable trickle mode, false to disable.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred. The specific error code
+ *      can be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_session_set_trickle(ElaSession *session, bool enable);
+
+/**
+ * \~English
+ * Enable or disable bundle mode of the session.
+ *
+ * In bundle mode, all streams of the session share one ICE transport,
+ * which gathers the candidates, runs the connectivity checks and keeps
+ * the relay allocation once for the whole session. The packets of each
+ * stream are told apart by the stream index on the shared transport.
+ * Both sides of the session must enable bundle mode when the session
+ * has more than one stream. This function must be called before adding
+ * any stream to the session.
+ *
+ * @param
+ *      session     [in] A handle to the carrier session.
+ * @param
+ *      enable      [in] True to enable bundle mode, false to disable.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred. The specific error code
+ *      can be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_session_set_bundle(ElaSession *session, bool enable);
+
+/**
+ * \~English
+ * ICE tuning profile of a session.
+ *
+ * The defaults of the ICE library suit the slow networks. On good
+ * networks, a session connects sooner with aggressive nomination, a
+ * short nomination delay and a short check list. Zero in any field
+ * keeps the default.
+ */
+typedef struct ElaSessionIceProfile {
+    /**
+     * \~English
+     * The controlling side nominates the pair of the first successful
+     * connectivity check, instead of checking again with the nomination
+     * once all components have a valid pair.
+     */
+    bool aggressive_nomination;
+
+    /**
+     * \~English
+     * Milliseconds the controlling side waits for a better pair in
+     * regular nomination, once every component has a valid pair. A short
+     * delay nominates the relayed pairs early.
+     */
+    int nomination_delay;
+
+    /**
+     * \~English
+     * Milliseconds the controlled side waits for the nomination, once its
+     * checks are done.
+     */
+    int nomination_timeout;
+
+    /**
+     * \~English
+     * The highest priority remote candidates of each component to check
+     * against. Fewer candidates make a shorter check list, which the
+     * checks go through sooner.
+     */
+    int max_remote_candidates;
+} ElaSessionIceProfile;
+
+/**
+ * \~English
+ * Set the ICE tuning profile of the session.
+ *
+ * This function must be called before adding any stream to the session.
+ *
+ * @param
+ *      session     [in] A handle to the carrier session.
+ * @param
+ *      profile     [in] The ICE tuning profile, or NULL for the defaults.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred. The specific error code
+ *      can be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_session_set_ice_profile(ElaSession *session,
+                                const ElaSessionIceProfile *profile);
+
+/**
+ * \~English
+ * Restart ICE of the session to move its streams to a new network path.
+ *
+ * Call it when the network of the host changed, such as a handover
+ * between Wi-Fi and cellular. The candidates are gathered and checked
+ * again while the connected streams, with their reliable and multiplexed
+ * channels, stay open on the old path. The streams move to the new path
+ * once the checks complete. A restart also starts by itself when the
+ * peer has been silent for a while.
+ *
+ * @param
+ *      session     [in] A handle to the carrier session.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred. The specific error code
+ *      can be retrieved by calling ela_get_error().
+ */
+CARRIER_API
+int ela_session_restart(ElaSession *session);
+
 /**
  * \~English
  * Get the remote peer's address of the session.
@@ -392,6 +722,8 @@ void *ela_session_get_userdata(ElaSession *session);
  * @param
  *      sdp         [in] The remote users SDP. End the null terminal.
  *                       Reference: https://tools.ietf.org/html/rfc4566
+ *                       With the peers supporting it, this is a compact
+ *                       binary offer instead, pass it as is.
  * @param
  *      len         [in] The length of the SDP.
  * @param
@@ -462,6 +794,8 @@ int ela_session_reply_request(ElaSession *session, const char *bundle,
  * @param
  *      sdp         [in] The remote users SDP. End the null terminal.
  *                       Reference: https://tools.ietf.org/html/rfc4566
+ *                       With the peers supporting it, this is a compact
+ *                       binary offer instead, pass it as is.
  * @param
  *      len         [in] The length of the SDP.
  *
@@ -553,6 +887,9 @@ typedef struct ElaStreamCallbacks {
      * receive stream_data callback any more. All data will reported
      * as multiplexing channel data.
      *
+     * If the stream enabled message framing mode, each callback carries
+     * one whole message sent by the remote peer.
+     *
      * @param
      *      session     [in] The handle to the ElaSession.
      * @param
@@ -717,6 +1054,38 @@ typedef struct ElaStreamCallbacks {
  */
 #define ELA_STREAM_PORT_FORWARDING      0x10
 
+/**
+ * Message framing option, indicates the stream would deliver whole
+ * messages instead of arbitrary byte chunks. Each write is sent as one
+ * length-prefixed message and the receiver gets exactly one stream_data
+ * callback per message. This option should bitwise with 'Reliable'
+ * option, and can not be used with 'Multiplexing' option.
+ */
+#define ELA_STREAM_MESSAGE_FRAMING      0x20
+
+/**
+ * Profiling option, indicates the time spent, bytes and calls of each
+ * handler in the stream pipeline would be recorded, and can be retrieved
+ * by ela_stream_get_profile(). This is a local option and is not
+ * negotiated with remote peer.
+ */
+#define ELA_STREAM_PROFILING            0x40
+
+/**
+ * Multipath option, indicates the stream would set up extra ICE paths over
+ * the other network interfaces or the TURN relay once connected, and
+ * spread the data over all the live paths weighted by their round trip
+ * time and loss. The data may arrive out of order, this option is meant
+ * to bitwise with 'Reliable' option, and can not be used in bundle mode.
+ */
+#define ELA_STREAM_MULTIPATH            0x80
+
+/**
+ * \~English
+ * The maximum message length on the message framing stream.
+ */
+#define ELA_MAX_STREAM_MESSAGE_LEN      (8 * 1024 * 1024)
+
 /**
  * \~English
  * Add a new stream to session.
@@ -749,6 +1118,10 @@ typedef struct ElaStreamCallbacks {
  *                         Multiplexing mode.
  *                       - ELA_STREAM_PORT_FORWARDING
  *                         Support portforwarding over multiplexing.
+ *                       - ELA_STREAM_MESSAGE_FRAMING
+ *                         Message framing over reliable mode.
+ *                       - ELA_STREAM_MULTIPATH
+ *                         Spread data over multiple ICE paths.
  *
  * @param
  *      callbacks   [in] The Application defined callback functions in
@@ -885,6 +1258,32 @@ CARRIER_API
 int ela_stream_get_transport_info(ElaSession *session, int stream,
                                       ElaTransportInfo *info);
 
+/**
+ * \~English
+ * Get the carrier stream statistics.
+ *
+ * The counters are maintained by each layer of the stream while data
+ * flows through it, and are only collected when this function is called,
+ * so it is cheap enough to be polled periodically. The counters are
+ * collected without stopping the stream, so they are not an atomic
+ * snapshot across layers.
+ *
+ * @param
+ *      session     [in] The handle to the ElaSession.
+ * @param
+ *      stream      [in] The stream ID.
+ * @param
+ *      stats       [out] The stream statistics defined in ElaStreamStats.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      ela_get_error().
+ */
+CARRIER_API
+int ela_stream_get_stats(ElaSession *session, int stream,
+                         ElaStreamStats *stats);
+
 /**
  * \~English
  * Send outgoing data to remote peer.
@@ -911,6 +1310,96 @@ CARRIER_API
 ssize_t ela_stream_write(ElaSession *session, int stream,
                              const void *data, size_t len);
 
+/**
+ * \~English
+ * Send large outgoing data to remote peer on a reliable stream.
+ *
+ * Unlike ela_stream_write(), the data length is not limited to
+ * ELA_MAX_USER_DATA_LEN. The data is queued into the reliable transport
+ * in one pass and segmented internally, and this function blocks until
+ * all data has been queued. If the stream is disconnected while waiting,
+ * the bytes already queued are returned.
+ *
+ * This function is only available for the reliable stream without
+ * multiplexing mode, otherwise it will return error.
+ *
+ * If the stream enabled message framing mode, the data is sent as one
+ * message, and the length should not exceed ELA_MAX_STREAM_MESSAGE_LEN.
+ * Messages written from several threads at once are never interleaved
+ * with each other.
+ *
+ * @param
+ *      session     [in] The handle to the ElaSession.
+ * @param
+ *      stream      [in] The stream ID.
+ * @param
+ *      data        [in] The outgoing data.
+ * @param
+ *      len         [in] The outgoing data length.
+ *
+ * @return
+ *      Sent bytes on success, or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      ela_get_error().
+ */
+CARRIER_API
+ssize_t ela_stream_write_bulk(ElaSession *session, int stream,
+                              const void *data, size_t len);
+
+/**
+ * \~English
+ * Send outgoing data gathered from multiple buffers to remote peer
+ * on a reliable stream.
+ *
+ * The buffers are sent in array order as one contiguous byte sequence,
+ * with the same semantics as ela_stream_write_bulk().
+ *
+ * @param
+ *      session     [in] The handle to the ElaSession.
+ * @param
+ *      stream      [in] The stream ID.
+ * @param
+ *      iov         [in] The array of outgoing data segments.
+ * @param
+ *      iovcnt      [in] The count of data segments in iov.
+ *
+ * @return
+ *      Sent bytes on success, or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      ela_get_error().
+ */
+CARRIER_API
+ssize_t ela_stream_writev(ElaSession *session, int stream,
+                          const ElaIOVec *iov, int iovcnt);
+
+/**
+ * \~English
+ * Get the profile of each handler in the stream pipeline.
+ *
+ * The stream must be added with ELA_STREAM_PROFILING option. The profiles
+ * are filled in pipeline order, from the application side to the network
+ * side.
+ *
+ * @param
+ *      session     [in] The handle to the ElaSession.
+ * @param
+ *      stream      [in] The stream ID.
+ * @param
+ *      profiles    [out] The array to receive the handler profiles.
+ * @param
+ *      count       [in] The number of elements of profiles array.
+ *
+ * @return
+ *      The number of handlers in the stream pipeline on success, which
+ *      might be larger than count, in that case only the first count
+ *      profiles are filled. Or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      ela_get_error().
+ */
+CARRIER_API
+int ela_stream_get_profile(ElaSession *session, int stream,
+                           ElaHandlerProfile *profiles, int count);
+
 /**
  * \~English
  * Open a new channel on multiplexing stream.
@@ -1022,6 +1511,31 @@ int ela_stream_pend_channel(ElaSession *session, int stream, int channel);
 CARRIER_API
 int ela_stream_resume_channel(ElaSession *session, int stream, int channel);
 
+/**
+ * \~English
+ * Get the traffic statistics of a channel on multiplexing stream.
+ *
+ * If the stream is not multiplexing this function will fail.
+ *
+ * @param
+ *      session     [in] The handle to the ElaSession.
+ * @param
+ *      stream      [in] The stream ID.
+ * @param
+ *      channel     [in] The channel ID.
+ * @param
+ *      stats       [out] The channel traffic counters defined in
+ *                        ElaLayerStats.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      ela_get_error().
+ */
+CARRIER_API
+int ela_stream_get_channel_stats(ElaSession *session, int stream, int channel,
+                                 ElaLayerStats *stats);
+
 /**
  * \~English
  * Open a portforwarding to remote service over multiplexing.
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_WINSOCK2_H
+#include <winsock2.h>
+#endif
+
+#include <vlog.h>
+#include <rc_mem.h>
+
+#include "flex_buffer.h"
+#include "session.h"
+#include "stream_handler.h"
+
+/*
+ * Message framing over reliable stream. Each message is transmitted as
+ * a 4 bytes length in network byte order followed by the message payload.
+ */
+
+/* Keep the reassembly buffer for reuse unless it grows beyond this size. */
+#define FRAMING_POOL_CACHED_LEN         (256 * 1024)
+
+typedef struct FramingHandler {
+    StreamHandler base;
+
+    int broken;
+
+    uint8_t header[FRAMING_HEAD_LEN];
+    size_t header_len;
+
+    size_t message_len;
+    size_t received;
+
+    char *pool;
+    size_t pool_capacity;
+} FramingHandler;
+
+static
+ssize_t framing_handler_write(StreamHandler *base, FlexBuffer *buf)
+{
+    uint32_t header;
+    size_t len;
+    ssize_t written;
+
+    assert(base);
+    assert(base->next);
+    assert(buf);
+    assert(flex_buffer_offset(buf) >= FRAMING_HEAD_LEN);
+
+    len = flex_buffer_size(buf);
+    if (len > ELA_MAX_STREAM_MESSAGE_LEN)
+        return ELA_GENERAL_ERROR(ELAERR_TOO_LONG);
+
+    header = htonl((uint32_t)len);
+
+    flex_buffer_backward_offset(buf, FRAMING_HEAD_LEN);
+    memcpy(flex_buffer_mutable_ptr(buf), &header, FRAMING_HEAD_LEN);
+
+    /* The reliable handler gives up the stream lock while the send buffer
+     * is full, hold the write lock to keep the message contiguous. */
+    pthread_mutex_lock(&base->stream->write_lock);
+    written = base->next->write(base->next, buf);
+    pthread_mutex_unlock(&base->stream->write_lock);
+    if (written < 0)
+        return written;
+
+    vlogT("Stream: %d framing handler wrote %zu bytes message.",
+          base->stream->id, len);
+
+    return (ssize_t)len;
+}
+
+static void framing_handler_reset(FramingHandler *handler)
+{
+    handler->header_len = 0;
+    handler->message_len = 0;
+    handler->received = 0;
+
+    if (handler->pool && handler->pool_capacity > FRAMING_POOL_CACHED_LEN) {
+        free(handler->pool);
+        handler->pool = NULL;
+        handler->pool_capacity = 0;
+    }
+}
+
+static void framing_handler_deliver(FramingHandler *handler,
+                                    const void *data, size_t len)
+{
+    FlexBuffer msg;
+
+    flex_buffer_init(&msg, data, len, 0);
+    flex_buffer_set_size(&msg, len);
+
+    vlogT("Stream: %d framing handler received %zu bytes message.",
+          handler->base.stream->id, len);
+
+    handler->base.prev->on_data(handler->base.prev, &msg);
+}
+
+static void framing_handler_abort(FramingHandler *handler, int error)
+{
+    handler->broken = 1;
+    framing_handler_reset(handler);
+
+    handler->base.next->stop(handler->base.next, error);
+}
+
+static
+void framing_handler_on_rx_data(StreamHandler *base, FlexBuffer *buf)
+{
+    FramingHandler *handler = (FramingHandler *)base;
+    size_t len;
+
+    assert(base);
+    assert(base->prev);
+    assert(buf);
+
+    if (handler->broken)
+        return;
+
+    while (flex_buffer_size(buf) > 0) {
+        if (handler->header_len < FRAMING_HEAD_LEN) {
+            uint32_t header;
+
+            len = FRAMING_HEAD_LEN - handler->header_len;
+            if (len > flex_buffer_size(buf))
+                len = flex_buffer_size(buf);
+
+            memcpy(handler->header + handler->header_len,
+                   flex_buffer_ptr(buf), len);
+            flex_buffer_forward_offset(buf, len);
+            handler->header_len += len;
+
+            if (handler->header_len < FRAMING_HEAD_LEN)
+                return;
+
+            memcpy(&header, handler->header, FRAMING_HEAD_LEN);
+            handler->message_len = ntohl(header);
+            handler->received = 0;
+
+            if (handler->message_len > ELA_MAX_STREAM_MESSAGE_LEN) {
+                vlogE("Stream: %d framing handler got invalid message "
+                      "length %zu.", base->stream->id, handler->message_len);
+                framing_handler_abort(handler,
+                                      ELA_GENERAL_ERROR(ELAERR_TOO_LONG));
+                return;
+            }
+
+            if (handler->message_len == 0) {
+                framing_handler_reset(handler);
+                continue;
+            }
+
+            /* Whole message arrived in one chunk, deliver it in place. */
+            if (flex_buffer_size(buf) >= handler->message_len) {
+                len = handler->message_len;
+                framing_handler_deliver(handler, flex_buffer_ptr(buf), len);
+                flex_buffer_forward_offset(buf, len);
+                framing_handler_reset(handler);
+                continue;
+            }
+
+            if (handler->pool_capacity < handler->message_len) {
+                char *pool;
+
+                pool = (char *)realloc(handler->pool, handler->message_len);
+                if (!pool) {
+                    vlogE("Stream: %d framing handler out of memory.",
+                          base->stream->id);
+                    framing_handler_abort(handler,
+                                ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
+                    return;
+                }
+
+                handler->pool = pool;
+                handler->pool_capacity = handler->message_len;
+            }
+        }
+
+        len = handler->message_len - handler->received;
+        if (len > flex_buffer_size(buf))
+            len = flex_buffer_size(buf);
+
+        memcpy(handler->pool + handler->received, flex_buffer_ptr(buf), len);
+        flex_buffer_forward_offset(buf, len);
+        handler->received += len;
+
+        if (handler->received == handler->message_len) {
+            framing_handler_deliver(handler, handler->pool,
+                                    handler->message_len);
+            framing_handler_reset(handler);
+        }
+    }
+}
+
+static void framing_handler_destroy(void *p)
+{
+    FramingHandler *handler = (FramingHandler *)p;
+
+    if (handler->pool)
+        free(handler->pool);
+
+    if (handler->base.next)
+        deref(handler->base.next);
+
+    vlogD("Stream: %d framing handler destroyed.", handler->base.stream->id);
+}
+
+int framing_handler_create(ElaStream *s, StreamHandler **handler)
+{
+    FramingHandler *_handler;
+
+    _handler = (FramingHandler *)rc_zalloc(sizeof(FramingHandler),
+                                           framing_handler_destroy);
+    if (!_handler)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    _handler->base.name = "Framing Handler";
+    _handler->base.stream = s;
+
+    _handler->base.init    = default_handler_init;
+    _handler->base.prepare = default_handler_prepare;
+    _handler->base.start   = default_handler_start;
+    _handler->base.stop    = default_handler_stop;
+    _handler->base.write   = framing_handler_write;
+    _handler->base.on_data = framing_handler_on_rx_data;
+    _handler->base.on_state_changed = default_handler_on_state_changed;
+
+    vlogD("Stream: %d framing handler created.", s->id);
+
+    *handler = (StreamHandler *)_handler;
+    return 0;
+}
@@ -67,18 +67,51 @@
 #include "ela_session.h"
 #include "ice.h"
 #include "session.h"
+#include "offer_generated.h"
 
 #define DEFAULT_KEEPALIVE_INTERVAL      30000 /* 30 seconds */
+#define ICE_KEEPALIVE_MIN_INTERVAL      10000 /* 10 seconds */
+#define ICE_KEEPALIVE_MAX_INTERVAL      35000 /* 35 seconds */
+#define ICE_KEEPALIVE_STEP              5000  /* 5 seconds */
+#define ICE_KEEPALIVE_CHECK_INTERVAL    5000  /* 5 seconds */
 #define DEFAULT_TIMEOUT_INTERVAL        120000 /* 120 seconds */
 
+#define ICE_RESTART_INTERVAL            45000 /* 45 seconds */
+#define ICE_RESTART_TIMEOUT             15000 /* 15 seconds */
+#define ICE_RESTART_POLL_INTERVAL       100   /* 100 milliseconds */
+
 #define KA_INTERVAL         25
 
+/*
+ * IPv6 host candidates of each component. The global addresses are the
+ * useful ones, the rest would only crowd the check list.
+ */
+#define ICE_IPV6_MAX_HOST_CANDS     2
+
+#define ICE_PATH_TIMER_INTERVAL         200   /* 200 milliseconds */
+#define ICE_PATH_SETUP_TIMEOUT          15000 /* 15 seconds */
+#define ICE_PATH_PROBE_INTERVAL         1000  /* 1 second */
+#define ICE_PATH_DEAD_INTERVAL          3000  /* 3 seconds */
+
+/*
+ * Multipath streams probe each path for its round trip time and loss, the
+ * receiver echoes a probe back on the path it arrived.
+ */
 enum {
     PKT_SHUTDOWN = 0,
     PKT_KEEPALIVE,
-    PKT_DATA
+    PKT_DATA,
+    PKT_PROBE,
+    PKT_PROBE_ACK
 };
 
+/*
+ * The version is 0 for a stream with its own ICE transport. The streams
+ * bundled on one transport set ICE_PACKET_BUNDLE and carry the media
+ * index of the stream in the low bits instead.
+ */
+#define ICE_PACKET_BUNDLE   0x80
+
 typedef struct {
     uint8_t  version;
     uint8_t  pkttype;
@@ -86,6 +119,13 @@ typedef struct {
     char data[0];
 } IcePacket;
 
+typedef struct {
+    uint8_t  path;
+    uint8_t  reserved[3];
+    uint32_t seq;
+    uint32_t time;      // in microseconds, of the sender.
+} IceProbe;
+
 typedef struct Notification {
     StreamHandler *handler;
 
@@ -253,6 +293,87 @@ pj_status_t ice_register_event(IceWorker *worker,
     return 0;
 }
 
+static bool ice_host_has_af(int af)
+{
+    pj_sockaddr addr;
+
+    return pj_gethostip(af, &addr) == PJ_SUCCESS;
+}
+
+static bool ice_server_has_af(const pj_str_t *server, int af)
+{
+    pj_addrinfo ai;
+    unsigned cnt = 1;
+
+    return pj_getaddrinfo(af, server, &cnt, &ai) == PJ_SUCCESS && cnt > 0;
+}
+
+/*
+ * A STUN transport per address family, each gathers the host candidates
+ * and the server reflexive one of the family, and a TURN transport per
+ * family the TURN server is reachable on. The IPv6 ones are there when
+ * the host has an IPv6 address, including NAT64 networks, where the
+ * servers resolve to synthesized IPv6 addresses.
+ */
+static void ice_worker_config_transports(IceWorker *worker)
+{
+    int i;
+
+    worker->cfg.stun_tp_cnt = 0;
+    worker->cfg.turn_tp_cnt = 0;
+
+    for (i = 0; i < 2; i++) {
+        bool ipv6 = (i == 1);
+        int af = ipv6 ? pj_AF_INET6() : pj_AF_INET();
+        pj_ice_strans_stun_cfg *stun_tp;
+        pj_ice_strans_turn_cfg *turn_tp;
+
+        if (ipv6 && !ice_host_has_af(af))
+            continue;
+
+        stun_tp = &worker->cfg.stun_tp[worker->cfg.stun_tp_cnt++];
+        pj_ice_strans_stun_cfg_default(stun_tp);
+        stun_tp->af = af;
+        stun_tp->max_host_cands = ipv6 ? ICE_IPV6_MAX_HOST_CANDS :
+                                         PJ_ICE_ST_MAX_CAND;
+        // Keep the IPv6 host candidates if the IPv6 binding fails.
+        stun_tp->ignore_stun_error = ipv6 ? PJ_TRUE : PJ_FALSE;
+
+        if (worker->stun_server.slen &&
+            (!ipv6 || ice_server_has_af(&worker->stun_server, af))) {
+            stun_tp->server = worker->stun_server;
+            stun_tp->port = worker->stun_port;
+        }
+
+        if (!worker->turn_server.slen ||
+            (ipv6 && !ice_server_has_af(&worker->turn_server, af)))
+            continue;
+
+        /* For this demo app, configure longer STUN keep-alive time
+         * so that it does't clutter the screen output.
+         */
+        stun_tp->cfg.ka_interval = KA_INTERVAL;
+
+        turn_tp = &worker->cfg.turn_tp[worker->cfg.turn_tp_cnt++];
+        pj_ice_strans_turn_cfg_default(turn_tp);
+        turn_tp->af = af;
+        turn_tp->server = worker->turn_server;
+        turn_tp->port = worker->turn_port;
+        turn_tp->alloc_param.ka_interval = KA_INTERVAL;
+
+        turn_tp->auth_cred.type = PJ_STUN_AUTH_CRED_STATIC;
+        turn_tp->auth_cred.data.static_cred.realm = worker->turn_realm;
+        turn_tp->auth_cred.data.static_cred.username = worker->turn_username;
+        turn_tp->auth_cred.data.static_cred.data_type = PJ_STUN_PASSWD_PLAIN;
+        turn_tp->auth_cred.data.static_cred.data = worker->turn_password;
+
+        turn_tp->conn_type = PJ_TURN_TP_UDP;
+    }
+
+    vlogD("Session: ICE worker %d uses %u STUN and %u TURN transports.",
+          worker->base.id, worker->cfg.stun_tp_cnt, worker->cfg.turn_tp_cnt);
+}
+
 static
 int ice_worker_init(IceWorker *worker, IceTransportOptions *opts)
 {
@@ -321,43 +442,11 @@ int ice_worker_init(IceWorker *worker, IceTransportOptions *opts)
 
     /* -= Start initializing ICE stream transport config =- */
 
-    /* Maximum number of host candidates */
-    worker->cfg.stun.max_host_cands = PJ_ICE_ST_MAX_CAND;
-
     /* Nomination strategy */
     worker->cfg.opt.aggressive = !worker->regular;
 
-    /* Configure STUN/srflx & TURN candidate resolution */
-    if (worker->stun_server.slen) {
-        worker->cfg.stun_tp_cnt = 1;
-        pj_ice_strans_stun_cfg_default(&worker->cfg.stun_tp[0]);
-        worker->cfg.stun_tp[0].af = pj_AF_INET();
-        worker->cfg.stun_tp[0].server = worker->stun_server;
-        worker->cfg.stun_tp[0].port = worker->stun_port;
-    }
-
-    if (worker->turn_server.slen) {
-        worker->cfg.turn_tp_cnt = 1;
-        pj_ice_strans_turn_cfg_default(&worker->cfg.turn_tp[0]);
-        worker->cfg.turn_tp[0].af = pj_AF_INET();
-        worker->cfg.turn_tp[0].server = worker->turn_server;
-        worker->cfg.turn_tp[0].port = worker->turn_port;
-
-        /* For this demo app, configure longer STUN keep-alive time
-         * so that it does't clutter the screen output.
-         */
-        worker->cfg.stun_tp[0].cfg.ka_interval = KA_INTERVAL;
-        worker->cfg.stun_tp[0].cfg.ka_interval = KA_INTERVAL;
-        worker->cfg.turn_tp[0].alloc_param.ka_interval = KA_INTERVAL;
-
-        worker->cfg.turn_tp[0].auth_cred.type = PJ_STUN_AUTH_CRED_STATIC;
-        worker->cfg.turn_tp[0].auth_cred.data.static_cred.realm = worker->turn_realm;
-        worker->cfg.turn_tp[0].auth_cred.data.static_cred.username = worker->turn_username;
-        worker->cfg.turn_tp[0].auth_cred.data.static_cred.data_type = PJ_STUN_PASSWD_PLAIN;
-        worker->cfg.turn_tp[0].auth_cred.data.static_cred.data = worker->turn_password;
-
-        worker->cfg.turn_tp[0].conn_type = PJ_TURN_TP_UDP;
-    }
+    /* Configure host, STUN/srflx & TURN candidate resolution */
+    ice_worker_config_transports(worker);
 
     // The read_key and write_key are used for reporting state changed.
     status = ice_register_event(worker, &worker->read_key, &worker->read_addr);
@@ -412,6 +501,11 @@ static void ice_worker_stop(TransportWorker *base)
 
     prepare_thread_context(worker->transport);
 
+    if (worker->warm) {
+        pj_ice_strans_destroy(worker->warm->st);
+        worker->warm = NULL;
+    }
+
     if (worker->read_key) {
         pj_ioqueue_unregister(worker->read_key);
         worker->read_key = NULL;
@@ -462,6 +556,9 @@ static int ice_transport_init(IceTransport *transport)
     if (rc != 0)
         return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
 
+    pthread_mutex_init(&transport->pool.lock, NULL);
+    pthread_cond_init(&transport->pool.cond, NULL);
+
     pj_log_set_level(0);
     pj_log_set_log_func(ice_log_print);
 
@@ -489,18 +586,25 @@ static int ice_transport_init(IceTransport *transport)
     return 0;
 }
 
+static void ice_pool_stop(IceTransport *transport);
+
 static void ice_transport_destroy(void *p)
 {
     IceTransport *transport = (IceTransport *)p;
 
     prepare_thread_context(transport);
 
+    ice_pool_stop(transport);
+
     transport_base_destroy(p);
 
     pj_shutdown();
 
     pthread_key_delete(transport->pj_thread_ctx);
 
+    pthread_mutex_destroy(&transport->pool.lock);
+    pthread_cond_destroy(&transport->pool.cond);
+
     vlogD("Session: ICE transport destroyed");
 }
 
@@ -599,13 +703,16 @@ static void ice_worker_destroy_timer(TransportWorker *base, Timer *tmr)
 static int transport_workerid(void)
 {
     static int workerid = 0;
+    int id;
 
-    if (++workerid == INT_MAX) {
-        workerid = 0;
-        ++workerid;
+    // Workers are also created by the pool thread.
+    id = __atomic_add_fetch(&workerid, 1, __ATOMIC_RELAXED);
+    if (id == INT_MAX) {
+        __atomic_store_n(&workerid, 1, __ATOMIC_RELAXED);
+        id = 1;
     }
 
-    return workerid;
+    return id;
 }
 
 static
@@ -673,6 +780,11 @@ static void ice_session_destroy(void *p)
 
     prepare_thread_context(transport);
 
+    if (session->restart.timer)
+        ice_worker_destroy_timer(session->base.worker, session->restart.timer);
+
+    pthread_mutex_destroy(&session->restart.lock);
+
     // Call base destructor
     session_base_destroy(p);
 
@@ -716,20 +828,234 @@ static void notify_state_changed(StreamHandler *handler, int state)
 
 }
 
-static void stream_on_ice_complete(pj_ice_strans *ice_st, pj_ice_strans_op op,
-                                   pj_status_t status)
+static int ice_cand_to_str(const pj_ice_sess_cand *candidate,
+                           char *buf, size_t len)
 {
-    IceStream *stream;
-    int state;
+    char str_addr[PJ_INET6_ADDRSTRLEN];
+    char str_rel_addr[PJ_INET6_ADDRSTRLEN];
+
+    if (candidate->type == PJ_ICE_CAND_TYPE_HOST)
+        return snprintf(buf, len, "%.*s %u UDP %u %s %u typ %s",
+                        (int)candidate->foundation.slen,
+                        candidate->foundation.ptr,
+                        (unsigned)candidate->comp_id,
+                        candidate->prio,
+                        pj_sockaddr_print(&candidate->addr, str_addr, sizeof(str_addr), 0),
+                        (unsigned)pj_sockaddr_get_port(&candidate->addr),
+                        pj_ice_get_cand_type_name(candidate->type));
+    else
+        return snprintf(buf, len, "%.*s %u UDP %u %s %u typ %s raddr %s rport %u",
+                        (int)candidate->foundation.slen,
+                        candidate->foundation.ptr,
+                        (unsigned)candidate->comp_id,
+                        candidate->prio,
+                        pj_sockaddr_print(&candidate->addr, str_addr, sizeof(str_addr), 0),
+                        (unsigned)pj_sockaddr_get_port(&candidate->addr),
+                        pj_ice_get_cand_type_name(candidate->type),
+                        pj_sockaddr_print(&candidate->rel_addr, str_rel_addr, sizeof(str_rel_addr), 0),
+                        (unsigned)pj_sockaddr_get_port(&candidate->rel_addr));
+}
 
-    pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ice_st);
-    pj_grp_lock_acquire(lock);
+/*
+ * Start the checks against the remote candidates. With the profile limits
+ * the remote candidates, only the highest priority ones of each component
+ * are paired, the check list stays short.
+ */
+static pj_status_t ice_handler_start_checks(IceHandler *handler,
+                                            pj_ice_strans *st,
+                                            const IceRemote *remote)
+{
+    ElaSession *session = stream_get_session(handler->base.stream);
+    int limit = session->ice_profile.max_remote_candidates;
+    pj_ice_sess_cand cand[PJ_ARRAY_SIZE(remote->cand)];
+    unsigned cand_cnt = 0;
+    pj_str_t rufrag;
+    pj_str_t rpwd;
+    unsigned i, j;
 
-    stream = (IceStream *)pj_ice_strans_get_user_data(ice_st);
-    if (!stream || nrefs(stream) == 0) {
-        vlogE("Session: Stream internal error!");
-        pj_grp_lock_release(lock);
-        return;
+    pj_cstr(&rufrag, remote->ufrag);
+    pj_cstr(&rpwd, remote->pwd);
+
+    if (limit <= 0 || remote->cand_cnt <= (unsigned)limit)
+        return pj_ice_strans_start_ice(st, &rufrag, &rpwd,
+                                       remote->cand_cnt,
+                                       remote->cand);
+
+    for (i = 0; i < remote->cand_cnt; i++) {
+        const pj_ice_sess_cand *c = &remote->cand[i];
+        int rank = 0;
+
+        for (j = 0; j < remote->cand_cnt; j++) {
+            const pj_ice_sess_cand *o = &remote->cand[j];
+
+            if (o->comp_id == c->comp_id &&
+                (o->prio > c->prio || (o->prio == c->prio && j < i)))
+                rank++;
+        }
+
+        if (rank < limit)
+            cand[cand_cnt++] = *c;
+    }
+
+    vlogD("Stream: %d ICE checks %u of %u remote candidates.",
+          handler->base.stream->id, cand_cnt, remote->cand_cnt);
+
+    return pj_ice_strans_start_ice(st, &rufrag, &rpwd, cand_cnt, cand);
+}
+
+/*
+ * pjnath takes the nomination options when the ICE session is created,
+ * set them from the session profile before each init. The transports are
+ * reused by sessions, so the worker defaults are set back as well.
+ */
+static pj_status_t ice_handler_set_options(IceHandler *handler,
+                                           pj_ice_strans *st)
+{
+    ElaSession *session = stream_get_session(handler->base.stream);
+    IceWorker *worker = (IceWorker *)session->worker;
+    ElaSessionIceProfile *profile = &session->ice_profile;
+    pj_ice_sess_options opt = worker->cfg.opt;
+
+    if (profile->aggressive_nomination)
+        opt.aggressive = PJ_TRUE;
+    if (profile->nomination_delay > 0)
+        opt.nominated_check_delay = (unsigned)profile->nomination_delay;
+    if (profile->nomination_timeout > 0)
+        opt.controlled_agent_want_nom_timeout = profile->nomination_timeout;
+
+    return pj_ice_strans_set_options(st, &opt);
+}
+
+/*
+ * pjnath does not take remote candidates after the checks started, and a
+ * running ICE session does not pick up local candidates gathered later.
+ * Restart the checks with the same credentials to bring in the candidates
+ * trickled on either side. Must be called with the group lock held.
+ */
+static pj_status_t ice_handler_restart_checks(IceHandler *handler)
+{
+    IceSession *session = (IceSession *)stream_get_session(handler->base.stream);
+    pj_str_t ufrag, pwd;
+    pj_status_t status;
+
+    if (!pj_ice_strans_has_sess(handler->st) ||
+        !pj_ice_strans_sess_is_running(handler->st) ||
+        pj_ice_strans_sess_is_complete(handler->st))
+        return PJ_SUCCESS;
+
+    pj_ice_strans_stop_ice(handler->st);
+
+    status = pj_ice_strans_init_ice(handler->st, session->role,
+                                    pj_cstr(&ufrag, session->ufrag),
+                                    pj_cstr(&pwd, session->pwd));
+    if (status != PJ_SUCCESS)
+        return status;
+
+    status = ice_handler_start_checks(handler, handler->st,
+                                      &handler->remote);
+    if (status == PJ_SUCCESS)
+        vlogD("Stream: %d ICE checks restarted with %u remote candidates.",
+              handler->base.stream->id, handler->remote.cand_cnt);
+
+    return status;
+}
+
+/*
+ * Encode the ready local candidates which are not in the local SDP or a
+ * previous trickle message yet. Must be called with the group lock held.
+ * Return the message length including the terminating NUL, 0 if nothing
+ * to trickle.
+ */
+static int ice_handler_encode_trickle(IceHandler *handler, char **msg)
+{
+    IceSession *session = (IceSession *)stream_get_session(handler->base.stream);
+    pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
+    unsigned ncomps;
+    size_t size = 4096;
+    int len;
+    int count = 0;
+    int i;
+    char *buf;
+
+    if (!handler->trickle.announced)
+        return 0;
+
+    buf = (char *)malloc(size);
+    if (!buf)
+        return 0;
+
+    len = snprintf(buf, size, "%s\n", session->ufrag);
+
+    ncomps = pj_ice_strans_get_running_comp_cnt(handler->st);
+    for (i = 0; i < (int)ncomps && i < PJ_ICE_MAX_COMP; i++) {
+        unsigned cand_cnt = PJ_ARRAY_SIZE(cand);
+        int j;
+
+        if (pj_ice_strans_enum_cands(handler->st, i+1, &cand_cnt, cand) != PJ_SUCCESS)
+            continue;
+
+        for (j = 0; j < (int)cand_cnt && j < 64; j++) {
+            char line[160];
+            int n;
+
+            if (cand[j].status != PJ_SUCCESS ||
+                (handler->trickle.sent[i] & ((uint64_t)1 << j)))
+                continue;
+
+            ice_cand_to_str(&cand[j], line, sizeof(line));
+            n = snprintf(buf + len, size - len, "%d %s\n",
+                         handler->media_index, line);
+            if (n < 0 || n >= (int)(size - len))
+                break;
+
+            len += n;
+            count++;
+            handler->trickle.sent[i] |= ((uint64_t)1 << j);
+        }
+    }
+
+    if (!count) {
+        free(buf);
+        return 0;
+    }
+
+    *msg = buf;
+    return len + 1;
+}
+
+/*
+ * Handle the completion of an ICE operation for one stream, with the group
+ * lock held. Return the length of the trickle message to send after the
+ * lock released, or 0.
+ */
+static int stream_ice_complete(IceStream *stream, pj_ice_strans_op op,
+                               pj_status_t status, char **msg)
+{
+    IceHandler *handler = (IceHandler *)stream->handler;
+    int state;
+    int len = 0;
+
+    if (op == PJ_ICE_STRANS_OP_INIT && handler->trickle.enabled) {
+        // Stream was initialized with the host candidates already.
+        if (status != PJ_SUCCESS)
+            vlogW("Session: Stream %d gathering error (0x%x), continue with "
+                  "the gathered candidates.", stream->base.id,
+                  ELA_ICE_ERROR(status));
+
+        if (!msg)
+            return 0;
+
+        len = ice_handler_encode_trickle(handler, msg);
+        if (len > 0 && stream->base.state == ElaStreamState_connecting) {
+            status = ice_handler_restart_checks(handler);
+            if (status != PJ_SUCCESS) {
+                vlogE("Stream: %d ICE handler restart checks error: %s.",
+                      stream->base.id, ice_strerror(status));
+                notify_state_changed(stream->handler, ElaStreamState_failed);
+            }
+        }
+
+        return len;
     }
 
     if (op == PJ_ICE_STRANS_OP_INIT) {
@@ -747,12 +1073,187 @@ static void stream_on_ice_complete(pj_ice_strans *ice_st, pj_ice_strans_op op,
             state = ElaStreamState_failed;
         }
     } else {
+        return 0;
+    }
+
+    notify_state_changed(stream->handler, state);
+    return 0;
+}
+
+/*
+ * The bundled streams of a session share one ICE transport, so each
+ * completion goes to all of them. Only the first stream trickles the
+ * shared candidates.
+ */
+static int bundle_ice_complete(IceStrans *ist, pj_ice_strans_op op,
+                               pj_status_t status, char **msg,
+                               ElaSession **session)
+{
+    IceSession *ws = ist->session;
+    list_iterator_t iterator;
+    int len = 0;
+    int rc;
+
+    if (nrefs(ws) == 0)
+        return 0;
+
+rescan:
+    list_iterate(ws->base.streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+        IceHandler *handler;
+        int _len;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        handler = (IceHandler *)stream->handler;
+        if (handler->ist != ist || handler->stopping ||
+            (op == PJ_ICE_STRANS_OP_NEGOTIATION && !handler->started)) {
+            deref(stream);
+            continue;
+        }
+
+        _len = stream_ice_complete(stream, op, status, len ? NULL : msg);
+        if (_len > 0)
+            len = _len;
+
+        deref(stream);
+    }
+
+    *session = &ws->base;
+    return len;
+}
+
+/*
+ * The restart goes on in the session restart timer on the worker thread,
+ * pjnath may hold the group lock of the new transport here.
+ */
+static void restart_ice_complete(IceStrans *ist, pj_ice_strans_op op,
+                                 pj_status_t status)
+{
+    IceSession *session;
+    IceWorker *worker;
+
+    // Canceled.
+    if (!ist->stream)
+        return;
+
+    if (op == PJ_ICE_STRANS_OP_INIT) {
+        ist->gathered = 1;
+        ist->status = status;
+    } else if (op == PJ_ICE_STRANS_OP_NEGOTIATION) {
+        ist->completed = 1;
+        ist->result = status;
+    } else {
+        return;
+    }
+
+    session = (IceSession *)stream_get_session(&ist->stream->base);
+    worker = (IceWorker *)session_get_worker(&session->base);
+
+    if (session->restart.timer)
+        ice_worker_schedule_timer(&worker->base, session->restart.timer,
+                        (unsigned long)(get_monotonic_time() / 1000));
+}
+
+// Goes on in the multipath timer of the stream, like the restart.
+static void path_ice_complete(IceStrans *ist, pj_ice_strans_op op,
+                              pj_status_t status)
+{
+    IceHandler *handler;
+    IceWorker *worker;
+
+    // Stopped.
+    if (!ist->stream)
+        return;
+
+    if (op == PJ_ICE_STRANS_OP_INIT) {
+        ist->gathered = 1;
+        ist->status = status;
+    } else if (op == PJ_ICE_STRANS_OP_NEGOTIATION) {
+        ist->completed = 1;
+        ist->result = status;
+    } else {
+        return;
+    }
+
+    handler = (IceHandler *)ist->stream->handler;
+    worker = (IceWorker *)session_get_worker(stream_get_session(&ist->stream->base));
+
+    if (handler->multipath.timer)
+        ice_worker_schedule_timer(&worker->base, handler->multipath.timer,
+                        (unsigned long)(get_monotonic_time() / 1000));
+}
+
+static void stream_on_ice_complete(pj_ice_strans *ice_st, pj_ice_strans_op op,
+                                   pj_status_t status)
+{
+    IceStrans *ist;
+    IceStream *stream;
+    ElaSession *session = NULL;
+    char *msg = NULL;
+    int len;
+
+    pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ice_st);
+    pj_grp_lock_acquire(lock);
+
+    ist = (IceStrans *)pj_ice_strans_get_user_data(ice_st);
+    if (!ist) {
+        vlogE("Session: Stream internal error!");
         pj_grp_lock_release(lock);
         return;
     }
 
-    notify_state_changed(stream->handler, state);
+    if (ist->restarting) {
+        restart_ice_complete(ist, op, status);
+        pj_grp_lock_release(lock);
+        return;
+    }
+
+    if (ist->path) {
+        path_ice_complete(ist, op, status);
+        pj_grp_lock_release(lock);
+        return;
+    }
+
+    if (op == PJ_ICE_STRANS_OP_INIT) {
+        ist->gathered = 1;
+        ist->status = status;
+    }
+
+    if (ist->session) {
+        len = bundle_ice_complete(ist, op, status, &msg, &session);
+    } else {
+        stream = ist->stream;
+        if (!stream) {
+            // Pre-warmed in pool, the claiming stream picks up the result.
+            vlogD("Session: Pre-warmed ICE transport gathered (0x%x).",
+                  status == PJ_SUCCESS ? 0 : ELA_ICE_ERROR(status));
+            pj_grp_lock_release(lock);
+            return;
+        }
+
+        if (nrefs(stream) == 0) {
+            vlogE("Session: Stream internal error!");
+            pj_grp_lock_release(lock);
+            return;
+        }
+
+        len = stream_ice_complete(stream, op, status, &msg);
+        session = stream_get_session(&stream->base);
+    }
+
     pj_grp_lock_release(lock);
+
+    if (len > 0) {
+        session_send_trickle(session, msg, len);
+        free(msg);
+    }
 }
 
 const char *state_name[] = {
@@ -766,9 +1267,12 @@ const char *state_name[] = {
     "failed"
 };
 
+static void ice_handler_on_probe_ack(IceHandler *handler, const IceProbe *probe);
+
 static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         pj_size_t size, const pj_sockaddr_t *src_addr, unsigned src_addr_len)
 {
+    IceStrans *ist;
     IceStream *stream;
     IcePacket *packet;
     char addr[128];
@@ -782,7 +1286,29 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         return;
     }
 
-    stream = (IceStream *)pj_ice_strans_get_user_data(ice_st);
+    packet = (IcePacket *)data;
+
+    ist = (IceStrans *)pj_ice_strans_get_user_data(ice_st);
+    if (ist && ist->session) {
+        int index = packet->version & ~ICE_PACKET_BUNDLE;
+
+        // Bundled streams are addressed by the media index.
+        if (size < sizeof(IcePacket) ||
+            !(packet->version & ICE_PACKET_BUNDLE) ||
+            index >= ICE_BUNDLE_MAX_STREAMS ||
+            !ist->session->bundle.streams[index]) {
+            vlogW("Session: ICE bundle received data for unknown stream "
+                  "from %s, ignore.",
+                  pj_sockaddr_print(src_addr, addr, sizeof(addr), 3));
+            pj_grp_lock_release(lock);
+            return;
+        }
+
+        stream = ist->session->bundle.streams[index];
+    } else {
+        stream = ist ? ist->stream : NULL;
+    }
+
     if (!stream || nrefs(stream) == 0) {
         vlogE("Session: Stream internal error!");
         pj_grp_lock_release(lock);
@@ -794,17 +1320,20 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         vlogW("Stream: %d ICE state is %s, but received data from %s, ignore.",
               stream->base.id, state_name[stream->base.state],
               pj_sockaddr_print(src_addr, addr, sizeof(addr), 3));
+        stats_dropped(&stream->base.stats.transport);
         pj_grp_lock_release(lock);
         return;
     }
 
-    packet = (IcePacket *)data;
     packet->len = ntohs(packet->len);
-    if (packet->version != 0 || packet->len + sizeof(IcePacket) != size ||
-            packet->pkttype < PKT_SHUTDOWN || packet->pkttype > PKT_DATA) {
+    if ((!ist->session && packet->version != 0) ||
+            packet->len + sizeof(IcePacket) != size ||
+            packet->pkttype < PKT_SHUTDOWN || packet->pkttype > PKT_PROBE_ACK ||
+            (packet->pkttype >= PKT_PROBE && packet->len != sizeof(IceProbe))) {
         vlogW("Stream: %d ICE component %d received invalid data from %s, ignore.",
               stream->base.id, comp,
               pj_sockaddr_print(src_addr, addr, sizeof(addr), 3));
+        stats_dropped(&stream->base.stats.transport);
         pj_grp_lock_release(lock);
         return;
     }
@@ -816,6 +1345,28 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         vlogD("Stream: %d ICE stream receive keep-alive.", stream->base.id);
 
         gettimeofday(&stream->remote_timestamp, NULL);
+        if (ist->session)
+            ist->session->bundle.remote_timestamp = stream->remote_timestamp;
+    } else if (packet->pkttype == PKT_PROBE) {
+        packet->pkttype = PKT_PROBE_ACK;
+        packet->len = htons(packet->len);
+        pj_ice_strans_sendto(ice_st, comp, packet, size, src_addr,
+                             pj_sockaddr_get_len(src_addr));
+
+        gettimeofday(&stream->remote_timestamp, NULL);
+    } else if (packet->pkttype == PKT_PROBE_ACK) {
+        gettimeofday(&stream->remote_timestamp, NULL);
+
+        // The handler lock goes before the lock of an extra path.
+        if (ist->restarting || ist->path) {
+            pj_grp_lock_release(lock);
+            ice_handler_on_probe_ack((IceHandler *)stream->handler,
+                                     (const IceProbe *)packet->data);
+            return;
+        }
+
+        ice_handler_on_probe_ack((IceHandler *)stream->handler,
+                                 (const IceProbe *)packet->data);
     } else {
         // Copy to user data to FlexBuffer with 128 bytes prefixed space
         FlexBuffer *buf;
@@ -827,24 +1378,153 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
               pj_sockaddr_print(src_addr, addr, sizeof(addr), 3));
 
         gettimeofday(&stream->remote_timestamp, NULL);
+        if (ist->session)
+            ist->session->bundle.remote_timestamp = stream->remote_timestamp;
+        stats_received(&stream->base.stats.transport, size);
+
+        // The handlers above lock the stream, which is not this transport
+        // for a restart or an extra path.
+        if (ist->restarting || ist->path) {
+            pj_grp_lock_release(lock);
+            stream->handler->on_data(stream->handler, buf);
+            return;
+        }
+
         stream->handler->on_data(stream->handler, buf);
     }
 
     pj_grp_lock_release(lock);
 }
 
-static void ice_handler_destroy(void *p)
+static pj_status_t ice_strans_create(IceWorker *worker,
+                                     const pj_ice_strans_cfg *cfg,
+                                     IceStream *stream, int restarting,
+                                     int path, IceStrans **ist)
 {
-    IceHandler *handler = (IceHandler *)p;
-    IceStream *stream = (IceStream *)handler->base.stream;
-    IceSession *session = (IceSession *)stream_get_session(&stream->base);
+    IceStrans *_ist;
+    pj_ice_strans_cb cbs;
+    pj_status_t status;
+
+    _ist = (IceStrans *)pj_pool_zalloc(worker->pool, sizeof(IceStrans));
+    if (!_ist)
+        return PJ_ENOMEM;
+
+    _ist->stream = stream;
+    _ist->restarting = restarting;
+    _ist->path = path;
+
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.on_ice_complete = stream_on_ice_complete;
+    cbs.on_rx_data = stream_on_rx_data;
+
+    status = pj_ice_strans_create(NULL, cfg, 1, _ist, &cbs, &_ist->st);
+    if (status != PJ_SUCCESS)
+        return status;
+
+    *ist = _ist;
+    return PJ_SUCCESS;
+}
+
+/*
+ * The ICE restart swaps the transport of the handler with the group lock of
+ * the old transport held, lock again if the transport changed meanwhile.
+ */
+static pj_grp_lock_t *ice_handler_lock(IceHandler *handler)
+{
+    pj_grp_lock_t *lock;
+
+    for (;;) {
+        lock = pj_ice_strans_get_grp_lock(handler->st);
+        pj_grp_lock_acquire(lock);
+
+        if (lock == pj_ice_strans_get_grp_lock(handler->st))
+            return lock;
+
+        pj_grp_lock_release(lock);
+    }
+}
+
+/*
+ * Drop the transport of an ICE restart, with the handler locked. The
+ * returned transport is to destroy after the lock released, the data it
+ * receives goes up the stream with its own lock held.
+ */
+static pj_ice_strans *ice_handler_cancel_restart(IceHandler *handler)
+{
+    IceStrans *ist = handler->restart.ist;
+
+    handler->restart.ist = NULL;
+    handler->restart.initialized = 0;
+    handler->restart.remote = 0;
+    handler->restart.checking = 0;
+
+    if (!ist)
+        return NULL;
+
+    ist->stream = NULL;
+    ist->session = NULL;
+    return ist->st;
+}
+
+static void ice_strans_destroy(pj_ice_strans *st)
+{
+    if (!st)
+        return;
+
+    if (pj_ice_strans_has_sess(st))
+        pj_ice_strans_stop_ice(st);
+
+    pj_ice_strans_destroy(st);
+}
+
+static void ice_handler_destroy(void *p)
+{
+    IceHandler *handler = (IceHandler *)p;
+    IceStream *stream = (IceStream *)handler->base.stream;
+    IceSession *session = (IceSession *)stream_get_session(&stream->base);
     IceTransport *transport = (IceTransport *)stream_get_transport(handler->base.stream);
+    int i;
 
     prepare_thread_context(transport);
 
     if (stream->keepalive_timer)
         ice_worker_destroy_timer(session->base.worker, stream->keepalive_timer);
 
+    if (handler->restart.ist)
+        ice_strans_destroy(ice_handler_cancel_restart(handler));
+
+    if (handler->multipath.timer)
+        ice_worker_destroy_timer(session->base.worker, handler->multipath.timer);
+
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        IcePath *path = handler->multipath.paths[i];
+
+        if (!path)
+            continue;
+
+        if (path->ist) {
+            path->ist->stream = NULL;
+            ice_strans_destroy(path->ist->st);
+        }
+
+        free(path);
+    }
+
+    if (handler->ist && handler->ist->session) {
+        pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(handler->st);
+        int owners;
+
+        pj_grp_lock_acquire(lock);
+        owners = --handler->ist->owners;
+        if (!owners && session->bundle.ist == handler->ist)
+            session->bundle.ist = NULL;
+        pj_grp_lock_release(lock);
+
+        // The other bundled streams still use the transport.
+        if (owners > 0)
+            handler->st = NULL;
+    }
+
     if (handler->st) {
         if (pj_ice_strans_has_sess(handler->st))
             pj_ice_strans_stop_ice(handler->st);
@@ -855,26 +1535,145 @@ static void ice_handler_destroy(void *p)
     vlogD("Stream: %d ICE handler destroyed.", handler->base.stream->id);
 }
 
+/*
+ * In bundle mode, the first stream of a session creates the ICE transport
+ * and the later streams join it instead of creating their own. Must be
+ * called with the group lock held.
+ */
+static void ice_strans_bundle(IceStrans *ist, IceSession *session)
+{
+    ist->session = session;
+    ist->owners = 1;
+    ist->users = 1;
+
+    session->bundle.ist = ist;
+}
+
+static int ice_handler_join_bundle(IceHandler *handler, IceStrans *ist)
+{
+    StreamHandler *base = &handler->base;
+    pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ist->st);
+
+    pj_grp_lock_acquire(lock);
+
+    if (ist->owners >= ICE_BUNDLE_MAX_STREAMS) {
+        pj_grp_lock_release(lock);
+        deref(base->stream);
+        vlogE("Stream: %d ICE handler init failed: too many bundled streams.",
+              base->stream->id);
+        return ELA_GENERAL_ERROR(ELAERR_LIMIT_EXCEEDED);
+    }
+
+    ist->owners++;
+    ist->users++;
+
+    handler->ist = ist;
+    handler->st = ist->st;
+
+    // Otherwise the gathering completion notifies all bundled streams.
+    if (handler->trickle.enabled)
+        notify_state_changed(base, ElaStreamState_initialized);
+    else if (ist->gathered)
+        notify_state_changed(base, ist->status == PJ_SUCCESS ?
+                             ElaStreamState_initialized :
+                             ElaStreamState_failed);
+
+    pj_grp_lock_release(lock);
+
+    vlogD("Stream: %d ICE handler initialized with bundled transport.",
+          base->stream->id);
+    return 0;
+}
+
+static bool ice_handler_warm_callback(void *user_data)
+{
+    IceHandler *handler = (IceHandler *)user_data;
+    pj_grp_lock_t *lock;
+
+    lock = ice_handler_lock(handler);
+
+    // Nothing else notified the stream meanwhile, it's still raw.
+    if (!handler->stopping && handler->base.stream->state == 0)
+        notify_state_changed(&handler->base, handler->warm.state);
+
+    pj_grp_lock_release(lock);
+
+    return false;
+}
+
+// Notify the state of a pre-warmed transport from the worker's timer.
+static void ice_handler_defer_state(IceHandler *handler, IceWorker *worker,
+                                    int state)
+{
+    int rc;
+
+    handler->warm.state = state;
+
+    rc = ice_worker_create_timer(&worker->base,
+                                 handler->base.stream->id | 0x00040000, 0,
+                                 ice_handler_warm_callback, handler,
+                                 &handler->warm.timer);
+    if (rc != 0) {
+        vlogW("Stream: %d ICE handler create warm timer error: %08X, "
+              "notify directly.", handler->base.stream->id, rc);
+        notify_state_changed(&handler->base, state);
+    }
+}
+
 static int ice_handler_init(StreamHandler *base)
 {
     IceHandler *handler = (IceHandler *)base;
     IceSession *session = (IceSession *)stream_get_session(base->stream);
     IceWorker  *worker  = (IceWorker *)session_get_worker(&session->base);
     IceTransport *transport = (IceTransport *)stream_get_transport(base->stream);
-    pj_ice_strans_cb cbs;
+    IceStrans *ist;
     pj_status_t status;
 
     prepare_thread_context(transport);
 
-    cbs.on_ice_complete = stream_on_ice_complete;
-    cbs.on_rx_data = stream_on_rx_data;
-
     // avoid memory-inreference for removing stream or closing session
     // in the callback of pj-nath.
     ref(base->stream);
 
-    status = pj_ice_strans_create(NULL, &worker->cfg, 1, base->stream, &cbs,
-                                  &handler->st);
+    handler->trickle.enabled = session->base.trickle;
+
+    if (session->base.bundle && session->bundle.ist)
+        return ice_handler_join_bundle(handler, session->bundle.ist);
+
+    ist = worker->warm;
+    if (ist) {
+        pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ist->st);
+
+        worker->warm = NULL;
+
+        pj_grp_lock_acquire(lock);
+        ist->stream = (IceStream *)base->stream;
+        handler->ist = ist;
+        handler->st = ist->st;
+
+        if (session->base.bundle)
+            ice_strans_bundle(ist, session);
+
+        // Gathering completed before the claim, nobody notified the stream.
+        // In trickle mode go on with what is there. Either way the stream
+        // learns it on the worker, after the pipeline init returned.
+        if (handler->trickle.enabled)
+            ice_handler_defer_state(handler, worker, ElaStreamState_initialized);
+        else if (ist->gathered)
+            ice_handler_defer_state(handler, worker,
+                                    ist->status == PJ_SUCCESS ?
+                                    ElaStreamState_initialized :
+                                    ElaStreamState_failed);
+        pj_grp_lock_release(lock);
+
+        vlogD("Stream: %d ICE handler initialized with pre-warmed transport "
+              "(%s).", base->stream->id,
+              ist->gathered ? "gathered" : "gathering");
+        return 0;
+    }
+
+    status = ice_strans_create(worker, &worker->cfg,
+                               (IceStream *)base->stream, 0, 0, &ist);
     if (status != PJ_SUCCESS) {
         deref(base->stream);
         vlogE("Stream: %d ICE handler init failed: %s.",
@@ -882,45 +1681,129 @@ static int ice_handler_init(StreamHandler *base)
         return ELA_ICE_ERROR(status);
     }
 
+    handler->ist = ist;
+    handler->st = ist->st;
+
+    if (session->base.bundle) {
+        pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ist->st);
+
+        pj_grp_lock_acquire(lock);
+        ice_strans_bundle(ist, session);
+        pj_grp_lock_release(lock);
+    }
+
+    // Host candidates are ready once the transport created, others trickle.
+    if (handler->trickle.enabled)
+        notify_state_changed(base, ElaStreamState_initialized);
+
     vlogD("Stream: %d ICE handler initialized.", base->stream->id);
 
     return 0;
 }
 
 static int ice_handler_write_packet(IceHandler *handler, int comp, IcePacket *packet);
+static int ice_session_request_restart(IceSession *session);
+static bool ice_handler_multipath_routine(void *user_data);
+static pj_ice_strans *ice_handler_pick_path(IceHandler *handler,
+                                            pj_sockaddr *addr);
+static void ice_handler_stop_paths(IceHandler *handler);
+
+/*
+ * The keep-alive goes out only after the stream was idle for the interval,
+ * all the traffic of the stream keeps the NAT bindings as well. The
+ * interval starts at the default and adapts to the NAT binding lifetime
+ * seen on the path: the peer reaching us through nearly a whole silent
+ * interval of ours proves the bindings live that long, so the interval
+ * grows a step, up to the maximum under the restart interval of the peer.
+ * The peer going silent may be a binding lost within the interval, so the
+ * interval halves, down to the minimum.
+ */
+static void ice_keepalive_adapt(IceStream *stream, IceKeepalive *ka,
+                                long silent, long held)
+{
+    int interval = ka->interval;
+
+    if (silent >= (ICE_RESTART_INTERVAL * 1000L)) {
+        if (!ka->backed_off) {
+            interval = interval / 2;
+            if (interval < ICE_KEEPALIVE_MIN_INTERVAL)
+                interval = ICE_KEEPALIVE_MIN_INTERVAL;
+            ka->backed_off = 1;
+        }
+    } else {
+        ka->backed_off = 0;
+
+        if (held >= ((ka->interval - ICE_KEEPALIVE_CHECK_INTERVAL) * 1000L)) {
+            interval = ka->interval + ICE_KEEPALIVE_STEP;
+            if (interval > ICE_KEEPALIVE_MAX_INTERVAL)
+                interval = ICE_KEEPALIVE_MAX_INTERVAL;
+        }
+    }
+
+    if (interval != ka->interval) {
+        vlogD("Session: Ice stream %d keep-alive interval %d -> %d ms.",
+              stream->base.id, ka->interval, interval);
+        ka->interval = interval;
+    }
+}
 
 static bool ice_stream_keepalive_callback(void *user_data)
 {
     IceStream *stream = (IceStream *)user_data;
+    IceHandler *handler = (IceHandler *)stream->handler;
+    struct timeval *local = &stream->local_timestamp;
+    struct timeval *remote = &stream->remote_timestamp;
+    IceKeepalive *ka = &stream->keepalive;
     struct timeval now;
     long interval;
+    long silent;
 
     if (stream->base.state < ElaStreamState_connected)
         return true;
     else if (stream->base.state > ElaStreamState_connected)
         return false;
 
+    // Bundled streams share the liveness of the transport.
+    if (handler->ist && handler->ist->session) {
+        local = &handler->ist->session->bundle.local_timestamp;
+        remote = &handler->ist->session->bundle.remote_timestamp;
+        ka = &handler->ist->session->bundle.keepalive;
+    }
+
     gettimeofday(&now, NULL);
 
     // Check peer timeout
-    interval = (now.tv_sec * 1000000 + now.tv_usec) -
-               (stream->remote_timestamp.tv_sec * 1000000 + stream->remote_timestamp.tv_usec);
+    silent = (now.tv_sec * 1000000 + now.tv_usec) -
+             (remote->tv_sec * 1000000 + remote->tv_usec);
 
-    if (interval >= (DEFAULT_TIMEOUT_INTERVAL * 1000)) {
+    if (silent >= (DEFAULT_TIMEOUT_INTERVAL * 1000)) {
         // Peer timeout, trade as close.
         vlogD("Session: Ice stream %d timeout.", stream->base.id);
         notify_state_changed(stream->handler, ElaStreamState_closed);
         return false;
     }
 
+    // The path may be gone with the network of either side, move the stream
+    // to a new one before it times out.
+    if (silent >= (ICE_RESTART_INTERVAL * 1000)) {
+        vlogD("Session: Ice stream %d peer silent, restart ICE.",
+              stream->base.id);
+        ice_session_request_restart(
+                    (IceSession *)stream_get_session(&stream->base));
+        ice_keepalive_adapt(stream, ka, silent, 0);
+    }
+
     // Check need send keepalive
     interval = (now.tv_sec * 1000000 + now.tv_usec) -
-               (stream->local_timestamp.tv_sec * 1000000 + stream->local_timestamp.tv_usec);
+               (local->tv_sec * 1000000 + local->tv_usec);
 
-    if (interval >= (DEFAULT_KEEPALIVE_INTERVAL * 1000)) {
+    if (interval >= (ka->interval * 1000L)) {
         // Need send keep-alive
         vlogD("Session: Ice stream %d send keep-alive.", stream->base.id);
 
+        // How long the peer got through since we went silent.
+        ice_keepalive_adapt(stream, ka, silent, interval - silent);
+
         IcePacket packet;
         packet.version = 0;
         packet.pkttype = PKT_KEEPALIVE;
@@ -946,6 +1829,13 @@ static int ice_handler_prepare(StreamHandler *base)
     prepare_thread_context(transport);
 
     if (pj_ice_strans_has_sess(handler->st)) {
+        if (handler->ist->session) {
+            // Prepared by another bundled stream.
+            vlogD("Stream: %d ICE handler prepared with bundle.", stream->base.id);
+            notify_state_changed(base, ElaStreamState_transport_ready);
+            return 0;
+        }
+
         vlogW("Stream: %d ICE handler already prepared.", stream->base.id);
         return 0;
     }
@@ -959,7 +1849,10 @@ static int ice_handler_prepare(StreamHandler *base)
     ufrag = pj_str(session->ufrag);
     pwd = pj_str(session->pwd);
 
-    status = pj_ice_strans_init_ice(handler->st, session->role, &ufrag, &pwd);
+    status = ice_handler_set_options(handler, handler->st);
+    if (status == PJ_SUCCESS)
+        status = pj_ice_strans_init_ice(handler->st, session->role,
+                                        &ufrag, &pwd);
     if (status != PJ_SUCCESS) {
         state = ElaStreamState_failed;
         vlogD("Stream: %d ICE handler prepare error: %s.", stream->base.id,
@@ -980,8 +1873,6 @@ static int ice_handler_start(StreamHandler *base)
     IceSession *session = (IceSession *)stream_get_session(base->stream);
     IceTransport *transport = (IceTransport *)stream_get_transport(base->stream);
     pj_status_t status;
-    pj_str_t rufrag;
-    pj_str_t rpwd;
     int rc;
 
     assert(handler->remote.cand_cnt > 0 && handler->remote.comp_cnt > 0);
@@ -994,8 +1885,12 @@ static int ice_handler_start(StreamHandler *base)
         return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
     }
 
+    stream->keepalive.interval = DEFAULT_KEEPALIVE_INTERVAL;
+    stream->keepalive.backed_off = 0;
+
     rc = ice_worker_create_timer(session->base.worker, stream->base.id | 0x00010000,
-                                 10000, ice_stream_keepalive_callback,
+                                 ICE_KEEPALIVE_CHECK_INTERVAL,
+                                 ice_stream_keepalive_callback,
                                  stream, &stream->keepalive_timer);
     if (rc != 0) {
         vlogE("Stream: %d ICE handler create keep-alive timer error: %08X.",
@@ -1003,15 +1898,58 @@ static int ice_handler_start(StreamHandler *base)
         return rc;
     }
 
+    // The extra paths run on their own transports, not with a bundle.
+    if (stream->base.multipath && !handler->ist->session) {
+        rc = ice_worker_create_timer(session->base.worker,
+                                     stream->base.id | 0x00030000,
+                                     ICE_PATH_TIMER_INTERVAL,
+                                     ice_handler_multipath_routine,
+                                     stream, &handler->multipath.timer);
+        if (rc != 0) {
+            vlogE("Stream: %d ICE handler create multipath timer error: %08X.",
+                  stream->base.id, rc);
+            return rc;
+        }
+
+        handler->multipath.enabled = 1;
+    }
+
+    if (handler->ist->session) {
+        pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(handler->st);
+
+        pj_grp_lock_acquire(lock);
+        handler->started = 1;
+
+        gettimeofday(&stream->local_timestamp, NULL);
+        gettimeofday(&stream->remote_timestamp, NULL);
+
+        // Checks started by another bundled stream.
+        if (pj_ice_strans_sess_is_running(handler->st) ||
+            pj_ice_strans_sess_is_complete(handler->st)) {
+            notify_state_changed(base, ElaStreamState_connecting);
+            if (pj_ice_strans_sess_is_complete(handler->st))
+                notify_state_changed(base, ElaStreamState_connected);
+            pj_grp_lock_release(lock);
+
+            vlogD("Stream: %d ICE handler started with bundle.", stream->base.id);
+            return 0;
+        }
+
+        session->bundle.local_timestamp = stream->local_timestamp;
+        session->bundle.remote_timestamp = stream->remote_timestamp;
+        session->bundle.keepalive = stream->keepalive;
+        pj_grp_lock_release(lock);
+    } else {
+        handler->started = 1;
+    }
+
     notify_state_changed(base, ElaStreamState_connecting);
 
     gettimeofday(&stream->local_timestamp, NULL);
     gettimeofday(&stream->remote_timestamp, NULL);
 
-    status = pj_ice_strans_start_ice(handler->st,
-                                     pj_cstr(&rufrag, handler->remote.ufrag),
-                                     pj_cstr(&rpwd, handler->remote.pwd),
-                                     handler->remote.cand_cnt, handler->remote.cand);
+    status = ice_handler_start_checks(handler, handler->st,
+                                      &handler->remote);
     if (status == PJ_SUCCESS) {
         vlogD("Stream: %d ICE handler starting negotiation...", stream->base.id);
     } else {
@@ -1030,12 +1968,12 @@ static void ice_handler_stop(StreamHandler *base, int error)
     IceStream  *stream  = (IceStream *)base->stream;
     IceSession *session = (IceSession *)stream_get_session(base->stream);
     IceTransport *transport = (IceTransport *)stream_get_transport(base->stream);
+    pj_ice_strans *restart_st;
     pj_grp_lock_t *lock;
 
     prepare_thread_context(transport);
 
-    lock = pj_ice_strans_get_grp_lock(handler->st);
-    pj_grp_lock_acquire(lock);
+    lock = ice_handler_lock(handler);
 
     if (handler->stopping) {
         pj_grp_lock_release(lock);
@@ -1061,15 +1999,43 @@ static void ice_handler_stop(StreamHandler *base, int error)
         base->on_state_changed(base, state);
     }
 
+    restart_st = ice_handler_cancel_restart(handler);
     pj_grp_lock_release(lock);
 
+    ice_strans_destroy(restart_st);
+
+    ice_handler_stop_paths(handler);
+
     if (stream->keepalive_timer) {
         ice_worker_destroy_timer(session->base.worker, stream->keepalive_timer);
         stream->keepalive_timer = NULL;
     }
 
+    if (handler->multipath.timer) {
+        ice_worker_destroy_timer(session->base.worker, handler->multipath.timer);
+        handler->multipath.timer = NULL;
+    }
+
+    if (handler->warm.timer) {
+        ice_worker_destroy_timer(session->base.worker, handler->warm.timer);
+        handler->warm.timer = NULL;
+    }
+
     if (pj_ice_strans_has_sess(handler->st)) {
-        pj_ice_strans_stop_ice(handler->st);
+        int users = 0;
+
+        if (handler->ist->session) {
+            pj_grp_lock_acquire(lock);
+            users = --handler->ist->users;
+            if (handler->media_index < ICE_BUNDLE_MAX_STREAMS &&
+                session->bundle.streams[handler->media_index] == stream)
+                session->bundle.streams[handler->media_index] = NULL;
+            pj_grp_lock_release(lock);
+        }
+
+        // The other bundled streams still use the ICE session.
+        if (users <= 0)
+            pj_ice_strans_stop_ice(handler->st);
 
         // to  match the 'ref' operation before 'pj_ice_strans_create'.
         deref(base->stream);
@@ -1089,12 +2055,28 @@ int ice_handler_write_packet(IceHandler *handler, int comp, IcePacket *packet)
     // We should guarantee total packet length <= PJ_STUN_SOCK_PKT_LEN
     assert(packet->len + sizeof(IcePacket) <= PJ_STUN_SOCK_PKT_LEN);
 
+    if (handler->ist->session)
+        packet->version = ICE_PACKET_BUNDLE | (uint8_t)handler->media_index;
+
     len = sizeof(IcePacket) + packet->len;
     packet->len = htons(packet->len);
 
+    if (handler->multipath.enabled && packet->pkttype == PKT_DATA) {
+        pj_sockaddr addr;
+        pj_ice_strans *st;
+
+        st = ice_handler_pick_path(handler, &addr);
+        if (st) {
+            status = pj_ice_strans_sendto(st, (unsigned)comp, packet, len,
+                                          &addr, pj_sockaddr_get_len(&addr));
+            goto sent;
+        }
+    }
+
     status = pj_ice_strans_sendto(handler->st, (unsigned)comp, packet, len,
                                   &handler->remote.def_addr[comp-1],
                                   pj_sockaddr_get_len(&handler->remote.def_addr[0]));
+sent:
     if (status != PJ_SUCCESS) {
         vlogW("Session: ICE handler %d sending data error: %s", stream->base.id,
               ice_strerror(status));
@@ -1104,6 +2086,8 @@ int ice_handler_write_packet(IceHandler *handler, int comp, IcePacket *packet)
     }
 
     gettimeofday(&stream->local_timestamp, NULL);
+    if (handler->ist->session)
+        handler->ist->session->bundle.local_timestamp = stream->local_timestamp;
 
     return 0;
 }
@@ -1134,9 +2118,12 @@ ssize_t ice_handler_write(StreamHandler *base, FlexBuffer *buf)
     if (rc != 0) {
         vlogE("Stream: %d ICE handler write date error %d.",
               base->stream->id, rc);
+        stats_dropped(&base->stream->stats.transport);
         return rc;
     }
 
+    stats_sent(&base->stream->stats.transport, len + sizeof(IcePacket));
+
     vlogT("Stream: %d ICE handler sent %zu bytes data.", base->stream->id, len);
     return len;
 }
@@ -1168,36 +2155,32 @@ static int ice_stream_get_info(ElaStream *base, ElaTransportInfo *info)
     }
 
     cand = check->lcand;
-    inet_ntop(((struct sockaddr *)&cand->addr)->sa_family,
-              &((struct sockaddr_in *)&cand->addr)->sin_addr,
-              info->local.addr, sizeof(info->local.addr));
-    info->local.port = ntohs(((struct sockaddr_in *)&cand->addr)->sin_port);
+    pj_sockaddr_print(&cand->addr, info->local.addr,
+                      sizeof(info->local.addr), 0);
+    info->local.port = pj_sockaddr_get_port(&cand->addr);
     info->local.type = (int)cand->type;
     ltype = cand->type;
 
     if (ltype != PJ_ICE_CAND_TYPE_HOST) {
-        inet_ntop(((struct sockaddr *)&cand->rel_addr)->sa_family,
-                  &((struct sockaddr_in *)&cand->rel_addr)->sin_addr,
-                  info->local.related_addr, sizeof(info->local.related_addr));
-        info->local.related_port = ntohs(((struct sockaddr_in *)&cand->rel_addr)->sin_port);
+        pj_sockaddr_print(&cand->rel_addr, info->local.related_addr,
+                          sizeof(info->local.related_addr), 0);
+        info->local.related_port = pj_sockaddr_get_port(&cand->rel_addr);
     } else {
         info->local.related_addr[0] = 0;
         info->local.related_port = 0;
     }
 
     cand = check->rcand;
-    inet_ntop(((struct sockaddr *)&cand->addr)->sa_family,
-              &((struct sockaddr_in *)&cand->addr)->sin_addr,
-              info->remote.addr, sizeof(info->remote.addr));
-    info->remote.port = ntohs(((struct sockaddr_in *)&cand->addr)->sin_port);
+    pj_sockaddr_print(&cand->addr, info->remote.addr,
+                      sizeof(info->remote.addr), 0);
+    info->remote.port = pj_sockaddr_get_port(&cand->addr);
     info->remote.type = (int)cand->type;
     rtype = cand->type;
 
     if (rtype != PJ_ICE_CAND_TYPE_HOST && rtype != PJ_ICE_CAND_TYPE_PRFLX) {
-        inet_ntop(((struct sockaddr *)&cand->rel_addr)->sa_family,
-                  &((struct sockaddr_in *)&cand->rel_addr)->sin_addr,
-                  info->remote.related_addr, sizeof(info->remote.related_addr));
-        info->remote.related_port = ntohs(((struct sockaddr_in *)&cand->rel_addr)->sin_port);
+        pj_sockaddr_print(&cand->rel_addr, info->remote.related_addr,
+                          sizeof(info->remote.related_addr), 0);
+        info->remote.related_port = pj_sockaddr_get_port(&cand->rel_addr);
     } else {
         info->remote.related_addr[0] = 0;
         info->remote.related_port = 0;
@@ -1227,11 +2210,9 @@ static void ice_stream_lock(ElaStream *base)
     IceStream *stream = (IceStream *)base;
     IceHandler *handler = (IceHandler *)stream->handler;
     IceTransport *transport = (IceTransport *)stream_get_transport(base);
-    pj_grp_lock_t *lock;
 
     prepare_thread_context(transport);
-    lock = pj_ice_strans_get_grp_lock(handler->st);
-    pj_grp_lock_acquire(lock);
+    ice_handler_lock(handler);
 }
 
 static void ice_stream_unlock(ElaStream *base)
@@ -1246,80 +2227,463 @@ static void ice_stream_unlock(ElaStream *base)
     pj_grp_lock_release(lock);
 }
 
-static int ice_session_apply_remote_sdp(ElaSession *base,
-                                        const char *sdp, size_t len)
+static int ice_remote_append_candidate(IceRemote *remote,
+                                       const char *foundation,
+                                       int comp_id, pj_uint32_t prio,
+                                       pj_ice_cand_type type,
+                                       const pj_sockaddr *addr,
+                                       const pj_sockaddr *rel_addr)
 {
-    IceSession *session = (IceSession *)base;
-    IceWorker  *worker  = (IceWorker *)session_get_worker(base);
-    IceTransport *transport = (IceTransport *)session_get_transport(base);
-    pjmedia_sdp_session *p_sdp;
-    pj_pool_t *pool;
-    pj_str_t ufrag = { NULL, 0 };
-    pj_str_t pwd = { NULL, 0 };
-    pj_str_t nonce = { NULL, 0 };
-    pj_status_t status;
-    list_iterator_t iterator;
-    int media_index;
-    int i;
-    int rc;
-    int fmt, ops = 0;
+    pj_ice_sess_cand *cand;
+    char *_foundation;
 
-    assert(base && sdp && len);
+    if (remote->cand_cnt >= PJ_ARRAY_SIZE(remote->cand))
+        return ELA_GENERAL_ERROR(ELAERR_LIMIT_EXCEEDED);
 
-    prepare_thread_context(transport);
+    if (comp_id <= 0 || comp_id > PJ_ICE_MAX_COMP ||
+        strlen(foundation) >= sizeof(remote->foundation[0]))
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
 
-    pool = pj_pool_create(&worker->cp.factory, NULL, 4096, 512, NULL);
-    if (!pool)
-        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+    cand = &remote->cand[remote->cand_cnt];
+    memset(cand, 0, sizeof(*cand));
 
-    status = pjmedia_sdp_parse(pool, (char *)sdp, len, &p_sdp);
-    if (status != PJ_SUCCESS) {
-        pj_pool_release(pool);
-        return ELA_ICE_ERROR(status);
-    }
+    // Keep the foundation here, the candidate outlives the parser.
+    _foundation = remote->foundation[remote->cand_cnt];
+    strcpy(_foundation, foundation);
 
-    if (pj_strcmp2(&p_sdp->name, "elastos-ice-session") != 0) {
-        pj_pool_release(pool);
+    cand->type = type;
+    cand->comp_id = (pj_uint8_t)comp_id;
+    cand->foundation = pj_str(_foundation);
+    cand->prio = prio;
+
+    pj_sockaddr_cp(&cand->addr, addr);
+    if (rel_addr)
+        pj_sockaddr_cp(&cand->rel_addr, rel_addr);
+
+    if (comp_id > (int)remote->comp_cnt)
+        remote->comp_cnt = comp_id;
+
+    remote->cand_cnt++;
+    return 0;
+}
+
+static int ice_remote_add_candidate(IceRemote *remote, const char *value)
+{
+    int comp_id, prio, port, rport;
+    int cnt;
+    int af;
+    char foundation[33], transport[13], ipaddr[81], type[33], raddr[81];
+    pj_ice_cand_type cand_type;
+    pj_sockaddr addr;
+    pj_sockaddr rel_addr;
+    pj_str_t str_ipaddr;
+
+    cnt = sscanf(value,
+                 "%32s %d %12s %d %80s %d typ %32s raddr %80s rport %d",
+                 foundation,
+                 &comp_id,
+                 transport,
+                 &prio,
+                 ipaddr,
+                 &port,
+                 type,
+                 raddr,
+                 &rport);
+    if (cnt != 7 && cnt != 9)
         return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
-    }
 
-    rc = (int)base58_decode(p_sdp->origin.user.ptr, p_sdp->origin.user.slen,
-                            base->peer_pubkey, sizeof(base->peer_pubkey));
-    if (rc < 0) {
-        vlogE("Session: Parse peer public key error.");
-        pj_pool_release(pool);
+    if (strcmp(type, "host")==0)
+        cand_type = PJ_ICE_CAND_TYPE_HOST;
+    else if (strcmp(type, "srflx")==0)
+        cand_type = PJ_ICE_CAND_TYPE_SRFLX;
+    else if (strcmp(type, "relay")==0)
+        cand_type = PJ_ICE_CAND_TYPE_RELAYED;
+    else if (strcmp(type, "prflx")==0)
+        cand_type = PJ_ICE_CAND_TYPE_PRFLX;
+    else
         return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
-    }
 
-    for (i = 0; i < (int)p_sdp->attr_count; i++) {
-        if (pj_strcmp2(&p_sdp->attr[i]->name, "ice-ufrag") == 0)
-            ufrag = p_sdp->attr[i]->value;
-        else if (pj_strcmp2(&p_sdp->attr[i]->name, "ice-pwd") == 0)
-            pwd = p_sdp->attr[i]->value;
-        else if (pj_strcmp2(&p_sdp->attr[i]->name, "nonce") == 0)
-            nonce = p_sdp->attr[i]->value;
+    if (strchr(ipaddr, ':'))
+        af = pj_AF_INET6();
+    else
+        af = pj_AF_INET();
+
+    str_ipaddr = pj_str(ipaddr);
+    pj_sockaddr_init(af, &addr, &str_ipaddr, (pj_uint16_t)port);
+    if (cnt == 9) {
+        pj_str_t str_rpaddr = pj_str(raddr);
+        pj_sockaddr_init(af, &rel_addr, &str_rpaddr, (pj_uint16_t)rport);
     }
 
-    if (nonce.ptr && session->role != PJ_ICE_SESS_ROLE_CONTROLLING)
-        crypto_nonce_from_str(base->nonce, nonce.ptr, nonce.slen);
+    return ice_remote_append_candidate(remote, foundation, comp_id,
+                                       (pj_uint32_t)prio, cand_type,
+                                       &addr, cnt == 9 ? &rel_addr : NULL);
+}
 
-rescan:
-    media_index = 0;
-    list_iterate(base->streams, &iterator);
-    while (list_iterator_has_next(&iterator)) {
-        int af;
-        int cand_index = 0;
-        IceStream *stream;
-        IceHandler *handler;
+/*
+ * Check the path nominated by the last session to the peer first. The
+ * remote candidate of the path is raised to the top priority, so the
+ * pairs with it lead the check list, and the other pairs still follow
+ * in case the path is gone.
+ */
+static void ice_handler_promote_remote_candidate(IceHandler *handler,
+                                                 const ElaAddressInfo *path)
+{
+    pj_sockaddr addr;
+    pj_str_t str_addr;
+    pj_uint32_t prio = 0;
+    pj_ice_sess_cand *found = NULL;
+    unsigned i;
+    int af;
 
-        rc = list_iterator_next(&iterator, (void **)&stream);
-        if (rc == 0)
-            break;
+    if (!path->addr[0] || path->port <= 0)
+        return;
 
-        if (rc == -1)
-            goto rescan;
+    if (strchr(path->addr, ':'))
+        af = pj_AF_INET6();
+    else
+        af = pj_AF_INET();
 
-        handler = (IceHandler *)stream->handler;
+    str_addr = pj_str((char *)path->addr);
+    if (pj_sockaddr_init(af, &addr, &str_addr,
+                         (pj_uint16_t)path->port) != PJ_SUCCESS)
+        return;
+
+    for (i = 0; i < handler->remote.cand_cnt; i++) {
+        pj_ice_sess_cand *cand = &handler->remote.cand[i];
+
+        if (cand->prio > prio)
+            prio = cand->prio;
+
+        if (!found && pj_sockaddr_cmp(&cand->addr, &addr) == 0)
+            found = cand;
+    }
+
+    if (!found || found->prio == prio || prio == 0xFFFFFFFF)
+        return;
+
+    found->prio = prio + 1;
+
+    vlogD("Stream: %d ICE checks the resumed path %s:%d first.",
+          handler->base.stream->id, path->addr, path->port);
+}
+
+static int ice_stream_get_options(IceStream *stream)
+{
+    int ops = 0;
+
+    if (stream->base.unencrypt)
+        ops |= ELA_STREAM_PLAIN;
+    if (stream->base.multiplexing)
+        ops |= ELA_STREAM_MULTIPLEXING;
+    if (stream->base.reliable)
+        ops |= ELA_STREAM_RELIABLE;
+    if (stream->base.portforwarding)
+        ops |= ELA_STREAM_PORT_FORWARDING;
+    if (stream->base.framing)
+        ops |= ELA_STREAM_MESSAGE_FRAMING;
+    if (stream->base.multipath)
+        ops |= ELA_STREAM_MULTIPATH;
+
+    return ops;
+}
+
+static int ice_sockaddr_from_bytes(pj_sockaddr *addr,
+                                   flatbuffers_uint8_vec_t bytes,
+                                   uint16_t port)
+{
+    size_t len = flatbuffers_uint8_vec_len(bytes);
+    int af;
+
+    if (len == sizeof(pj_in_addr))
+        af = pj_AF_INET();
+    else if (len == sizeof(pj_in6_addr))
+        af = pj_AF_INET6();
+    else
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+
+    pj_sockaddr_init(af, addr, NULL, port);
+    memcpy(pj_sockaddr_get_addr(addr), bytes, len);
+
+    return 0;
+}
+
+static int ice_handler_apply_compact_candidate(IceHandler *handler,
+                                               elaoffer_candidate_table_t cand)
+{
+    flatbuffers_string_t foundation;
+    pj_sockaddr addr;
+    pj_sockaddr rel_addr;
+    int has_rel_addr;
+    int type;
+    int rc;
+
+    foundation = elaoffer_candidate_foundation(cand);
+    type = elaoffer_candidate_type(cand);
+    if (!foundation || type >= PJ_ICE_CAND_TYPE_MAX)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+
+    rc = ice_sockaddr_from_bytes(&addr, elaoffer_candidate_addr(cand),
+                                 elaoffer_candidate_port(cand));
+    if (rc < 0)
+        return rc;
+
+    has_rel_addr = elaoffer_candidate_raddr_is_present(cand);
+    if (has_rel_addr) {
+        rc = ice_sockaddr_from_bytes(&rel_addr, elaoffer_candidate_raddr(cand),
+                                     elaoffer_candidate_rport(cand));
+        if (rc < 0)
+            return rc;
+    }
+
+    return ice_remote_append_candidate(&handler->remote, foundation,
+                                       elaoffer_candidate_comp(cand),
+                                       elaoffer_candidate_prio(cand),
+                                       (pj_ice_cand_type)type, &addr,
+                                       has_rel_addr ? &rel_addr : NULL);
+}
+
+/*
+ * Same as the SDP text below, but the options are compared per stream,
+ * the text keeps accumulating them over the streams for compatibility.
+ */
+static int ice_session_apply_compact_offer(ElaSession *base,
+                                           const char *sdp, size_t len)
+{
+    IceSession *session = (IceSession *)base;
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    elaoffer_offer_table_t offer;
+    elaoffer_media_vec_t medias;
+    flatbuffers_uint8_vec_t vec;
+    flatbuffers_string_t ufrag;
+    flatbuffers_string_t pwd;
+    list_iterator_t iterator;
+    void *buf;
+    int media_count;
+    int media_index;
+    int rc;
+
+    prepare_thread_context(transport);
+
+    // The offer follows the bundle in the invite data, copy it to have
+    // the buffer aligned as the verifier requires.
+    buf = malloc(len);
+    if (!buf)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    memcpy(buf, sdp, len);
+
+    if (elaoffer_offer_verify_as_root(buf, len) != 0) {
+        vlogE("Session: Invalid compact offer.");
+        free(buf);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    offer = elaoffer_offer_as_root(buf);
+
+    vec = elaoffer_offer_pubkey(offer);
+    if (flatbuffers_uint8_vec_len(vec) != sizeof(base->peer_pubkey)) {
+        vlogE("Session: Parse peer public key error.");
+        free(buf);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+    memcpy(base->peer_pubkey, vec, sizeof(base->peer_pubkey));
+
+    // Both sides put all streams on one transport, or none does.
+    if (!!elaoffer_offer_bundle(offer) != !!base->bundle &&
+        list_size(base->streams) > 1) {
+        vlogE("Session: Bundle mode mismatch with peer (local %s, remote %s).",
+              base->bundle ? "on" : "off", base->bundle ? "off" : "on");
+        free(buf);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    vec = elaoffer_offer_nonce(offer);
+    if (flatbuffers_uint8_vec_len(vec) == sizeof(base->nonce) &&
+        session->role != PJ_ICE_SESS_ROLE_CONTROLLING)
+        memcpy(base->nonce, vec, sizeof(base->nonce));
+
+    ufrag = elaoffer_offer_ufrag(offer);
+    pwd = elaoffer_offer_pwd(offer);
+    medias = elaoffer_offer_medias(offer);
+    media_count = (int)elaoffer_media_vec_len(medias);
+
+rescan:
+    media_index = 0;
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+        IceHandler *handler;
+        elaoffer_media_table_t media;
+        elaoffer_candidate_vec_t cands;
+        int i;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        handler = (IceHandler *)stream->handler;
+
+        if (media_index >= media_count) {
+            stream->base.deactivate = 1;
+            vlogD("Session: ICE stream %d deactivated.", stream->base.id);
+            deref(stream);
+            continue;
+        }
+
+        memset(&handler->remote, 0, sizeof(handler->remote));
+
+        handler->media_index = media_index;
+        if (handler->ist && handler->ist->session &&
+            media_index < ICE_BUNDLE_MAX_STREAMS) {
+            ice_stream_lock(&stream->base);
+            session->bundle.streams[media_index] = stream;
+            ice_stream_unlock(&stream->base);
+        }
+
+        media = elaoffer_media_vec_at(medias, media_index);
+
+        if (ufrag)
+            strncpy(handler->remote.ufrag, ufrag,
+                    sizeof(handler->remote.ufrag) - 1);
+        if (pwd)
+            strncpy(handler->remote.pwd, pwd,
+                    sizeof(handler->remote.pwd) - 1);
+
+        rc = ice_sockaddr_from_bytes(&handler->remote.def_addr[0],
+                                     elaoffer_media_defaddr(media),
+                                     elaoffer_media_defport(media));
+        if (rc < 0) {
+            memset(&handler->remote, 0, sizeof(handler->remote));
+            free(buf);
+            deref(stream);
+            return rc;
+        }
+
+        if (elaoffer_media_options(media) != ice_stream_get_options(stream)) {
+            stream->base.deactivate = 1;
+            media_index++;
+            vlogD("ICE: Stream %d deactivated.", stream->base.id);
+            deref(stream);
+            continue;
+        }
+
+        cands = elaoffer_media_cands(media);
+        for (i = 0; i < (int)elaoffer_candidate_vec_len(cands); i++) {
+            rc = ice_handler_apply_compact_candidate(handler,
+                                        elaoffer_candidate_vec_at(cands, i));
+            if (rc < 0) {
+                memset(&handler->remote, 0, sizeof(handler->remote));
+                free(buf);
+                deref(stream);
+                return rc;
+            }
+        }
+
+        if (media_index < base->resume.path_cnt)
+            ice_handler_promote_remote_candidate(handler,
+                                        &base->resume.paths[media_index]);
+        media_index++;
+        deref(stream);
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int ice_session_apply_remote_sdp(ElaSession *base,
+                                        const char *sdp, size_t len)
+{
+    IceSession *session = (IceSession *)base;
+    IceWorker  *worker  = (IceWorker *)session_get_worker(base);
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    pjmedia_sdp_session *p_sdp;
+    pj_pool_t *pool;
+    pj_str_t ufrag = { NULL, 0 };
+    pj_str_t pwd = { NULL, 0 };
+    pj_str_t nonce = { NULL, 0 };
+    pj_status_t status;
+    list_iterator_t iterator;
+    int bundle = 0;
+    int media_index;
+    int i;
+    int rc;
+    int fmt, ops = 0;
+
+    assert(base && sdp && len);
+
+    if (session_is_compact_offer(sdp, len))
+        return ice_session_apply_compact_offer(base, sdp, len);
+
+    prepare_thread_context(transport);
+
+    pool = pj_pool_create(&worker->cp.factory, NULL, 4096, 512, NULL);
+    if (!pool)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    status = pjmedia_sdp_parse(pool, (char *)sdp, len, &p_sdp);
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool);
+        return ELA_ICE_ERROR(status);
+    }
+
+    if (pj_strcmp2(&p_sdp->name, "elastos-ice-session") != 0) {
+        pj_pool_release(pool);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    rc = (int)base58_decode(p_sdp->origin.user.ptr, p_sdp->origin.user.slen,
+                            base->peer_pubkey, sizeof(base->peer_pubkey));
+    if (rc < 0) {
+        vlogE("Session: Parse peer public key error.");
+        pj_pool_release(pool);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    for (i = 0; i < (int)p_sdp->attr_count; i++) {
+        if (pj_strcmp2(&p_sdp->attr[i]->name, "ice-ufrag") == 0)
+            ufrag = p_sdp->attr[i]->value;
+        else if (pj_strcmp2(&p_sdp->attr[i]->name, "ice-pwd") == 0)
+            pwd = p_sdp->attr[i]->value;
+        else if (pj_strcmp2(&p_sdp->attr[i]->name, "nonce") == 0)
+            nonce = p_sdp->attr[i]->value;
+        else if (pj_strcmp2(&p_sdp->attr[i]->name, "group") == 0 &&
+                 p_sdp->attr[i]->value.slen >= 6 &&
+                 pj_memcmp(p_sdp->attr[i]->value.ptr, "BUNDLE", 6) == 0)
+            bundle = 1;
+    }
+
+    // Both sides put all streams on one transport, or none does.
+    if (bundle != base->bundle && list_size(base->streams) > 1) {
+        vlogE("Session: Bundle mode mismatch with peer (local %s, remote %s).",
+              base->bundle ? "on" : "off", bundle ? "on" : "off");
+        pj_pool_release(pool);
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    if (nonce.ptr && session->role != PJ_ICE_SESS_ROLE_CONTROLLING)
+        crypto_nonce_from_str(base->nonce, nonce.ptr, nonce.slen);
+
+rescan:
+    media_index = 0;
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        int af;
+        IceStream *stream;
+        IceHandler *handler;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        handler = (IceHandler *)stream->handler;
 
         if (media_index >= (int)p_sdp->media_count) {
             stream->base.deactivate = 1;
@@ -1328,124 +2692,1562 @@ rescan:
             continue;
         }
 
-        memset(&handler->remote, 0, sizeof(handler->remote));
+        memset(&handler->remote, 0, sizeof(handler->remote));
+
+        handler->media_index = media_index;
+        if (handler->ist && handler->ist->session &&
+            media_index < ICE_BUNDLE_MAX_STREAMS) {
+            ice_stream_lock(&stream->base);
+            session->bundle.streams[media_index] = stream;
+            ice_stream_unlock(&stream->base);
+        }
+
+        pjmedia_sdp_media *media = p_sdp->media[media_index];
+        pjmedia_sdp_conn *conn = media->conn;
+
+        if (ufrag.ptr)
+            strncpy(handler->remote.ufrag, ufrag.ptr, ufrag.slen);
+        if (pwd.ptr)
+            strncpy(handler->remote.pwd, pwd.ptr, pwd.slen);
+
+        if (pj_strchr(&conn->addr, ':') != NULL)
+            af = pj_AF_INET6();
+        else
+            af = pj_AF_INET();
+
+        pj_sockaddr_init(af, &handler->remote.def_addr[0],
+                         &conn->addr, media->desc.port);
+
+        fmt = atoi(media->desc.fmt[0].ptr);
+
+        if (stream->base.unencrypt)
+            ops |= ELA_STREAM_PLAIN;
+        if (stream->base.multiplexing)
+            ops |= ELA_STREAM_MULTIPLEXING;
+        if (stream->base.reliable)
+            ops |= ELA_STREAM_RELIABLE;
+        if (stream->base.portforwarding)
+            ops |= ELA_STREAM_PORT_FORWARDING;
+        if (stream->base.framing)
+            ops |= ELA_STREAM_MESSAGE_FRAMING;
+        if (stream->base.multipath)
+            ops |= ELA_STREAM_MULTIPATH;
+
+        if (ops != fmt) {
+            stream->base.deactivate = 1;
+            media_index++;
+            vlogD("ICE: Stream %d deactivated.", stream->base.id);
+            deref(stream);
+            continue;
+        }
+
+        for (i = 0; i < (int)media->attr_count; i++) {
+            if (pj_strcmp2(&media->attr[i]->name, "candidate") == 0) {
+                rc = ice_remote_add_candidate(&handler->remote,
+                                              media->attr[i]->value.ptr);
+                if (rc < 0) {
+                    memset(&handler->remote, 0, sizeof(handler->remote));
+                    pj_pool_release(pool);
+                    deref(stream);
+                    return rc;
+                }
+            }
+        }
+
+        if (media_index < base->resume.path_cnt)
+            ice_handler_promote_remote_candidate(handler,
+                                        &base->resume.paths[media_index]);
+        media_index++;
+        deref(stream);
+    }
+
+    pj_pool_release(pool);
+
+    return 0;
+}
+
+static IceStream *ice_session_get_stream(ElaSession *base, int media_index)
+{
+    list_iterator_t iterator;
+    IceStream *stream;
+    int index;
+    int rc;
+
+rescan:
+    index = 0;
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        if (index++ == media_index)
+            return stream;
+
+        deref(stream);
+    }
+
+    return NULL;
+}
+
+static int ice_session_add_remote_candidates(ElaSession *base,
+                                             const char *ufrag,
+                                             const char *candidates,
+                                             size_t len)
+{
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    const char *pos = candidates;
+    const char *end = candidates + len;
+    uint32_t touched = 0;
+    int matched = 0;
+    int i;
+
+    assert(base && ufrag && candidates);
+
+    prepare_thread_context(transport);
+
+    while (pos < end) {
+        const char *eol;
+        IceStream *stream;
+        IceHandler *handler;
+        int media_index;
+        int n = 0;
+        int rc;
+
+        eol = memchr(pos, '\n', end - pos);
+        if (!eol)
+            eol = end;
+
+        if (sscanf(pos, "%d %n", &media_index, &n) != 1 || n == 0 ||
+            media_index < 0 || pos + n >= eol)
+            return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+        stream = ice_session_get_stream(base, media_index);
+        if (!stream) {
+            pos = eol + 1;
+            continue;
+        }
+
+        handler = (IceHandler *)stream->handler;
+
+        ice_stream_lock(&stream->base);
+        if (strcmp(handler->remote.ufrag, ufrag) != 0 ||
+            stream->base.deactivate) {
+            ice_stream_unlock(&stream->base);
+            deref(stream);
+            pos = eol + 1;
+            continue;
+        }
+
+        rc = ice_remote_add_candidate(&handler->remote, pos + n);
+        ice_stream_unlock(&stream->base);
+        deref(stream);
+
+        if (rc < 0) {
+            vlogW("Session: Drop trickled candidate for stream %d (0x%x).",
+                  media_index, rc);
+        } else {
+            matched = 1;
+            if (media_index < 32)
+                touched |= (1u << media_index);
+        }
+
+        pos = eol + 1;
+    }
+
+    if (!matched)
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    for (i = 0; i < 32 && touched; i++) {
+        IceStream *stream;
+        IceHandler *handler;
+        pj_status_t status;
+
+        if (!(touched & (1u << i)))
+            continue;
+
+        touched &= ~(1u << i);
+
+        stream = ice_session_get_stream(base, i);
+        if (!stream)
+            continue;
+
+        handler = (IceHandler *)stream->handler;
+
+        // Not started yet, the candidates go with the start.
+        ice_stream_lock(&stream->base);
+        if (stream->base.state == ElaStreamState_connecting) {
+            status = ice_handler_restart_checks(handler);
+            if (status != PJ_SUCCESS) {
+                vlogE("Stream: %d ICE handler restart checks error: %s.",
+                      stream->base.id, ice_strerror(status));
+                notify_state_changed(stream->handler, ElaStreamState_failed);
+            }
+        }
+        ice_stream_unlock(&stream->base);
+        deref(stream);
+    }
+
+    return 0;
+}
+
+/*
+ * ICE restart. With a network change of either side the nominated pair
+ * dies, while the handlers above the ICE handler still hold the state of
+ * the reliable and multiplexed channels. The restart gathers on a new ICE
+ * transport with new credentials and sends the candidates in a session
+ * message:
+ *   restart <sender ice-ufrag> <new ice-ufrag> <new ice-pwd>\n
+ *   <media index> <candidate>\n
+ *   ...
+ * The peer restarts as well on receiving it and answers likewise. The
+ * stream stays connected on the old path during the checks, and the new
+ * transport is swapped in underneath once they complete. The restart runs
+ * in the session restart timer on the worker thread, the other threads and
+ * the pjnath callbacks only flag the work and schedule the timer.
+ */
+static bool ice_session_restart_routine(void *user_data);
+
+// Must be called with the restart lock held.
+static int ice_session_schedule_restart(IceSession *session)
+{
+    TransportWorker *worker = session_get_worker(&session->base);
+
+    if (session->restart.timer) {
+        ice_worker_schedule_timer(worker, session->restart.timer,
+                        (unsigned long)(get_monotonic_time() / 1000));
+        return 0;
+    }
+
+    return ice_worker_create_timer(worker, 0x00020000, ICE_RESTART_POLL_INTERVAL,
+                                   ice_session_restart_routine, session,
+                                   &session->restart.timer);
+}
+
+static int ice_session_request_restart(IceSession *session)
+{
+    int rc;
+
+    pthread_mutex_lock(&session->restart.lock);
+
+    if (!session->restart.pending)
+        session->restart.requested = 1;
+
+    rc = ice_session_schedule_restart(session);
+
+    pthread_mutex_unlock(&session->restart.lock);
+
+    if (rc != 0)
+        vlogE("Session: ICE restart create timer error: %08X.", rc);
+
+    return rc;
+}
+
+// A bundled transport is restarted for all its streams by one of them.
+static bool ice_handler_bundle_restarting(IceHandler *handler,
+                                          IceSession *session)
+{
+    int i;
+
+    for (i = 0; i < ICE_BUNDLE_MAX_STREAMS; i++) {
+        IceStream *stream = session->bundle.streams[i];
+        IceHandler *other;
+
+        if (!stream || &stream->base == handler->base.stream)
+            continue;
+
+        other = (IceHandler *)stream->handler;
+        if (other->ist == handler->ist && other->restart.ist)
+            return true;
+    }
+
+    return false;
+}
+
+static int ice_handler_begin_restart(IceHandler *handler, IceSession *session)
+{
+    IceStream *stream = (IceStream *)handler->base.stream;
+    IceWorker *worker = (IceWorker *)session_get_worker(&session->base);
+    IceStrans *ist;
+    pj_status_t status;
+
+    if (handler->ist->session && ice_handler_bundle_restarting(handler, session))
+        return 0;
+
+    status = ice_strans_create(worker, &worker->cfg, stream, 1, 0, &ist);
+    if (status != PJ_SUCCESS) {
+        vlogE("Stream: %d ICE restart create transport error: %s.",
+              stream->base.id, ice_strerror(status));
+        return ELA_ICE_ERROR(status);
+    }
+
+    // The peer may send on the new path before it is swapped in here.
+    if (handler->ist->session)
+        ist->session = session;
+
+    handler->restart.ist = ist;
+
+    vlogD("Stream: %d ICE restart gathering...", stream->base.id);
+    return 0;
+}
+
+/*
+ * Encode all the local candidates of the transport after the header line.
+ * Return the message length including the terminating NUL, 0 if nothing to
+ * send.
+ */
+static int ice_handler_encode_cands(IceHandler *handler, pj_ice_strans *st,
+                                    const char *header, char **msg)
+{
+    pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
+    unsigned ncomps;
+    size_t size = 4096;
+    int len;
+    int count = 0;
+    int i;
+    char *buf;
+
+    buf = (char *)malloc(size);
+    if (!buf)
+        return 0;
+
+    len = snprintf(buf, size, "%s", header);
+
+    ncomps = pj_ice_strans_get_running_comp_cnt(st);
+    for (i = 0; i < (int)ncomps && i < PJ_ICE_MAX_COMP; i++) {
+        unsigned cand_cnt = PJ_ARRAY_SIZE(cand);
+        int j;
+
+        if (pj_ice_strans_enum_cands(st, i+1, &cand_cnt, cand) != PJ_SUCCESS)
+            continue;
+
+        for (j = 0; j < (int)cand_cnt; j++) {
+            char line[160];
+            int n;
+
+            if (cand[j].status != PJ_SUCCESS)
+                continue;
+
+            ice_cand_to_str(&cand[j], line, sizeof(line));
+            n = snprintf(buf + len, size - len, "%d %s\n",
+                         handler->media_index, line);
+            if (n < 0 || n >= (int)(size - len))
+                break;
+
+            len += n;
+            count++;
+        }
+    }
+
+    if (!count) {
+        free(buf);
+        return 0;
+    }
+
+    *msg = buf;
+    return len + 1;
+}
+
+// The new path is the nominated pair of each component.
+static void ice_handler_update_def_addr(IceHandler *handler)
+{
+    unsigned comp;
+
+    for (comp = 1; comp <= handler->remote.comp_cnt &&
+                   comp <= PJ_ICE_MAX_COMP; comp++) {
+        const pj_ice_sess_check *check;
+
+        check = pj_ice_strans_get_valid_pair(handler->st, comp);
+        if (check)
+            pj_sockaddr_cp(&handler->remote.def_addr[comp-1],
+                           &check->rcand->addr);
+    }
+}
+
+/*
+ * Swap in the restart transport, with the handler locked. Return the old
+ * transport to destroy after the lock released.
+ */
+static pj_ice_strans *ice_handler_swap_restart(IceHandler *handler,
+                                               IceSession *session)
+{
+    IceStream *stream = (IceStream *)handler->base.stream;
+    IceStrans *old = handler->ist;
+    IceStrans *ist = handler->restart.ist;
+    int i;
+
+    handler->restart.ist = NULL;
+    ist->restarting = 0;
+
+    if (old->session) {
+        ice_strans_bundle(ist, session);
+        ist->owners = old->owners;
+        ist->users = old->users;
+        old->owners = 0;
+        old->users = 0;
+
+        // All the streams bundled on the old transport move together.
+        for (i = 0; i < ICE_BUNDLE_MAX_STREAMS; i++) {
+            IceStream *s = session->bundle.streams[i];
+            IceHandler *h;
+
+            if (!s)
+                continue;
+
+            h = (IceHandler *)s->handler;
+            if (h->ist != old)
+                continue;
+
+            h->ist = ist;
+            h->st = ist->st;
+            ice_handler_update_def_addr(h);
+            gettimeofday(&s->remote_timestamp, NULL);
+        }
+
+        session->bundle.remote_timestamp = stream->remote_timestamp;
+    } else {
+        handler->ist = ist;
+        handler->st = ist->st;
+        ice_handler_update_def_addr(handler);
+        gettimeofday(&stream->remote_timestamp, NULL);
+    }
+
+    old->stream = NULL;
+    old->session = NULL;
+
+    handler->restart.initialized = 0;
+    handler->restart.remote = 0;
+    handler->restart.checking = 0;
+    session->restart.swapped = 1;
+
+    vlogI("Stream: %d ICE restarted, moved to the new path.", stream->base.id);
+    return old->st;
+}
+
+/*
+ * Go on with the restart of one stream, on the worker thread with the
+ * restart lock held. Return true if the restart is still running.
+ */
+static bool ice_handler_step_restart(IceHandler *handler, IceSession *session,
+                                     int64_t now)
+{
+    IceStream *stream = (IceStream *)handler->base.stream;
+    pj_ice_strans *done_st = NULL;
+    pj_grp_lock_t *lock;
+    IceStrans *ist;
+    pj_status_t status = PJ_SUCCESS;
+    char *msg = NULL;
+    int len = 0;
+    bool running;
+
+    lock = ice_handler_lock(handler);
+
+    if (handler->restart.round != session->restart.round) {
+        handler->restart.round = session->restart.round;
+
+        if (!handler->stopping && !stream->base.deactivate &&
+            stream->base.state == ElaStreamState_connected)
+            ice_handler_begin_restart(handler, session);
+    }
+
+    ist = handler->restart.ist;
+    if (!ist) {
+        pj_grp_lock_release(lock);
+        return false;
+    }
+
+    if (now >= session->restart.expire_time) {
+        vlogW("Stream: %d ICE restart timeout, stay on the old path.",
+              stream->base.id);
+        done_st = ice_handler_cancel_restart(handler);
+        goto out;
+    }
+
+    if (ist->gathered && !handler->restart.initialized) {
+        pj_str_t ufrag, pwd;
+        char header[256];
+
+        status = ist->status;
+        if (status == PJ_SUCCESS)
+            status = ice_handler_set_options(handler, ist->st);
+        if (status == PJ_SUCCESS)
+            status = pj_ice_strans_init_ice(ist->st, session->role,
+                                    pj_cstr(&ufrag, session->restart.ufrag),
+                                    pj_cstr(&pwd, session->restart.pwd));
+        if (status != PJ_SUCCESS) {
+            vlogE("Stream: %d ICE restart prepare error: %s.",
+                  stream->base.id, ice_strerror(status));
+            done_st = ice_handler_cancel_restart(handler);
+            goto out;
+        }
+
+        handler->restart.initialized = 1;
+
+        snprintf(header, sizeof(header), SESSION_RESTART_PREFIX "%s %s %s\n",
+                 session->ufrag, session->restart.ufrag, session->restart.pwd);
+        len = ice_handler_encode_cands(handler, ist->st, header, &msg);
+    }
+
+    if (handler->restart.initialized && handler->restart.remote &&
+        !handler->restart.checking) {
+        status = ice_handler_start_checks(handler, ist->st, &handler->remote);
+        if (status != PJ_SUCCESS) {
+            vlogE("Stream: %d ICE restart checks error: %s.",
+                  stream->base.id, ice_strerror(status));
+            done_st = ice_handler_cancel_restart(handler);
+            goto out;
+        }
+
+        handler->restart.checking = 1;
+        vlogD("Stream: %d ICE restart checking %u remote candidates...",
+              stream->base.id, handler->remote.cand_cnt);
+    }
+
+    if (ist->completed) {
+        if (ist->result == PJ_SUCCESS) {
+            done_st = ice_handler_swap_restart(handler, session);
+        } else {
+            vlogW("Stream: %d ICE restart negotiation error: %s, stay on "
+                  "the old path.", stream->base.id, ice_strerror(ist->result));
+            done_st = ice_handler_cancel_restart(handler);
+        }
+    }
+
+out:
+    running = (handler->restart.ist != NULL);
+    pj_grp_lock_release(lock);
+
+    ice_strans_destroy(done_st);
+
+    if (len > 0) {
+        session_send_trickle(&session->base, msg, len);
+        free(msg);
+    }
+
+    return running;
+}
+
+static bool ice_session_restart_routine(void *user_data)
+{
+    IceSession *session = (IceSession *)user_data;
+    list_iterator_t iterator;
+    int64_t now = get_monotonic_time() / 1000;
+    bool running = false;
+    int rc;
+
+    pthread_mutex_lock(&session->restart.lock);
+
+    if (session->restart.requested && !session->restart.pending) {
+        pj_create_random_string(session->restart.ufrag, PJ_ICE_UFRAG_LEN);
+        pj_create_random_string(session->restart.pwd, PJ_ICE_UFRAG_LEN);
+
+        session->restart.pending = 1;
+        session->restart.swapped = 0;
+        session->restart.round++;
+        session->restart.expire_time = now + ICE_RESTART_TIMEOUT;
+
+        vlogD("Session: ICE restart to %s started.", session->base.to);
+    }
+
+    session->restart.requested = 0;
+
+    if (!session->restart.pending) {
+        pthread_mutex_unlock(&session->restart.lock);
+        return false;
+    }
+
+rescan:
+    list_iterate(session->base.streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        if (ice_handler_step_restart((IceHandler *)stream->handler,
+                                     session, now))
+            running = true;
+
+        deref(stream);
+    }
+
+    if (!running) {
+        // The trickled candidates of later checks go with the credentials
+        // the peer knows now.
+        if (session->restart.swapped) {
+            strcpy(session->ufrag, session->restart.ufrag);
+            strcpy(session->pwd, session->restart.pwd);
+        }
+
+        session->restart.pending = 0;
+        vlogD("Session: ICE restart to %s finished.", session->base.to);
+    }
+
+    pthread_mutex_unlock(&session->restart.lock);
+
+    // Keep polling for the timeout while running.
+    return running;
+}
+
+static int ice_session_restart(ElaSession *base)
+{
+    IceSession *session = (IceSession *)base;
+    list_iterator_t iterator;
+    int connected = 0;
+    int rc;
+
+rescan:
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        if (stream->base.state == ElaStreamState_connected)
+            connected = 1;
+
+        deref(stream);
+    }
+
+    if (!connected)
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+
+    return ice_session_request_restart(session);
+}
+
+// Must be called with the handler locked.
+static int ice_handler_add_restart_candidate(IceHandler *handler,
+                                             const char *rufrag,
+                                             const char *ufrag,
+                                             const char *pwd,
+                                             const char *value)
+{
+    if (strcmp(handler->remote.ufrag, rufrag) == 0) {
+        // First candidate of the restart. The checks of the old path go on
+        // with their own copy of the remote candidates.
+        strcpy(handler->remote.ufrag, ufrag);
+        strcpy(handler->remote.pwd, pwd);
+        handler->remote.cand_cnt = 0;
+        handler->remote.comp_cnt = 0;
+        handler->restart.remote = 0;
+    } else if (strcmp(handler->remote.ufrag, ufrag) != 0) {
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+    }
+
+    return ice_remote_add_candidate(&handler->remote, value);
+}
+
+static int ice_session_apply_restart(ElaSession *base, const char *data,
+                                     size_t len)
+{
+    IceSession *session = (IceSession *)base;
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    const char *pos;
+    const char *end = data + len;
+    char header[256];
+    char rufrag[80];
+    char ufrag[80];
+    char pwd[80];
+    uint32_t touched = 0;
+    int i;
+
+    assert(base && data);
+
+    prepare_thread_context(transport);
+
+    pos = memchr(data, '\n', len);
+    if (!pos || pos - data >= sizeof(header))
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+    memcpy(header, data, pos - data);
+    header[pos - data] = 0;
+    pos++;
+
+    if (sscanf(header, SESSION_RESTART_PREFIX "%79s %79s %79s",
+               rufrag, ufrag, pwd) != 3)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+    while (pos < end) {
+        const char *eol;
+        IceStream *stream;
+        IceHandler *handler;
+        pj_grp_lock_t *lock;
+        int media_index;
+        int n = 0;
+        int rc = 0;
+
+        eol = memchr(pos, '\n', end - pos);
+        if (!eol)
+            eol = end;
+
+        if (sscanf(pos, "%d %n", &media_index, &n) != 1 || n == 0 ||
+            media_index < 0 || pos + n >= eol)
+            return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+        stream = ice_session_get_stream(base, media_index);
+        if (!stream) {
+            pos = eol + 1;
+            continue;
+        }
+
+        handler = (IceHandler *)stream->handler;
+        lock = ice_handler_lock(handler);
+
+        if (stream->base.state != ElaStreamState_connected ||
+            stream->base.deactivate) {
+            rc = ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+        } else if (handler->ist->session) {
+            // Whichever bundled stream restarts, it checks the candidates.
+            for (i = 0; i < ICE_BUNDLE_MAX_STREAMS; i++) {
+                IceStream *s = session->bundle.streams[i];
+                IceHandler *h;
+
+                if (!s || ((IceHandler *)s->handler)->ist != handler->ist)
+                    continue;
+
+                h = (IceHandler *)s->handler;
+                rc = ice_handler_add_restart_candidate(h, rufrag, ufrag,
+                                                       pwd, pos + n);
+                if (rc == 0 && i < 32)
+                    touched |= (1u << i);
+            }
+        } else {
+            rc = ice_handler_add_restart_candidate(handler, rufrag, ufrag,
+                                                   pwd, pos + n);
+            if (rc == 0 && media_index < 32)
+                touched |= (1u << media_index);
+        }
+
+        pj_grp_lock_release(lock);
+        deref(stream);
+
+        if (rc < 0)
+            vlogW("Session: Drop restart candidate for stream %d (0x%x).",
+                  media_index, rc);
+
+        pos = eol + 1;
+    }
+
+    if (!touched)
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    // Mark after all candidates in, the checks start with the full list.
+    for (i = 0; i < 32 && touched; i++) {
+        IceStream *stream;
+        pj_grp_lock_t *lock;
+
+        if (!(touched & (1u << i)))
+            continue;
+
+        touched &= ~(1u << i);
+
+        stream = ice_session_get_stream(base, i);
+        if (!stream)
+            continue;
+
+        lock = ice_handler_lock((IceHandler *)stream->handler);
+        ((IceHandler *)stream->handler)->restart.remote = 1;
+        pj_grp_lock_release(lock);
+        deref(stream);
+    }
+
+    return ice_session_request_restart(session);
+}
+
+/*
+ * Multipath streams. Besides the main path, a multipath stream runs ICE on
+ * extra transports, each bound to another local interface or relayed
+ * through the TURN server, so the paths go over different links. The
+ * extra paths are set up once the stream connected, with a session
+ * message per path like the restart:
+ *   path <sender ice-ufrag> <path index> <path ice-ufrag> <path ice-pwd>\n
+ *   <media index> <candidate>\n
+ *   ...
+ * The peer sets up the path with the same index on receiving it, on its
+ * own kind of transport for the index or a default one. All paths are
+ * probed for the round trip time and loss, and the data packets are
+ * spread over the live ones by weighted round-robin, the weight being the
+ * delivery rate over the round trip time. The reliable handler above puts
+ * the reordered data back in order.
+ */
+
+// The local interfaces other than the default one, as the extra paths.
+static unsigned ice_path_interfaces(pj_sockaddr *ifs, unsigned size)
+{
+    pj_sockaddr addrs[ICE_MAX_PATHS + 2];
+    pj_sockaddr def;
+    unsigned count = PJ_ARRAY_SIZE(addrs);
+    unsigned n = 0;
+    unsigned i;
+
+    if (pj_enum_ip_interface(pj_AF_INET(), &count, addrs) != PJ_SUCCESS)
+        return 0;
+
+    if (pj_gethostip(pj_AF_INET(), &def) != PJ_SUCCESS)
+        pj_bzero(&def, sizeof(def));
+
+    for (i = 0; i < count && n < size; i++) {
+        if ((pj_ntohl(addrs[i].ipv4.sin_addr.s_addr) >> 24) == 127 ||
+            pj_sockaddr_cmp(&addrs[i], &def) == 0)
+            continue;
+
+        pj_sockaddr_cp(&ifs[n++], &addrs[i]);
+    }
+
+    return n;
+}
+
+/*
+ * Transport config of the extra path. The paths on the other interfaces
+ * come first, then the relayed one. Return false if this host has no such
+ * path, it still answers the path of the peer with a default transport.
+ */
+static bool ice_path_get_cfg(IceWorker *worker, int index,
+                             pj_ice_strans_cfg *cfg)
+{
+    pj_sockaddr ifs[ICE_MAX_PATHS];
+    unsigned count;
+
+    *cfg = worker->cfg;
+
+    count = ice_path_interfaces(ifs, PJ_ARRAY_SIZE(ifs));
+    if (index <= (int)count) {
+        cfg->stun_tp_cnt = 1;
+        pj_sockaddr_cp(&cfg->stun_tp[0].cfg.bound_addr, &ifs[index - 1]);
+        cfg->turn_tp_cnt = 0;
+        return true;
+    }
+
+    if (index == (int)count + 1 && worker->cfg.turn_tp_cnt > 0) {
+        cfg->stun_tp_cnt = 0;
+        return true;
+    }
+
+    return false;
+}
+
+// Must be called with the handler locked.
+static IcePath *ice_handler_get_path(IceHandler *handler, int index)
+{
+    IcePath *path = handler->multipath.paths[index];
+
+    if (path)
+        return path;
+
+    path = (IcePath *)calloc(1, sizeof(IcePath));
+    if (!path)
+        return NULL;
+
+    path->index = index;
+    pj_create_random_string(path->ufrag, PJ_ICE_UFRAG_LEN);
+    pj_create_random_string(path->pwd, PJ_ICE_UFRAG_LEN);
+
+    handler->multipath.paths[index] = path;
+    return path;
+}
+
+static pj_ice_strans *ice_path_get_st(IceHandler *handler, IcePath *path)
+{
+    return path->ist ? path->ist->st : handler->st;
+}
+
+static const pj_sockaddr *ice_path_get_addr(IceHandler *handler,
+                                            IcePath *path)
+{
+    return path->ist ? &path->remote.def_addr[0] : &handler->remote.def_addr[0];
+}
+
+static void ice_handler_send_probe(IceHandler *handler, IcePath *path,
+                                   int64_t now)
+{
+    char buf[sizeof(IcePacket) + sizeof(IceProbe)];
+    IcePacket *packet = (IcePacket *)buf;
+    IceProbe *probe = (IceProbe *)packet->data;
+    const pj_sockaddr *addr = ice_path_get_addr(handler, path);
+
+    // The last probe not answered in time counts as lost.
+    if (path->probe_time && !path->probe_acked)
+        path->loss = (path->loss * 7 + 1000) / 8;
+
+    memset(buf, 0, sizeof(buf));
+    packet->pkttype = PKT_PROBE;
+    packet->len = htons(sizeof(IceProbe));
+    probe->path = (uint8_t)path->index;
+    probe->seq = ++path->probe_seq;
+    probe->time = (uint32_t)get_monotonic_time();
+
+    path->probe_time = now;
+    path->probe_acked = 0;
+
+    pj_ice_strans_sendto(ice_path_get_st(handler, path), 1, buf, sizeof(buf),
+                         addr, pj_sockaddr_get_len(addr));
+}
+
+static void ice_handler_on_probe_ack(IceHandler *handler, const IceProbe *probe)
+{
+    pj_grp_lock_t *lock;
+    IcePath *path;
+    uint32_t rtt;
+
+    if (probe->path >= ICE_MAX_PATHS)
+        return;
+
+    lock = ice_handler_lock(handler);
+
+    path = handler->multipath.paths[probe->path];
+    if (!handler->multipath.enabled || !path ||
+        probe->seq != path->probe_seq || path->probe_acked) {
+        pj_grp_lock_release(lock);
+        return;
+    }
+
+    rtt = (uint32_t)get_monotonic_time() - probe->time;
+
+    path->srtt = path->srtt ? (path->srtt * 7 + rtt) / 8 : rtt;
+    path->loss = path->loss * 7 / 8;
+    path->probe_acked = 1;
+    path->ack_time = get_monotonic_time() / 1000;
+
+    if (!path->active)
+        vlogD("Stream: %d ICE path %d is live, rtt %u us.",
+              handler->base.stream->id, path->index, rtt);
+
+    path->active = 1;
+
+    pj_grp_lock_release(lock);
+}
+
+/*
+ * Go on with the setup of an extra path, with the handler locked. Return
+ * the length of the path message to send after the lock released, or 0.
+ */
+static int ice_handler_step_path(IceHandler *handler, IcePath *path,
+                                 int64_t now, char **msg)
+{
+    IceStream *stream = (IceStream *)handler->base.stream;
+    IceSession *session = (IceSession *)stream_get_session(&stream->base);
+    IceWorker *worker = (IceWorker *)session_get_worker(&session->base);
+    IceStrans *ist;
+    pj_status_t status;
+    int len = 0;
+
+    if (path->failed || path->nominated)
+        return 0;
+
+    if (!path->ist) {
+        pj_ice_strans_cfg cfg;
+
+        // A path of the peer goes on a default transport here.
+        if (!ice_path_get_cfg(worker, path->index, &cfg) &&
+            !path->remote.ufrag[0]) {
+            path->failed = 1;
+            return 0;
+        }
+
+        status = ice_strans_create(worker, &cfg, stream, 0, path->index,
+                                   &path->ist);
+        if (status != PJ_SUCCESS) {
+            vlogW("Stream: %d ICE path %d create transport error: %s.",
+                  stream->base.id, path->index, ice_strerror(status));
+            path->failed = 1;
+            return 0;
+        }
+
+        path->expire_time = now + ICE_PATH_SETUP_TIMEOUT;
+        vlogD("Stream: %d ICE path %d gathering...", stream->base.id,
+              path->index);
+    }
+
+    ist = path->ist;
+
+    if (now >= path->expire_time) {
+        vlogD("Stream: %d ICE path %d setup timeout.", stream->base.id,
+              path->index);
+        goto failed;
+    }
+
+    if (ist->gathered && !path->initialized) {
+        pj_str_t ufrag, pwd;
+        char header[256];
+
+        status = ist->status;
+        if (status == PJ_SUCCESS)
+            status = ice_handler_set_options(handler, ist->st);
+        if (status == PJ_SUCCESS)
+            status = pj_ice_strans_init_ice(ist->st, session->role,
+                                            pj_cstr(&ufrag, path->ufrag),
+                                            pj_cstr(&pwd, path->pwd));
+        if (status != PJ_SUCCESS) {
+            vlogW("Stream: %d ICE path %d prepare error: %s.",
+                  stream->base.id, path->index, ice_strerror(status));
+            goto failed;
+        }
+
+        path->initialized = 1;
+
+        snprintf(header, sizeof(header), SESSION_PATH_PREFIX "%s %d %s %s\n",
+                 session->ufrag, path->index, path->ufrag, path->pwd);
+        len = ice_handler_encode_cands(handler, ist->st, header, msg);
+    }
+
+    if (path->initialized && path->remote_ready && !path->checking) {
+        status = ice_handler_start_checks(handler, ist->st, &path->remote);
+        if (status != PJ_SUCCESS) {
+            vlogW("Stream: %d ICE path %d checks error: %s.",
+                  stream->base.id, path->index, ice_strerror(status));
+            goto failed;
+        }
+
+        path->checking = 1;
+    }
+
+    if (ist->completed) {
+        const pj_ice_sess_check *check;
+
+        check = pj_ice_strans_get_valid_pair(ist->st, 1);
+        if (ist->result != PJ_SUCCESS || !check) {
+            vlogD("Stream: %d ICE path %d negotiation error: %s.",
+                  stream->base.id, path->index, ice_strerror(ist->result));
+            goto failed;
+        }
+
+        pj_sockaddr_cp(&path->remote.def_addr[0], &check->rcand->addr);
+        path->nominated = 1;
+
+        vlogI("Stream: %d ICE path %d nominated.", stream->base.id,
+              path->index);
+    }
+
+    return len;
+
+failed:
+    // The transport goes with the handler, a writer may hold it still.
+    if (pj_ice_strans_has_sess(ist->st))
+        pj_ice_strans_stop_ice(ist->st);
+    path->failed = 1;
+    return len;
+}
+
+static void ice_handler_weigh_paths(IceHandler *handler, int64_t now)
+{
+    int i;
+
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        IcePath *path = handler->multipath.paths[i];
+
+        if (!path)
+            continue;
+
+        if (path->active && now - path->ack_time >= ICE_PATH_DEAD_INTERVAL) {
+            vlogD("Stream: %d ICE path %d is silent.",
+                  handler->base.stream->id, path->index);
+            path->active = 0;
+        }
+
+        path->weight = path->active ?
+                (1000 - path->loss) * 1000 / (int)(path->srtt / 1000 + 1) : 0;
+    }
+}
+
+static bool ice_handler_multipath_routine(void *user_data)
+{
+    IceStream *stream = (IceStream *)user_data;
+    IceHandler *handler = (IceHandler *)stream->handler;
+    IceSession *session = (IceSession *)stream_get_session(&stream->base);
+    IceWorker *worker = (IceWorker *)session_get_worker(&session->base);
+    int64_t now = get_monotonic_time() / 1000;
+    pj_grp_lock_t *lock;
+    char *msgs[ICE_MAX_PATHS];
+    int lens[ICE_MAX_PATHS];
+    int i;
+
+    if (stream->base.state < ElaStreamState_connected)
+        return true;
+    else if (stream->base.state > ElaStreamState_connected)
+        return false;
+
+    memset(lens, 0, sizeof(lens));
+
+    lock = ice_handler_lock(handler);
+
+    if (!handler->multipath.enabled) {
+        pj_grp_lock_release(lock);
+        return false;
+    }
+
+    // The main path, and the extra ones of this host.
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        pj_ice_strans_cfg cfg;
+
+        if (handler->multipath.paths[i])
+            continue;
+
+        if (i == 0 || ice_path_get_cfg(worker, i, &cfg))
+            ice_handler_get_path(handler, i);
+    }
+
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        IcePath *path = handler->multipath.paths[i];
+
+        if (!path)
+            continue;
+
+        if (i > 0)
+            lens[i] = ice_handler_step_path(handler, path, now, &msgs[i]);
+
+        if ((i == 0 || path->nominated) && !path->failed &&
+            now - path->probe_time >= ICE_PATH_PROBE_INTERVAL)
+            ice_handler_send_probe(handler, path, now);
+    }
+
+    ice_handler_weigh_paths(handler, now);
+
+    pj_grp_lock_release(lock);
+
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        if (lens[i] > 0) {
+            session_send_trickle(&session->base, msgs[i], lens[i]);
+            free(msgs[i]);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Pick the path of the next data packet by smooth weighted round-robin.
+ * Return the transport of the extra path picked with its remote address,
+ * or NULL for the main path.
+ */
+static pj_ice_strans *ice_handler_pick_path(IceHandler *handler,
+                                            pj_sockaddr *addr)
+{
+    pj_ice_strans *st = NULL;
+    pj_grp_lock_t *lock;
+    IcePath *picked = NULL;
+    int total = 0;
+    int i;
+
+    lock = ice_handler_lock(handler);
+
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        IcePath *path = handler->multipath.paths[i];
+
+        if (!path || path->failed || path->weight <= 0 ||
+            (i > 0 && !path->nominated))
+            continue;
+
+        path->current += path->weight;
+        total += path->weight;
+
+        if (!picked || path->current > picked->current)
+            picked = path;
+    }
+
+    if (picked) {
+        picked->current -= total;
+
+        if (picked->ist) {
+            st = picked->ist->st;
+            pj_sockaddr_cp(addr, &picked->remote.def_addr[0]);
+        }
+    }
+
+    pj_grp_lock_release(lock);
+
+    return st;
+}
+
+/*
+ * Stop the checks of the extra paths. The transports go with the handler,
+ * as a writer may still hold one.
+ */
+static void ice_handler_stop_paths(IceHandler *handler)
+{
+    pj_grp_lock_t *lock;
+    int i;
+
+    lock = ice_handler_lock(handler);
+    handler->multipath.enabled = 0;
+    pj_grp_lock_release(lock);
+
+    // No more transports created once disabled.
+    for (i = 0; i < ICE_MAX_PATHS; i++) {
+        IcePath *path = handler->multipath.paths[i];
+
+        if (path && path->ist && pj_ice_strans_has_sess(path->ist->st))
+            pj_ice_strans_stop_ice(path->ist->st);
+    }
+}
+
+static int ice_session_apply_path(ElaSession *base, const char *data,
+                                  size_t len)
+{
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    const char *pos;
+    const char *end = data + len;
+    char header[256];
+    char rufrag[80];
+    char ufrag[80];
+    char pwd[80];
+    int index;
+    uint32_t touched = 0;
+    int i;
+
+    assert(base && data);
+
+    prepare_thread_context(transport);
+
+    pos = memchr(data, '\n', len);
+    if (!pos || pos - data >= sizeof(header))
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+    memcpy(header, data, pos - data);
+    header[pos - data] = 0;
+    pos++;
+
+    if (sscanf(header, SESSION_PATH_PREFIX "%79s %d %79s %79s",
+               rufrag, &index, ufrag, pwd) != 4 ||
+        index <= 0 || index >= ICE_MAX_PATHS)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+    while (pos < end) {
+        const char *eol;
+        IceStream *stream;
+        IceHandler *handler;
+        IcePath *path;
+        pj_grp_lock_t *lock;
+        int media_index;
+        int n = 0;
+        int rc;
+
+        eol = memchr(pos, '\n', end - pos);
+        if (!eol)
+            eol = end;
+
+        if (sscanf(pos, "%d %n", &media_index, &n) != 1 || n == 0 ||
+            media_index < 0 || pos + n >= eol)
+            return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+        stream = ice_session_get_stream(base, media_index);
+        if (!stream) {
+            pos = eol + 1;
+            continue;
+        }
+
+        handler = (IceHandler *)stream->handler;
+        lock = ice_handler_lock(handler);
+
+        path = NULL;
+        if (handler->multipath.enabled &&
+            strcmp(handler->remote.ufrag, rufrag) == 0)
+            path = ice_handler_get_path(handler, index);
+
+        if (!path || path->checking || path->failed) {
+            rc = ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+        } else {
+            if (strcmp(path->remote.ufrag, ufrag) != 0) {
+                memset(&path->remote, 0, sizeof(path->remote));
+                strcpy(path->remote.ufrag, ufrag);
+                strcpy(path->remote.pwd, pwd);
+            }
+
+            rc = ice_remote_add_candidate(&path->remote, pos + n);
+            if (rc == 0 && media_index < 32)
+                touched |= (1u << media_index);
+        }
+
+        pj_grp_lock_release(lock);
+        deref(stream);
+
+        if (rc < 0)
+            vlogW("Session: Drop path %d candidate for stream %d (0x%x).",
+                  index, media_index, rc);
+
+        pos = eol + 1;
+    }
+
+    if (!touched)
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    // Mark after all candidates in, the checks start with the full list.
+    for (i = 0; i < 32 && touched; i++) {
+        IceStream *stream;
+        IceHandler *handler;
+        IceWorker *worker;
+        pj_grp_lock_t *lock;
+
+        if (!(touched & (1u << i)))
+            continue;
+
+        touched &= ~(1u << i);
+
+        stream = ice_session_get_stream(base, i);
+        if (!stream)
+            continue;
+
+        handler = (IceHandler *)stream->handler;
+        worker = (IceWorker *)session_get_worker(base);
+
+        lock = ice_handler_lock(handler);
+        handler->multipath.paths[index]->remote_ready = 1;
+        if (handler->multipath.timer)
+            ice_worker_schedule_timer(&worker->base, handler->multipath.timer,
+                            (unsigned long)(get_monotonic_time() / 1000));
+        pj_grp_lock_release(lock);
+        deref(stream);
+    }
+
+    return 0;
+}
+
+#define pj_str(s)       pj_str((char *)(s))
+
+/*
+ * Default candidate of the first component. While it is still pending,
+ * fall back to a host candidate which is ready.
+ */
+static pj_status_t ice_handler_get_def_cand(IceHandler *handler,
+                                            pj_ice_sess_cand *def_cand)
+{
+    pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
+    unsigned cand_cnt = PJ_ARRAY_SIZE(cand);
+    pj_status_t status;
+    int i;
+
+    status = pj_ice_strans_get_def_cand(handler->st, 1, def_cand);
+    if (status != PJ_SUCCESS || def_cand->status == PJ_SUCCESS)
+        return status;
+
+    status = pj_ice_strans_enum_cands(handler->st, 1, &cand_cnt, cand);
+    if (status != PJ_SUCCESS)
+        return status;
+
+    for (i = 0; i < (int)cand_cnt; i++) {
+        if (cand[i].type == PJ_ICE_CAND_TYPE_HOST &&
+            cand[i].status == PJ_SUCCESS) {
+            *def_cand = cand[i];
+            return PJ_SUCCESS;
+        }
+    }
+
+    return PJ_ENOTFOUND;
+}
+
+static const char *stream_type_str[] = {
+    "audio",
+    "video",
+    "text",
+    "application",
+    "message"
+};
+
+static flatbuffers_ref_t ice_cand_build(flatcc_builder_t *builder,
+                                       const pj_ice_sess_cand *cand)
+{
+    flatbuffers_string_ref_t foundation;
+    flatbuffers_uint8_vec_ref_t addr;
+    flatbuffers_uint8_vec_ref_t rel_addr = 0;
+
+    foundation = flatcc_builder_create_string(builder, cand->foundation.ptr,
+                                              cand->foundation.slen);
+    addr = flatbuffers_uint8_vec_create(builder,
+                                        pj_sockaddr_get_addr(&cand->addr),
+                                        pj_sockaddr_get_addr_len(&cand->addr));
+    if (cand->type != PJ_ICE_CAND_TYPE_HOST)
+        rel_addr = flatbuffers_uint8_vec_create(builder,
+                                pj_sockaddr_get_addr(&cand->rel_addr),
+                                pj_sockaddr_get_addr_len(&cand->rel_addr));
+
+    elaoffer_candidate_start(builder);
+    elaoffer_candidate_foundation_add(builder, foundation);
+    elaoffer_candidate_comp_add(builder, cand->comp_id);
+    elaoffer_candidate_prio_add(builder, cand->prio);
+    elaoffer_candidate_type_add(builder, (uint8_t)cand->type);
+    elaoffer_candidate_addr_add(builder, addr);
+    elaoffer_candidate_port_add(builder, pj_sockaddr_get_port(&cand->addr));
+    if (rel_addr) {
+        elaoffer_candidate_raddr_add(builder, rel_addr);
+        elaoffer_candidate_rport_add(builder,
+                                     pj_sockaddr_get_port(&cand->rel_addr));
+    }
+    return elaoffer_candidate_end(builder);
+}
+
+/*
+ * The compact offer carries what the SDP text does, with the keys and
+ * addresses in raw bytes, which keeps it well within one Tox message.
+ */
+static int ice_session_encode_compact_offer(ElaSession *base,
+                                            char *sdp, size_t len)
+{
+    IceSession *session = (IceSession *)base;
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    flatcc_builder_t builder;
+    flatbuffers_string_ref_t str;
+    flatbuffers_uint8_vec_ref_t vec;
+    elaoffer_media_ref_t medias[PJMEDIA_MAX_SDP_MEDIA];
+    elaoffer_media_vec_ref_t media_vec;
+    list_iterator_t iterator;
+    size_t size;
+    int index;
+    int rc;
+
+    prepare_thread_context(transport);
 
-        pjmedia_sdp_media *media = p_sdp->media[media_index];
-        pjmedia_sdp_conn *conn = media->conn;
+    flatcc_builder_init(&builder);
 
-        if (ufrag.ptr)
-            strncpy(handler->remote.ufrag, ufrag.ptr, ufrag.slen);
-        if (pwd.ptr)
-            strncpy(handler->remote.pwd, pwd.ptr, pwd.slen);
+rescan:
+    index = 0;
+    flatcc_builder_reset(&builder);
 
-        if ((pj_strchr(&conn->addr, ':')-conn->addr.ptr) <= conn->addr.slen)
-            af = pj_AF_INET6();
-        else
-            af = pj_AF_INET();
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+        IceHandler *handler;
+        pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
+        elaoffer_candidate_ref_t cands[PJ_ICE_ST_MAX_CAND * PJ_ICE_MAX_COMP];
+        elaoffer_candidate_vec_ref_t cand_vec;
+        pj_sockaddr def_addr;
+        pj_grp_lock_t *lock;
+        pj_status_t status;
+        unsigned ncomps;
+        int cand_cnt = 0;
+        int i;
 
-        pj_sockaddr_init(af, &handler->remote.def_addr[0],
-                         &conn->addr, media->desc.port);
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
 
-        fmt = atoi(media->desc.fmt[0].ptr);
+        if (rc == -1)
+            goto rescan;
 
-        if (stream->base.unencrypt)
-            ops |= ELA_STREAM_PLAIN;
-        if (stream->base.multiplexing)
-            ops |= ELA_STREAM_MULTIPLEXING;
-        if (stream->base.reliable)
-            ops |= ELA_STREAM_RELIABLE;
-        if (stream->base.portforwarding)
-            ops |= ELA_STREAM_PORT_FORWARDING;
+        handler = (IceHandler *)stream->handler;
 
-        if (ops != fmt) {
-            stream->base.deactivate = 1;
-            media_index++;
-            vlogD("ICE: Stream %d deactivated.", stream->base.id);
+        if ((!handler->st) || !pj_ice_strans_has_sess(handler->st)) {
+            flatcc_builder_clear(&builder);
             deref(stream);
-            continue;
+            return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
         }
 
-        for (i = 0; i < (int)media->attr_count; i++) {
-            if (pj_strcmp2(&media->attr[i]->name, "candidate") == 0) {
-                int comp_id, prio, port, rport;
-                int cnt;
-                char foundation[32], transport[12], ipaddr[80], type[32], raddr[80];
-                pj_ice_sess_cand *cand = &handler->remote.cand[cand_index];
-
-                cnt = sscanf(media->attr[i]->value.ptr,
-                             "%32s %d %12s %d %80s %d typ %32s raddr %80s rport %d",
-                             foundation,
-                             &comp_id,
-                             transport,
-                             &prio,
-                             ipaddr,
-                             &port,
-                             type,
-                             raddr,
-                             &rport);
-                if (cnt != 7 && cnt != 9) {
-                    memset(&handler->remote, 0, sizeof(handler->remote));
-                    pj_pool_release(pool);
-                    deref(stream);
-                    return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
-                }
+        ncomps = pj_ice_strans_get_running_comp_cnt(handler->st);
+        if (!ncomps || ncomps > PJ_ICE_MAX_COMP) {
+            flatcc_builder_clear(&builder);
+            deref(stream);
+            return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+        }
 
-                if (strcmp(type, "host")==0)
-                    cand->type = PJ_ICE_CAND_TYPE_HOST;
-                else if (strcmp(type, "srflx")==0)
-                    cand->type = PJ_ICE_CAND_TYPE_SRFLX;
-                else if (strcmp(type, "relay")==0)
-                    cand->type = PJ_ICE_CAND_TYPE_RELAYED;
-                else if (strcmp(type, "prflx")==0)
-                    cand->type = PJ_ICE_CAND_TYPE_PRFLX;
-                else {
-                    memset(&handler->remote, 0, sizeof(handler->remote));
-                    pj_pool_release(pool);
-                    deref(stream);
-                    return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
-                }
+        if (index >= PJMEDIA_MAX_SDP_MEDIA) {
+            flatcc_builder_clear(&builder);
+            deref(stream);
+            return ELA_GENERAL_ERROR(ELAERR_LIMIT_EXCEEDED);
+        }
+
+        lock = pj_ice_strans_get_grp_lock(handler->st);
+        pj_grp_lock_acquire(lock);
 
-                cand->comp_id = (pj_uint8_t)comp_id;
-                cand->foundation = pj_str(foundation);
-                cand->prio = (pj_uint32_t)prio;
+        status = ice_handler_get_def_cand(handler, &cand[0]);
+        if (status != PJ_SUCCESS) {
+            pj_grp_lock_release(lock);
+            flatcc_builder_clear(&builder);
+            deref(stream);
+            return ELA_ICE_ERROR(status);
+        }
+        pj_sockaddr_cp(&def_addr, &cand[0].addr);
 
-                if (strchr(ipaddr, ':'))
-                    af = pj_AF_INET6();
-                else
-                    af = pj_AF_INET();
+        for (i = 0; i < (int)ncomps; i++) {
+            unsigned n = PJ_ARRAY_SIZE(cand);
+            int j;
 
-                pj_str_t str_ipaddr = pj_str(ipaddr);
-                pj_sockaddr_init(af, &cand->addr, &str_ipaddr, (pj_uint16_t)port);
-                if (cnt == 9) {
-                    pj_str_t str_rpaddr = pj_str(raddr);
-                    pj_sockaddr_init(af, &cand->rel_addr, &str_rpaddr, (pj_uint16_t)rport);
-                }
+            status = pj_ice_strans_enum_cands(handler->st, i+1, &n, cand);
+            if (status != PJ_SUCCESS) {
+                pj_grp_lock_release(lock);
+                flatcc_builder_clear(&builder);
+                deref(stream);
+                return ELA_ICE_ERROR(status);
+            }
 
-                if (comp_id > (int)handler->remote.comp_cnt) {
-                    handler->remote.comp_cnt = comp_id;
-                }
+            handler->trickle.sent[i] = 0;
+
+            for (j = 0; j < (int)n; j++) {
+                // Pending candidates are trickled once gathered.
+                if (cand[j].status != PJ_SUCCESS)
+                    continue;
 
-                handler->remote.cand_cnt = ++cand_index;
+                cands[cand_cnt++] = ice_cand_build(&builder, &cand[j]);
+                if (j < 64)
+                    handler->trickle.sent[i] |= ((uint64_t)1 << j);
             }
         }
-        media_index++;
+
+        handler->media_index = index;
+        handler->trickle.announced = 1;
+        pj_grp_lock_release(lock);
+
+        cand_vec = elaoffer_candidate_vec_create(&builder, cands, cand_cnt);
+        vec = flatbuffers_uint8_vec_create(&builder,
+                                           pj_sockaddr_get_addr(&def_addr),
+                                           pj_sockaddr_get_addr_len(&def_addr));
+
+        elaoffer_media_start(&builder);
+        elaoffer_media_type_add(&builder, (uint8_t)stream->base.type);
+        elaoffer_media_options_add(&builder,
+                                   (uint16_t)ice_stream_get_options(stream));
+        elaoffer_media_defaddr_add(&builder, vec);
+        elaoffer_media_defport_add(&builder, pj_sockaddr_get_port(&def_addr));
+        elaoffer_media_cands_add(&builder, cand_vec);
+        medias[index++] = elaoffer_media_end(&builder);
+
         deref(stream);
     }
 
-    pj_pool_release(pool);
+    media_vec = elaoffer_media_vec_create(&builder, medias, index);
+
+    elaoffer_offer_start_as_root(&builder);
+    elaoffer_offer_version_add(&builder, SESSION_OFFER_LATEST);
+    vec = flatbuffers_uint8_vec_create(&builder, base->public_key,
+                                       sizeof(base->public_key));
+    elaoffer_offer_pubkey_add(&builder, vec);
+    str = flatcc_builder_create_string_str(&builder, session->ufrag);
+    elaoffer_offer_ufrag_add(&builder, str);
+    str = flatcc_builder_create_string_str(&builder, session->pwd);
+    elaoffer_offer_pwd_add(&builder, str);
+    if (base->crypto.enabled) {
+        vec = flatbuffers_uint8_vec_create(&builder, base->nonce,
+                                           sizeof(base->nonce));
+        elaoffer_offer_nonce_add(&builder, vec);
+    }
+    elaoffer_offer_trickle_add(&builder, base->trickle ? 1 : 0);
+    elaoffer_offer_bundle_add(&builder, base->bundle ? 1 : 0);
+    elaoffer_offer_medias_add(&builder, media_vec);
+    if (!elaoffer_offer_end_as_root(&builder)) {
+        flatcc_builder_clear(&builder);
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+    }
 
-    return 0;
-}
+    size = flatcc_builder_get_buffer_size(&builder);
+    if (size > len) {
+        flatcc_builder_clear(&builder);
+        return ELA_GENERAL_ERROR(ELAERR_SDP_TOO_LONG);
+    }
 
-#define pj_str(s)       pj_str((char *)(s))
+    flatcc_builder_copy_buffer(&builder, sdp, size);
+    flatcc_builder_clear(&builder);
 
-static const char *stream_type_str[] = {
-    "audio",
-    "video",
-    "text",
-    "application",
-    "message"
-};
+    return (int)size;
+}
 
 static int ice_session_encode_local_sdp(ElaSession *base,
                                         char *sdp, size_t len)
@@ -1465,6 +4267,10 @@ static int ice_session_encode_local_sdp(ElaSession *base,
     pjmedia_sdp_attr ufrag_attr;
     pjmedia_sdp_attr pwd_attr;
     pjmedia_sdp_attr nonce_attr;
+    pjmedia_sdp_attr options_attr;
+    pjmedia_sdp_attr group_attr;
+    pjmedia_sdp_attr versions_attr;
+    char group[8 + 4 * ICE_BUNDLE_MAX_STREAMS];
     list_iterator_t iterator;
     int index = 0;
     int rc;
@@ -1473,6 +4279,9 @@ static int ice_session_encode_local_sdp(ElaSession *base,
 
     assert(base && sdp && len);
 
+    if (base->offer_version >= SESSION_OFFER_COMPACT)
+        return ice_session_encode_compact_offer(base, sdp, len);
+
     prepare_thread_context(transport);
 
     pool = pj_pool_create(&worker->cp.factory, NULL, 4096, 512, NULL);
@@ -1481,7 +4290,10 @@ static int ice_session_encode_local_sdp(ElaSession *base,
 
     memset(&sdp_session, 0, sizeof(sdp_session));
 
+    // IPv6 only hosts have no IPv4 address for the origin.
     status = pj_gethostip(pj_AF_INET(), &addr);
+    if (status != PJ_SUCCESS)
+        status = pj_gethostip(pj_AF_INET6(), &addr);
     if (status != PJ_SUCCESS) {
         pj_pool_release(pool);
         return ELA_ICE_ERROR(status);
@@ -1498,8 +4310,9 @@ static int ice_session_encode_local_sdp(ElaSession *base,
     sdp_session.origin.id = (pj_uint32_t)seconds;
     sdp_session.origin.version = (pj_uint32_t)seconds;
     sdp_session.origin.net_type = pj_str("IN");
-    sdp_session.origin.addr_type = pj_str("IP4");
-    pj_sockaddr_print(&addr, str_addr, sizeof(addr), 0);
+    sdp_session.origin.addr_type = pj_str(addr.addr.sa_family == pj_AF_INET6() ?
+                                          "IP6" : "IP4");
+    pj_sockaddr_print(&addr, str_addr, sizeof(str_addr), 0);
     pj_strdup2_with_null(pool, &sdp_session.origin.addr, str_addr);
 
     // SDP session subject (s=)
@@ -1536,6 +4349,44 @@ static int ice_session_encode_local_sdp(ElaSession *base,
         }
     }
 
+    if (base->trickle) {
+        options_attr.name = pj_str("ice-options");
+        options_attr.value = pj_str("trickle");
+
+        status = pjmedia_sdp_session_add_attr(&sdp_session, &options_attr);
+        if (status != PJ_SUCCESS) {
+            pj_pool_release(pool);
+            return ELA_ICE_ERROR(status);
+        }
+    }
+
+    // Offer formats understood, the peer answers in the compact one.
+    versions_attr.name = pj_str("offer-versions");
+    versions_attr.value = pj_str(SESSION_OFFER_VERSIONS);
+
+    status = pjmedia_sdp_session_add_attr(&sdp_session, &versions_attr);
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool);
+        return ELA_ICE_ERROR(status);
+    }
+
+    if (base->bundle) {
+        int i, n = (int)list_size(base->streams);
+
+        strcpy(group, "BUNDLE");
+        for (i = 0; i < n && i < ICE_BUNDLE_MAX_STREAMS; i++)
+            sprintf(group + strlen(group), " %d", i);
+
+        group_attr.name = pj_str("group");
+        group_attr.value = pj_str(group);
+
+        status = pjmedia_sdp_session_add_attr(&sdp_session, &group_attr);
+        if (status != PJ_SUCCESS) {
+            pj_pool_release(pool);
+            return ELA_ICE_ERROR(status);
+        }
+    }
+
 rescan:
     list_iterate(base->streams, &iterator);
     while (list_iterator_has_next(&iterator)) {
@@ -1544,6 +4395,7 @@ rescan:
         pjmedia_sdp_media *media;
         pjmedia_sdp_conn *conn;
         pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
+        pj_grp_lock_t *lock;
         unsigned ncomps;
         int i;
 
@@ -1574,8 +4426,12 @@ rescan:
         // Media descriptions (m=)
         media->desc.media = pj_str(stream_type_str[stream->base.type]);
 
-        status = pj_ice_strans_get_def_cand(handler->st, 1, &cand[0]);
+        lock = pj_ice_strans_get_grp_lock(handler->st);
+        pj_grp_lock_acquire(lock);
+
+        status = ice_handler_get_def_cand(handler, &cand[0]);
         if (status != PJ_SUCCESS) {
+            pj_grp_lock_release(lock);
             pj_pool_release(pool);
             deref(stream);
             return ELA_ICE_ERROR(status);
@@ -1593,6 +4449,10 @@ rescan:
             ops |= ELA_STREAM_RELIABLE;
         if (stream->base.portforwarding)
             ops |= ELA_STREAM_PORT_FORWARDING;
+        if (stream->base.framing)
+            ops |= ELA_STREAM_MESSAGE_FRAMING;
+        if (stream->base.multipath)
+            ops |= ELA_STREAM_MULTIPATH;
         sprintf(str_ops, "%d", ops);
 
         pj_strdup2_with_null(pool, &media->desc.fmt[0], str_ops);
@@ -1600,8 +4460,9 @@ rescan:
         // Media connection (c=)
         conn = pj_pool_calloc(pool, 1, sizeof(pjmedia_sdp_conn));
         conn->net_type = pj_str("IN");
-        conn->addr_type = pj_str("IP4");
-        pj_sockaddr_print(&cand[0].addr, str_addr, sizeof(addr), 0);
+        conn->addr_type = pj_str(cand[0].addr.addr.sa_family == pj_AF_INET6() ?
+                                 "IP6" : "IP4");
+        pj_sockaddr_print(&cand[0].addr, str_addr, sizeof(str_addr), 0);
         pj_strdup2_with_null(pool, &conn->addr, str_addr);
         media->conn = conn;
 
@@ -1615,38 +4476,23 @@ rescan:
 
             status = pj_ice_strans_enum_cands(handler->st, i+1, &cand_cnt, cand);
             if(status != PJ_SUCCESS) {
+                pj_grp_lock_release(lock);
                 pj_pool_release(pool);
                 deref(stream);
                 return ELA_ICE_ERROR(status);
             }
 
+            if (i < PJ_ICE_MAX_COMP)
+                handler->trickle.sent[i] = 0;
+
             for (j = 0, candidate = cand; j < (int)cand_cnt; j++, candidate++) {
-                char buf[128];
-
-                if (candidate->type == PJ_ICE_CAND_TYPE_HOST) {
-                    snprintf(buf, sizeof(buf), "%.*s %u UDP %u %s %u typ %s",
-                             (int)candidate->foundation.slen,
-                             candidate->foundation.ptr,
-                             (unsigned)candidate->comp_id,
-                             candidate->prio,
-                             pj_sockaddr_print(&candidate->addr, str_addr, sizeof(str_addr), 0),
-                             (unsigned)pj_sockaddr_get_port(&candidate->addr),
-                             pj_ice_get_cand_type_name(candidate->type));
-                } else if ((candidate->type == PJ_ICE_CAND_TYPE_SRFLX)
-                           || (candidate->type == PJ_ICE_CAND_TYPE_RELAYED)) {
-                    char str_rel_addr[PJ_INET6_ADDRSTRLEN];
-
-                    snprintf(buf, sizeof(buf), "%.*s %u UDP %u %s %u typ %s raddr %s rport %u",
-                             (int)candidate->foundation.slen,
-                             candidate->foundation.ptr,
-                             (unsigned)candidate->comp_id,
-                             candidate->prio,
-                             pj_sockaddr_print(&candidate->addr, str_addr, sizeof(str_addr), 0),
-                             (unsigned)pj_sockaddr_get_port(&candidate->addr),
-                             pj_ice_get_cand_type_name(candidate->type),
-                             pj_sockaddr_print(&candidate->rel_addr, str_rel_addr, sizeof(str_rel_addr), 0),
-                             (unsigned)pj_sockaddr_get_port(&candidate->rel_addr));
-                }
+                char buf[160];
+
+                // Pending candidates are trickled once gathered.
+                if (candidate->status != PJ_SUCCESS)
+                    continue;
+
+                ice_cand_to_str(candidate, buf, sizeof(buf));
 
                 cand_attr = pj_pool_calloc(pool, 1, sizeof(pjmedia_sdp_attr));
                 cand_attr->name = pj_str("candidate");
@@ -1654,13 +4500,21 @@ rescan:
 
                 status = pjmedia_sdp_media_add_attr(media, cand_attr);
                 if (status != PJ_SUCCESS) {
+                    pj_grp_lock_release(lock);
                     pj_pool_release(pool);
                     deref(stream);
                     return ELA_ICE_ERROR(status);
                 }
+
+                if (i < PJ_ICE_MAX_COMP && j < 64)
+                    handler->trickle.sent[i] |= ((uint64_t)1 << j);
             }
         }
 
+        handler->media_index = index;
+        handler->trickle.announced = 1;
+        pj_grp_lock_release(lock);
+
         sdp_session.media[index] = media;
         sdp_session.media_count++;
         index++;
@@ -1716,6 +4570,8 @@ static int ice_session_create_stream(ElaSession *base, ElaStream **stream)
     if (!s)
         return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
 
+    pthread_mutex_init(&s->base.write_lock, NULL);
+
     s->base.get_info = ice_stream_get_info;
     s->base.fire_state_changed = ice_stream_fire_state_changed;
     s->base.lock = ice_stream_lock;
@@ -1749,6 +4605,12 @@ static int ice_transport_create_session(ElaTransport *base, ElaSession **session
     s->base.set_offer = ice_session_set_offer;
     s->base.encode_local_sdp = ice_session_encode_local_sdp;
     s->base.apply_remote_sdp = ice_session_apply_remote_sdp;
+    s->base.add_remote_candidates = ice_session_add_remote_candidates;
+    s->base.restart = ice_session_restart;
+    s->base.apply_restart = ice_session_apply_restart;
+    s->base.apply_path = ice_session_apply_path;
+
+    pthread_mutex_init(&s->restart.lock, NULL);
 
 
     vlogD("Session: ICE session created");
@@ -1757,6 +4619,266 @@ static int ice_transport_create_session(ElaTransport *base, ElaSession **session
     return 0;
 }
 
+/*
+ * Pool of pre-warmed ICE workers. Every pooled worker carries an ICE
+ * stream transport which starts gathering host, STUN and TURN candidates
+ * as soon as it is created, so a new session claims a worker with the
+ * candidates (mostly) gathered already, and its first stream takes over
+ * the transport instead of gathering from scratch. The pool thread
+ * refills the pool after claims and replaces the workers which are too
+ * old or failed to gather.
+ */
+#define ICE_POOL_MAX_AGE                (5 * 60 * 1000) /* 5 minutes */
+#define ICE_POOL_CHECK_INTERVAL         10000 /* 10 seconds */
+#define ICE_POOL_RETRY_INTERVAL         5000  /* 5 seconds */
+
+static bool ice_pool_worker_usable(IceWorker *worker, int64_t now)
+{
+    IceStrans *ist = worker->warm;
+    pj_grp_lock_t *lock;
+    bool usable;
+
+    if (!ist || now - worker->warm_time >= ICE_POOL_MAX_AGE)
+        return false;
+
+    lock = pj_ice_strans_get_grp_lock(ist->st);
+    pj_grp_lock_acquire(lock);
+    usable = !ist->gathered || ist->status == PJ_SUCCESS;
+    pj_grp_lock_release(lock);
+
+    return usable;
+}
+
+static void ice_pool_release_worker(IceWorker *worker)
+{
+    ice_worker_stop(&worker->base);
+    deref(worker);
+}
+
+static int ice_pool_create_worker(IceTransport *transport, IceWorker **worker)
+{
+    ElaTurnServer turn_server;
+    IceTransportOptions opts;
+    TransportWorker *base;
+    IceWorker *w;
+    pj_status_t status;
+    int rc;
+
+    rc = session_get_ice_options(transport->base.ext, &turn_server, &opts);
+    if (rc < 0)
+        return ela_get_error();
+
+    rc = ice_worker_create(&transport->base, &opts, &base);
+    if (rc < 0)
+        return rc;
+
+    w = (IceWorker *)base;
+
+    status = ice_strans_create(w, &w->cfg, NULL, 0, 0, &w->warm);
+    if (status != PJ_SUCCESS) {
+        ice_pool_release_worker(w);
+        return ELA_ICE_ERROR(status);
+    }
+
+    w->warm_time = get_monotonic_time() / 1000;
+
+    *worker = w;
+    return 0;
+}
+
+// Take out one worker not usable any more, with the pool locked.
+static IceWorker *ice_pool_take_stale(IceTransport *transport, int64_t now)
+{
+    int i;
+
+    for (i = 0; i < transport->pool.size; i++) {
+        IceWorker *worker = transport->pool.workers[i];
+
+        if (!ice_pool_worker_usable(worker, now)) {
+            transport->pool.workers[i] =
+                    transport->pool.workers[--transport->pool.size];
+            return worker;
+        }
+    }
+
+    return NULL;
+}
+
+static void *ice_pool_routine(void *arg)
+{
+    IceTransport *transport = (IceTransport *)arg;
+    bool failed = false;
+
+    prepare_thread_context(transport);
+
+    vlogD("Session: ICE pool routine started.");
+
+    pthread_mutex_lock(&transport->pool.lock);
+
+    while (!transport->pool.quit) {
+        IceWorker *worker;
+        struct timeval tv;
+        struct timespec ts;
+        uint64_t next;
+        int64_t now;
+        int rc;
+
+        now = get_monotonic_time() / 1000;
+
+        worker = ice_pool_take_stale(transport, now);
+        if (worker) {
+            pthread_mutex_unlock(&transport->pool.lock);
+
+            vlogD("Session: ICE pool drops stale worker %d.", worker->base.id);
+            ice_pool_release_worker(worker);
+
+            pthread_mutex_lock(&transport->pool.lock);
+            continue;
+        }
+
+        if (!failed && transport->pool.size < ICE_POOL_SIZE) {
+            pthread_mutex_unlock(&transport->pool.lock);
+
+            rc = ice_pool_create_worker(transport, &worker);
+            if (rc < 0) {
+                vlogD("Session: ICE pool create worker error (0x%x), "
+                      "retry later.", rc);
+                failed = true;
+                worker = NULL;
+            }
+
+            pthread_mutex_lock(&transport->pool.lock);
+
+            if (worker) {
+                if (!transport->pool.quit &&
+                        transport->pool.size < ICE_POOL_SIZE) {
+                    transport->pool.workers[transport->pool.size++] = worker;
+                    vlogD("Session: ICE pool pre-warmed worker %d.",
+                          worker->base.id);
+                } else {
+                    pthread_mutex_unlock(&transport->pool.lock);
+                    ice_pool_release_worker(worker);
+                    pthread_mutex_lock(&transport->pool.lock);
+                }
+            }
+            continue;
+        }
+
+        gettimeofday(&tv, NULL);
+        next = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec +
+               (failed ? ICE_POOL_RETRY_INTERVAL : ICE_POOL_CHECK_INTERVAL) * 1000;
+        ts.tv_sec = (time_t)(next / 1000000);
+        ts.tv_nsec = (long)(next % 1000000) * 1000;
+
+        pthread_cond_timedwait(&transport->pool.cond, &transport->pool.lock, &ts);
+        failed = false;
+    }
+
+    pthread_mutex_unlock(&transport->pool.lock);
+
+    vlogD("Session: ICE pool routine finished.");
+    return NULL;
+}
+
+/*
+ * Started by the first new session, the nodes never using sessions do not
+ * pay for the pre-warmed workers. Later calls return right away.
+ */
+static void ice_transport_prewarm(ElaTransport *base)
+{
+    IceTransport *transport = (IceTransport *)base;
+    int rc;
+
+    pthread_mutex_lock(&transport->pool.lock);
+
+    if (transport->pool.started || transport->pool.disabled) {
+        pthread_mutex_unlock(&transport->pool.lock);
+        return;
+    }
+
+    rc = pthread_create(&transport->pool.thread, NULL, ice_pool_routine,
+                        transport);
+    if (rc != 0) {
+        vlogW("Session: Create ICE pool thread error (%d), pool disabled.", rc);
+        transport->pool.disabled = 1;
+    } else {
+        transport->pool.started = 1;
+    }
+
+    pthread_mutex_unlock(&transport->pool.lock);
+}
+
+static void ice_pool_stop(IceTransport *transport)
+{
+    int i;
+
+    if (!transport->pool.started)
+        return;
+
+    pthread_mutex_lock(&transport->pool.lock);
+    transport->pool.quit = 1;
+    pthread_cond_signal(&transport->pool.cond);
+    pthread_mutex_unlock(&transport->pool.lock);
+
+    pthread_join(transport->pool.thread, NULL);
+    transport->pool.started = 0;
+
+    for (i = 0; i < transport->pool.size; i++)
+        ice_pool_release_worker(transport->pool.workers[i]);
+
+    transport->pool.size = 0;
+}
+
+static IceWorker *ice_pool_claim(IceTransport *transport)
+{
+    IceWorker *worker = NULL;
+    int64_t now;
+    int i;
+
+    now = get_monotonic_time() / 1000;
+
+    pthread_mutex_lock(&transport->pool.lock);
+
+    if (!transport->pool.started) {
+        pthread_mutex_unlock(&transport->pool.lock);
+        return NULL;
+    }
+
+    for (i = 0; i < transport->pool.size; i++) {
+        if (ice_pool_worker_usable(transport->pool.workers[i], now)) {
+            worker = transport->pool.workers[i];
+            transport->pool.workers[i] =
+                    transport->pool.workers[--transport->pool.size];
+            break;
+        }
+    }
+
+    // Wake up the pool thread to refill.
+    pthread_cond_signal(&transport->pool.cond);
+    pthread_mutex_unlock(&transport->pool.lock);
+
+    return worker;
+}
+
+static
+int ice_transport_create_worker(ElaTransport *base, IceTransportOptions *opts,
+                                TransportWorker **worker)
+{
+    IceTransport *transport = (IceTransport *)base;
+    IceWorker *w;
+
+    prepare_thread_context(transport);
+
+    w = ice_pool_claim(transport);
+    if (w) {
+        vlogD("Session: ICE worker %d claimed from pool.", w->base.id);
+        *worker = &w->base;
+        return 0;
+    }
+
+    return ice_worker_create(base, opts, worker);
+}
+
 int ice_transport_create(ElaTransport **transport)
 {
     IceTransport *t;
@@ -1775,7 +4897,8 @@ int ice_transport_create(ElaTransport **transport)
     }
 
     t->base.create_session = ice_transport_create_session;
-    t->base.create_worker = ice_worker_create;
+    t->base.create_worker = ice_transport_create_worker;
+    t->base.prewarm = ice_transport_prewarm;
 
     vlogD("Session: ICE transport created.");
 
@@ -60,6 +60,37 @@
 extern "C" {
 #endif
 typedef struct IceTransport IceTransport;
+typedef struct IceStream IceStream;
+
+#define ICE_POOL_SIZE                   2
+#define ICE_BUNDLE_MAX_STREAMS          16
+#define ICE_MAX_PATHS                   4
+
+/*
+ * Holder of an ICE stream transport. The pj_ice_strans user data points
+ * here instead of the stream, so a transport can start gathering before
+ * the stream it will belong to exists.
+ */
+typedef struct IceStrans {
+    pj_ice_strans       *st;
+    IceStream           *stream;    // NULL while pre-warmed in pool.
+    int                 gathered;
+    pj_status_t         status;
+
+    // Set while gathering and checking for the ICE restart of the stream,
+    // before it is swapped in.
+    int                 restarting;
+    int                 completed;
+    pj_status_t         result;
+
+    // Index of the extra path of a multipath stream, 0 for the main path.
+    int                 path;
+
+    // Set when shared by the bundled streams of a session.
+    struct IceSession   *session;
+    int                 owners;     // handlers not destroyed.
+    int                 users;      // handlers not stopped.
+} IceStrans;
 
 typedef struct IceWorker {
     TransportWorker     base;
@@ -86,45 +117,152 @@ typedef struct IceWorker {
     pj_sockaddr_in      read_addr;
     pj_ioqueue_key_t    *read_key;
     pj_ioqueue_key_t    *write_key;
+
+    IceStrans           *warm;      // pre-gathered, claimed by first stream.
+    int64_t             warm_time;
 } IceWorker;
 
 typedef struct IceTransport {
     ElaTransport        base;
     pthread_key_t       pj_thread_ctx;
+
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+        pthread_t       thread;
+        int             started;
+        int             disabled;   // pool thread failed to start.
+        int             quit;
+        int             size;
+        IceWorker       *workers[ICE_POOL_SIZE];
+    } pool;
 } IceTransport;
 
+/*
+ * The keep-alive interval of a path, adapted to the lifetime of the NAT
+ * bindings on it.
+ */
+typedef struct IceKeepalive {
+    int                 interval;   // in milliseconds.
+    int                 backed_off; // shrunk for the current peer silence.
+} IceKeepalive;
+
 typedef struct IceSession {
     ElaSession          base;
 
     pj_ice_sess_role    role;
     char                ufrag[PJ_ICE_UFRAG_LEN+1];
     char                pwd[PJ_ICE_UFRAG_LEN+1];
+
+    struct {
+        IceStrans       *ist;
+        IceStream       *streams[ICE_BUNDLE_MAX_STREAMS]; // by media index.
+        struct timeval  local_timestamp;
+        struct timeval  remote_timestamp;
+        IceKeepalive    keepalive;
+    } bundle;
+
+    struct {
+        pthread_mutex_t lock;
+        Timer           *timer;
+        int             requested;
+        int             pending;
+        int             round;
+        int             swapped;
+        int64_t         expire_time;
+        char            ufrag[PJ_ICE_UFRAG_LEN+1];
+        char            pwd[PJ_ICE_UFRAG_LEN+1];
+    } restart;
 } IceSession;
 
-typedef struct IceStream {
+struct IceStream {
     ElaStream           base;
     StreamHandler       *handler;
 
     struct timeval      local_timestamp;
     struct timeval      remote_timestamp;
+    IceKeepalive        keepalive;
     Timer               *keepalive_timer;
-} IceStream;
+};
+
+typedef struct IceRemote {
+    char                ufrag[80];
+    char                pwd[80];
+    unsigned int        comp_cnt;
+    pj_sockaddr         def_addr[PJ_ICE_MAX_COMP];
+    unsigned int        cand_cnt;
+    pj_ice_sess_cand    cand[PJ_ICE_ST_MAX_CAND];
+    char                foundation[PJ_ICE_ST_MAX_CAND][33];
+} IceRemote;
+
+/*
+ * A path of the multipath stream. The main path is the ICE transport of
+ * the handler, the extra ones have their own transports.
+ */
+typedef struct IcePath {
+    IceStrans           *ist;       // NULL for the main path.
+    int                 index;
+
+    char                ufrag[PJ_ICE_UFRAG_LEN+1];
+    char                pwd[PJ_ICE_UFRAG_LEN+1];
+    IceRemote           remote;
+
+    int                 initialized;
+    int                 remote_ready;
+    int                 checking;
+    int                 nominated;
+    int                 failed;
+    int64_t             expire_time;
+
+    // Probed liveness and quality, times in milliseconds.
+    int                 active;
+    uint32_t            probe_seq;
+    int64_t             probe_time;
+    int                 probe_acked;
+    int64_t             ack_time;
+    uint32_t            srtt;       // in microseconds.
+    int                 loss;       // in per mille.
+
+    int                 weight;
+    int                 current;    // smooth weighted round-robin.
+} IcePath;
 
 typedef struct IceHandler {
     StreamHandler       base;
 
     pj_ice_strans       *st;
+    IceStrans           *ist;
 
     int                 stopping;
+    int                 started;
+    int                 media_index;
+
+    IceRemote           remote;
+
+    struct {
+        int             enabled;
+        int             announced;  // local SDP encoded.
+        uint64_t        sent[PJ_ICE_MAX_COMP];  // bitmask of local candidates.
+    } trickle;
+
+    struct {
+        IceStrans       *ist;       // swapped in once the checks complete.
+        int             round;
+        int             initialized;
+        int             remote;     // restart candidates of peer received.
+        int             checking;
+    } restart;
+
+    struct {
+        int             enabled;
+        Timer           *timer;
+        IcePath         *paths[ICE_MAX_PATHS];
+    } multipath;
 
     struct {
-        char            ufrag[80];
-        char            pwd[80];
-        unsigned int    comp_cnt;
-        pj_sockaddr     def_addr[PJ_ICE_MAX_COMP];
-        unsigned int    cand_cnt;
-        pj_ice_sess_cand    cand[PJ_ICE_ST_MAX_CAND];
-    } remote;
+        Timer           *timer;
+        int             state;      // notified on the worker once claimed.
+    } warm;
 } IceHandler;
 
 int ice_transport_create(ElaTransport **transport);
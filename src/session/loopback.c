@@ -0,0 +1,1078 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <rc_mem.h>
+#include <vlog.h>
+#include <base58.h>
+#include <crypto.h>
+#include <time_util.h>
+
+#include "flex_buffer.h"
+#include "session.h"
+#include "stream_handler.h"
+#include "loopback.h"
+
+#define LOOPBACK_SDP_NAME           "elastos-loopback-session"
+
+/* Drop the outgoing packets if the emulated link queued more than this. */
+#define LOOPBACK_MAX_BACKLOG        (1000 * 1000) // us
+
+#define LOOPBACK_IDLE_WAIT          (500 * 1000)  // us
+
+typedef enum LoopbackEventType {
+    EVENT_STATE_CHANGED,
+    EVENT_DATA,
+    EVENT_SHUTDOWN
+} LoopbackEventType;
+
+struct LoopbackEvent {
+    LoopbackEvent       *next;
+    uint64_t            due;
+    LoopbackEventType   type;
+    LoopbackStream      *stream;
+    int                 state;
+    size_t              len;
+    uint8_t             data[0];
+};
+
+struct LoopbackTimer {
+    LoopbackTimer       *next;
+    int                 id;
+    unsigned long       interval;
+    uint64_t            due;
+    int                 scheduled;
+    int                 running;
+    int                 cancelled;
+    TimerCallback       *callback;
+    void                *user_data;
+};
+
+static uint32_t loopback_random(uint32_t *seed)
+{
+    // xorshift32, reproducible with the same seed on all platforms.
+    uint32_t x = *seed ? *seed : 0x9E3779B9;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    *seed = x;
+    return x;
+}
+
+static
+void loopback_worker_post(LoopbackWorker *worker, LoopbackEvent *event)
+{
+    LoopbackEvent **pp;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->quit) {
+        pthread_mutex_unlock(&worker->lock);
+        deref(event->stream);
+        free(event);
+        return;
+    }
+
+    // Keep the events ordered by due time, FIFO for the same due time.
+    for (pp = &worker->events; *pp && (*pp)->due <= event->due; pp = &(*pp)->next);
+    event->next = *pp;
+    *pp = event;
+
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static LoopbackEvent *loopback_event_new(LoopbackEventType type,
+                                         LoopbackStream *stream, uint64_t due,
+                                         const void *data, size_t len)
+{
+    LoopbackEvent *event;
+
+    event = (LoopbackEvent *)malloc(sizeof(LoopbackEvent) + len);
+    if (!event)
+        return NULL;
+
+    event->next = NULL;
+    event->due = due;
+    event->type = type;
+    event->stream = (LoopbackStream *)ref(stream);
+    event->state = 0;
+    event->len = len;
+    if (len)
+        memcpy(event->data, data, len);
+
+    return event;
+}
+
+static void notify_state_changed(StreamHandler *handler, int state)
+{
+    LoopbackStream *stream = (LoopbackStream *)handler->stream;
+    LoopbackWorker *worker;
+    LoopbackEvent *event;
+
+    worker = (LoopbackWorker *)stream_get_worker(&stream->base);
+
+    event = loopback_event_new(EVENT_STATE_CHANGED, stream,
+                               get_monotonic_time(), NULL, 0);
+    if (!event) {
+        vlogE("Stream: %d can not notify state changed, out of memory.",
+              handler->stream->id);
+        return;
+    }
+
+    event->state = state;
+    loopback_worker_post(worker, event);
+}
+
+static void loopback_dispatch_event(LoopbackEvent *event)
+{
+    LoopbackStream *stream = event->stream;
+    StreamHandler *handler = stream->handler;
+    FlexBuffer *buf;
+
+    pthread_mutex_lock(&stream->lock);
+
+    switch (event->type) {
+    case EVENT_STATE_CHANGED:
+        handler->on_state_changed(handler, event->state);
+        break;
+
+    case EVENT_SHUTDOWN:
+        if (stream->base.state == ElaStreamState_connecting ||
+            stream->base.state == ElaStreamState_connected) {
+            vlogD("Stream: %d loopback stream closed by remote.", stream->base.id);
+            handler->on_state_changed(handler, ElaStreamState_closed);
+        }
+        break;
+
+    case EVENT_DATA:
+        if (stream->base.state != ElaStreamState_connecting &&
+            stream->base.state != ElaStreamState_connected) {
+            vlogW("Stream: %d loopback state is %d, but received data, ignore.",
+                  stream->base.id, stream->base.state);
+            stats_dropped(&stream->base.stats.transport);
+            break;
+        }
+
+        flex_buffer_from(buf, FLEX_PADDING_LEN, event->data, event->len);
+        stats_received(&stream->base.stats.transport, event->len);
+        handler->on_data(handler, buf);
+        break;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void *loopback_worker_routine(void *arg)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)arg;
+
+    ref(worker);
+
+    vlogD("Session: Loopback worker %d routine started.", worker->base.id);
+
+    pthread_mutex_lock(&worker->lock);
+
+    while (!worker->quit) {
+        LoopbackTimer **pp;
+        LoopbackTimer *timer = NULL;
+        LoopbackEvent *event;
+        uint64_t now = get_monotonic_time();
+        uint64_t next = now + LOOPBACK_IDLE_WAIT;
+        struct timeval tv;
+        struct timespec ts;
+        bool again;
+
+        event = worker->events;
+        if (event && event->due <= now) {
+            worker->events = event->next;
+            pthread_mutex_unlock(&worker->lock);
+
+            loopback_dispatch_event(event);
+            deref(event->stream);
+            free(event);
+
+            pthread_mutex_lock(&worker->lock);
+            continue;
+        }
+
+        if (event)
+            next = event->due;
+
+        for (pp = &worker->timers; *pp; pp = &(*pp)->next) {
+            if (!(*pp)->scheduled)
+                continue;
+
+            if ((*pp)->due <= now) {
+                timer = *pp;
+                break;
+            }
+
+            if ((*pp)->due < next)
+                next = (*pp)->due;
+        }
+
+        if (timer) {
+            timer->scheduled = 0;
+            timer->running = 1;
+            pthread_mutex_unlock(&worker->lock);
+
+            again = timer->callback(timer->user_data);
+
+            pthread_mutex_lock(&worker->lock);
+            timer->running = 0;
+
+            if (timer->cancelled) {
+                for (pp = &worker->timers; *pp != timer; pp = &(*pp)->next);
+                *pp = timer->next;
+                free(timer);
+            } else if (again && !timer->scheduled) {
+                timer->due = get_monotonic_time() + timer->interval * 1000;
+                timer->scheduled = 1;
+            }
+            continue;
+        }
+
+        // Wait on the wall clock, the difference of the clocks is ignorable
+        // for such short waits.
+        gettimeofday(&tv, NULL);
+        next = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec + (next - now);
+        ts.tv_sec = (time_t)(next / 1000000);
+        ts.tv_nsec = (long)(next % 1000000) * 1000;
+
+        pthread_cond_timedwait(&worker->cond, &worker->lock, &ts);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    deref(worker);
+
+    vlogD("Session: Loopback worker %d routine finished.", worker->base.id);
+    return NULL;
+}
+
+static void loopback_worker_stop(TransportWorker *base)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)base;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = 1;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    if (worker->started && !pthread_equal(worker->thread, pthread_self())) {
+        vlogD("Session: Loopback worker %d stopping thread...", worker->base.id);
+        pthread_join(worker->thread, NULL);
+        worker->started = 0;
+    }
+
+    vlogD("Session: Loopback worker %d stopped.", worker->base.id);
+}
+
+static void loopback_worker_destroy(void *p)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)p;
+
+    loopback_worker_stop(&worker->base);
+
+    if (worker->started)
+        pthread_detach(worker->thread);
+
+    while (worker->events) {
+        LoopbackEvent *event = worker->events;
+
+        worker->events = event->next;
+        deref(event->stream);
+        free(event);
+    }
+
+    while (worker->timers) {
+        LoopbackTimer *timer = worker->timers;
+
+        worker->timers = timer->next;
+        free(timer);
+    }
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+
+    vlogD("Session: Loopback worker %d destroyed", worker->base.id);
+}
+
+static
+void loopback_worker_schedule_timer(TransportWorker *base, Timer *tmr,
+                                    unsigned long next)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)base;
+    LoopbackTimer *timer = (LoopbackTimer *)tmr;
+
+    assert(worker);
+    assert(timer);
+
+    pthread_mutex_lock(&worker->lock);
+    timer->due = (uint64_t)next * 1000;
+    timer->scheduled = 1;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static
+int loopback_worker_create_timer(TransportWorker *base, int id,
+                                 unsigned long interval,
+                                 TimerCallback *callback, void *user_data,
+                                 Timer **tmr)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)base;
+    LoopbackTimer *timer;
+
+    assert(base);
+    assert(callback);
+    assert(tmr);
+
+    timer = (LoopbackTimer *)calloc(1, sizeof(LoopbackTimer));
+    if (!timer)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    timer->id = id;
+    timer->interval = interval;
+    timer->callback = callback;
+    timer->user_data = user_data;
+    timer->due = get_monotonic_time() + interval * 1000;
+    timer->scheduled = 1;
+
+    pthread_mutex_lock(&worker->lock);
+    timer->next = worker->timers;
+    worker->timers = timer;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    *tmr = timer;
+    return 0;
+}
+
+static void loopback_worker_destroy_timer(TransportWorker *base, Timer *tmr)
+{
+    LoopbackWorker *worker = (LoopbackWorker *)base;
+    LoopbackTimer *timer = (LoopbackTimer *)tmr;
+    LoopbackTimer **pp;
+
+    assert(base);
+    assert(tmr);
+
+    pthread_mutex_lock(&worker->lock);
+
+    if (timer->running) {
+        // Released by the worker routine once the callback returns.
+        timer->cancelled = 1;
+        timer->scheduled = 0;
+    } else {
+        for (pp = &worker->timers; *pp && *pp != timer; pp = &(*pp)->next);
+        if (*pp) {
+            *pp = timer->next;
+            free(timer);
+        }
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static int loopback_workerid(void)
+{
+    static int workerid = 0;
+
+    if (++workerid == INT_MAX) {
+        workerid = 0;
+        ++workerid;
+    }
+
+    return workerid;
+}
+
+static
+int loopback_worker_create(ElaTransport *transport, IceTransportOptions *opts,
+                           TransportWorker **worker)
+{
+    LoopbackWorker *w;
+    int rc;
+
+    assert(worker);
+
+    w = (LoopbackWorker *)rc_zalloc(sizeof(LoopbackWorker),
+                                    loopback_worker_destroy);
+    if (!w)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    w->base.id = loopback_workerid();
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    w->base.stop = loopback_worker_stop;
+    w->base.schedule_timer = loopback_worker_schedule_timer;
+    w->base.create_timer = loopback_worker_create_timer;
+    w->base.destroy_timer = loopback_worker_destroy_timer;
+
+    rc = pthread_create(&w->thread, NULL, loopback_worker_routine, w);
+    if (rc != 0) {
+        vlogE("Session: Loopback worker %d create worker thread failed.",
+              w->base.id);
+        deref(w);
+        return ELA_SYS_ERROR(rc);
+    }
+    w->started = 1;
+
+    *worker = &w->base;
+    vlogD("Session: Loopback worker %d created.", w->base.id);
+
+    return 0;
+}
+
+static void loopback_handler_release_peer(LoopbackHandler *handler)
+{
+    if (handler->peer) {
+        deref(handler->peer);
+        handler->peer = NULL;
+    }
+
+    if (handler->peer_worker) {
+        deref(handler->peer_worker);
+        handler->peer_worker = NULL;
+    }
+}
+
+static int loopback_handler_init(StreamHandler *base)
+{
+    notify_state_changed(base, ElaStreamState_initialized);
+
+    vlogD("Stream: %d loopback handler initialized.", base->stream->id);
+
+    return 0;
+}
+
+static int loopback_handler_prepare(StreamHandler *base)
+{
+    if (base->stream->state != ElaStreamState_initialized) {
+        vlogE("Stream: %d loopback stream not completely initialized.",
+              base->stream->id);
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    }
+
+    notify_state_changed(base, ElaStreamState_transport_ready);
+
+    vlogD("Stream: %d loopback handler prepared.", base->stream->id);
+
+    return 0;
+}
+
+static int loopback_handler_start(StreamHandler *base)
+{
+    LoopbackHandler *handler = (LoopbackHandler *)base;
+
+    if (base->stream->state != ElaStreamState_transport_ready) {
+        vlogE("Stream: %d loopback handler not ready to start.",
+              base->stream->id);
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    }
+
+    if (!handler->peer) {
+        notify_state_changed(base, ElaStreamState_failed);
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    }
+
+    // Nothing to negotiate, the stream is usable right away.
+    notify_state_changed(base, ElaStreamState_connecting);
+    notify_state_changed(base, ElaStreamState_connected);
+
+    vlogD("Stream: %d loopback handler started.", base->stream->id);
+
+    return 0;
+}
+
+static void loopback_handler_stop(StreamHandler *base, int error)
+{
+    LoopbackHandler *handler = (LoopbackHandler *)base;
+    LoopbackStream *stream = (LoopbackStream *)base->stream;
+    LoopbackEvent *event;
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (handler->stopping) {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    handler->stopping = 1;
+
+    if (stream->base.state <= ElaStreamState_connected) {
+        int state;
+
+        if (stream->base.state >= ElaStreamState_connecting && handler->peer) {
+            event = loopback_event_new(EVENT_SHUTDOWN, handler->peer,
+                                       get_monotonic_time(), NULL, 0);
+            if (event)
+                loopback_worker_post(handler->peer_worker, event);
+        }
+
+        state = (error == 0 ? ElaStreamState_closed : ElaStreamState_failed);
+        base->on_state_changed(base, state);
+    }
+
+    loopback_handler_release_peer(handler);
+
+    pthread_mutex_unlock(&stream->lock);
+
+    vlogD("Stream: %d loopback handler stopped.", base->stream->id);
+}
+
+static
+ssize_t loopback_handler_write(StreamHandler *base, FlexBuffer *buf)
+{
+    LoopbackHandler *handler = (LoopbackHandler *)base;
+    LoopbackStream *stream = (LoopbackStream *)base->stream;
+    LoopbackTransport *transport;
+    LoopbackLinkOptions *link;
+    LoopbackEvent *event;
+    size_t len = flex_buffer_size(buf);
+    uint64_t now;
+    uint64_t due;
+
+    transport = (LoopbackTransport *)stream_get_transport(base->stream);
+    link = &transport->link;
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (!handler->peer) {
+        pthread_mutex_unlock(&stream->lock);
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    }
+
+    now = get_monotonic_time();
+
+    if (link->bandwidth) {
+        if (handler->link_free < now)
+            handler->link_free = now;
+
+        if (handler->link_free - now > LOOPBACK_MAX_BACKLOG) {
+            pthread_mutex_unlock(&stream->lock);
+            stats_dropped(&base->stream->stats.transport);
+            return ELA_GENERAL_ERROR(ELAERR_BUSY);
+        }
+
+        handler->link_free += len * 1000000 / link->bandwidth;
+        due = handler->link_free;
+    } else {
+        due = now;
+    }
+
+    due += (uint64_t)link->delay * 1000;
+    if (link->jitter)
+        due += loopback_random(&handler->seed) % (link->jitter * 1000 + 1);
+
+    if (link->loss && loopback_random(&handler->seed) % 1000 < link->loss) {
+        // Lost on the wire, the sender never knows.
+        pthread_mutex_unlock(&stream->lock);
+        stats_sent(&base->stream->stats.transport, len);
+        return len;
+    }
+
+    event = loopback_event_new(EVENT_DATA, handler->peer, due,
+                               flex_buffer_ptr(buf), len);
+    if (!event) {
+        pthread_mutex_unlock(&stream->lock);
+        stats_dropped(&base->stream->stats.transport);
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+    }
+
+    loopback_worker_post(handler->peer_worker, event);
+
+    pthread_mutex_unlock(&stream->lock);
+
+    stats_sent(&base->stream->stats.transport, len);
+
+    vlogT("Stream: %d loopback handler sent %zu bytes data.",
+          base->stream->id, len);
+    return len;
+}
+
+static void loopback_handler_destroy(void *p)
+{
+    LoopbackHandler *handler = (LoopbackHandler *)p;
+
+    loopback_handler_release_peer(handler);
+
+    vlogD("Stream: %d loopback handler destroyed.", handler->base.stream->id);
+}
+
+static int loopback_handler_create(LoopbackStream *stream,
+                                   StreamHandler **handler)
+{
+    LoopbackTransport *transport;
+    LoopbackHandler *h;
+
+    transport = (LoopbackTransport *)stream_get_transport(&stream->base);
+
+    h = (LoopbackHandler *)rc_zalloc(sizeof(LoopbackHandler),
+                                     loopback_handler_destroy);
+    if (!h)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    h->base.name = "Loopback Transport Handler";
+    h->base.stream = (ElaStream *)stream;
+    h->seed = transport->link.seed;
+
+    h->base.init = loopback_handler_init;
+    h->base.prepare = loopback_handler_prepare;
+    h->base.start = loopback_handler_start;
+    h->base.stop = loopback_handler_stop;
+    h->base.write = loopback_handler_write;
+    h->base.on_data = default_handler_on_data;
+    h->base.on_state_changed = default_handler_on_state_changed;
+
+    *handler = (StreamHandler *)h;
+    return 0;
+}
+
+static void loopback_stream_destroy(void *p)
+{
+    LoopbackStream *stream = (LoopbackStream *)p;
+
+    // Call base destructor
+    stream_base_destroy(&stream->base);
+
+    pthread_mutex_destroy(&stream->lock);
+
+    vlogD("Stream: %d destroyed.", stream->base.id);
+}
+
+static int loopback_stream_get_info(ElaStream *base, ElaTransportInfo *info)
+{
+    LoopbackHandler *handler;
+
+    assert(base && info);
+
+    handler = (LoopbackHandler *)((LoopbackStream *)base)->handler;
+    if (!handler->peer)
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+
+    memset(info, 0, sizeof(*info));
+
+    info->topology = ElaNetworkTopology_LAN;
+
+    info->local.type = ElaCandidateType_Host;
+    strcpy(info->local.addr, "127.0.0.1");
+    info->local.port = base->id;
+
+    info->remote.type = ElaCandidateType_Host;
+    strcpy(info->remote.addr, "127.0.0.1");
+    info->remote.port = handler->peer->base.id;
+
+    return 0;
+}
+
+static void loopback_stream_fire_state_changed(ElaStream *base, int state)
+{
+    LoopbackStream *stream = (LoopbackStream *)base;
+
+    notify_state_changed(stream->handler, state);
+}
+
+static void loopback_stream_lock(ElaStream *base)
+{
+    pthread_mutex_lock(&((LoopbackStream *)base)->lock);
+}
+
+static void loopback_stream_unlock(ElaStream *base)
+{
+    pthread_mutex_unlock(&((LoopbackStream *)base)->lock);
+}
+
+static int loopback_session_create_stream(ElaSession *base, ElaStream **stream)
+{
+    LoopbackStream *s;
+    StreamHandler *handler;
+    pthread_mutexattr_t attr;
+    int rc;
+
+    s = (LoopbackStream *)rc_zalloc(sizeof(LoopbackStream),
+                                    loopback_stream_destroy);
+    if (!s)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    // Handlers might re-enter the stream lock from the data callbacks.
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&s->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_init(&s->base.write_lock, NULL);
+
+    s->base.session = base;
+    s->base.get_info = loopback_stream_get_info;
+    s->base.fire_state_changed = loopback_stream_fire_state_changed;
+    s->base.lock = loopback_stream_lock;
+    s->base.unlock = loopback_stream_unlock;
+
+    rc = loopback_handler_create(s, &handler);
+    if (rc != 0) {
+        deref(s);
+        return rc;
+    }
+
+    s->handler = handler;
+    handler_connect(&s->base.pipeline, handler);
+
+    vlogD("Session: Loopback stream & handler created");
+
+    *stream = (ElaStream *)s;
+    return 0;
+}
+
+static int loopback_session_init(ElaSession *base)
+{
+    LoopbackSession *session = (LoopbackSession *)base;
+    LoopbackTransport *transport;
+
+    transport = (LoopbackTransport *)session_get_transport(base);
+
+    pthread_mutex_lock(&transport->lock);
+    session->token = ++transport->last_token;
+    session->next = transport->sessions;
+    transport->sessions = session;
+    pthread_mutex_unlock(&transport->lock);
+
+    vlogD("Session: Loopback session %d initialized.", session->token);
+
+    return 0;
+}
+
+static void loopback_session_destroy(void *p)
+{
+    LoopbackSession *session = (LoopbackSession *)p;
+    LoopbackTransport *transport;
+    LoopbackSession **pp;
+
+    transport = (LoopbackTransport *)session_get_transport(&session->base);
+    if (transport && session->token) {
+        pthread_mutex_lock(&transport->lock);
+        for (pp = &transport->sessions; *pp && *pp != session; pp = &(*pp)->next);
+        if (*pp)
+            *pp = session->next;
+        pthread_mutex_unlock(&transport->lock);
+    }
+
+    // Call base destructor
+    session_base_destroy(p);
+
+    vlogD("Session: Loopback session destroyed");
+}
+
+static bool loopback_session_set_offer(ElaSession *base, bool offerer)
+{
+    return true;
+}
+
+static int loopback_session_encode_local_sdp(ElaSession *base,
+                                             char *sdp, size_t len)
+{
+    LoopbackSession *session = (LoopbackSession *)base;
+    list_iterator_t iterator;
+    char pk[64];
+    size_t pklen = sizeof(pk);
+    char nonce[NONCE_BYTES * 2];
+    size_t pos;
+    int rc;
+
+    if (!base58_encode(base->public_key, sizeof(base->public_key), pk, &pklen))
+        return ELA_SYS_ERROR(ELAERR_INVALID_CREDENTIAL);
+
+    crypto_nonce_to_str(base->nonce, nonce, sizeof(nonce));
+
+    rc = snprintf(sdp, len, "s=%s\r\no=%s %d\r\na=nonce:%s\r\n",
+                  LOOPBACK_SDP_NAME, pk, session->token, nonce);
+    if (rc < 0 || (size_t)rc >= len)
+        return ELA_GENERAL_ERROR(ELAERR_SDP_TOO_LONG);
+    pos = (size_t)rc;
+
+reencode:
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        ElaStream *stream;
+        int ops = 0;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1) {
+            pos = strlen(sdp);
+            goto reencode;
+        }
+
+        if (stream->unencrypt)
+            ops |= ELA_STREAM_PLAIN;
+        if (stream->multiplexing)
+            ops |= ELA_STREAM_MULTIPLEXING;
+        if (stream->reliable)
+            ops |= ELA_STREAM_RELIABLE;
+        if (stream->portforwarding)
+            ops |= ELA_STREAM_PORT_FORWARDING;
+        if (stream->framing)
+            ops |= ELA_STREAM_MESSAGE_FRAMING;
+
+        rc = snprintf(sdp + pos, len - pos, "m=%d %d\r\n", stream->id, ops);
+        deref(stream);
+
+        if (rc < 0 || (size_t)rc >= len - pos)
+            return ELA_GENERAL_ERROR(ELAERR_SDP_TOO_LONG);
+        pos += (size_t)rc;
+    }
+
+    return (int)pos;
+}
+
+static LoopbackStream *loopback_session_get_stream(LoopbackSession *session,
+                                                   int id)
+{
+    list_iterator_t iterator;
+    ElaStream *stream;
+    int rc;
+
+rescan:
+    list_iterate(session->base.streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        if (stream->id == id)
+            return (LoopbackStream *)stream;
+
+        deref(stream);
+    }
+
+    return NULL;
+}
+
+static int loopback_session_apply_remote_sdp(ElaSession *base,
+                                             const char *sdp, size_t len)
+{
+    LoopbackTransport *transport;
+    LoopbackSession *peer;
+    list_iterator_t iterator;
+    const char *line;
+    const char *end = sdp + len;
+    char pk[64];
+    char nonce[NONCE_BYTES * 2 + 1];
+    int token;
+    int rc;
+
+    assert(base && sdp && len);
+
+    transport = (LoopbackTransport *)session_get_transport(base);
+
+    if (len <= strlen("s=" LOOPBACK_SDP_NAME) ||
+        strncmp(sdp, "s=" LOOPBACK_SDP_NAME "\r\n",
+                strlen("s=" LOOPBACK_SDP_NAME "\r\n")) != 0)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+
+    line = strstr(sdp, "\r\no=");
+    if (!line || line >= end ||
+        sscanf(line + 4, "%63s %d", pk, &token) != 2)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+
+    rc = (int)base58_decode(pk, strlen(pk), base->peer_pubkey,
+                            sizeof(base->peer_pubkey));
+    if (rc < 0) {
+        vlogE("Session: Parse peer public key error.");
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+    }
+
+    line = strstr(sdp, "\r\na=nonce:");
+    if (!line || line >= end ||
+        sscanf(line + 10, "%48s", nonce) != 1)
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+
+    if (!base->offerer)
+        crypto_nonce_from_str(base->nonce, nonce, strlen(nonce));
+
+    pthread_mutex_lock(&transport->lock);
+    for (peer = transport->sessions; peer && peer->token != token;
+         peer = peer->next);
+    if (peer)
+        ref(peer);
+    pthread_mutex_unlock(&transport->lock);
+
+    if (!peer) {
+        vlogE("Session: Loopback peer session %d not exist.", token);
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+    }
+
+    line = sdp;
+
+rescan:
+    list_iterate(base->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        LoopbackStream *stream;
+        LoopbackStream *peer_stream;
+        LoopbackHandler *handler;
+        int id, fmt, ops = 0;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        handler = (LoopbackHandler *)stream->handler;
+
+        line = strstr(line, "\r\nm=");
+        if (!line || line >= end ||
+            sscanf(line + 4, "%d %d", &id, &fmt) != 2) {
+            stream->base.deactivate = 1;
+            vlogD("Session: Loopback stream %d deactivated.", stream->base.id);
+            deref(stream);
+            line = end;
+            continue;
+        }
+        line += 4;
+
+        if (stream->base.unencrypt)
+            ops |= ELA_STREAM_PLAIN;
+        if (stream->base.multiplexing)
+            ops |= ELA_STREAM_MULTIPLEXING;
+        if (stream->base.reliable)
+            ops |= ELA_STREAM_RELIABLE;
+        if (stream->base.portforwarding)
+            ops |= ELA_STREAM_PORT_FORWARDING;
+        if (stream->base.framing)
+            ops |= ELA_STREAM_MESSAGE_FRAMING;
+
+        peer_stream = loopback_session_get_stream(peer, id);
+        if (ops != fmt || !peer_stream) {
+            if (peer_stream)
+                deref(peer_stream);
+
+            stream->base.deactivate = 1;
+            vlogD("Session: Loopback stream %d deactivated.", stream->base.id);
+            deref(stream);
+            continue;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        handler->peer = peer_stream;
+        handler->peer_worker = (LoopbackWorker *)ref(peer->base.worker);
+        pthread_mutex_unlock(&stream->lock);
+
+        deref(stream);
+    }
+
+    deref(peer);
+
+    return 0;
+}
+
+static int loopback_transport_create_session(ElaTransport *base,
+                                             ElaSession **session)
+{
+    LoopbackSession *s;
+
+    s = (LoopbackSession *)rc_zalloc(sizeof(LoopbackSession),
+                                     loopback_session_destroy);
+    if (!s)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    s->base.transport = base;
+
+    s->base.init = loopback_session_init;
+    s->base.create_stream = loopback_session_create_stream;
+    s->base.set_offer = loopback_session_set_offer;
+    s->base.encode_local_sdp = loopback_session_encode_local_sdp;
+    s->base.apply_remote_sdp = loopback_session_apply_remote_sdp;
+
+    *session = (ElaSession *)s;
+    return 0;
+}
+
+static void loopback_transport_destroy(void *p)
+{
+    LoopbackTransport *transport = (LoopbackTransport *)p;
+
+    transport_base_destroy(p);
+
+    pthread_mutex_destroy(&transport->lock);
+
+    vlogD("Session: Loopback transport destroyed");
+}
+
+void loopback_transport_set_link(ElaTransport *base,
+                                 const LoopbackLinkOptions *link)
+{
+    LoopbackTransport *transport = (LoopbackTransport *)base;
+
+    assert(base && link);
+
+    pthread_mutex_lock(&transport->lock);
+    transport->link = *link;
+    if (transport->link.loss > 1000)
+        transport->link.loss = 1000;
+    pthread_mutex_unlock(&transport->lock);
+}
+
+int loopback_transport_create(ElaTransport **transport)
+{
+    LoopbackTransport *t;
+
+    assert(transport);
+
+    t = (LoopbackTransport *)rc_zalloc(sizeof(LoopbackTransport),
+                                       loopback_transport_destroy);
+    if (!t)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    pthread_mutex_init(&t->lock, NULL);
+
+    t->base.create_worker = loopback_worker_create;
+    t->base.create_session = loopback_transport_create_session;
+
+    *transport = &t->base;
+
+    vlogD("Session: Loopback transport created.");
+
+    return 0;
+}
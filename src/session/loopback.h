@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __TRANSPORT_LOOPBACK_H__
+#define __TRANSPORT_LOOPBACK_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "session.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-process transport pairing sessions of the same transport through
+ * memory queues instead of network, with an emulated link in between.
+ * It's used to measure the session pipeline without network.
+ */
+
+typedef struct LoopbackLinkOptions {
+    /* One-way delay in milliseconds. */
+    unsigned int        delay;
+    /* Maximum random variation of the delay, in milliseconds. */
+    unsigned int        jitter;
+    /* Packet loss rate in percent per mille, 0 - 1000. */
+    unsigned int        loss;
+    /* Link bandwidth in bytes per second, 0 means unlimited. */
+    uint64_t            bandwidth;
+    /* Seed of the loss and jitter generator, for reproducible runs. */
+    uint32_t            seed;
+} LoopbackLinkOptions;
+
+typedef struct LoopbackEvent LoopbackEvent;
+typedef struct LoopbackTimer LoopbackTimer;
+typedef struct LoopbackSession LoopbackSession;
+
+typedef struct LoopbackWorker {
+    TransportWorker     base;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           thread;
+    int                 started;
+    int                 quit;
+
+    LoopbackEvent       *events;
+    LoopbackTimer       *timers;
+} LoopbackWorker;
+
+typedef struct LoopbackTransport {
+    ElaTransport        base;
+
+    pthread_mutex_t     lock;
+    LoopbackLinkOptions link;
+    LoopbackSession     *sessions;
+    int                 last_token;
+} LoopbackTransport;
+
+struct LoopbackSession {
+    ElaSession          base;
+
+    int                 token;
+    LoopbackSession     *next;
+};
+
+typedef struct LoopbackStream {
+    ElaStream           base;
+    StreamHandler       *handler;
+
+    pthread_mutex_t     lock;
+} LoopbackStream;
+
+typedef struct LoopbackHandler {
+    StreamHandler       base;
+
+    int                 stopping;
+
+    LoopbackStream      *peer;
+    LoopbackWorker      *peer_worker;
+
+    uint32_t            seed;
+    /* Time the emulated link finishes sending queued data, in us. */
+    uint64_t            link_free;
+} LoopbackHandler;
+
+int loopback_transport_create(ElaTransport **transport);
+
+void loopback_transport_set_link(ElaTransport *transport,
+                                 const LoopbackLinkOptions *link);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRANSPORT_LOOPBACK_H__ */
@@ -43,6 +43,7 @@
 #include "channels.h"
 #include "portforwardings.h"
 #include "multiplex_handler.h"
+#include "peercaps.h"
 
 #define KEEPALIVE_INTERVAL              30000
 #define KEEPALIVE_TIMEOUT_INTERVAL      130000
@@ -107,6 +108,16 @@ static int multiplex_handler_start(StreamHandler *base)
         return rc;
 
     if (!stream_is_reliable(base->stream)) {
+        ElaSession *ws = base->stream->session;
+
+        // Legacy peers time out every channel on its own keep-alives.
+        handler->stream_keepalive = peercaps_get_offer_version(
+                    stream_get_extension(base->stream)->peercaps, ws->to) >=
+                    SESSION_OFFER_KEEPALIVE;
+
+        gettimeofday(&handler->local_timestamp, NULL);
+        handler->remote_timestamp = handler->local_timestamp;
+
         rc = multiplex_handler_create_timer(handler, KEEPALIVE_INTERVAL,
                                     multiplex_handler_checkpoint, handler);
         if (rc < 0)
@@ -289,8 +300,14 @@ int multiplex_handler_send_packet(MultiplexHandler *handler,
     pb->payload_len = htons((uint16_t)len);
 
     sent = handler->base.next->write(handler->base.next, buf);
-    if (sent < 0)
+    if (sent < 0) {
+        stats_dropped(&handler->base.stream->stats.multiplex);
         return (int)sent;
+    }
+
+    gettimeofday(&handler->local_timestamp, NULL);
+
+    stats_sent(&handler->base.stream->stats.multiplex, flex_buffer_size(buf));
 
     vlogT("Stream: %d multiplex handler[%d] send packet[%s] with %zu bytes payload.",
           handler->base.stream->id, local_channel_id, PacketTypeNames[type], len);
@@ -375,6 +392,7 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
     if (flex_buffer_size(buf) < PROTOCOL_HEAD_LEN) {
         vlogW("Stream: %d multiplex handler got invalid packet, ignore.",
               handler->base.stream->id);
+        stats_dropped(&handler->base.stream->stats.multiplex);
         return;
     }
 
@@ -386,9 +404,14 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
     if (flex_buffer_size(buf) != (pb->payload_len + PROTOCOL_HEAD_LEN)) {
         vlogW("Stream: %d multiplex handler got invalid packet, ignore.",
               handler->base.stream->id);
+        stats_dropped(&handler->base.stream->stats.multiplex);
         return;
     }
 
+    stats_received(&handler->base.stream->stats.multiplex, flex_buffer_size(buf));
+
+    gettimeofday(&handler->remote_timestamp, NULL);
+
     if (pb->remote_channel_id == 0 && pb->local_channel_id == 0
             && pb->type == PacketType_ChannelData) {
         flex_buffer_forward_offset(buf, sizeof(ProtocolBuffer));
@@ -460,6 +483,7 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
         if (!ch) {
             vlogW("Stream: %d multiplex handler unknown channel %d, ignore.",
                   handler->base.stream->id, (int)pb->local_channel_id);
+            stats_dropped(&handler->base.stream->stats.multiplex);
             return;
         }
     }
@@ -514,11 +538,13 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
             ch->status != ChannelStatus_Open) {
             vlogW("Stream: %d multiplex handler channel %d not open, ignore data.",
                   handler->base.stream->id, ch->id);
+            stats_dropped(&ch->stats);
             deref(ch);
             return;
         }
 
         flex_buffer_forward_offset(buf, sizeof(ProtocolBuffer));
+        stats_received(&ch->stats, flex_buffer_size(buf));
         ok = notify_channel_data(ch, buf);
         if (!ok) {
             notify_channel_close(ch, CloseReason_Error);
@@ -781,14 +807,38 @@ int multiplex_handler_write_channel(Multiplexer *mux, int cid, FlexBuffer *buf)
                                        ch->id, ch->remote_id, buf);
 
     if (rc >= 0) {
+        stats_sent(&ch->stats, (size_t)rc);
         gettimeofday(&ch->local_timestamp, NULL);
         ch->last_activity = ch->local_timestamp;
+    } else {
+        stats_dropped(&ch->stats);
     }
 
     deref(ch);
     return rc;
 }
 
+static
+int multiplex_handler_get_channel_stats(Multiplexer *mux, int cid,
+                                        ElaLayerStats *stats)
+{
+    MultiplexHandler *handler = HANDLER(mux);
+    Channel *ch;
+
+    assert(mux);
+    assert(cid > 0);
+    assert(stats);
+
+    ch = channels_get(handler->channels, cid);
+    if (!ch)
+        return ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    stats_copy(stats, &ch->stats);
+
+    deref(ch);
+    return 0;
+}
+
 static int multiplex_handler_pend_channel(Multiplexer *mux, int cid)
 {
     MultiplexHandler *handler = HANDLER(mux);
@@ -861,6 +911,21 @@ static int multiplex_handler_resume_channel(Multiplexer *mux, int cid)
     return rc;
 }
 
+static inline
+int elapsed_ms(const struct timeval *now, const struct timeval *then)
+{
+    return (int)((now->tv_sec - then->tv_sec) * 1000) +
+           (int)((now->tv_usec - then->tv_usec) / 1000);
+}
+
+/*
+ * With a peer which negotiated stream keep-alive, the liveness of the
+ * channels is the liveness of the stream: any packet from the remote peer
+ * keeps all the channels alive, and one keep-alive on a channel is sent
+ * only when the stream had no outgoing packet for the whole interval,
+ * instead of one on every idle channel. Other peers get a keep-alive on
+ * every idle channel.
+ */
 static bool multiplex_handler_checkpoint(void *user_data)
 {
     MultiplexHandler *handler = (MultiplexHandler *)user_data;
@@ -868,6 +933,8 @@ static bool multiplex_handler_checkpoint(void *user_data)
 
     hashtable_iterator_t it;
     struct timeval now;
+    struct timeval *remote;
+    bool need_keepalive;
     int interval;
     int rc;
 
@@ -876,8 +943,11 @@ static bool multiplex_handler_checkpoint(void *user_data)
 
     vlogT("Stream: %d multiplex handler Checkpoint", handler->base.stream->id);
 
-rescan:
     gettimeofday(&now, NULL);
+    need_keepalive = elapsed_ms(&now, &handler->local_timestamp) >=
+                     KEEPALIVE_INTERVAL;
+
+rescan:
     channels_iterate(handler->channels, &it);
     while (channels_iterator_has_next(&it)) {
         rc = channels_iterator_next(&it, &ch);
@@ -890,8 +960,7 @@ rescan:
 
         /* Data timeout */
         if (ch->timeout) {
-            interval = (int)((now.tv_sec - ch->last_activity.tv_sec) * 1000) +
-                       (int)((now.tv_usec - ch->last_activity.tv_usec) / 1000);
+            interval = elapsed_ms(&now, &ch->last_activity);
             if (interval >= (ch->timeout * 1000)) {
                 notify_channel_close(ch, CloseReason_Timeout);
                 channels_iterator_remove(&it);
@@ -901,8 +970,12 @@ rescan:
         }
 
         /* Keep-alive timeout */
-        interval = (int)((now.tv_sec - ch->remote_timestamp.tv_sec) * 1000) +
-                   (int)((now.tv_usec - ch->remote_timestamp.tv_usec) / 1000);
+        remote = &ch->remote_timestamp;
+        if (handler->stream_keepalive &&
+            timercmp(&handler->remote_timestamp, remote, >))
+            remote = &handler->remote_timestamp;
+
+        interval = elapsed_ms(&now, remote);
         if (interval >= KEEPALIVE_TIMEOUT_INTERVAL) {
             notify_channel_close(ch, CloseReason_Timeout);
             channels_iterator_remove(&it);
@@ -911,14 +984,25 @@ rescan:
         }
 
         /* Keep-alive */
-        interval = (int)((now.tv_sec - ch->local_timestamp.tv_sec) * 1000) +
-                   (int)((now.tv_usec - ch->local_timestamp.tv_usec) / 1000);
-        if (interval >= KEEPALIVE_INTERVAL) {
+        if (!handler->stream_keepalive) {
+            interval = elapsed_ms(&now, &ch->local_timestamp);
+            if (interval >= KEEPALIVE_INTERVAL) {
+                rc = multiplex_handler_send_packet(handler,
+                                    PacketType_ChannelKeepAlive,
+                                    0, ch->id, ch->remote_id, NULL);
+                if (rc == 0)
+                    ch->local_timestamp = now;
+            }
+        } else if (need_keepalive && ch->remote_id != 0 &&
+                   (ch->status == ChannelStatus_Open ||
+                    ch->status == ChannelStatus_Pending)) {
             rc = multiplex_handler_send_packet(handler, PacketType_ChannelKeepAlive,
                                                0, ch->id, ch->remote_id, NULL);
 
-            if (rc == 0)
+            if (rc == 0) {
                 ch->local_timestamp = now;
+                need_keepalive = false;
+            }
         }
 
         deref(ch);
@@ -1057,6 +1141,7 @@ int multiplex_handler_create(ElaStream *s, MultiplexHandler **handler)
     _handler->mux.channel.pend = multiplex_handler_pend_channel;
     _handler->mux.channel.resume = multiplex_handler_resume_channel;
     _handler->mux.channel.write = multiplex_handler_write_channel;
+    _handler->mux.channel.stats = multiplex_handler_get_channel_stats;
 
     if (stream_is_reliable(s))
         flex_buffer_init(&_handler->incomplete_buf, _handler->__buffer,
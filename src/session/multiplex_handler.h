@@ -83,6 +83,7 @@ struct Multiplexer {
         int (*pend)  (Multiplexer *, int channel);
         int (*resume)(Multiplexer *, int channel);
         int (*write) (Multiplexer *, int channel, FlexBuffer *buf);
+        int (*stats) (Multiplexer *, int channel, ElaLayerStats *stats);
     } channel;
 
     struct {
@@ -105,6 +106,11 @@ typedef struct MultiplexHandler {
 
     Timer *timer;
 
+    /* Liveness of the whole stream, shared by all the channels */
+    bool stream_keepalive;
+    struct timeval local_timestamp;
+    struct timeval remote_timestamp;
+
     FlexBuffer incomplete_buf;
     char __buffer[0];
 } MultiplexHandler;
@@ -133,6 +139,8 @@ struct Channel {
 
     int timeout;
 
+    ElaLayerStats stats;
+
     hash_entry_t he;
 };
 
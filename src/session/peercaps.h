@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PEERCAPS_H__
+#define __PEERCAPS_H__
+
+#include <string.h>
+#include <rc_mem.h>
+#include <linkedhashtable.h>
+
+#include "ela_carrier.h"
+#include "session.h"
+
+/*
+ * Offer formats a peer understands, learned from the last offer or answer
+ * received from the peer. Peers never heard from get the SDP text.
+ */
+typedef struct PeerCaps {
+    hash_entry_t        he;
+    char                to[ELA_MAX_ID_LEN + 1];
+    int                 offer_version;
+} PeerCaps;
+
+static inline
+int peercaps_key_compare(const void *key1, size_t len1,
+                         const void *key2, size_t len2)
+{
+    return strcmp(key1, key2);
+}
+
+static inline
+hashtable_t *peercaps_create(int capacity)
+{
+    return hashtable_create(capacity, 1, NULL, peercaps_key_compare);
+}
+
+static inline
+int peercaps_get_offer_version(hashtable_t *htab, const char *to)
+{
+    PeerCaps *caps;
+    int version;
+
+    caps = (PeerCaps *)hashtable_get(htab, (void *)to, strlen(to));
+    if (!caps)
+        return SESSION_OFFER_SDP;
+
+    version = caps->offer_version;
+    deref(caps);
+
+    return version;
+}
+
+static inline
+void peercaps_set_offer_version(hashtable_t *htab, const char *to,
+                                int version)
+{
+    PeerCaps *caps;
+
+    if (strlen(to) > ELA_MAX_ID_LEN)
+        return;
+
+    caps = (PeerCaps *)rc_zalloc(sizeof(PeerCaps), NULL);
+    if (!caps)
+        return;
+
+    strcpy(caps->to, to);
+    caps->offer_version = version;
+
+    deref(hashtable_remove(htab, (void *)caps->to, strlen(caps->to)));
+
+    caps->he.data = caps;
+    caps->he.key = (void *)caps->to;
+    caps->he.keylen = strlen(caps->to);
+    hashtable_put(htab, &caps->he);
+
+    deref(caps);
+}
+
+static inline
+void peercaps_clear(hashtable_t *htab)
+{
+    hashtable_clear(htab);
+}
+
+#endif /* __PEERCAPS_H__ */
@@ -502,6 +502,7 @@ struct _PseudoTcpSocketPrivate {
   // Congestion avoidance, Fast retransmit/recovery, Delayed ACKs
   guint32 ssthresh, cwnd;
   guint8 dup_acks;
+  guint32 retransmits;
   guint32 recover;
   gboolean fast_recovery;
   guint32 t_ack;  /* time a delayed ack was scheduled; 0 if no acks scheduled */
@@ -1164,6 +1165,67 @@ pseudo_tcp_socket_send(PseudoTcpSocket *self, const char * buffer, guint32 len)
   return written;
 }
 
+gint
+pseudo_tcp_socket_send_more(PseudoTcpSocket *self, const char * buffer,
+    guint32 len)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  gint written;
+  gsize available_space;
+
+  if (priv->state != TCP_ESTABLISHED) {
+    priv->error = pseudo_tcp_state_has_sent_fin (priv->state) ? EPIPE : ENOTCONN;
+    return -1;
+  }
+
+  available_space = pseudo_tcp_fifo_get_write_remaining (&priv->sbuf);
+
+  if (!available_space) {
+    priv->bWriteEnable = TRUE;
+    priv->error = EWOULDBLOCK;
+    return -1;
+  }
+
+  /* Queue only, the caller pushes the coalesced data out with
+   * pseudo_tcp_socket_flush() once it has nothing more to append. */
+  written = queue (self, buffer, len, FLAG_NONE);
+
+  if (written > 0 && (guint32)written < len) {
+    priv->bWriteEnable = TRUE;
+  }
+
+  return written;
+}
+
+void
+pseudo_tcp_socket_flush(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  if (priv->state != TCP_ESTABLISHED)
+    return;
+
+  attempt_send(self, sfNone);
+}
+
+void
+pseudo_tcp_socket_get_stats(PseudoTcpSocket *self, PseudoTcpStats *stats)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  stats->srtt = priv->rx_srtt;
+  stats->rttvar = priv->rx_rttvar;
+  stats->rto = priv->rx_rto;
+  stats->cwnd = priv->cwnd;
+  stats->ssthresh = priv->ssthresh;
+  stats->mss = priv->mss;
+  stats->retransmits = priv->retransmits;
+  stats->snd_buffered = pseudo_tcp_fifo_get_buffered (&priv->sbuf);
+  stats->snd_buf_size = priv->sbuf_len;
+  stats->rcv_buffered = pseudo_tcp_fifo_get_buffered (&priv->rbuf);
+  stats->rcv_buf_size = priv->rbuf_len;
+}
+
 void
 pseudo_tcp_socket_close(PseudoTcpSocket *self, gboolean force)
 {
@@ -2031,6 +2093,9 @@ transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now)
           g_queue_find (&priv->unsent_slist, segment), subseg);
   }
 
+  if (segment->xmit > 0)
+    priv->retransmits++;
+
   if (segment->xmit == 0) {
     g_assert (g_queue_peek_head (&priv->unsent_slist) == segment);
     g_queue_pop_head (&priv->unsent_slist);
@@ -38,6 +38,7 @@
 #ifndef __PSEUDOTCP_H__
 #define __PSEUDOTCP_H__
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -209,6 +210,37 @@ typedef struct {
       const char * buffer, uint32_t len, void *data);
 } PseudoTcpCallbacks;
 
+/**
+ * PseudoTcpStats:
+ * @srtt: Smoothed round-trip time, in milliseconds
+ * @rttvar: Round-trip time variation, in milliseconds
+ * @rto: Current retransmission timeout, in milliseconds
+ * @cwnd: Congestion window, in bytes
+ * @ssthresh: Slow start threshold, in bytes
+ * @mss: Current maximum segment size, in bytes
+ * @retransmits: Number of segments transmitted more than once
+ * @snd_buffered: Bytes held in the send buffer, unsent or unacknowledged
+ * @snd_buf_size: Capacity of the send buffer
+ * @rcv_buffered: Bytes received but not yet read by the application
+ * @rcv_buf_size: Capacity of the receive buffer
+ *
+ * A snapshot of the socket's transport state, filled by
+ * pseudo_tcp_socket_get_stats().
+ */
+typedef struct {
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t mss;
+  uint32_t retransmits;
+  size_t snd_buffered;
+  size_t snd_buf_size;
+  size_t rcv_buffered;
+  size_t rcv_buf_size;
+} PseudoTcpStats;
+
 /**
  * pseudo_tcp_socket_new:
  * @conversation: The conversation id for the socket.
@@ -303,6 +335,42 @@ int  pseudo_tcp_socket_recv(PseudoTcpSocket *self, char * buffer, size_t len);
 int pseudo_tcp_socket_send(PseudoTcpSocket *self, const char * buffer,
     uint32_t len);
 
+/**
+ * pseudo_tcp_socket_send_more:
+ * @self: The #PseudoTcpSocket object.
+ * @buffer: The buffer with data to send
+ * @len: The length of @buffer
+ *
+ * Queue data on the socket without transmitting it, the same as
+ * pseudo_tcp_socket_send() with MSG_MORE semantics. Consecutive calls are
+ * coalesced into the pending segment and split at the MSS only when
+ * pseudo_tcp_socket_flush() is called.
+ *
+ * Returns: The number of bytes queued or -1 in case of error
+ * <para> See also: pseudo_tcp_socket_get_error() </para>
+ */
+int pseudo_tcp_socket_send_more(PseudoTcpSocket *self, const char * buffer,
+    uint32_t len);
+
+/**
+ * pseudo_tcp_socket_flush:
+ * @self: The #PseudoTcpSocket object.
+ *
+ * Transmit the data queued by pseudo_tcp_socket_send_more(), as far as the
+ * congestion and receive windows allow.
+ */
+void pseudo_tcp_socket_flush(PseudoTcpSocket *self);
+
+/**
+ * pseudo_tcp_socket_get_stats:
+ * @self: The #PseudoTcpSocket object.
+ * @stats: The #PseudoTcpStats to fill
+ *
+ * Take a snapshot of the round-trip estimates, congestion control state,
+ * retransmission count and buffer occupancy of the socket.
+ */
+void pseudo_tcp_socket_get_stats(PseudoTcpSocket *self, PseudoTcpStats *stats);
+
 
 /**
  * pseudo_tcp_socket_close:
@@ -24,9 +24,13 @@
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #include <rc_mem.h>
 #include <vlog.h>
@@ -49,6 +53,11 @@ typedef struct ReliableHandler {
 
     uint64_t last_clock_timeout;
     Timer *clock;
+
+    /* Bulk writers wait here for the send buffer to drain. */
+    pthread_mutex_t writable_lock;
+    pthread_cond_t writable_cond;
+    uint32_t writable_seq;
 } ReliableHandler;
 
 /* Maximum size of a UDP packet’s payload, as the packet’s length field is 16b
@@ -57,6 +66,9 @@ typedef struct ReliableHandler {
 
 #define DEFAULT_TCP_MTU 1400 /* Use 1400 because of VPNs and we assume IEE 802.3 */
 
+/* Upper bound of a single wait for the writable notification. */
+#define WRITABLE_WAIT_INTERVAL  1000 // ms
+
 static void reliable_handler_adjust_clock(ReliableHandler *tcp);
 static void reliable_handler_stop(StreamHandler *handler, int error);
 
@@ -74,6 +86,57 @@ void reliable_handler_unlock(ReliableHandler *handler)
     handler->base.stream->unlock(handler->base.stream);
 }
 
+static inline
+void reliable_handler_notify_writable(ReliableHandler *handler)
+{
+    pthread_mutex_lock(&handler->writable_lock);
+    handler->writable_seq++;
+    pthread_cond_broadcast(&handler->writable_cond);
+    pthread_mutex_unlock(&handler->writable_lock);
+}
+
+static inline
+uint32_t reliable_handler_writable_seq(ReliableHandler *handler)
+{
+    uint32_t seq;
+
+    pthread_mutex_lock(&handler->writable_lock);
+    seq = handler->writable_seq;
+    pthread_mutex_unlock(&handler->writable_lock);
+
+    return seq;
+}
+
+/*
+ * Wait until the pseudo-TCP socket reports writable after the given
+ * sequence, or the stream leaves the connected state. Must be called
+ * without the stream lock.
+ */
+static
+void reliable_handler_wait_writable(ReliableHandler *handler, uint32_t seq)
+{
+    struct timeval tv;
+    struct timespec ts;
+    uint64_t due;
+
+    gettimeofday(&tv, NULL);
+    due = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec +
+          WRITABLE_WAIT_INTERVAL * 1000;
+    ts.tv_sec = (time_t)(due / 1000000);
+    ts.tv_nsec = (long)(due % 1000000) * 1000;
+
+    pthread_mutex_lock(&handler->writable_lock);
+
+    while (handler->writable_seq == seq &&
+           handler->base.stream->state == ElaStreamState_connected) {
+        if (pthread_cond_timedwait(&handler->writable_cond,
+                                   &handler->writable_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+
+    pthread_mutex_unlock(&handler->writable_lock);
+}
+
 static inline
 int reliable_handler_create_timer(ReliableHandler *handler, unsigned long interval,
                                   TimerCallback *callback, void *user_data)
@@ -249,6 +312,8 @@ static void pseudo_tcp_socket_writable(PseudoTcpSocket *sock, void *user_data)
     ReliableHandler *tcp = (ReliableHandler *)user_data;
 
     vlogT("Stream: %d pseudo Tcp socket writable", tcp->base.stream->id);
+
+    reliable_handler_notify_writable(tcp);
 }
 
 static void pseudo_tcp_socket_closed(PseudoTcpSocket *sock, uint32_t err,
@@ -290,7 +355,11 @@ static PseudoTcpWriteResult pseudo_tcp_socket_write_packet(PseudoTcpSocket *sock
 
         flex_buffer_from(buf, FLEX_PADDING_LEN, buffer, len);
         rc = handler->next->write(handler->next, buf);
-        if (rc > 0 || rc == ELA_GENERAL_ERROR(ELAERR_BUSY)) {
+        if (rc > 0) {
+            stats_sent(&handler->stream->stats.reliable, len);
+            return WR_SUCCESS;
+        } else if (rc == ELA_GENERAL_ERROR(ELAERR_BUSY)) {
+            stats_dropped(&handler->stream->stats.reliable);
             return WR_SUCCESS; //TODO:
         }
     } else {
@@ -370,6 +439,9 @@ static void reliable_handler_stop(StreamHandler *base, int error)
 
     reliable_handler_unlock(handler);
 
+    // Release the bulk writers waiting on a socket that never drains.
+    reliable_handler_notify_writable(handler);
+
     vlogD("Stream: %d reliable handler stoped.", base->stream->id);
 
     base->next->stop(base->next, error);
@@ -428,6 +500,124 @@ ssize_t reliable_handler_write(StreamHandler *base, FlexBuffer *buf)
     return len;
 }
 
+static
+ssize_t reliable_handler_writev(StreamHandler *base,
+                                const ElaIOVec *iov, int iovcnt)
+{
+    ReliableHandler *handler = (ReliableHandler *)base;
+    const char *ptr;
+    size_t remain;
+    size_t total = 0;
+    int i = 0;
+
+    assert(base);
+    assert(handler->sock);
+    assert(iov && iovcnt > 0);
+
+    if(base->stream->state != ElaStreamState_connected)
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+
+    ptr = (const char *)iov[0].data;
+    remain = iov[0].len;
+
+    reliable_handler_lock(handler);
+
+    while (true) {
+        uint32_t seq;
+        int sent;
+        int error;
+
+        while (remain == 0 && ++i < iovcnt) {
+            ptr = (const char *)iov[i].data;
+            remain = iov[i].len;
+        }
+
+        if (remain == 0)
+            break;
+
+        /* Queue as much as the send buffer takes, pseudo-TCP coalesces the
+         * consecutive pieces and segments them at MSS on flush. */
+        sent = pseudo_tcp_socket_send_more(handler->sock, ptr,
+                        remain > UINT32_MAX ? UINT32_MAX : (uint32_t)remain);
+        if (sent >= 0) {
+            ptr += sent;
+            remain -= sent;
+            total += sent;
+            continue;
+        }
+
+        error = pseudo_tcp_socket_get_error(handler->sock);
+        if (error != EWOULDBLOCK) {
+            reliable_handler_unlock(handler);
+
+            vlogE("Stream: %d reliable handler write data error %d.",
+                  base->stream->id, error);
+
+            reliable_handler_stop(base, error);
+            return total > 0 ? (ssize_t)total : (ssize_t)ELA_SYS_ERROR(error);
+        }
+
+        /* Send buffer is full, push out the queued segments and wait
+         * for the peer's ACKs to free the space. The sequence is taken
+         * under the stream lock so a writable notification raised by
+         * the flush is not missed. */
+        pseudo_tcp_socket_flush(handler->sock);
+        reliable_handler_adjust_clock(handler);
+        seq = reliable_handler_writable_seq(handler);
+
+        reliable_handler_unlock(handler);
+
+        vlogT("Stream: %d reliable handler busy, wait for writable.",
+              base->stream->id);
+        reliable_handler_wait_writable(handler, seq);
+
+        if (base->stream->state != ElaStreamState_connected) {
+            vlogD("Stream: %d reliable handler state changed after "
+                  "%zu bytes bulk data.", base->stream->id, total);
+            return total > 0 ? (ssize_t)total :
+                               ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+        }
+
+        reliable_handler_lock(handler);
+    }
+
+    pseudo_tcp_socket_flush(handler->sock);
+    reliable_handler_adjust_clock(handler);
+
+    reliable_handler_unlock(handler);
+
+    vlogT("Stream: %d reliable handler wrote %zu bytes bulk data.",
+          base->stream->id, total);
+
+    return (ssize_t)total;
+}
+
+void reliable_handler_get_stats(StreamHandler *base, ElaStreamStats *stats)
+{
+    ReliableHandler *handler = (ReliableHandler *)base;
+    PseudoTcpStats tcp_stats;
+
+    assert(handler);
+    assert(stats);
+
+    if (!handler->sock)
+        return;
+
+    reliable_handler_lock(handler);
+    pseudo_tcp_socket_get_stats(handler->sock, &tcp_stats);
+    reliable_handler_unlock(handler);
+
+    stats->retransmits      = tcp_stats.retransmits;
+    stats->rtt              = tcp_stats.srtt;
+    stats->rtt_var          = tcp_stats.rttvar;
+    stats->cwnd             = tcp_stats.cwnd;
+    stats->ssthresh         = tcp_stats.ssthresh;
+    stats->send_buffered    = tcp_stats.snd_buffered;
+    stats->send_buffer_size = tcp_stats.snd_buf_size;
+    stats->recv_buffered    = tcp_stats.rcv_buffered;
+    stats->recv_buffer_size = tcp_stats.rcv_buf_size;
+}
+
 static
 void reliable_handler_on_rx_data(StreamHandler *base, FlexBuffer *buf)
 {
@@ -436,6 +626,8 @@ void reliable_handler_on_rx_data(StreamHandler *base, FlexBuffer *buf)
     vlogT("Stream: %d reliable handler received %zu bytes data.",
           base->stream->id, flex_buffer_size(buf));
 
+    stats_received(&base->stream->stats.reliable, flex_buffer_size(buf));
+
     reliable_handler_lock(handler);
 
     pseudo_tcp_socket_notify_packet(handler->sock, flex_buffer_ptr(buf),
@@ -465,6 +657,7 @@ void reliable_handler_on_state_changed(StreamHandler *base, int state)
     } else {
         //TODO: pseudoTCP need do something to handler the state change?
         base->prev->on_state_changed(base->prev, state);
+        reliable_handler_notify_writable(handler);
     }
 }
 
@@ -480,6 +673,9 @@ static void reliable_handler_destroy(void *p)
 
     reliable_handler_destroy_timer(handler);
 
+    pthread_cond_destroy(&handler->writable_cond);
+    pthread_mutex_destroy(&handler->writable_lock);
+
     if (handler->base.next)
         deref(handler->base.next);
 
@@ -498,11 +694,15 @@ int reliable_handler_create(ElaStream *s, StreamHandler **handler)
     _handler->base.name = "Reliable Handler";
     _handler->base.stream = s;
 
+    pthread_mutex_init(&_handler->writable_lock, NULL);
+    pthread_cond_init(&_handler->writable_cond, NULL);
+
     _handler->base.init    = default_handler_init;
     _handler->base.prepare = reliable_handler_prepare;
     _handler->base.start   = reliable_handler_start;
     _handler->base.stop    = reliable_handler_stop;
     _handler->base.write   = reliable_handler_write;
+    _handler->base.writev  = reliable_handler_writev;
     _handler->base.on_data = reliable_handler_on_rx_data;
     _handler->base.on_state_changed = reliable_handler_on_state_changed;
 
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
 
@@ -36,9 +37,13 @@
 #include "ela_turnserver.h"
 #include "portforwarding.h"
 #include "services.h"
+#include "tickets.h"
+#include "peercaps.h"
+#include "offer_generated.h"
 #include "session.h"
 #include "stream_handler.h"
 #include "multiplex_handler.h"
+#include "stream_profiler.h"
 #include "flex_buffer.h"
 #include "ice.h"
 
@@ -95,6 +100,67 @@ int ela_session_register_strerror()
     return 0;
 }
 
+static int compact_offer_version(const char *sdp, size_t len)
+{
+    int version = SESSION_OFFER_COMPACT;
+    void *buf;
+
+    // Copy to have the buffer aligned as the verifier requires.
+    buf = malloc(len);
+    if (!buf)
+        return version;
+
+    memcpy(buf, sdp, len);
+
+    if (elaoffer_offer_verify_as_root(buf, len) == 0)
+        version = elaoffer_offer_version(elaoffer_offer_as_root(buf));
+
+    free(buf);
+
+    return version;
+}
+
+/*
+ * Learn the offer formats of the peer from its offer or answer: the
+ * compact one carries its version, the SDP text lists them in
+ * "offer-versions".
+ */
+static void update_peercaps(SessionExtension *ext, const char *peer,
+                            const char *sdp, size_t len)
+{
+    const char *pos;
+    int version = SESSION_OFFER_SDP;
+
+    if (session_is_compact_offer(sdp, len)) {
+        version = compact_offer_version(sdp, len);
+    } else {
+        pos = strstr(sdp, "a=offer-versions:");
+        if (pos) {
+            pos += strlen("a=offer-versions:");
+            while (*pos && *pos != '\r' && *pos != '\n') {
+                int v = (int)strtol(pos, (char **)&pos, 10);
+
+                if (v > version)
+                    version = v;
+
+                while (*pos == ' ')
+                    pos++;
+
+                if (*pos && !isdigit((unsigned char)*pos))
+                    break;
+            }
+        }
+    }
+
+    if (version < SESSION_OFFER_COMPACT && session_is_compact_offer(sdp, len))
+        version = SESSION_OFFER_COMPACT;
+
+    if (version > SESSION_OFFER_LATEST)
+        version = SESSION_OFFER_LATEST;
+
+    peercaps_set_offer_version(ext->peercaps, peer, version);
+}
+
 static void friend_invite(ElaCarrier *w, const char *from,
                           const char *data, size_t len, void *context)
 {
@@ -104,6 +170,7 @@ static void friend_invite(ElaCarrier *w, const char *from,
     list_iterator_t it;
     const char *bundle;
     const char *sdp;
+    size_t sdp_len;
 
     ext = (SessionExtension *)context;
     if (!ext) {
@@ -114,11 +181,20 @@ static void friend_invite(ElaCarrier *w, const char *from,
     bundle = data;
     sdp = data + strlen(bundle) + 1;
 
-    // bundle\x0sdp\x0\x0
+    // bundle\x0sdp\x0\x0, the compact offer is binary in place of sdp.
     assert(data[len-1] == 0);
-    assert(strlen(bundle) + strlen(sdp) + 3 == len);
+    assert(strlen(bundle) + 3 <= len);
+    sdp_len = len - strlen(bundle) - 3;
+    assert(session_is_compact_offer(sdp, sdp_len) || strlen(sdp) == sdp_len);
+
+    if (session_is_compact_offer(sdp, sdp_len))
+        vlogD("Session: Session request from %s with bundle: %s, "
+              "compact offer (%zu bytes)", from, bundle, sdp_len);
+    else
+        vlogD("Session: Session request from %s with bundle: %s, SDP: %s",
+              from, bundle, sdp);
 
-    vlogD("Session: Session request from %s with bundle: %s, SDP: %s", from, bundle, sdp);
+    update_peercaps(ext, from, sdp, sdp_len);
 
     pthread_rwlock_rdlock(&ext->callbacks_lock);
 
@@ -163,6 +239,395 @@ static void friend_invite(ElaCarrier *w, const char *from,
         callback(w, from, bundle, sdp, len, callback_context);
 }
 
+/*
+ * Trickled candidates are sent as session extension messages:
+ *   <sender ice-ufrag>\n
+ *   <media index> <candidate>\n
+ *   ...
+ * The receiver routes them to the session to the sender whose remote
+ * ice-ufrag matches. Candidates arrived before the session applied the
+ * remote SDP are kept for a while and applied on session start.
+ */
+typedef struct TrickleMessage {
+    list_entry_t le;
+    char from[ELA_MAX_ID_LEN + 1];
+    int64_t expire_time;
+    size_t len;
+    char data[1];
+} TrickleMessage;
+
+#define TRICKLE_PENDING_TIMEOUT     (30 * 1000) // in milliseconds.
+#define MAX_PENDING_TRICKLES        64
+
+static int dispatch_trickle(SessionExtension *ext, const char *from,
+                            const char *data, size_t len)
+{
+    char ufrag[80];
+    const char *pos;
+    list_iterator_t it;
+    int rc = ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    pos = memchr(data, '\n', len);
+    if (!pos || pos == data || pos - data >= sizeof(ufrag))
+        return ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS);
+
+    memcpy(ufrag, data, pos - data);
+    ufrag[pos - data] = 0;
+    pos++;
+
+    pthread_mutex_lock(&ext->sessions_lock);
+
+relookup:
+    list_iterate(ext->sessions, &it);
+    while (list_iterator_has_next(&it)) {
+        ElaSession *ws;
+        int _rc;
+
+        _rc = list_iterator_next(&it, (void **)&ws);
+        if (_rc == 0)
+            break;
+
+        if (_rc == -1)
+            goto relookup;
+
+        if (strcmp(ws->to, from) == 0 && ws->add_remote_candidates)
+            rc = ws->add_remote_candidates(ws, ufrag, pos,
+                                           len - (pos - data));
+        deref(ws);
+
+        if (rc == 0)
+            break;
+    }
+
+    pthread_mutex_unlock(&ext->sessions_lock);
+
+    return rc;
+}
+
+static int dispatch_session(SessionExtension *ext, const char *from,
+                            const char *data, size_t len, bool path)
+{
+    list_iterator_t it;
+    int rc = ELA_GENERAL_ERROR(ELAERR_NOT_EXIST);
+
+    pthread_mutex_lock(&ext->sessions_lock);
+
+relookup:
+    list_iterate(ext->sessions, &it);
+    while (list_iterator_has_next(&it)) {
+        ElaSession *ws;
+        int _rc;
+
+        _rc = list_iterator_next(&it, (void **)&ws);
+        if (_rc == 0)
+            break;
+
+        if (_rc == -1)
+            goto relookup;
+
+        if (strcmp(ws->to, from) == 0) {
+            if (path && ws->apply_path)
+                rc = ws->apply_path(ws, data, len);
+            else if (!path && ws->apply_restart)
+                rc = ws->apply_restart(ws, data, len);
+        }
+        deref(ws);
+
+        if (rc == 0)
+            break;
+    }
+
+    pthread_mutex_unlock(&ext->sessions_lock);
+
+    return rc;
+}
+
+static void friend_message(ElaCarrier *w, const char *from,
+                           const char *data, size_t len, void *context)
+{
+    SessionExtension *ext = (SessionExtension *)context;
+    TrickleMessage *tm;
+    list_iterator_t it;
+    int rc;
+
+    if (!ext || !data || !len || data[len - 1] != 0) {
+        vlogW("Session: Invalid session message from %s, dropped.", from);
+        return;
+    }
+
+    // The restart and the paths go to a running session, nothing to keep
+    // for later.
+    if (strncmp(data, SESSION_RESTART_PREFIX,
+                strlen(SESSION_RESTART_PREFIX)) == 0) {
+        rc = dispatch_session(ext, from, data, len - 1, false);
+        if (rc == 0)
+            vlogD("Session: ICE restart from %s applied.", from);
+        else
+            vlogW("Session: ICE restart from %s dropped (0x%x).", from, rc);
+        return;
+    }
+
+    if (strncmp(data, SESSION_PATH_PREFIX, strlen(SESSION_PATH_PREFIX)) == 0) {
+        rc = dispatch_session(ext, from, data, len - 1, true);
+        if (rc == 0)
+            vlogD("Session: ICE path from %s applied.", from);
+        else
+            vlogW("Session: ICE path from %s dropped (0x%x).", from, rc);
+        return;
+    }
+
+    rc = dispatch_trickle(ext, from, data, len - 1);
+    if (rc == 0) {
+        vlogD("Session: Trickled candidates from %s applied.", from);
+        return;
+    }
+
+    if (rc != ELA_GENERAL_ERROR(ELAERR_NOT_EXIST)) {
+        vlogW("Session: Invalid trickled candidates from %s, dropped.", from);
+        return;
+    }
+
+    pthread_mutex_lock(&ext->sessions_lock);
+
+    // Drop the expired ones.
+reiterate:
+    list_iterate(ext->pending_trickles, &it);
+    while (list_iterator_has_next(&it)) {
+        int64_t now = get_monotonic_time() / 1000;
+
+        rc = list_iterator_next(&it, (void **)&tm);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto reiterate;
+
+        if (tm->expire_time <= now)
+            list_iterator_remove(&it);
+
+        deref(tm);
+    }
+
+    if (list_size(ext->pending_trickles) >= MAX_PENDING_TRICKLES) {
+        pthread_mutex_unlock(&ext->sessions_lock);
+        vlogW("Session: Too many pending trickled candidates, dropped.");
+        return;
+    }
+
+    tm = (TrickleMessage *)rc_zalloc(sizeof(TrickleMessage) + len, NULL);
+    if (!tm) {
+        pthread_mutex_unlock(&ext->sessions_lock);
+        return;
+    }
+
+    strcpy(tm->from, from);
+    tm->expire_time = get_monotonic_time() / 1000 + TRICKLE_PENDING_TIMEOUT;
+    tm->len = len - 1;
+    memcpy(tm->data, data, len);
+
+    tm->le.data = tm;
+    list_add(ext->pending_trickles, &tm->le);
+    deref(tm);
+
+    pthread_mutex_unlock(&ext->sessions_lock);
+
+    vlogD("Session: Trickled candidates from %s pending for session start.",
+          from);
+}
+
+static void apply_pending_trickles(ElaSession *ws)
+{
+    SessionExtension *ext = session_get_extension(ws);
+    list_iterator_t it;
+    int64_t now = get_monotonic_time() / 1000;
+
+    if (!ws->add_remote_candidates)
+        return;
+
+    pthread_mutex_lock(&ext->sessions_lock);
+
+reiterate:
+    list_iterate(ext->pending_trickles, &it);
+    while (list_iterator_has_next(&it)) {
+        TrickleMessage *tm;
+        char *pos;
+        char ufrag[80];
+        int rc;
+
+        rc = list_iterator_next(&it, (void **)&tm);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto reiterate;
+
+        if (tm->expire_time <= now) {
+            list_iterator_remove(&it);
+            deref(tm);
+            continue;
+        }
+
+        if (strcmp(tm->from, ws->to) != 0) {
+            deref(tm);
+            continue;
+        }
+
+        pos = strchr(tm->data, '\n');
+        if (pos && pos - tm->data < sizeof(ufrag)) {
+            memcpy(ufrag, tm->data, pos - tm->data);
+            ufrag[pos - tm->data] = 0;
+            pos++;
+
+            rc = ws->add_remote_candidates(ws, ufrag, pos,
+                                           tm->len - (pos - tm->data));
+            if (rc == 0) {
+                vlogD("Session: Pending trickled candidates from %s applied.",
+                      ws->to);
+                list_iterator_remove(&it);
+            }
+        }
+
+        deref(tm);
+    }
+
+    pthread_mutex_unlock(&ext->sessions_lock);
+}
+
+int session_send_trickle(ElaSession *ws, const char *data, size_t len)
+{
+    ElaCarrier *w;
+    char *ext_to;
+    int rc;
+
+    assert(ws);
+    assert(data && len > 0 && data[len - 1] == 0);
+
+    w = session_get_extension(ws)->carrier;
+
+    ext_to = (char *)alloca(ELA_MAX_ID_LEN + strlen(extension_name) + 2);
+    strcpy(ext_to, ws->to);
+    strcat(ext_to, ":");
+    strcat(ext_to, extension_name);
+
+    rc = ela_send_friend_message(w, ext_to, data, len);
+    if (rc < 0) {
+        vlogW("Session: Send trickled candidates to %s error (0x%x).",
+              ws->to, ela_get_error());
+        return ela_get_error();
+    }
+
+    vlogD("Session: Trickled candidates to %s sent.", ws->to);
+    return 0;
+}
+
+#define SESSION_TICKET_LIFETIME     (60 * 60 * 1000) // in milliseconds.
+
+static void ticket_destroy(void *p)
+{
+    SessionTicket *ticket = (SessionTicket *)p;
+
+    // Clear sensitive data for security reason
+    memset(ticket->secret_key, 0, sizeof(ticket->secret_key));
+    memset(ticket->key, 0, sizeof(ticket->key));
+}
+
+static SessionTicket *get_ticket(ElaSession *ws)
+{
+    SessionExtension *ext = session_get_extension(ws);
+    SessionTicket *ticket;
+
+    ticket = tickets_get(ext->tickets, ws->to);
+    if (!ticket)
+        return NULL;
+
+    if (ticket->expire_time <= get_monotonic_time() / 1000) {
+        tickets_remove(ext->tickets, ws->to);
+        deref(ticket);
+        return NULL;
+    }
+
+    return ticket;
+}
+
+/*
+ * Keep the keys and the nominated paths of a session which got connected,
+ * so the next session to the same peer can resume. A session started but
+ * never got connected invalidates the ticket of the peer.
+ */
+static void store_ticket(ElaSession *ws)
+{
+    SessionExtension *ext = session_get_extension(ws);
+    SessionTicket *ticket;
+    list_iterator_t it;
+    int connected = 0;
+    int started = 0;
+    int index = 0;
+    int rc;
+
+    if (strlen(ws->to) > ELA_MAX_ID_LEN)
+        return;
+
+    ticket = (SessionTicket *)rc_zalloc(sizeof(SessionTicket), ticket_destroy);
+    if (!ticket)
+        return;
+
+reiterate:
+    index = 0;
+    connected = 0;
+    started = 0;
+    list_iterate(ws->streams, &it);
+    while (list_iterator_has_next(&it)) {
+        ElaStream *s;
+        ElaTransportInfo info;
+
+        rc = list_iterator_next(&it, (void **)&s);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto reiterate;
+
+        if (s->state >= ElaStreamState_connecting)
+            started++;
+
+        if (index < SESSION_MAX_RESUME_PATHS &&
+            s->state == ElaStreamState_connected && !s->deactivate &&
+            s->get_info && s->get_info(s, &info) == 0) {
+            ticket->paths[index] = info.remote;
+            connected++;
+        }
+
+        index++;
+        deref(s);
+    }
+
+    if (!connected) {
+        if (started)
+            tickets_remove(ext->tickets, ws->to);
+        deref(ticket);
+        return;
+    }
+
+    strcpy(ticket->to, ws->to);
+    ticket->expire_time = get_monotonic_time() / 1000 + SESSION_TICKET_LIFETIME;
+    ticket->path_cnt = index < SESSION_MAX_RESUME_PATHS ?
+                       index : SESSION_MAX_RESUME_PATHS;
+
+    memcpy(ticket->public_key, ws->public_key, sizeof(ticket->public_key));
+    memcpy(ticket->secret_key, ws->secret_key, sizeof(ticket->secret_key));
+    memcpy(ticket->peer_pubkey, ws->peer_pubkey, sizeof(ticket->peer_pubkey));
+
+    if (ws->crypto.enabled) {
+        memcpy(ticket->key, ws->crypto.key, sizeof(ticket->key));
+        ticket->has_key = 1;
+    }
+
+    tickets_put(ext->tickets, ticket);
+    deref(ticket);
+
+    vlogD("Session: Resumption ticket to %s stored.", ws->to);
+}
+
 static void remove_transport(ElaTransport *);
 
 static void extension_destroy(void *p)
@@ -181,7 +646,30 @@ static void extension_destroy(void *p)
         ext->callbacks = NULL;
     }
 
+    if (ext->sessions) {
+        deref(ext->sessions);
+        ext->sessions = NULL;
+    }
+
+    if (ext->pending_trickles) {
+        deref(ext->pending_trickles);
+        ext->pending_trickles = NULL;
+    }
+
+    if (ext->tickets) {
+        tickets_clear(ext->tickets);
+        deref(ext->tickets);
+        ext->tickets = NULL;
+    }
+
+    if (ext->peercaps) {
+        peercaps_clear(ext->peercaps);
+        deref(ext->peercaps);
+        ext->peercaps = NULL;
+    }
+
     pthread_rwlock_destroy(&ext->callbacks_lock);
+    pthread_mutex_destroy(&ext->sessions_lock);
 
     ids_heap_destroy((ids_heap_t *)&ext->stream_ids);
 
@@ -214,15 +702,14 @@ static int add_transport(SessionExtension *ext)
     return 0;
 }
 
-int ela_session_init(ElaCarrier *w)
+int session_extension_init(ElaCarrier *w,
+                           int (*create_transport)(ElaTransport **transport))
 {
     SessionExtension *ext;
     int rc;
 
-    if (!w) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-        return -1;
-    }
+    assert(w);
+    assert(create_transport);
 
     pthread_mutex_lock(&w->ext_mutex);
     if (w->extension) {
@@ -237,50 +724,83 @@ int ela_session_init(ElaCarrier *w)
                                            extension_destroy);
     if (!ext) {
         pthread_mutex_unlock(&w->ext_mutex);
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return -1;
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
     }
 
     ext->carrier = w;
     ext->friend_invite_cb = friend_invite;
     ext->friend_invite_context = ext;
-    ext->create_transport = ice_transport_create;
+    ext->friend_message_cb = friend_message;
+    ext->friend_message_context = ext;
+    ext->create_transport = create_transport;
+
+    rc = pthread_mutex_init(&ext->sessions_lock, NULL);
+    if (rc != 0) {
+        deref(ext);
+        pthread_mutex_unlock(&w->ext_mutex);
+        return ELA_SYS_ERROR(rc);
+    }
 
     rc = pthread_rwlock_init(&ext->callbacks_lock, NULL);
     if (rc != 0) {
         deref(ext);
         pthread_mutex_unlock(&w->ext_mutex);
-        ela_set_error(ELA_SYS_ERROR(rc));
-        return -1;
+        return ELA_SYS_ERROR(rc);
+    }
+
+    ext->sessions = list_create(1, NULL);
+    ext->pending_trickles = list_create(1, NULL);
+    ext->tickets = tickets_create(8);
+    ext->peercaps = peercaps_create(8);
+    if (!ext->sessions || !ext->pending_trickles || !ext->tickets ||
+        !ext->peercaps) {
+        deref(ext);
+        pthread_mutex_unlock(&w->ext_mutex);
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
     }
 
     ext->callbacks = list_create(0, NULL);
     if (!ext->callbacks) {
         deref(ext);
         pthread_mutex_unlock(&w->ext_mutex);
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return -1;
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
     }
 
     rc = ids_heap_init((ids_heap_t *)&ext->stream_ids, MAX_STREAM_ID);
     if (rc < 0) {
         deref(ext);
         pthread_mutex_unlock(&w->ext_mutex);
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY));
-        return -1;
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
     }
 
     rc = add_transport(ext);
     if (rc < 0) {
         deref(ext);
         pthread_mutex_unlock(&w->ext_mutex);
-        ela_set_error(rc);
-        return -1;
+        return rc;
     }
 
     w->extension = ext;
     pthread_mutex_unlock(&w->ext_mutex);
 
+    return 0;
+}
+
+int ela_session_init(ElaCarrier *w)
+{
+    int rc;
+
+    if (!w) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    rc = session_extension_init(w, ice_transport_create);
+    if (rc < 0) {
+        ela_set_error(rc);
+        return -1;
+    }
+
     ela_register_strerror(ELAF_ICE, ice_strerror);
 
     vlogD("Session: Initialize session extension %s.",
@@ -449,31 +969,15 @@ void session_base_destroy(void *p)
         free(ws->to);
 }
 
-ElaSession *ela_session_new(ElaCarrier *w, const char *address)
+ElaSession *session_create(SessionExtension *ext, const char *to,
+                           IceTransportOptions *opts)
 {
-    SessionExtension *ext;
     ElaSession *ws;
     ElaTransport *transport;
-    IceTransportOptions opts;
-    ElaTurnServer turn_server;
     int rc;
 
-    if (!w || !address) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-        return NULL;
-    }
-
-    ext = w->extension;
-    if (!ext) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
-        return NULL;
-    }
-
-    if (!ela_is_friend(w, address)) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
-        vlogE("Session: %s is not friend yet.", address);
-        return NULL;
-    }
+    assert(ext);
+    assert(to);
 
     transport = ext->transport;
     if (!transport) {
@@ -496,23 +1000,9 @@ ElaSession *ela_session_new(ElaCarrier *w, const char *address)
     }
 
     ws->transport = transport;
-    ws->to = strdup(address);
+    ws->to = strdup(to);
 
-    rc = ela_get_turn_server(w, &turn_server);
-    if (rc < 0) {
-        deref(ws);
-        return NULL;
-    }
-
-    opts.stun_host = turn_server.server;
-    opts.stun_port = NULL;
-    opts.turn_host = turn_server.server;
-    opts.turn_port = NULL;
-    opts.turn_username = turn_server.username;
-    opts.turn_password = turn_server.password;
-    opts.turn_realm = turn_server.realm;
-
-    rc = transport->create_worker(transport, &opts, &ws->worker);
+    rc = transport->create_worker(transport, opts, &ws->worker);
     if (rc < 0) {
         deref(ws);
         ela_set_error(rc);
@@ -529,11 +1019,159 @@ ElaSession *ela_session_new(ElaCarrier *w, const char *address)
 
     list_add(transport->workers, &ws->worker->le);
 
+    ws->le.data = ws;
+    pthread_mutex_lock(&ext->sessions_lock);
+    list_add(ext->sessions, &ws->le);
+    pthread_mutex_unlock(&ext->sessions_lock);
+
     vlogD("Session: Session to %s created.", ws->to);
 
     return ws;
 }
 
+int session_get_ice_options(SessionExtension *ext, ElaTurnServer *turn_server,
+                            IceTransportOptions *opts)
+{
+    int rc;
+
+    assert(ext);
+    assert(turn_server);
+    assert(opts);
+
+    rc = ela_get_turn_server(ext->carrier, turn_server);
+    if (rc < 0)
+        return rc;
+
+    opts->stun_host = turn_server->server;
+    opts->stun_port = NULL;
+    opts->turn_host = turn_server->server;
+    opts->turn_port = NULL;
+    opts->turn_username = turn_server->username;
+    opts->turn_password = turn_server->password;
+    opts->turn_realm = turn_server->realm;
+
+    return 0;
+}
+
+ElaSession *ela_session_new(ElaCarrier *w, const char *address)
+{
+    SessionExtension *ext;
+    IceTransportOptions opts;
+    ElaTurnServer turn_server;
+    int rc;
+
+    if (!w || !address) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return NULL;
+    }
+
+    ext = w->extension;
+    if (!ext) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        return NULL;
+    }
+
+    if (!ela_is_friend(w, address)) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        vlogE("Session: %s is not friend yet.", address);
+        return NULL;
+    }
+
+    if (!ext->transport) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        vlogE("Session: Transport not intialized yet.");
+        return NULL;
+    }
+
+    rc = session_get_ice_options(ext, &turn_server, &opts);
+    if (rc < 0)
+        return NULL;
+
+    // Pre-warm the transports for the sessions to come.
+    if (ext->transport->prewarm)
+        ext->transport->prewarm(ext->transport);
+
+    return session_create(ext, address, &opts);
+}
+
+int ela_session_set_trickle(ElaSession *ws, bool enable)
+{
+    if (!ws) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (list_size(ws->streams) > 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    ws->trickle = enable ? 1 : 0;
+    return 0;
+}
+
+int ela_session_set_bundle(ElaSession *ws, bool enable)
+{
+    if (!ws) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (list_size(ws->streams) > 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    ws->bundle = enable ? 1 : 0;
+    return 0;
+}
+
+int ela_session_set_ice_profile(ElaSession *ws,
+                                const ElaSessionIceProfile *profile)
+{
+    if (!ws || (profile && (profile->nomination_delay < 0 ||
+                            profile->nomination_timeout < 0 ||
+                            profile->max_remote_candidates < 0))) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (list_size(ws->streams) > 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    if (profile)
+        ws->ice_profile = *profile;
+    else
+        memset(&ws->ice_profile, 0, sizeof(ws->ice_profile));
+
+    return 0;
+}
+
+int ela_session_restart(ElaSession *ws)
+{
+    int rc;
+
+    if (!ws) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (!ws->restart) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_IMPLEMENTED));
+        return -1;
+    }
+
+    rc = ws->restart(ws);
+    if (rc < 0) {
+        ela_set_error(rc);
+        return -1;
+    }
+
+    return 0;
+}
+
 char *ela_session_get_peer(ElaSession *ws, char *peer, size_t size)
 {
     if (!ws || !peer || !size) {
@@ -563,9 +1201,19 @@ void *ela_session_get_userdata(ElaSession *ws)
 
 static void session_internal_close(ElaSession *ws)
 {
+    SessionExtension *ext = session_get_extension(ws);
     list_iterator_t it;
     assert(ws);
 
+    if (ws->le.data) {
+        pthread_mutex_lock(&ext->sessions_lock);
+        deref(list_remove_entry(ext->sessions, &ws->le));
+        pthread_mutex_unlock(&ext->sessions_lock);
+        ws->le.data = NULL;
+    }
+
+    store_ticket(ws);
+
 restop:
     list_iterate(ws->streams, &it);
     while (list_iterator_has_next(&it)) {
@@ -616,55 +1264,84 @@ static void friend_invite_response(ElaCarrier *w, const char *from,
     ElaSession *ws = (ElaSession*)context;
     const char *bundle;
     const char *sdp;
+    size_t sdp_len;
+
+    if (status == 0 && !data) {
+        status = ELA_GENERAL_ERROR(ELAERR_INVALID_SDP);
+        reason = "Session response without SDP";
+    }
+
+    if (status != 0) {
+        vlogD("Session: Session request to %s failed, status: %d, reason: %s",
+              from, status, reason ? reason : "");
+        if (ws->complete_callback)
+            ws->complete_callback(ws, NULL, status, reason, NULL, 0, ws->context);
+        return;
+    }
 
     bundle = (const char *)data;
     sdp = (const char *)data + strlen(bundle) + 1;
 
-    // bundle\x0sdp\x0\x0
+    // bundle\x0sdp\x0\x0, the compact answer is binary in place of sdp.
     assert(((const char *)data)[len-1] == 0);
-    assert(strlen(bundle) + strlen(sdp) + 3 == len);
+    assert(strlen(bundle) + 3 <= len);
+    sdp_len = len - strlen(bundle) - 3;
+    assert(session_is_compact_offer(sdp, sdp_len) || strlen(sdp) == sdp_len);
 
-    vlogD("Session: Session response from %s with bundle: %s, SDP: %s", from, bundle, sdp);
+    if (session_is_compact_offer(sdp, sdp_len))
+        vlogD("Session: Session response from %s with bundle: %s, "
+              "compact answer (%zu bytes)", from, bundle, sdp_len);
+    else
+        vlogD("Session: Session response from %s with bundle: %s, SDP: %s",
+              from, bundle, sdp);
+
+    update_peercaps(session_get_extension(ws), ws->to, sdp, sdp_len);
     len -= strlen(bundle) + 2;
     if (ws->complete_callback) {
         ws->complete_callback(ws, bundle, status, reason, (const char *)sdp, len, ws->context);
     }
 }
 
-int ela_session_request(ElaSession *ws, const char *bundle,
-        ElaSessionRequestCompleteCallback *callback, void *context)
+int session_prepare_local_sdp(ElaSession *ws, bool offerer,
+                              char *sdp, size_t len)
 {
-    ElaCarrier *w;
-    int rc = 0;
+    SessionTicket *ticket;
     list_iterator_t iterator;
-    char data[ELA_MAX_BUNDLE_LEN + SDP_MAX_LEN + 2];
-    size_t data_len;
-    char *sdp;
-    char *ext_to;
+    int rc;
 
-    if (!ws || !callback || (bundle && strlen(bundle) > ELA_MAX_BUNDLE_LEN)) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
-        return -1;
-    }
+    assert(ws);
+    assert(sdp);
 
-    w = session_get_extension(ws)->carrier;
-    assert(w);
+    if (list_size(ws->streams) == 0)
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
 
-    if (list_size(ws->streams) == 0) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
-        return -1;
-    }
+    ws->offerer = offerer ? 1 : 0;
+    if (!ws->set_offer(ws, offerer))
+        return ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
 
-    ws->offerer = 1;
-    if (!ws->set_offer(ws, true)) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
-        return -1;
+    ticket = get_ticket(ws);
+    if (ticket) {
+        // Resume with the keypair and the paths of the last session.
+        memcpy(ws->public_key, ticket->public_key, sizeof(ws->public_key));
+        memcpy(ws->secret_key, ticket->secret_key, sizeof(ws->secret_key));
+
+        ws->resume.path_cnt = ticket->path_cnt;
+        memcpy(ws->resume.paths, ticket->paths, sizeof(ws->resume.paths));
+        deref(ticket);
+
+        vlogD("Session: Session to %s resumes with ticket.", ws->to);
+    } else {
+        crypto_create_keypair(ws->public_key, ws->secret_key);
+        ws->resume.path_cnt = 0;
     }
 
-    crypto_create_keypair(ws->public_key, ws->secret_key);
     crypto_random_nonce(ws->nonce);
     crypto_random_nonce(ws->credential);
 
+    // The compact offer only goes to the peers which advertised it.
+    ws->offer_version = peercaps_get_offer_version(
+                                session_get_extension(ws)->peercaps, ws->to);
+
 reprepare:
     list_iterate(ws->streams, &iterator);
     while (list_iterator_has_next(&iterator)) {
@@ -680,12 +1357,42 @@ reprepare:
         rc = s->pipeline.prepare(&s->pipeline);
         deref(s);
 
-        if (rc != 0) {
-            ela_set_error(rc);
-            return -1;
-        }
+        if (rc != 0)
+            return rc;
+    }
+
+    rc = ws->encode_local_sdp(ws, sdp, len);
+    if (rc < 0) {
+        vlogE("Session: Encode local SDP failed(0x%x).", rc);
+        return rc;
+    }
+
+    if (ws->offer_version >= SESSION_OFFER_COMPACT)
+        vlogD("Session: Encode local compact offer success[%d bytes].", rc);
+    else
+        vlogD("Session: Encode local SDP success[%.*s].", rc, sdp);
+
+    return rc;
+}
+
+int ela_session_request(ElaSession *ws, const char *bundle,
+        ElaSessionRequestCompleteCallback *callback, void *context)
+{
+    ElaCarrier *w;
+    int rc = 0;
+    char data[ELA_MAX_BUNDLE_LEN + SDP_MAX_LEN + 2];
+    size_t data_len;
+    char *sdp;
+    char *ext_to;
+
+    if (!ws || !callback || (bundle && strlen(bundle) > ELA_MAX_BUNDLE_LEN)) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
     }
 
+    w = session_get_extension(ws)->carrier;
+    assert(w);
+
     if (bundle && bundle[0]) {
         data_len = strlen(bundle) + 1;
         strcpy(data, bundle);
@@ -695,9 +1402,8 @@ reprepare:
     }
     sdp = data + data_len;
 
-    rc = ws->encode_local_sdp(ws, sdp, SDP_MAX_LEN);
+    rc = session_prepare_local_sdp(ws, true, sdp, SDP_MAX_LEN);
     if (rc < 0) {
-        vlogE("Session: Encode local SDP failed(0x%x).", rc);
         ela_set_error(rc);
         return -1;
     }
@@ -706,8 +1412,6 @@ reprepare:
     sdp[rc+1] = 0;
     data_len += (rc + 2);
 
-    vlogD("Session: Encode local SDP success[%s].", sdp);
-
     ws->complete_callback = callback;
     ws->context = context;
 
@@ -744,16 +1448,6 @@ int ela_session_reply_request(ElaSession *ws, const char *bundle,
     w = session_get_extension(ws)->carrier;
     assert(w);
 
-    ws->offerer = 0;
-    if (!ws->set_offer(ws, false)) {
-        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
-        return -1;
-    }
-
-    crypto_create_keypair(ws->public_key, ws->secret_key);
-    crypto_random_nonce(ws->nonce);
-    crypto_random_nonce(ws->credential);
-
     if (bundle && bundle[0]) {
         data_len = strlen(bundle) + 1;
         strcpy(data, bundle);
@@ -764,37 +1458,8 @@ int ela_session_reply_request(ElaSession *ws, const char *bundle,
     sdp = data + data_len;
 
     if (status == 0) {
-        list_iterator_t iterator;
-
-        if (list_size(ws->streams) == 0) {
-            ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
-            return -1;
-        }
-
-reprepare:
-        list_iterate(ws->streams, &iterator);
-        while (list_iterator_has_next(&iterator)) {
-            ElaStream *s;
-
-            rc = list_iterator_next(&iterator, (void **)&s);
-            if (rc == 0)
-                break;
-
-            if (rc == -1)
-                goto reprepare;
-
-            rc = s->pipeline.prepare(&s->pipeline);
-            deref(s);
-
-            if (rc != 0) {
-                ela_set_error(rc);
-                return -1;
-            }
-        }
-
-        rc = ws->encode_local_sdp(ws, sdp, SDP_MAX_LEN);
+        rc = session_prepare_local_sdp(ws, false, sdp, SDP_MAX_LEN);
         if (rc < 0) {
-            vlogE("Session: Encode local SDP failed(0x%x).", rc);
             ela_set_error(rc);
             return -1;
         }
@@ -802,8 +1467,12 @@ reprepare:
         sdp[rc] = 0;
         sdp[rc + 1] = 0;
         data_len += (rc + 2);
-
-        vlogD("Session: Encode local SDP success[%s].", sdp);
+    } else {
+        ws->offerer = 0;
+        if (!ws->set_offer(ws, false)) {
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+            return -1;
+        }
     }
 
     ext_to = (char *)alloca(ELA_MAX_ID_LEN + strlen(extension_name) + 2);
@@ -835,10 +1504,6 @@ int ela_session_start(ElaSession *ws, const char *sdp, size_t len)
         return -1;
     }
 
-    if (ws->crypto.enabled)
-        crypto_compute_symmetric_key(ws->peer_pubkey, ws->secret_key,
-                                     ws->crypto.key);
-
     ref(ws);
 
 recheck:
@@ -873,6 +1538,26 @@ recheck:
         return -1;
     }
 
+    apply_pending_trickles(ws);
+
+    // The peer public key comes with the remote SDP.
+    if (ws->crypto.enabled) {
+        SessionTicket *ticket = get_ticket(ws);
+
+        if (ticket && ticket->has_key &&
+            memcmp(ticket->public_key, ws->public_key, sizeof(ws->public_key)) == 0 &&
+            memcmp(ticket->peer_pubkey, ws->peer_pubkey, sizeof(ws->peer_pubkey)) == 0) {
+            memcpy(ws->crypto.key, ticket->key, sizeof(ws->crypto.key));
+            vlogD("Session: Session to %s resumed the symmetric key.", ws->to);
+        } else {
+            crypto_compute_symmetric_key(ws->peer_pubkey, ws->secret_key,
+                                         ws->crypto.key);
+        }
+
+        if (ticket)
+            deref(ticket);
+    }
+
 restart:
     list_iterate(ws->streams, &iterator);
     while (list_iterator_has_next(&iterator)) {
@@ -902,6 +1587,13 @@ void stream_base_destroy(void *p)
 {
     ElaStream *s = (ElaStream *)p;
 
+    if (s->profiles) {
+        stream_profiler_dump(s);
+        deref(s->profiles);
+    }
+
+    pthread_mutex_destroy(&s->write_lock);
+
     if (s->pipeline.next)
         deref(s->pipeline.next);
 
@@ -916,12 +1608,25 @@ void stream_base_on_data(StreamHandler *handler, FlexBuffer *buf)
 {
     ElaStream *s = (ElaStream *)handler;
 
+    stats_received(&s->stats.application, flex_buffer_size(buf));
+
     if (s->callbacks.stream_data)
         s->callbacks.stream_data(s->session, s->id,
                                  flex_buffer_ptr(buf), flex_buffer_size(buf),
                                  s->context);
 }
 
+static
+ssize_t stream_base_writev(StreamHandler *handler,
+                           const ElaIOVec *iov, int iovcnt)
+{
+    ElaStream *s = (ElaStream *)handler;
+
+    /* Bulk data goes straight to the reliable handler, skipping the
+     * handlers in between. */
+    return s->tcp->writev(s->tcp, iov, iovcnt);
+}
+
 static
 void stream_base_on_state_chagned(StreamHandler *handler, int state)
 {
@@ -987,6 +1692,24 @@ int ela_session_add_stream(ElaSession *ws, ElaStreamType type,
         s->multiplexing = 1;
         s->portforwarding = 1;
     }
+    if (options & ELA_STREAM_MESSAGE_FRAMING) {
+        if (!s->reliable || s->multiplexing) {
+            deref(s);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return -1;
+        }
+        s->framing = 1;
+    }
+    if (options & ELA_STREAM_PROFILING)
+        s->profiling = 1;
+    if (options & ELA_STREAM_MULTIPATH) {
+        if (ws->bundle) {
+            deref(s);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return -1;
+        }
+        s->multipath = 1;
+    }
 
     s->pipeline.name = "Root Handler";
     s->pipeline.init = default_handler_init;
@@ -994,6 +1717,7 @@ int ela_session_add_stream(ElaSession *ws, ElaStreamType type,
     s->pipeline.start = default_handler_start;
     s->pipeline.stop = default_handler_stop;
     s->pipeline.write = default_handler_write;
+    s->pipeline.writev = stream_base_writev;
     s->pipeline.on_data = stream_base_on_data;
     s->pipeline.on_state_changed = stream_base_on_state_chagned;
 
@@ -1014,6 +1738,17 @@ int ela_session_add_stream(ElaSession *ws, ElaStreamType type,
         prev = &handler->base;
     }
 
+    if (s->framing) {
+        rc = framing_handler_create(s, &handler);
+        if (rc < 0) {
+            deref(s);
+            ela_set_error(rc);
+            return -1;
+        }
+        handler_connect(prev, handler);
+        prev = handler;
+    }
+
     if (s->reliable) {
         rc = reliable_handler_create(s, &handler);
         if (rc < 0) {
@@ -1021,6 +1756,7 @@ int ela_session_add_stream(ElaSession *ws, ElaStreamType type,
             ela_set_error(rc);
             return -1;
         }
+        s->tcp = handler;
         handler_connect(prev, handler);
         prev = handler;
     }
@@ -1037,6 +1773,15 @@ int ela_session_add_stream(ElaSession *ws, ElaStreamType type,
         prev = handler;
     }
 
+    if (s->profiling) {
+        rc = stream_profiler_attach(s);
+        if (rc < 0) {
+            deref(s);
+            ela_set_error(rc);
+            return -1;
+        }
+    }
+
     s->le.data = s;
     list_add(ws->streams, &s->le);
 
@@ -1141,15 +1886,118 @@ ssize_t ela_stream_write(ElaSession *ws, int stream,
 
     flex_buffer_from(buf, FLEX_PADDING_LEN, data, len);
     sent = s->pipeline.write(&s->pipeline, buf);
-    if (sent < 0)
+    if (sent < 0) {
         ela_set_error((int)sent);
-    else
+    } else {
+        stats_sent(&s->stats.application, (size_t)sent);
         vlogD("Session: Stream %d sent %d bytes data.", s->id, (int)len);
+    }
+
+    deref(s);
+    return sent < 0 ? -1: sent;
+}
+
+ssize_t ela_stream_writev(ElaSession *ws, int stream,
+                          const ElaIOVec *iov, int iovcnt)
+{
+    ElaStream *s;
+    ElaIOVec *_iov;
+    uint32_t header;
+    size_t total = 0;
+    ssize_t sent;
+    int i;
+
+    if (!ws || stream <= 0 || !iov || iovcnt <= 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (!iov[i].data && iov[i].len) {
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+            return -1;
+        }
+        total += iov[i].len;
+    }
+
+    s = get_stream(ws, stream);
+    if (!s) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        return -1;
+    }
+
+    if (s->type == ElaStreamType_audio || s->type == ElaStreamType_video) {
+        deref(s);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_IMPLEMENTED));
+        return -1;
+    }
+
+    /* Bulk data bypasses the multiplexer framing, so it's only
+     * available on the plain reliable stream. */
+    if (!s->tcp || s->multiplexing) {
+        deref(s);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    if (s->state != ElaStreamState_connected) {
+        deref(s);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    if (s->framing) {
+        if (total > ELA_MAX_STREAM_MESSAGE_LEN) {
+            deref(s);
+            ela_set_error(ELA_GENERAL_ERROR(ELAERR_TOO_LONG));
+            return -1;
+        }
+
+        /* Prepend the message header as the first segment. */
+        header = htonl((uint32_t)total);
+
+        _iov = (ElaIOVec *)alloca(sizeof(ElaIOVec) * (iovcnt + 1));
+        _iov[0].data = &header;
+        _iov[0].len = FRAMING_HEAD_LEN;
+        memcpy(_iov + 1, iov, sizeof(ElaIOVec) * iovcnt);
+
+        // Keep the message contiguous against concurrent writers.
+        pthread_mutex_lock(&s->write_lock);
+        sent = s->pipeline.writev(&s->pipeline, _iov, iovcnt + 1);
+        pthread_mutex_unlock(&s->write_lock);
+        if (sent > 0)
+            sent -= FRAMING_HEAD_LEN;
+    } else {
+        sent = s->pipeline.writev(&s->pipeline, iov, iovcnt);
+    }
+
+    if (sent < 0) {
+        ela_set_error((int)sent);
+    } else {
+        stats_sent(&s->stats.application, (size_t)sent);
+        vlogD("Session: Stream %d sent %zd bytes bulk data.", s->id, sent);
+    }
 
     deref(s);
     return sent < 0 ? -1: sent;
 }
 
+ssize_t ela_stream_write_bulk(ElaSession *ws, int stream,
+                              const void *data, size_t len)
+{
+    ElaIOVec iov;
+
+    if (!data || !len) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    iov.data = data;
+    iov.len = len;
+
+    return ela_stream_writev(ws, stream, &iov, 1);
+}
+
 int ela_stream_get_type(ElaSession *ws, int stream, ElaStreamType *type)
 {
     ElaStream *s;
@@ -1222,6 +2070,66 @@ int ela_stream_get_transport_info(ElaSession *ws, int stream, ElaTransportInfo *
     return rc < 0 ? -1 : 0;
 }
 
+int ela_stream_get_stats(ElaSession *ws, int stream, ElaStreamStats *stats)
+{
+    ElaStream *s;
+
+    if (!ws || stream <= 0 || !stats) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    s = get_stream(ws, stream);
+    if (!s) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(ElaStreamStats));
+
+    stats_copy(&stats->application, &s->stats.application);
+    stats_copy(&stats->multiplex, &s->stats.multiplex);
+    stats_copy(&stats->reliable, &s->stats.reliable);
+    stats_copy(&stats->crypto, &s->stats.crypto);
+    stats_copy(&stats->transport, &s->stats.transport);
+    stats->crypto_failures = stats_get(&s->stats.crypto_failures);
+
+    if (s->tcp)
+        reliable_handler_get_stats(s->tcp, stats);
+
+    deref(s);
+    return 0;
+}
+
+int ela_stream_get_profile(ElaSession *ws, int stream,
+                           ElaHandlerProfile *profiles, int count)
+{
+    ElaStream *s;
+    int rc;
+
+    if (!ws || stream <= 0 || !profiles || count <= 0) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    s = get_stream(ws, stream);
+    if (!s) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        return -1;
+    }
+
+    if (!s->profiles) {
+        deref(s);
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+        return -1;
+    }
+
+    rc = stream_profiler_collect(s, profiles, count);
+
+    deref(s);
+    return rc;
+}
+
 int ela_stream_open_channel(ElaSession *ws, int stream, const char *cookie)
 {
     int rc;
@@ -1380,6 +2288,35 @@ int ela_stream_resume_channel(ElaSession *ws, int stream, int channel)
     return rc < 0 ? -1 : 0;
 }
 
+int ela_stream_get_channel_stats(ElaSession *ws, int stream, int channel,
+                                 ElaLayerStats *stats)
+{
+    int rc;
+    ElaStream *s;
+
+    if (!ws || stream <= 0 || channel <= 0 || !stats) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+        return -1;
+    }
+
+    s = get_stream(ws, stream);
+    if (!s) {
+        ela_set_error(ELA_GENERAL_ERROR(ELAERR_NOT_EXIST));
+        return -1;
+    }
+
+    if (!s->mux)
+        rc = ELA_GENERAL_ERROR(ELAERR_WRONG_STATE);
+    else
+        rc = s->mux->channel.stats(s->mux, channel, stats);
+
+    if (rc < 0)
+        ela_set_error(rc);
+
+    deref(s);
+    return rc < 0 ? -1 : 0;
+}
+
 int ela_session_add_service(ElaSession *ws, const char *service,
                             PortForwardingProtocol protocol,
                             const char *host, const char *port)
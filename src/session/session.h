@@ -23,7 +23,12 @@
 #ifndef __SESSION_H__
 #define __SESSION_H__
 
+#include <string.h>
+#include <stdbool.h>
 #include <pthread.h>
+#ifdef HAVE_WINSOCK2_H
+#include <winsock2.h>
+#endif
 
 #ifdef __APPLE__
 #pragma GCC diagnostic push
@@ -41,6 +46,7 @@
 #include <ids_heap.h>
 
 #include "ela_session.h"
+#include "ela_turnserver.h"
 #include "stream_handler.h"
 
 #ifdef __cplusplus
@@ -48,6 +54,26 @@ extern "C" {
 #endif
 
 #define MAX_STREAM_ID       256
+#define SESSION_MAX_RESUME_PATHS    4
+
+/*
+ * Offer formats. The SDP text is understood by all peers, the compact
+ * one is a flatbuffer (see offer.fbs) used once the peer advertised it.
+ * Version 3 is the compact offer from peers which also keep multiplexed
+ * channels alive per stream instead of per channel.
+ */
+#define SESSION_OFFER_SDP           1
+#define SESSION_OFFER_COMPACT       2
+#define SESSION_OFFER_KEEPALIVE     3
+#define SESSION_OFFER_LATEST        SESSION_OFFER_KEEPALIVE
+#define SESSION_OFFER_VERSIONS      "1 2 3"
+#define SESSION_OFFER_IDENTIFIER    "ELSO"
+
+// Session messages starting with it carry the ICE restart of the sender.
+#define SESSION_RESTART_PREFIX      "restart "
+
+// Session messages starting with it set up an extra path of a stream.
+#define SESSION_PATH_PREFIX         "path "
 
 typedef void Timer;
 typedef bool TimerCallback(void *user_data);
@@ -71,6 +97,9 @@ typedef struct IceTransportOptions {
 typedef void (*friend_invite_callback)(ElaCarrier *, const char *from,
               const char *data, size_t len, void *context);
 
+typedef void (*friend_message_callback)(ElaCarrier *, const char *from,
+              const char *data, size_t len, void *context);
+
 struct ElaCarrier       {
     pthread_mutex_t         ext_mutex;
     void                    *extension;
@@ -90,6 +119,9 @@ struct SessionExtension {
     friend_invite_callback  friend_invite_cb;
     void                    *friend_invite_context;
 
+    friend_message_callback friend_message_cb;
+    void                    *friend_message_context;
+
     ElaSessionRequestCallback *default_callback;
     void                    *default_context;
 
@@ -98,6 +130,18 @@ struct SessionExtension {
 
     ElaTransport            *transport;
 
+    // Sessions to route trickled candidates, and the trickled candidates
+    // arrived before their session applied the remote SDP.
+    pthread_mutex_t         sessions_lock;
+    list_t                  *sessions;
+    list_t                  *pending_trickles;
+
+    // Resumption tickets of the last sessions, keyed by peer.
+    hashtable_t             *tickets;
+
+    // Highest offer format understood by each peer.
+    hashtable_t             *peercaps;
+
     IDS_HEAP(stream_ids, MAX_STREAM_ID);
 
     int (*create_transport)(ElaTransport **transport);
@@ -110,6 +154,7 @@ struct ElaTransport {
     int (*create_worker)   (ElaTransport *transport, IceTransportOptions *opts,
                             TransportWorker **worker);
     int (*create_session)  (ElaTransport *transport, ElaSession **session);
+    void (*prewarm)        (ElaTransport *transport);
 };
 
 struct TransportWorker {
@@ -129,9 +174,16 @@ typedef struct ElaSession {
     ElaTransport            *transport;
     char                    *to;
 
+    list_entry_t            le;
+
     TransportWorker         *worker;
 
     int                     offerer;
+    int                     trickle;
+    int                     bundle;
+    int                     offer_version;
+
+    ElaSessionIceProfile    ice_profile;
 
     ElaSessionRequestCompleteCallback *complete_callback;
     void                    *context;
@@ -152,6 +204,12 @@ typedef struct ElaSession {
         uint8_t key[SYMMETRIC_KEY_BYTES];
     }  crypto;
 
+    // Nominated remote addresses of the last session to the peer.
+    struct {
+        int path_cnt;
+        ElaAddressInfo paths[SESSION_MAX_RESUME_PATHS];
+    } resume;
+
     struct {
         int enabled;
         hashtable_t *services;
@@ -162,6 +220,11 @@ typedef struct ElaSession {
     bool (*set_offer)       (ElaSession *session, bool offerer);
     int  (*encode_local_sdp)(ElaSession *session, char *sdp, size_t len);
     int  (*apply_remote_sdp)(ElaSession *session, const char *sdp, size_t sdp_len);
+    int  (*add_remote_candidates)(ElaSession *session, const char *ufrag,
+                                  const char *candidates, size_t len);
+    int  (*restart)         (ElaSession *session);
+    int  (*apply_restart)   (ElaSession *session, const char *data, size_t len);
+    int  (*apply_path)      (ElaSession *session, const char *data, size_t len);
 } ElaSession;
 
 typedef struct Multiplexer  Multiplexer;
@@ -169,6 +232,7 @@ typedef struct Multiplexer  Multiplexer;
 struct ElaStream {
     StreamHandler           pipeline;
     Multiplexer             *mux;
+    StreamHandler           *tcp;
 
     list_entry_t            le;
     int                     id;
@@ -181,11 +245,21 @@ struct ElaStream {
     int                     reliable;
     int                     multiplexing;
     int                     portforwarding;
+    int                     framing;
+    int                     profiling;
+    int                     multipath;
     int                     deactivate;
 
     ElaStreamCallbacks  callbacks;
     void *context;
 
+    // Held across a whole message write on the framing stream.
+    pthread_mutex_t         write_lock;
+
+    ElaStreamStats          stats;
+    HandlerProfile          *profiles;
+    int                     profile_count;
+
     int  (*get_info)        (ElaStream *stream, ElaTransportInfo *info);
     void (*fire_state_changed)(ElaStream *stream, int state);
     void (*lock)            (ElaStream *stream);
@@ -198,6 +272,27 @@ void session_base_destroy(void *p);
 
 void stream_base_destroy(void *p);
 
+int session_extension_init(ElaCarrier *w,
+                           int (*create_transport)(ElaTransport **transport));
+
+ElaSession *session_create(SessionExtension *ext, const char *to,
+                           IceTransportOptions *opts);
+
+int session_get_ice_options(SessionExtension *ext, ElaTurnServer *turn_server,
+                            IceTransportOptions *opts);
+
+int session_send_trickle(ElaSession *ws, const char *data, size_t len);
+
+int session_prepare_local_sdp(ElaSession *ws, bool offerer,
+                              char *sdp, size_t len);
+
+static inline
+bool session_is_compact_offer(const char *sdp, size_t len)
+{
+    // The flatbuffer file identifier follows the root offset.
+    return len >= 8 && memcmp(sdp + 4, SESSION_OFFER_IDENTIFIER, 4) == 0;
+}
+
 static inline
 SessionExtension *stream_get_extension(ElaStream *stream)
 {
@@ -246,6 +341,61 @@ TransportWorker *session_get_worker(ElaSession *session)
     return session->worker;
 }
 
+/*
+ * Stream counters are bumped on the data path by whichever thread is
+ * running it, so a relaxed atomic add is all the synchronization needed;
+ * ela_stream_get_stats() collects them on read.
+ */
+static inline
+void stats_add(uint64_t *counter, uint64_t value)
+{
+#if defined(_MSC_VER)
+    InterlockedExchangeAdd64((volatile LONG64 *)counter, (LONG64)value);
+#else
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline
+uint64_t stats_get(uint64_t *counter)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)counter, 0, 0);
+#else
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline
+void stats_sent(ElaLayerStats *stats, size_t len)
+{
+    stats_add(&stats->bytes_sent, len);
+    stats_add(&stats->packets_sent, 1);
+}
+
+static inline
+void stats_received(ElaLayerStats *stats, size_t len)
+{
+    stats_add(&stats->bytes_received, len);
+    stats_add(&stats->packets_received, 1);
+}
+
+static inline
+void stats_dropped(ElaLayerStats *stats)
+{
+    stats_add(&stats->packets_dropped, 1);
+}
+
+static inline
+void stats_copy(ElaLayerStats *dst, ElaLayerStats *src)
+{
+    dst->bytes_sent       = stats_get(&src->bytes_sent);
+    dst->bytes_received   = stats_get(&src->bytes_received);
+    dst->packets_sent     = stats_get(&src->packets_sent);
+    dst->packets_received = stats_get(&src->packets_received);
+    dst->packets_dropped  = stats_get(&src->packets_dropped);
+}
+
 void ela_set_error(int error);
 
 int ela_register_strerror(int facility, int (*strerr)(int, char *, size_t));
@@ -32,6 +32,9 @@ extern "C" {
 typedef struct ElaStream ElaStream;
 typedef struct StreamHandler StreamHandler;
 typedef struct FlexBuffer FlexBuffer;
+typedef struct ElaIOVec ElaIOVec;
+typedef struct ElaStreamStats ElaStreamStats;
+typedef struct HandlerProfile HandlerProfile;
 
 struct StreamHandler {
     const char *name;
@@ -41,11 +44,15 @@ struct StreamHandler {
     StreamHandler *prev;
     StreamHandler *next;
 
+    HandlerProfile *profile;
+
     int  (*init)            (StreamHandler *handler);
     int  (*prepare)         (StreamHandler *handler);
     int  (*start)           (StreamHandler *handler);
     void (*stop)            (StreamHandler *handler, int error);
     ssize_t (*write)        (StreamHandler *handler, FlexBuffer *buf);
+    ssize_t (*writev)       (StreamHandler *handler, const ElaIOVec *iov,
+                             int iovcnt);
     void (*on_data)         (StreamHandler *handler, FlexBuffer *buf);
     void (*on_state_changed)(StreamHandler *handler, int state);
 };
@@ -115,10 +122,16 @@ void default_handler_on_state_changed(StreamHandler *handler, int state)
     handler->prev->on_state_changed(handler->prev, state);
 }
 
+#define FRAMING_HEAD_LEN        4
+
 int crypto_handler_create(ElaStream *s, StreamHandler **handler);
 
+int framing_handler_create(ElaStream *s, StreamHandler **handler);
+
 int reliable_handler_create(ElaStream *s, StreamHandler **handler);
 
+void reliable_handler_get_stats(StreamHandler *handler, ElaStreamStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
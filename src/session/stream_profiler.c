@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <vlog.h>
+#include <rc_mem.h>
+
+#include "flex_buffer.h"
+#include "session.h"
+#include "stream_handler.h"
+#include "stream_profiler.h"
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL    __declspec(thread)
+#else
+#define THREAD_LOCAL    __thread
+#endif
+
+/*
+ * Handlers call each other down (write) and up (on_data) the pipeline,
+ * so the time measured around a call includes the nested handlers. The
+ * nested time of the current call is tracked per thread to get the self
+ * time of each handler.
+ */
+static THREAD_LOCAL uint64_t nested_time;
+
+typedef struct ProfileFrame {
+    uint64_t start;
+    uint64_t nested;
+} ProfileFrame;
+
+static inline uint64_t profiler_clock(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void stats_max(uint64_t *counter, uint64_t value)
+{
+#if defined(_MSC_VER)
+    LONG64 old = *(volatile LONG64 *)counter;
+    LONG64 prev;
+
+    while ((uint64_t)old < value) {
+        prev = InterlockedCompareExchange64((volatile LONG64 *)counter,
+                                            (LONG64)value, old);
+        if (prev == old)
+            break;
+        old = prev;
+    }
+#else
+    uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+    while (old < value &&
+           !__atomic_compare_exchange_n(counter, &old, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+}
+
+static inline void profiler_enter(ProfileFrame *frame)
+{
+    frame->nested = nested_time;
+    nested_time = 0;
+    frame->start = profiler_clock();
+}
+
+static inline
+void profiler_leave(ProfileFrame *frame, ElaHandlerCallStats *stats,
+                    size_t bytes)
+{
+    uint64_t elapsed = profiler_clock() - frame->start;
+    uint64_t self;
+    uint64_t t;
+    int bucket = 0;
+
+    self = elapsed > nested_time ? elapsed - nested_time : 0;
+    nested_time = frame->nested + elapsed;
+
+    for (t = self >> 10; t && bucket < ELA_PROFILE_HISTOGRAM_BUCKETS - 1; t >>= 1)
+        bucket++;
+
+    stats_add(&stats->calls, 1);
+    stats_add(&stats->bytes, bytes);
+    stats_add(&stats->time, self);
+    stats_add(&stats->histogram[bucket], 1);
+    stats_max(&stats->max_time, self);
+}
+
+static
+ssize_t profiled_handler_write(StreamHandler *handler, FlexBuffer *buf)
+{
+    HandlerProfile *profile = handler->profile;
+    size_t len = flex_buffer_size(buf);
+    ProfileFrame frame;
+    ssize_t rc;
+
+    profiler_enter(&frame);
+    rc = profile->write(handler, buf);
+    profiler_leave(&frame, &profile->stats.write, len);
+
+    return rc;
+}
+
+static
+ssize_t profiled_handler_writev(StreamHandler *handler,
+                                const ElaIOVec *iov, int iovcnt)
+{
+    HandlerProfile *profile = handler->profile;
+    size_t len = 0;
+    ProfileFrame frame;
+    ssize_t rc;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].len;
+
+    profiler_enter(&frame);
+    rc = profile->writev(handler, iov, iovcnt);
+    profiler_leave(&frame, &profile->stats.write, len);
+
+    return rc;
+}
+
+static
+void profiled_handler_on_data(StreamHandler *handler, FlexBuffer *buf)
+{
+    HandlerProfile *profile = handler->profile;
+    size_t len = flex_buffer_size(buf);
+    ProfileFrame frame;
+
+    profiler_enter(&frame);
+    profile->on_data(handler, buf);
+    profiler_leave(&frame, &profile->stats.on_data, len);
+}
+
+int stream_profiler_attach(ElaStream *s)
+{
+    StreamHandler *handler;
+    HandlerProfile *profiles;
+    int count = 0;
+    int i;
+
+    assert(s);
+    assert(!s->profiles);
+
+    for (handler = &s->pipeline; handler; handler = handler->next)
+        count++;
+
+    profiles = (HandlerProfile *)rc_zalloc(sizeof(HandlerProfile) * count, NULL);
+    if (!profiles)
+        return ELA_GENERAL_ERROR(ELAERR_OUT_OF_MEMORY);
+
+    for (i = 0, handler = &s->pipeline; handler; handler = handler->next, i++) {
+        HandlerProfile *profile = &profiles[i];
+
+        profile->write = handler->write;
+        profile->writev = handler->writev;
+        profile->on_data = handler->on_data;
+        profile->stats.name = handler->name;
+
+        handler->profile = profile;
+        if (handler->write)
+            handler->write = profiled_handler_write;
+        if (handler->writev)
+            handler->writev = profiled_handler_writev;
+        if (handler->on_data)
+            handler->on_data = profiled_handler_on_data;
+    }
+
+    s->profiles = profiles;
+    s->profile_count = count;
+
+    vlogD("Stream: %d profiling %d handlers.", s->id, count);
+
+    return 0;
+}
+
+static
+void call_stats_copy(ElaHandlerCallStats *dst, ElaHandlerCallStats *src)
+{
+    int i;
+
+    dst->calls    = stats_get(&src->calls);
+    dst->bytes    = stats_get(&src->bytes);
+    dst->time     = stats_get(&src->time);
+    dst->max_time = stats_get(&src->max_time);
+
+    for (i = 0; i < ELA_PROFILE_HISTOGRAM_BUCKETS; i++)
+        dst->histogram[i] = stats_get(&src->histogram[i]);
+}
+
+int stream_profiler_collect(ElaStream *s, ElaHandlerProfile *profiles,
+                            int count)
+{
+    int i;
+
+    assert(s);
+    assert(s->profiles);
+
+    for (i = 0; i < s->profile_count && i < count; i++) {
+        profiles[i].name = s->profiles[i].stats.name;
+        call_stats_copy(&profiles[i].write, &s->profiles[i].stats.write);
+        call_stats_copy(&profiles[i].on_data, &s->profiles[i].stats.on_data);
+    }
+
+    return s->profile_count;
+}
+
+void stream_profiler_dump(ElaStream *s)
+{
+    ElaHandlerProfile profile;
+    int i;
+
+    assert(s);
+
+    for (i = 0; i < s->profile_count; i++) {
+        profile.name = s->profiles[i].stats.name;
+        call_stats_copy(&profile.write, &s->profiles[i].stats.write);
+        call_stats_copy(&profile.on_data, &s->profiles[i].stats.on_data);
+
+        vlogI("Stream: %d profile %s: write %"PRIu64" calls %"PRIu64" bytes "
+              "%"PRIu64" us (max %"PRIu64" us), on_data %"PRIu64" calls "
+              "%"PRIu64" bytes %"PRIu64" us (max %"PRIu64" us).",
+              s->id, profile.name,
+              profile.write.calls, profile.write.bytes,
+              profile.write.time / 1000, profile.write.max_time / 1000,
+              profile.on_data.calls, profile.on_data.bytes,
+              profile.on_data.time / 1000, profile.on_data.max_time / 1000);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __STREAM_PROFILER_H__
+#define __STREAM_PROFILER_H__
+
+#include <sys/types.h>
+
+#include "ela_session.h"
+#include "stream_handler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct HandlerProfile {
+    ssize_t (*write)  (StreamHandler *handler, FlexBuffer *buf);
+    ssize_t (*writev) (StreamHandler *handler, const ElaIOVec *iov, int iovcnt);
+    void    (*on_data)(StreamHandler *handler, FlexBuffer *buf);
+
+    ElaHandlerProfile stats;
+} HandlerProfile;
+
+int stream_profiler_attach(ElaStream *s);
+
+int stream_profiler_collect(ElaStream *s, ElaHandlerProfile *profiles,
+                            int count);
+
+void stream_profiler_dump(ElaStream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __STREAM_PROFILER_H__ */
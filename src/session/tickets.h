@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TICKETS_H__
+#define __TICKETS_H__
+
+#include <string.h>
+#include <stdint.h>
+#include <rc_mem.h>
+#include <linkedhashtable.h>
+#include <crypto.h>
+
+#include "ela_carrier.h"
+#include "ela_session.h"
+#include "session.h"
+
+/*
+ * Resumption ticket of the last session to a peer. It keeps the session
+ * keypair, the peer public key and the derived symmetric key, so a new
+ * session to the same peer skips the key generation and derivation when
+ * the peer resumes as well, and the nominated remote address of each
+ * stream, which is checked first by the new session.
+ */
+typedef struct SessionTicket {
+    hash_entry_t        he;
+    char                to[ELA_MAX_ID_LEN + 1];
+
+    int64_t             expire_time;
+
+    uint8_t             public_key[PUBLIC_KEY_BYTES];
+    uint8_t             secret_key[SECRET_KEY_BYTES];
+    uint8_t             peer_pubkey[PUBLIC_KEY_BYTES];
+    int                 has_key;
+    uint8_t             key[SYMMETRIC_KEY_BYTES];
+
+    int                 path_cnt;
+    ElaAddressInfo      paths[SESSION_MAX_RESUME_PATHS];
+} SessionTicket;
+
+static inline
+int tickets_key_compare(const void *key1, size_t len1,
+                        const void *key2, size_t len2)
+{
+    return strcmp(key1, key2);
+}
+
+static inline
+hashtable_t *tickets_create(int capacity)
+{
+    return hashtable_create(capacity, 1, NULL, tickets_key_compare);
+}
+
+static inline
+void tickets_put(hashtable_t *htab, SessionTicket *ticket)
+{
+    deref(hashtable_remove(htab, (void *)ticket->to, strlen(ticket->to)));
+
+    ticket->he.data = ticket;
+    ticket->he.key = (void *)ticket->to;
+    ticket->he.keylen = strlen(ticket->to);
+
+    hashtable_put(htab, &ticket->he);
+}
+
+static inline
+SessionTicket *tickets_get(hashtable_t *htab, const char *to)
+{
+    return (SessionTicket *)hashtable_get(htab, (void *)to, strlen(to));
+}
+
+static inline
+void tickets_remove(hashtable_t *htab, const char *to)
+{
+    deref(hashtable_remove(htab, (void *)to, strlen(to)));
+}
+
+static inline
+void tickets_clear(hashtable_t *htab)
+{
+    hashtable_clear(htab);
+}
+
+#endif /* __TICKETS_H__ */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2018 Elastos Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#include <CUnit/Basic.h>
+#include <vlog.h>
+#include <socket.h>
+
+#include "ela_carrier.h"
+
+#include "config.h"
+#include "cond.h"
+#include "test_helper.h"
+
+#define MAX_FDS         16
+
+static void ready_cb(ElaCarrier *w, void *context)
+{
+    cond_signal(((CarrierContext *)context)->ready_cond);
+}
+
+static ElaCallbacks callbacks = {
+    .idle            = NULL,
+    .connection_status = NULL,
+    .ready           = ready_cb,
+    .self_info       = NULL,
+    .friend_list     = NULL,
+    .friend_connection = NULL,
+    .friend_info     = NULL,
+    .friend_presence = NULL,
+    .friend_request  = NULL,
+    .friend_added    = NULL,
+    .friend_removed  = NULL,
+    .friend_message  = NULL,
+    .friend_invite   = NULL
+};
+
+static Condition DEFINE_COND(ready_cond);
+
+static CarrierContext carrier_context = {
+    .cbs = &callbacks,
+    .carrier = NULL,
+    .ready_cond = &ready_cond,
+    .cond = NULL,
+    .extra = NULL
+};
+
+static TestContext test_context = {
+    .carrier = &carrier_context,
+    .session = NULL,
+    .stream  = NULL
+};
+
+static void embedded_ready_cb(ElaCarrier *w, void *context)
+{
+    *(bool *)context = true;
+}
+
+static ElaCallbacks embedded_callbacks = {
+    .ready           = embedded_ready_cb
+};
+
+static ElaCarrier *embedded_carrier_new(bool *ready)
+{
+    ElaCarrier *w;
+    char datadir[PATH_MAX];
+    ElaOptions opts = {
+        .udp_enabled = true,
+        .persistent_location = datadir,
+        .bootstraps_size = global_config.bootstraps_size,
+        .bootstraps = NULL
+    };
+    int i;
+
+    sprintf(datadir, "%s/embedded", global_config.data_location);
+
+    opts.bootstraps = (BootstrapNode *)calloc(1, sizeof(BootstrapNode) * opts.bootstraps_size);
+    if (!opts.bootstraps)
+        return NULL;
+
+    for (i = 0 ; i < opts.bootstraps_size; i++) {
+        BootstrapNode *b = &opts.bootstraps[i];
+        BootstrapNode *node = global_config.bootstraps[i];
+
+        b->ipv4 = node->ipv4;
+        b->ipv6 = node->ipv6;
+        b->port = node->port;
+        b->public_key = node->public_key;
+    }
+
+    w = ela_new(&opts, &embedded_callbacks, ready);
+    free(opts.bootstraps);
+
+    return w;
+}
+
+static void test_process_running_node(void)
+{
+    ElaCarrier *w = test_context.carrier->carrier;
+    int rc;
+
+    // The node is driven by ela_run() on its own thread.
+    rc = ela_process(w);
+    CU_ASSERT_EQUAL(rc, -1);
+    CU_ASSERT_EQUAL(ela_get_error(), ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+}
+
+static void test_embedded_event_loop(void)
+{
+    ElaCarrier *w;
+    bool ready = false;
+    time_t deadline;
+    int fds[MAX_FDS];
+    int rc;
+
+    w = embedded_carrier_new(&ready);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(w);
+
+    // Nothing started yet, the first step is due right away.
+    rc = ela_get_next_timeout(w);
+    CU_ASSERT_EQUAL(rc, 0);
+
+    deadline = time(NULL) + 60;
+
+    while (!ready && time(NULL) < deadline) {
+        struct timeval tv;
+        fd_set rfds;
+        int maxfd = -1;
+        int timeout;
+        int nfds;
+        int i;
+
+        rc = ela_process(w);
+        CU_ASSERT_EQUAL_FATAL(rc, 0);
+
+        nfds = ela_get_fds(w, fds, MAX_FDS);
+        CU_ASSERT_FATAL(nfds >= 0);
+        if (nfds > MAX_FDS)
+            nfds = MAX_FDS;
+
+        timeout = ela_get_next_timeout(w);
+        CU_ASSERT_FATAL(timeout >= 0);
+
+        FD_ZERO(&rfds);
+        for (i = 0; i < nfds; i++) {
+            FD_SET(fds[i], &rfds);
+            if (fds[i] > maxfd)
+                maxfd = fds[i];
+        }
+
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        select(maxfd + 1, &rfds, NULL, NULL, &tv);
+    }
+
+    CU_ASSERT_TRUE(ready);
+
+    // UDP is enabled, so the UDP socket is always there.
+    rc = ela_get_fds(w, NULL, 0);
+    CU_ASSERT(rc >= 1);
+
+    // Embedded node can not be driven by ela_run() as well.
+    rc = ela_run(w, 10);
+    CU_ASSERT_EQUAL(rc, -1);
+    CU_ASSERT_EQUAL(ela_get_error(), ELA_GENERAL_ERROR(ELAERR_WRONG_STATE));
+
+    ela_kill(w);
+}
+
+static CU_TestInfo cases[] = {
+    { "test_process_running_node", test_process_running_node },
+    { "test_embedded_event_loop",  test_embedded_event_loop  },
+    { NULL, NULL }
+};
+
+CU_TestInfo *event_loop_test_get_cases(void)
+{
+    return cases;
+}
+
+int event_loop_test_suite_init(void)
+{
+    int rc;
+
+    rc = test_suite_init(&test_context);
+    if (rc < 0) {
+        CU_FAIL("Error: test suite initialize error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_test_suite_cleanup(void)
+{
+    test_suite_cleanup(&test_context);
+
+    return 0;
+}
@@ -229,6 +229,45 @@ static void test_friend_invite_reject(void)
     }
 }
 
+static void test_friend_invite_timeout(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    CarrierContextExtra *extra = wctxt->extra;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(ela_is_friend(wctxt->carrier, robotid));
+
+    const char* hello = "hello";
+    rc = ela_invite_friend_with_timeout(wctxt->carrier, robotid, hello,
+                                        strlen(hello) + 1, 3000,
+                                        friend_invite_response_cb, wctxt);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+
+    char in[32] = {0};
+    char in2[32] = {0};
+    rc = read_ack("%32s %32s", in, in2);
+    CU_ASSERT_EQUAL_FATAL(rc, 2);
+    CU_ASSERT_STRING_EQUAL(in, "data");
+    CU_ASSERT_STRING_EQUAL(in2, hello);
+
+    // no reply from robot, wait for invite response callback with timeout.
+    bool bRet = cond_trywait(wctxt->cond, 60000);
+    CU_ASSERT_TRUE(bRet);
+    if (bRet) {
+        CU_ASSERT_NSTRING_EQUAL(extra->from, robotid, strlen(robotid));
+        CU_ASSERT_EQUAL(extra->status, ELA_GENERAL_ERROR(ELAERR_TIMEOUT));
+        CU_ASSERT_PTR_NOT_NULL(extra->reason);
+        CU_ASSERT_PTR_NULL(extra->data);
+
+        FREE_ANYWAY(extra->from);
+        FREE_ANYWAY(extra->reason);
+    }
+}
+
 static void test_friend_invite_stranger(void)
 {
     CarrierContext *wctxt = test_context.carrier;
@@ -264,6 +303,7 @@ static void test_friend_invite_self(void)
 static CU_TestInfo cases[] = {
     { "test_friend_invite_confirm",  test_friend_invite_confirm },
     { "test_friend_invite_reject",   test_friend_invite_reject },
+    { "test_friend_invite_timeout",  test_friend_invite_timeout },
     { "test_friend_invite_stranger", test_friend_invite_stranger },
     { "test_friend_invite_self",     test_friend_invite_self },
     { NULL, NULL }
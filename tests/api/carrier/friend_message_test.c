@@ -36,12 +36,18 @@ struct CarrierContextExtra {
     char* from;
     char* msg;
     int len;
+
+    int64_t receipt_msgid;
+    ElaReceiptState receipt_state;
 };
 
 static CarrierContextExtra extra = {
     .from = NULL,
     .msg  = NULL,
-    .len  = 0
+    .len  = 0,
+
+    .receipt_msgid = 0,
+    .receipt_state = ElaReceipt_Error
 };
 
 static inline void wakeup(void* context)
@@ -147,6 +153,99 @@ static void test_send_message_to_friend(void)
     CU_ASSERT_STRING_EQUAL(in, out);
 }
 
+static void test_send_bulk_message_to_friend(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    const size_t size = ELA_MAX_APP_MESSAGE_LEN * 8 + 100;
+    char *out;
+    char ack[32];
+    int len = 0;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(ela_is_friend(wctxt->carrier, robotid));
+
+    out = (char *)malloc(size);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+    memset(out, 'b', size - 1);
+    out[size - 1] = 0;
+
+    rc = ela_send_friend_message(wctxt->carrier, robotid, out, size);
+    free(out);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+
+    rc = read_ack("%31s %d", ack, &len);
+    CU_ASSERT_EQUAL(rc, 2);
+    CU_ASSERT_STRING_EQUAL(ack, "bulkmsg");
+    CU_ASSERT_EQUAL(len, (int)size);
+}
+
+static void test_send_oversized_message(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    const size_t size = ELA_MAX_APP_BULKMSG_LEN + 1;
+    char *out;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    out = (char *)calloc(1, size);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(out);
+
+    rc = ela_send_friend_message(wctxt->carrier, robotid, out, size);
+    free(out);
+    CU_ASSERT_EQUAL(rc, -1);
+    CU_ASSERT_EQUAL(ela_get_error(), ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+}
+
+static void message_receipt_cb(ElaCarrier *w, int64_t msgid,
+                               ElaReceiptState state, void *context)
+{
+    CarrierContextExtra *extra = ((CarrierContext *)context)->extra;
+
+    extra->receipt_msgid = msgid;
+    extra->receipt_state = state;
+
+    wakeup(context);
+}
+
+static void test_send_message_with_receipt(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    CarrierContextExtra *extra = wctxt->extra;
+    int64_t msgid;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(ela_is_friend(wctxt->carrier, robotid));
+
+    extra->receipt_msgid = 0;
+    extra->receipt_state = ElaReceipt_Error;
+
+    const char* out = "receipt-test";
+    msgid = ela_send_message_with_receipt(wctxt->carrier, robotid, out,
+                                          strlen(out) + 1,
+                                          message_receipt_cb, wctxt);
+    CU_ASSERT_FATAL(msgid > 0);
+
+    char in[64];
+    rc = read_ack("%64s", in);
+    CU_ASSERT_EQUAL(rc, 1);
+    CU_ASSERT_STRING_EQUAL(in, out);
+
+    // wait for delivery receipt.
+    bool bRet = cond_trywait(wctxt->cond, 60000);
+    CU_ASSERT_TRUE(bRet);
+    CU_ASSERT_EQUAL(extra->receipt_msgid, msgid);
+    CU_ASSERT_EQUAL(extra->receipt_state, ElaReceipt_ByFriend);
+}
+
 static void test_send_message_from_friend(void)
 {
     CarrierContext *wctxt = test_context.carrier;
@@ -216,6 +315,9 @@ static void test_send_message_to_self(void)
 
 static CU_TestInfo cases[] = {
     { "test_send_message_to_friend",   test_send_message_to_friend },
+    { "test_send_bulk_message_to_friend", test_send_bulk_message_to_friend },
+    { "test_send_oversized_message", test_send_oversized_message },
+    { "test_send_message_with_receipt", test_send_message_with_receipt },
     { "test_send_message_from_friend", test_send_message_from_friend },
     { "test_send_message_to_stranger", test_send_message_to_stranger },
     { "test_send_message_to_self",     test_send_message_to_self },
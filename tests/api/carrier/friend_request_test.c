@@ -268,11 +268,44 @@ static void test_add_self_be_friend(void)
     CU_ASSERT_EQUAL(ela_get_error(), ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
 }
 
+static void test_get_friends_page(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    ElaFriendInfo friends[2];
+    uint32_t cursor = 0;
+    bool found = false;
+    int rc;
+    int i;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(ela_is_friend(wctxt->carrier, robotid));
+
+    while ((rc = ela_get_friends_page(wctxt->carrier, &cursor, friends, 2)) > 0) {
+        CU_ASSERT_TRUE(rc <= 2);
+
+        for (i = 0; i < rc; i++) {
+            if (strcmp(friends[i].user_info.userid, robotid) == 0)
+                found = true;
+        }
+    }
+
+    CU_ASSERT_EQUAL(rc, 0);
+    CU_ASSERT_TRUE(found);
+
+    rc = ela_get_friends_page(wctxt->carrier, &cursor, friends, 0);
+    CU_ASSERT_EQUAL(rc, -1);
+    CU_ASSERT_EQUAL(ela_get_error(), ELA_GENERAL_ERROR(ELAERR_INVALID_ARGS));
+}
+
 static CU_TestInfo cases[] = {
     { "test_add_friend",           test_add_friend           },
     { "test_accept_friend",        test_accept_friend        },
     { "test_add_friend_be_friend", test_add_friend_be_friend },
     { "test_add_self_be_friend",   test_add_self_be_friend   },
+    { "test_get_friends_page",     test_get_friends_page     },
     { NULL, NULL }
 };
 
@@ -21,6 +21,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <pthread.h>
@@ -194,6 +195,17 @@ static StreamContext stream_context = {
     .extra = &stream_extra,
 };
 
+static Condition DEFINE_COND(stream2_cond);
+
+static StreamContext stream2_context = {
+    .cbs = &stream_callbacks,
+    .stream_id = -1,
+    .state = 0,
+    .state_bits = 0,
+    .cond = &stream2_cond,
+    .extra = NULL,
+};
+
 static void test_context_reset(TestContext *context)
 {
     SessionContext *session = context->session;
@@ -210,12 +222,20 @@ static void test_context_reset(TestContext *context)
     stream->stream_id = -1;
     stream->state = 0;
     stream->state_bits = 0;
+
+    stream = context->stream2;
+    cond_reset(stream->cond);
+
+    stream->stream_id = -1;
+    stream->state = 0;
+    stream->state_bits = 0;
 }
 
 static TestContext test_context = {
     .carrier = &carrier_context,
     .session = &session_context,
     .stream  = &stream_context,
+    .stream2 = &stream2_context,
 
     .context_reset = test_context_reset
 };
@@ -316,6 +336,503 @@ static int do_bulk_write(TestContext *context)
     return extra->return_val;
 }
 
+static void *bulk_write_large_routine(void *arg)
+{
+    ssize_t rc;
+    int i;
+    SessionContext *sctxt = ((TestContext *)arg)->session;
+    StreamContext *stream_ctxt = ((TestContext *)arg)->stream;
+    StreamContextExtra *extra = stream_ctxt->extra;
+    char *packet;
+    ElaIOVec iov[2];
+
+    packet = (char *)malloc(extra->packet_size);
+    if (!packet) {
+        vlogE("Out of memory.");
+        return NULL;
+    }
+    memset(packet, 'D', extra->packet_size);
+
+    vlogD("Begin sending bulk data...");
+    vlogD("stream %d send: total %d packets and %d bytes per packet.",
+          stream_ctxt->stream_id, extra->packet_count, extra->packet_size);
+
+    for (i = 0; i < extra->packet_count; i++) {
+        if (i % 2 == 0) {
+            rc = ela_stream_write_bulk(sctxt->session, stream_ctxt->stream_id,
+                                       packet, extra->packet_size);
+        } else {
+            iov[0].data = packet;
+            iov[0].len = extra->packet_size / 2;
+            iov[1].data = packet + iov[0].len;
+            iov[1].len = extra->packet_size - iov[0].len;
+
+            rc = ela_stream_writev(sctxt->session, stream_ctxt->stream_id,
+                                   iov, 2);
+        }
+
+        if (rc != extra->packet_size) {
+            vlogE("Write bulk data failed (0x%x)", ela_get_error());
+            free(packet);
+            return NULL;
+        }
+    }
+
+    vlogD("Finished writing");
+
+    free(packet);
+
+    extra->return_val = 0;
+    return NULL;
+}
+
+static int do_bulk_write_large(TestContext *context)
+{
+#define MIN_BULK_SIZE 1024*64
+#define MAX_BULK_SIZE 1024*1024
+
+    StreamContextExtra *extra = context->stream->extra;
+    pthread_t thread;
+    int rc;
+
+    extra->packet_size = rand() % (MAX_BULK_SIZE - MIN_BULK_SIZE) + MIN_BULK_SIZE;
+    extra->packet_count = 32;
+    extra->return_val = -1;
+
+    rc = pthread_create(&thread, NULL, bulk_write_large_routine, context);
+    if (rc != 0) {
+        vlogE("create thread failed.");
+        return -1;
+    }
+
+    pthread_join(thread, NULL);
+
+    return extra->return_val;
+}
+
+static int do_write_stats(TestContext *context)
+{
+    SessionContext *sctxt = context->session;
+    StreamContext *stream_ctxt = context->stream;
+    ElaStreamStats stats;
+    char packet[1024];
+    size_t total = 0;
+    ssize_t rc;
+    int i;
+
+    memset(packet, 'S', sizeof(packet));
+
+    for (i = 0; i < 64; i++) {
+        rc = ela_stream_write(sctxt->session, stream_ctxt->stream_id,
+                              packet, sizeof(packet));
+        if (rc < 0) {
+            if (ela_get_error() == ELA_GENERAL_ERROR(ELAERR_BUSY)) {
+                usleep(100);
+                i--;
+                continue;
+            }
+
+            vlogE("Write data failed (0x%x)", ela_get_error());
+            return -1;
+        }
+
+        total += rc;
+    }
+
+    rc = ela_stream_get_stats(sctxt->session, stream_ctxt->stream_id, &stats);
+    if (rc < 0) {
+        vlogE("Get stream stats failed (0x%x)", ela_get_error());
+        return -1;
+    }
+
+    vlogD("stream %d stats: application %"PRIu64"/%"PRIu64" bytes, "
+          "transport %"PRIu64"/%"PRIu64" packets, %"PRIu64" dropped, "
+          "%"PRIu64" retransmits, rtt %u ms.", stream_ctxt->stream_id,
+          stats.application.bytes_sent, stats.application.bytes_received,
+          stats.transport.packets_sent, stats.transport.packets_received,
+          stats.transport.packets_dropped, stats.retransmits, stats.rtt);
+
+    if (stats.application.bytes_sent != total ||
+        stats.application.packets_sent != 64 ||
+        stats.transport.packets_sent == 0 ||
+        stats.transport.bytes_sent < total) {
+        vlogE("Stream stats mismatch with the data written.");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_write_profile(TestContext *context)
+{
+    SessionContext *sctxt = context->session;
+    StreamContext *stream_ctxt = context->stream;
+    ElaHandlerProfile profiles[8];
+    char packet[1024];
+    ssize_t rc;
+    int count;
+    int i;
+
+    memset(packet, 'P', sizeof(packet));
+
+    for (i = 0; i < 64; i++) {
+        rc = ela_stream_write(sctxt->session, stream_ctxt->stream_id,
+                              packet, sizeof(packet));
+        if (rc < 0) {
+            if (ela_get_error() == ELA_GENERAL_ERROR(ELAERR_BUSY)) {
+                usleep(100);
+                i--;
+                continue;
+            }
+
+            vlogE("Write data failed (0x%x)", ela_get_error());
+            return -1;
+        }
+    }
+
+    count = ela_stream_get_profile(sctxt->session, stream_ctxt->stream_id,
+                                   profiles, 8);
+    if (count < 0) {
+        vlogE("Get stream profile failed (0x%x)", ela_get_error());
+        return -1;
+    }
+
+    if (count < 2 || count > 8) {
+        vlogE("Unexpected stream pipeline length %d.", count);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        vlogD("stream %d profile %s: write %"PRIu64" calls %"PRIu64" ns, "
+              "on_data %"PRIu64" calls %"PRIu64" ns.", stream_ctxt->stream_id,
+              profiles[i].name, profiles[i].write.calls, profiles[i].write.time,
+              profiles[i].on_data.calls, profiles[i].on_data.time);
+
+    if (profiles[0].write.calls != 64 ||
+        profiles[0].write.bytes != 64 * sizeof(packet)) {
+        vlogE("Stream profile mismatch with the data written.");
+        return -1;
+    }
+
+    return 0;
+}
+
+#define FRAMING_WRITERS         4
+#define FRAMING_MESSAGES        256
+#define FRAMING_MAX_BULK_LEN    (64 * 1024)
+
+typedef struct FramingWriter {
+    TestContext *context;
+    int index;
+    int return_val;
+} FramingWriter;
+
+/*
+ * Message starts with its length in 4 bytes big-endian, followed by the
+ * same byte repeated, so the robot can tell a whole message from pieces
+ * of interleaved ones.
+ */
+static void fill_message(uint8_t *msg, size_t len, uint8_t fill)
+{
+    msg[0] = (uint8_t)(len >> 24);
+    msg[1] = (uint8_t)(len >> 16);
+    msg[2] = (uint8_t)(len >> 8);
+    msg[3] = (uint8_t)len;
+    memset(msg + 4, fill, len - 4);
+}
+
+/*
+ * Write the i-th message of the writer with the index, in the buffer of
+ * FRAMING_MAX_BULK_LEN bytes. Short messages go in one piece, long ones
+ * with the length prefix as a separate segment.
+ */
+static int write_message(ElaSession *session, int stream, uint8_t *msg,
+                         int index, int i)
+{
+    ElaIOVec iov[2];
+    size_t len;
+    ssize_t rc;
+
+    if (i % 2 == 0) {
+        len = 5 + (i * 997 + index * 131) % (ELA_MAX_USER_DATA_LEN - 4);
+        fill_message(msg, len, (uint8_t)('A' + index));
+
+        rc = ela_stream_write(session, stream, msg, len);
+    } else {
+        len = ELA_MAX_USER_DATA_LEN + (i * 7919 + index * 257) %
+                  (FRAMING_MAX_BULK_LEN - ELA_MAX_USER_DATA_LEN);
+        fill_message(msg, len, (uint8_t)('a' + index));
+
+        iov[0].data = msg;
+        iov[0].len = 4;
+        iov[1].data = msg + 4;
+        iov[1].len = len - 4;
+
+        rc = ela_stream_writev(session, stream, iov, 2);
+    }
+
+    if (rc != (ssize_t)len) {
+        vlogE("Write message failed (0x%x)", ela_get_error());
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_messages(TestContext *context, int index, int count)
+{
+    SessionContext *sctxt = context->session;
+    StreamContext *stream_ctxt = context->stream;
+    uint8_t *msg;
+    int rc = 0;
+    int i;
+
+    msg = (uint8_t *)malloc(FRAMING_MAX_BULK_LEN);
+    if (!msg) {
+        vlogE("Out of memory.");
+        return -1;
+    }
+
+    for (i = 0; i < count && rc == 0; i++)
+        rc = write_message(sctxt->session, stream_ctxt->stream_id, msg,
+                           index, i);
+
+    free(msg);
+    return rc;
+}
+
+/*
+ * The robot checks every message it received on the stream is a whole
+ * one, and, with two streams, one written to that stream.
+ */
+static int check_robot_messages(int stream_index, int total)
+{
+    char cmd[32];
+    int messages = 0;
+    int broken = 0;
+    int foreign = 0;
+    int rc;
+    int i;
+
+    for (i = 0; i < 30 && messages < total; i++) {
+        if (i > 0)
+            sleep(1);
+
+        rc = write_cmd("smsgs %d\n", stream_index);
+        if (rc < 0)
+            return -1;
+
+        rc = read_ack("%32s %d %d %d", cmd, &messages, &broken, &foreign);
+        if (rc != 4 || strcmp(cmd, "smsgs") != 0)
+            return -1;
+    }
+
+    vlogD("Robot received %d of %d messages on stream %d, %d broken, "
+          "%d of another stream.", messages, total, stream_index, broken,
+          foreign);
+
+    return (messages == total && broken == 0 && foreign == 0) ? 0 : -1;
+}
+
+static void *framing_write_routine(void *arg)
+{
+    FramingWriter *writer = (FramingWriter *)arg;
+
+    writer->return_val = write_messages(writer->context, writer->index,
+                                        FRAMING_MESSAGES);
+    return NULL;
+}
+
+static int do_framing_write(TestContext *context)
+{
+    int rc;
+
+    rc = write_messages(context, 0, FRAMING_MESSAGES);
+    if (rc < 0)
+        return -1;
+
+    return check_robot_messages(0, FRAMING_MESSAGES);
+}
+
+static bool same_transport_pair(const ElaTransportInfo *a,
+                                const ElaTransportInfo *b)
+{
+    return strcmp(a->local.addr, b->local.addr) == 0 &&
+           a->local.port == b->local.port &&
+           strcmp(a->remote.addr, b->remote.addr) == 0 &&
+           a->remote.port == b->remote.port;
+}
+
+/*
+ * Restart ICE half way through, the rest of the messages go out while the
+ * stream migrates to the new path, and the stream must stay connected.
+ * The restart gathers on a new transport, so the stream ends up on a pair
+ * with another local port.
+ */
+static int do_framing_restart_write(TestContext *context)
+{
+    SessionContext *sctxt = context->session;
+    StreamContext *stream_ctxt = context->stream;
+    ElaTransportInfo before, after;
+    int rc;
+    int i;
+
+    rc = ela_stream_get_transport_info(sctxt->session, stream_ctxt->stream_id,
+                                       &before);
+    if (rc < 0)
+        return -1;
+
+    rc = write_messages(context, 0, FRAMING_MESSAGES / 2);
+    if (rc < 0)
+        return -1;
+
+    rc = ela_session_restart(sctxt->session);
+    if (rc < 0) {
+        vlogE("Restart session failed (0x%x)", ela_get_error());
+        return -1;
+    }
+
+    rc = write_messages(context, 1, FRAMING_MESSAGES / 2);
+    if (rc < 0)
+        return -1;
+
+    rc = check_robot_messages(0, FRAMING_MESSAGES);
+    if (rc < 0)
+        return -1;
+
+    for (i = 0; i < 30; i++) {
+        if (i > 0)
+            sleep(1);
+
+        if (stream_ctxt->state != ElaStreamState_connected) {
+            vlogE("Stream left connected state during restart.");
+            return -1;
+        }
+
+        rc = ela_stream_get_transport_info(sctxt->session,
+                                           stream_ctxt->stream_id, &after);
+        if (rc < 0)
+            return -1;
+
+        if (!same_transport_pair(&before, &after))
+            break;
+    }
+
+    if (same_transport_pair(&before, &after)) {
+        vlogE("Stream still on %s:%d-%s:%d after restart.",
+              before.local.addr, before.local.port,
+              before.remote.addr, before.remote.port);
+        return -1;
+    }
+
+    vlogD("Stream moved from %s:%d-%s:%d to %s:%d-%s:%d.",
+          before.local.addr, before.local.port,
+          before.remote.addr, before.remote.port,
+          after.local.addr, after.local.port,
+          after.remote.addr, after.remote.port);
+
+    // The path is usable after the move as well.
+    rc = write_messages(context, 2, FRAMING_MESSAGES / 2);
+    if (rc < 0)
+        return -1;
+
+    return check_robot_messages(0, FRAMING_MESSAGES + FRAMING_MESSAGES / 2);
+}
+
+/*
+ * Interleave the messages of the two bundled streams, each must reach the
+ * robot on its own stream only. The streams share one ICE transport, which
+ * ran the connectivity checks once, so both are on the same pair.
+ */
+static int do_framing_bundle_write(TestContext *context)
+{
+    SessionContext *sctxt = context->session;
+    StreamContext *stream_ctxt = context->stream;
+    StreamContext *stream2_ctxt = context->stream2;
+    ElaTransportInfo info, info2;
+    uint8_t *msg;
+    int rc = 0;
+    int i;
+
+    rc = ela_stream_get_transport_info(sctxt->session, stream_ctxt->stream_id,
+                                       &info);
+    if (rc < 0)
+        return -1;
+
+    rc = ela_stream_get_transport_info(sctxt->session, stream2_ctxt->stream_id,
+                                       &info2);
+    if (rc < 0)
+        return -1;
+
+    if (!same_transport_pair(&info, &info2)) {
+        vlogE("Bundled streams on different pairs: %s:%d-%s:%d, %s:%d-%s:%d",
+              info.local.addr, info.local.port,
+              info.remote.addr, info.remote.port,
+              info2.local.addr, info2.local.port,
+              info2.remote.addr, info2.remote.port);
+        return -1;
+    }
+
+    msg = (uint8_t *)malloc(FRAMING_MAX_BULK_LEN);
+    if (!msg) {
+        vlogE("Out of memory.");
+        return -1;
+    }
+
+    for (i = 0; i < FRAMING_MESSAGES && rc == 0; i++) {
+        rc = write_message(sctxt->session, stream_ctxt->stream_id, msg, 0, i);
+        if (rc == 0)
+            rc = write_message(sctxt->session, stream2_ctxt->stream_id, msg,
+                               1, i);
+    }
+
+    free(msg);
+
+    if (rc < 0)
+        return -1;
+
+    rc = check_robot_messages(0, FRAMING_MESSAGES);
+    if (rc < 0)
+        return -1;
+
+    return check_robot_messages(1, FRAMING_MESSAGES);
+}
+
+static int do_framing_concurrent_write(TestContext *context)
+{
+    FramingWriter writers[FRAMING_WRITERS];
+    pthread_t threads[FRAMING_WRITERS];
+    int rc;
+    int i;
+
+    for (i = 0; i < FRAMING_WRITERS; i++) {
+        writers[i].context = context;
+        writers[i].index = i;
+        writers[i].return_val = -1;
+
+        rc = pthread_create(&threads[i], NULL, framing_write_routine,
+                            &writers[i]);
+        if (rc != 0) {
+            vlogE("create thread failed.");
+            while (--i >= 0)
+                pthread_join(threads[i], NULL);
+            return -1;
+        }
+    }
+
+    rc = 0;
+    for (i = 0; i < FRAMING_WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+        if (writers[i].return_val != 0)
+            rc = -1;
+    }
+
+    if (rc < 0)
+        return -1;
+
+    return check_robot_messages(0, FRAMING_WRITERS * FRAMING_MESSAGES);
+}
+
 static inline
 void test_stream_write(int stream_options)
 {
@@ -349,6 +866,102 @@ static void test_stream_reliable_plain(void)
     test_stream_write(stream_options);
 }
 
+static void test_stream_unreliable_stats(void)
+{
+    test_stream_scheme(ElaStreamType_text, 0, &test_context, do_write_stats);
+}
+
+static void test_stream_reliable_stats(void)
+{
+    test_stream_scheme(ElaStreamType_text, ELA_STREAM_RELIABLE,
+                       &test_context, do_write_stats);
+}
+
+static void test_stream_reliable_profiling(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_PROFILING;
+
+    test_stream_scheme(ElaStreamType_text, stream_options,
+                       &test_context, do_write_profile);
+}
+
+static void test_stream_reliable_bulk(void)
+{
+    test_stream_scheme(ElaStreamType_text, ELA_STREAM_RELIABLE,
+                       &test_context, do_bulk_write_large);
+}
+
+static void test_stream_reliable_plain_bulk(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_PLAIN;
+    stream_options |= ELA_STREAM_RELIABLE;
+
+    test_stream_scheme(ElaStreamType_text, stream_options,
+                       &test_context, do_bulk_write_large);
+}
+
+static void test_stream_reliable_framing(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_MESSAGE_FRAMING;
+
+    test_stream_write(stream_options);
+}
+
+static void test_stream_reliable_framing_bulk(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_MESSAGE_FRAMING;
+
+    test_stream_scheme(ElaStreamType_text, stream_options,
+                       &test_context, do_bulk_write_large);
+}
+
+static void test_stream_reliable_framing_concurrent(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_MESSAGE_FRAMING;
+
+    test_stream_scheme(ElaStreamType_text, stream_options,
+                       &test_context, do_framing_concurrent_write);
+}
+
+static void test_stream_reliable_framing_bundle(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_MESSAGE_FRAMING;
+
+    // The packets of both streams go through the demux of the shared
+    // transport.
+    test_session_stream_scheme(ElaStreamType_text, stream_options,
+                               TEST_SESSION_BUNDLE | TEST_SESSION_TWO_STREAMS,
+                               &test_context, do_framing_bundle_write);
+}
+
+static void test_stream_reliable_framing_restart(void)
+{
+    int stream_options = 0;
+
+    stream_options |= ELA_STREAM_RELIABLE;
+    stream_options |= ELA_STREAM_MESSAGE_FRAMING;
+
+    test_stream_scheme(ElaStreamType_text, stream_options,
+                       &test_context, do_framing_restart_write);
+}
+
 static void test_stream_multiplexing(void)
 {
     int stream_options = 0;
@@ -417,6 +1030,16 @@ static CU_TestInfo cases[] = {
     { "test_stream_plain", test_stream_unreliable_plain },
     { "test_stream_reliable", test_stream_reliable },
     { "test_stream_reliable_plain", test_stream_reliable_plain },
+    { "test_stream_unreliable_stats", test_stream_unreliable_stats },
+    { "test_stream_reliable_stats", test_stream_reliable_stats },
+    { "test_stream_reliable_profiling", test_stream_reliable_profiling },
+    { "test_stream_reliable_bulk", test_stream_reliable_bulk },
+    { "test_stream_reliable_plain_bulk", test_stream_reliable_plain_bulk },
+    { "test_stream_reliable_framing", test_stream_reliable_framing },
+    { "test_stream_reliable_framing_bulk", test_stream_reliable_framing_bulk },
+    { "test_stream_reliable_framing_concurrent", test_stream_reliable_framing_concurrent },
+    { "test_stream_reliable_framing_bundle", test_stream_reliable_framing_bundle },
+    { "test_stream_reliable_framing_restart", test_stream_reliable_framing_restart },
     { "test_stream_multiplexing", test_stream_multiplexing },
     { "test_stream_plain_multiplexing", test_stream_plain_multiplexing },
     { "test_stream_reliable_multiplexing", test_stream_reliable_multiplexing },
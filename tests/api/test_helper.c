@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <time.h>
 #include <limits.h>
@@ -375,10 +376,51 @@ const char *stream_state_name(ElaStreamState state)
 
 void test_stream_scheme(ElaStreamType stream_type, int stream_options,
                         TestContext *context, int (*do_work_cb)(TestContext *))
+{
+    test_session_stream_scheme(stream_type, stream_options, 0, context,
+                               do_work_cb);
+}
+
+/*
+ * Wait until the stream has been in the state. The state bits keep the
+ * states passed already, so it does not matter how many state changes
+ * are still to be consumed from the condition.
+ */
+int wait_stream_state(StreamContext *stream_ctxt, ElaStreamState state)
+{
+    int end_bits = (1 << ElaStreamState_closed) | (1 << ElaStreamState_failed);
+
+    while (!(stream_ctxt->state_bits & (1 << state))) {
+        if (stream_ctxt->state_bits & end_bits & ~(1 << state))
+            return -1;
+
+        cond_wait(stream_ctxt->cond);
+    }
+
+    return 0;
+}
+
+static int apply_session_options(ElaSession *session, int session_options)
+{
+    int rc;
+
+    if (session_options & TEST_SESSION_BUNDLE) {
+        rc = ela_session_set_bundle(session, true);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+void test_session_stream_scheme(ElaStreamType stream_type, int stream_options,
+                                int session_options, TestContext *context,
+                                int (*do_work_cb)(TestContext *))
 {
     CarrierContext *wctxt = context->carrier;
     SessionContext *sctxt = context->session;
     StreamContext *stream_ctxt = context->stream;
+    StreamContext *stream2_ctxt = NULL;
 
     int rc;
     char cmd[32];
@@ -386,6 +428,11 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
 
     context->context_reset(context);
 
+    if (session_options & TEST_SESSION_TWO_STREAMS) {
+        stream2_ctxt = context->stream2;
+        CU_ASSERT_TRUE_FATAL(stream2_ctxt != NULL);
+    }
+
     rc = add_friend_anyway(context, robotid, robotaddr);
     CU_ASSERT_EQUAL_FATAL(rc, 0);
     CU_ASSERT_TRUE_FATAL(ela_is_friend(wctxt->carrier, robotid));
@@ -404,6 +451,9 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
     sctxt->session = ela_session_new(wctxt->carrier, robotid);
     TEST_ASSERT_TRUE(sctxt->session != NULL);
 
+    rc = apply_session_options(sctxt->session, session_options);
+    TEST_ASSERT_TRUE(rc == 0);
+
     stream_ctxt->stream_id = ela_session_add_stream(sctxt->session,
                                         stream_type, stream_options,
                                         stream_ctxt->cbs, stream_ctxt);
@@ -413,6 +463,16 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
     TEST_ASSERT_TRUE(stream_ctxt->state == ElaStreamState_initialized);
     TEST_ASSERT_TRUE(stream_ctxt->state_bits & (1 << ElaStreamState_initialized));
 
+    if (stream2_ctxt) {
+        stream2_ctxt->stream_id = ela_session_add_stream(sctxt->session,
+                                        stream_type, stream_options,
+                                        stream2_ctxt->cbs, stream2_ctxt);
+        TEST_ASSERT_TRUE(stream2_ctxt->stream_id > 0);
+
+        rc = wait_stream_state(stream2_ctxt, ElaStreamState_initialized);
+        TEST_ASSERT_TRUE(rc == 0);
+    }
+
     rc = ela_session_request(sctxt->session, NULL, sctxt->request_complete_cb, sctxt);
     TEST_ASSERT_TRUE(rc == 0);
 
@@ -420,12 +480,18 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
     TEST_ASSERT_TRUE(stream_ctxt->state == ElaStreamState_transport_ready);
     TEST_ASSERT_TRUE(stream_ctxt->state_bits & (1 << ElaStreamState_transport_ready));
 
+    if (stream2_ctxt) {
+        rc = wait_stream_state(stream2_ctxt, ElaStreamState_transport_ready);
+        TEST_ASSERT_TRUE(rc == 0);
+    }
+
     rc = read_ack("%32s %32s", cmd, result);
     TEST_ASSERT_TRUE(rc == 2);
     TEST_ASSERT_TRUE(strcmp(cmd, "srequest") == 0);
     TEST_ASSERT_TRUE(strcmp(result, "received") == 0);
 
-    rc = write_cmd("sreply confirm %d %d\n", stream_type, stream_options);
+    rc = write_cmd("sreply confirm %d %d %d\n", stream_type, stream_options,
+                   session_options);
     TEST_ASSERT_TRUE(rc > 0);
 
     cond_wait(sctxt->request_complete_cond);
@@ -459,9 +525,23 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
     TEST_ASSERT_TRUE(stream_ctxt->state == ElaStreamState_connected);
     TEST_ASSERT_TRUE(stream_ctxt->state_bits & (1 << ElaStreamState_connected));
 
+    if (stream2_ctxt) {
+        rc = wait_stream_state(stream2_ctxt, ElaStreamState_connected);
+        TEST_ASSERT_TRUE(rc == 0);
+    }
+
     rc = do_work_cb ? do_work_cb(context) : 0;
     TEST_ASSERT_TRUE(rc == 0);
 
+    if (stream2_ctxt) {
+        rc = ela_session_remove_stream(sctxt->session, stream2_ctxt->stream_id);
+        TEST_ASSERT_TRUE(rc == 0);
+        stream2_ctxt->stream_id = -1;
+
+        rc = wait_stream_state(stream2_ctxt, ElaStreamState_closed);
+        TEST_ASSERT_TRUE(rc == 0);
+    }
+
     rc = ela_session_remove_stream(sctxt->session, stream_ctxt->stream_id);
     TEST_ASSERT_TRUE(rc == 0);
     stream_ctxt->stream_id = -1;
@@ -471,6 +551,11 @@ void test_stream_scheme(ElaStreamType stream_type, int stream_options,
     TEST_ASSERT_TRUE(stream_ctxt->state_bits & (1 << ElaStreamState_closed));
 
 cleanup:
+    if (stream2_ctxt && stream2_ctxt->stream_id > 0) {
+        ela_session_remove_stream(sctxt->session, stream2_ctxt->stream_id);
+        stream2_ctxt->stream_id = -1;
+    }
+
     if (stream_ctxt->stream_id > 0) {
         ela_session_remove_stream(sctxt->session, stream_ctxt->stream_id);
         stream_ctxt->stream_id = -1;
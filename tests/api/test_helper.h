@@ -55,9 +55,15 @@ void robot_sfree(void);
 
 const char *stream_state_name(ElaStreamState state);
 
+int wait_stream_state(StreamContext *stream_ctxt, ElaStreamState state);
+
 void test_stream_scheme(ElaStreamType stream_type, int stream_options,
                         TestContext *context, int (*do_work_cb)(TestContext *));
 
+void test_session_stream_scheme(ElaStreamType stream_type, int stream_options,
+                                int session_options, TestContext *context,
+                                int (*do_work_cb)(TestContext *));
+
 const char* connection_str(enum ElaConnectionStatus status);
 
 int write_cmd(const char *cmd, ...);
@@ -28,6 +28,14 @@
 
 #include "cond.h"
 
+/*
+ * Session options of the stream test scheme, the robot applies the same
+ * to its side of the session.
+ */
+#define TEST_SESSION_BUNDLE             0x01
+// Both sides add a second stream of the same type and options.
+#define TEST_SESSION_TWO_STREAMS        0x02
+
 typedef struct Condition Condition;
 typedef struct CarrierContextExtra CarrierContextExtra;
 typedef struct SessionContextExtra SessionContextExtra;
@@ -75,6 +83,7 @@ struct TestContext {
     CarrierContext *carrier;
     SessionContext *session;
     StreamContext  *stream;
+    StreamContext  *stream2; // with TEST_SESSION_TWO_STREAMS only.
 
     void (*context_reset)(TestContext *);
 };
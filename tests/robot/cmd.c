@@ -41,6 +41,7 @@
 #include "test_context.h"
 
 const char *stream_state_name(ElaStreamState state);
+int wait_stream_state(StreamContext *stream_ctxt, ElaStreamState state);
 
 #define CHK_ARGS(exp) if (!(exp)) { \
         vlogE("Invalid command syntax"); \
@@ -150,9 +151,87 @@ static SessionContext session_context = {
     .extra = &session_extra
 };
 
+struct StreamContextExtra {
+    struct {
+        int will_open_confirm;
+        int channel_id;
+        int channel_error_state;
+    } channels[MAX_CHANNEL_COUNT];
+
+    int portforwarding_id;
+
+    int framing;
+    int owner;
+    int messages;
+    int broken_messages;
+    int foreign_messages;
+};
+
+static StreamContextExtra stream_extra = {
+    .channels = { {0, 0, 0 } },
+    .portforwarding_id = -1,
+    .framing = 0,
+    .owner = 0,
+    .messages = 0,
+    .broken_messages = 0,
+    .foreign_messages = 0
+};
+
+static StreamContextExtra stream2_extra = {
+    .channels = { {0, 0, 0 } },
+    .portforwarding_id = -1,
+    .framing = 0,
+    .owner = 0,
+    .messages = 0,
+    .broken_messages = 0,
+    .foreign_messages = 0
+};
+
+/*
+ * On the framing stream the test client sends messages starting with their
+ * own length in 4 bytes big-endian, followed by the same byte repeated.
+ * Every delivery must be exactly one such message.
+ */
+static bool is_whole_message(const uint8_t *data, size_t len)
+{
+    size_t msglen;
+    size_t i;
+
+    if (len <= 4)
+        return false;
+
+    msglen = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) |
+             ((size_t)data[2] << 8) | (size_t)data[3];
+    if (msglen != len)
+        return false;
+
+    for (i = 5; i < len; i++) {
+        if (data[i] != data[4])
+            return false;
+    }
+
+    return true;
+}
+
 static void stream_on_data(ElaSession *ws, int stream, const void *data,
                            size_t len, void *context)
 {
+    StreamContextExtra *extra = ((StreamContext *)context)->extra;
+
+    if (extra->framing) {
+        extra->messages++;
+        if (!is_whole_message((const uint8_t *)data, len)) {
+            vlogD("Stream [%d] received broken message of %zu bytes",
+                  stream, len);
+            extra->broken_messages++;
+        } else if (extra->owner &&
+                   (((const uint8_t *)data)[4] | 0x20) != extra->owner) {
+            vlogD("Stream [%d] received message of another stream", stream);
+            extra->foreign_messages++;
+        }
+        return;
+    }
+
     vlogD("Stream [%d] received data [%.*s]", stream, (int)len, (char*)data);
 }
 
@@ -169,21 +248,6 @@ static void stream_state_changed(ElaSession *ws, int stream,
     cond_signal(stream_ctxt->cond);
 }
 
-struct StreamContextExtra {
-    struct {
-        int will_open_confirm;
-        int channel_id;
-        int channel_error_state;
-    } channels[MAX_CHANNEL_COUNT];
-
-    int portforwarding_id;
-};
-
-static StreamContextExtra stream_extra = {
-    .channels = { {0, 0, 0 } },
-    .portforwarding_id = -1
-};
-
 static bool channel_open(ElaSession *ws, int stream, int channel,
                          const char *cookie, void *context)
 {
@@ -264,10 +328,22 @@ static StreamContext stream_context = {
     .extra = &stream_extra
 };
 
+static Condition DEFINE_COND(stream2_cond);
+
+static StreamContext stream2_context = {
+    .cbs = &stream_callbacks,
+    .stream_id = -1,
+    .state = 0,
+    .state_bits = 0,
+    .cond = &stream2_cond,
+    .extra = &stream2_extra
+};
+
 TestContext test_context = {
     .carrier = &carrier_context,
     .session = &session_context,
-    .stream  = &stream_context
+    .stream  = &stream_context,
+    .stream2 = &stream2_context
 };
 
 /*
@@ -464,6 +540,13 @@ static void robot_context_reset(TestContext *context)
     stream_ctxt->state = 0;
     stream_ctxt->state_bits = 0;
     stream_ctxt->extra->portforwarding_id = -1;
+
+    stream_ctxt = context->stream2;
+    cond_reset(stream_ctxt->cond);
+    stream_ctxt->stream_id = -1;
+    stream_ctxt->state = 0;
+    stream_ctxt->state_bits = 0;
+    stream_ctxt->extra->portforwarding_id = -1;
 }
 
 /*
@@ -557,17 +640,18 @@ cleanup:
 }
 
 /*
- * command format: sreply comfirm stream_type stream_options
+ * command format: sreply comfirm stream_type stream_options [session_options]
  *                 sreply refuse
  */
 static void sreply(TestContext *context, int argc, char *argv[])
 {
     SessionContext *sctxt = context->session;
     StreamContext *stream_ctxt = context->stream;
+    StreamContext *stream2_ctxt = NULL;
     int need_sreply_ack = 1;
     int rc;
 
-    CHK_ARGS(argc == 4 || argc == 2);
+    CHK_ARGS(argc == 5 || argc == 4 || argc == 2);
 
     sctxt->session = ela_session_new(context->carrier->carrier, sctxt->extra->test_peer_id);
     if (!sctxt->session) {
@@ -578,8 +662,29 @@ static void sreply(TestContext *context, int argc, char *argv[])
     }
 
     if (strcmp(argv[1], "confirm") == 0) {
-        int stream_type    = atoi(argv[2]);
-        int stream_options = atoi(argv[3]);
+        int stream_type     = atoi(argv[2]);
+        int stream_options  = atoi(argv[3]);
+        int session_options = argc == 5 ? atoi(argv[4]) : 0;
+
+        if (session_options & TEST_SESSION_BUNDLE) {
+            rc = ela_session_set_bundle(sctxt->session, true);
+            if (rc < 0) {
+                vlogE("Enable bundle failed: 0x%x", ela_get_error());
+                goto cleanup;
+            }
+        }
+
+        if (session_options & TEST_SESSION_TWO_STREAMS)
+            stream2_ctxt = context->stream2;
+
+        // The test client fills the messages of the first stream with 'a'
+        // and the second with 'b', in either case.
+        stream_ctxt->extra->framing =
+                    !!(stream_options & ELA_STREAM_MESSAGE_FRAMING);
+        stream_ctxt->extra->owner = stream2_ctxt ? 'a' : 0;
+        stream_ctxt->extra->messages = 0;
+        stream_ctxt->extra->broken_messages = 0;
+        stream_ctxt->extra->foreign_messages = 0;
 
         stream_ctxt->stream_id = ela_session_add_stream(sctxt->session,
                     stream_type, stream_options, stream_ctxt->cbs, stream_ctxt);
@@ -594,6 +699,27 @@ static void sreply(TestContext *context, int argc, char *argv[])
             goto cleanup;
         }
 
+        if (stream2_ctxt) {
+            stream2_ctxt->extra->framing = stream_ctxt->extra->framing;
+            stream2_ctxt->extra->owner = 'b';
+            stream2_ctxt->extra->messages = 0;
+            stream2_ctxt->extra->broken_messages = 0;
+            stream2_ctxt->extra->foreign_messages = 0;
+
+            stream2_ctxt->stream_id = ela_session_add_stream(sctxt->session,
+                    stream_type, stream_options, stream2_ctxt->cbs, stream2_ctxt);
+            if (stream2_ctxt->stream_id < 0) {
+                vlogE("Add second stream failed: 0x%x", ela_get_error());
+                goto cleanup;
+            }
+
+            if (wait_stream_state(stream2_ctxt, ElaStreamState_initialized) < 0) {
+                vlogE("Second stream is in %d state, not 'initialized'",
+                      stream2_ctxt->state);
+                goto cleanup;
+            }
+        }
+
         rc = ela_session_reply_request(sctxt->session, NULL, 0, NULL);
         if (rc < 0) {
             vlogE("Confirm session reply request failed: 0x%x", ela_get_error());
@@ -606,6 +732,13 @@ static void sreply(TestContext *context, int argc, char *argv[])
             goto cleanup;
         }
 
+        if (stream2_ctxt &&
+            wait_stream_state(stream2_ctxt, ElaStreamState_transport_ready) < 0) {
+            vlogE("Second stream is in %d state, not 'transport ready'",
+                  stream2_ctxt->state);
+            goto cleanup;
+        }
+
         vlogD("Confirm session request success.");
         write_ack("sreply success\n");
 
@@ -630,6 +763,13 @@ static void sreply(TestContext *context, int argc, char *argv[])
             goto cleanup;
         }
 
+        if (stream2_ctxt &&
+            wait_stream_state(stream2_ctxt, ElaStreamState_connected) < 0) {
+            vlogE("Second stream is in %d state, not 'connected'",
+                  stream2_ctxt->state);
+            goto cleanup;
+        }
+
         write_ack("sconnect success\n");
         return;
     }
@@ -652,6 +792,11 @@ static void sreply(TestContext *context, int argc, char *argv[])
     return;
 
 cleanup:
+    if (stream2_ctxt && stream2_ctxt->stream_id > 0) {
+        ela_session_remove_stream(sctxt->session, stream2_ctxt->stream_id);
+        stream2_ctxt->stream_id = -1;
+    }
+
     if (stream_ctxt->stream_id > 0) {
         ela_session_remove_stream(sctxt->session, stream_ctxt->stream_id);
         stream_ctxt->stream_id = -1;
@@ -676,9 +821,19 @@ static void sfree(TestContext *context, int argc, char *argv[])
     ElaCarrier *w = context->carrier->carrier;
     SessionContext *sctxt = context->session;
     StreamContext *stream_ctxt = context->stream;
+    StreamContext *stream2_ctxt = context->stream2;
 
     CHK_ARGS(argc == 1);
 
+    if (stream2_ctxt->stream_id > 0) {
+        ela_session_remove_stream(sctxt->session, stream2_ctxt->stream_id);
+
+        if (wait_stream_state(stream2_ctxt, ElaStreamState_closed) < 0)
+            vlogE("Second stream should be closed, but (%d)",
+                  stream2_ctxt->state);
+        stream2_ctxt->stream_id = -1;
+    }
+
     if (stream_ctxt->stream_id > 0) {
         ela_session_remove_stream(sctxt->session, stream_ctxt->stream_id);
 
@@ -701,6 +856,23 @@ static void sfree(TestContext *context, int argc, char *argv[])
     vlogD("Robot session cleanuped");
 }
 
+/*
+ * command format: smsgs [stream_index]
+ */
+static void smsgs(TestContext *context, int argc, char *argv[])
+{
+    StreamContextExtra *extra = context->stream->extra;
+
+    CHK_ARGS(argc == 1 || argc == 2);
+
+    // Stream index 1 is the second stream of the session.
+    if (argc == 2 && atoi(argv[1]) == 1)
+        extra = context->stream2->extra;
+
+    write_ack("smsgs %d %d %d\n", extra->messages, extra->broken_messages,
+              extra->foreign_messages);
+}
+
 static void spfsvcadd(TestContext *context, int argc, char *argv[])
 {
     ElaSession *session = context->session->session;
@@ -885,6 +1057,7 @@ static struct command {
     { "srequest",     srequest     },
     { "sreply",       sreply       },
     { "sfree",        sfree        },
+    { "smsgs",        smsgs        },
     { "spfsvcadd",    spfsvcadd    },
     { "spfsvcremove", spfsvcremove },
     { "spfopen",      spf_open     },
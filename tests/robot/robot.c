@@ -197,6 +197,13 @@ static void friend_message_cb(ElaCarrier *w, const char *from,
                              const void *msg, size_t len, void *context)
 {
     vlogD("Received message from %s", from);
+
+    if (len > ELA_MAX_APP_MESSAGE_LEN) {
+        vlogD(" large msg: %zu bytes", len);
+        write_ack("bulkmsg %zu\n", len);
+        return;
+    }
+
     vlogD(" msg: %s", (const char *)msg);
 
     write_ack("%s\n", msg);